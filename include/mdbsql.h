@@ -43,6 +43,10 @@ typedef struct {
 	unsigned char *kludge_ttable_pg;
 	long max_rows;
 	char error_msg[1024];
+	/* open databases for writing */
+	int writable;
+	/* rows changed by a statement that returns none, -1 for queries */
+	long rows_affected;
 } MdbSQL;
 
 typedef struct {
@@ -52,6 +56,8 @@ typedef struct {
 	int  bind_type;
 	int  *bind_len;
 	int  bind_max;
+	unsigned char order;	/* MDB_ASC or MDB_DESC, in CREATE INDEX */
+	char *value;	/* new value in UPDATE, NULL for a NULL */
 } MdbSQLColumn;
 
 typedef struct {
@@ -99,6 +105,10 @@ extern void mdb_sql_bind_all(MdbSQL *sql);
 extern int mdb_sql_fetch_row(MdbSQL *sql, MdbTableDef *table);
 extern int mdb_sql_add_temp_col(MdbSQL *sql, MdbTableDef *ttable, int col_num, char *name, int col_type, int col_size, int is_fixed);
 extern void mdb_sql_bind_column(MdbSQL *sql, int colnum, void *varaddr, int *len_ptr);
+extern int mdb_sql_add_index_column(MdbSQL *sql, char *column_name, int order);
+extern void mdb_sql_create_index(MdbSQL *sql, char *index_name, int unique);
+extern int mdb_sql_add_set(MdbSQL *sql, char *column_name, char *constant);
+extern void mdb_sql_update(MdbSQL *sql);
 
 #ifdef __cplusplus
   }
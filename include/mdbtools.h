@@ -121,12 +121,15 @@ enum {
 typedef enum {
 	MDB_TABLE_SCAN,
 	MDB_LEAF_SCAN,
-	MDB_INDEX_SCAN
+	MDB_INDEX_SCAN,
+	MDB_BITMAP_SCAN,
+	MDB_COVERING_SCAN
 } MdbStrategy;
 
 typedef enum {
 	MDB_NOFLAGS = 0x00,
-	MDB_WRITABLE = 0x01
+	MDB_WRITABLE = 0x01,
+	MDB_WRITEBACK = 0x02 /* keep written pages in memory until mdb_flush() */
 } MdbFileFlags;
 
 enum {
@@ -138,6 +141,7 @@ enum {
 	MDB_DEBUG_PROPS = 0x0020,
 	MDB_USE_INDEX = 0x0040,
 	MDB_NO_MEMO = 0x0080, /* don't follow memo fields */
+	MDB_DEBUG_INDEX = 0x0100, /* check index trees changed in place */
 };
 
 #define mdb_is_logical_op(x) (x == MDB_OR || \
@@ -189,6 +193,7 @@ enum {
 /* forward declarations */
 typedef struct mdbindex MdbIndex;
 typedef struct mdbsargtree MdbSargNode;
+typedef struct mdbdecodedpage MdbDecodedPage;
 
 typedef struct {
 	char *name;
@@ -230,6 +235,17 @@ typedef struct {
 	/* free map */
 	int  map_sz;
 	unsigned char *free_map;
+	/* pages up to this one were found in use or already reused */
+	guint32 free_scan_pg;
+	/* decoded index pages, keyed by page number, most recently used
+	 * first in idx_lru, both guarded by idx_lock (see index.c) */
+	GHashTable *idx_cache;
+	GQueue idx_lru;
+	GMutex idx_lock;
+	/* pages written but not on disk yet, keyed by page number, when
+	 * opened with MDB_WRITEBACK (see write.c) */
+	GHashTable *dirty;
+	off_t dirty_end;
 	/* reference count */
 	int refs;
 } MdbFile; 
@@ -254,6 +270,10 @@ typedef struct {
 	guint16		tab_col_offset_var;
 	guint16		tab_col_offset_fixed;
 	guint16		tab_row_col_num_offset;
+	guint16		idx_pref_len_offset;
+	guint16		idx_bitmap_offset;
+	guint16		idx_entries_offset;
+	guint16		idx_next_pg_offset;
 } MdbFormatConstants; 
 
 typedef struct {
@@ -269,6 +289,8 @@ typedef struct {
 	char		*backend_name;
 	MdbFormatConstants *fmt;
 	MdbStatistics *stats;
+	/* last decoded index page handed out, see mdb_index_read_page() */
+	MdbDecodedPage *idx_page;
 #ifdef HAVE_ICONV
 	iconv_t	iconv_in;
 	iconv_t	iconv_out;
@@ -324,6 +346,8 @@ typedef struct {
 	int		col_scale;
 	unsigned char     is_long_auto;
 	unsigned char     is_uuid_auto;
+	/* Jet4 text stored with Unicode compression */
+	unsigned char     is_compressed;
 	MdbProperties	*props;
 	/* info needed for handling deleted/added columns */
 	int 		fixed_offset;
@@ -342,13 +366,36 @@ struct mdbsargtree {
 	MdbSargNode *right;
 };
 
+/*
+ * an index page unpacked once: the offsets of its entries and their keys
+ * with the shared prefix put back, so scans don't redo it on every visit.
+ * The arrays live in the same block as the struct.
+ */
+#define MDB_MAX_INDEX_KEY 256
+
+struct mdbdecodedpage {
+	guint32 pg;
+	unsigned char pg_type;
+	guint32 next_pg;
+	unsigned int num_entries;
+	guint16 *entry_starts;	/* num_entries + 1, the last one is the end */
+	guint16 *key_starts;	/* num_entries + 1, into keys */
+	guint32 *pg_rows;	/* (data page << 8) | row of each entry */
+	guint32 *child_pgs;	/* interior pages only, else NULL */
+	unsigned char *keys;
+	int refs;		/* the cache's and the handles' */
+	GList lru;		/* link in the cache's recency list */
+};
+
 typedef struct {
 	guint32 pg;
 	int start_pos;
 	int offset;
 	int len;
-	guint16 idx_starts[2000];	
-	unsigned char cache_value[256];
+	guint32 pg_row;
+	guint32 child_pg;
+	unsigned char cache_value[MDB_MAX_INDEX_KEY];
+	int cache_len;
 } MdbIndexPage;
 
 typedef int (*MdbSargTreeFunc)(MdbSargNode *, gpointer data);
@@ -362,6 +409,14 @@ typedef struct {
 	MdbIndexPage pages[MDB_MAX_INDEX_DEPTH];
 } MdbIndexChain;
 
+/* pages of a table with room left, grouped by their free bytes (map.c) */
+#define MDB_FREE_SPACE_BUCKETS 32
+
+typedef struct {
+	GHashTable *pg_free;	/* page -> free bytes */
+	GHashTable *buckets[MDB_FREE_SPACE_BUCKETS];	/* sets of pages */
+} MdbFreeSpace;
+
 typedef struct S_MdbTableDef {
 	MdbCatalogEntry *entry;
 	char	name[MDB_MAX_OBJ_NAME+1];
@@ -376,6 +431,9 @@ typedef struct S_MdbTableDef {
 	guint32	cur_pg_num;
 	guint32	cur_phys_pg;
 	unsigned int    cur_row;
+	/* data pages a table scan is limited to, see mdb_table_set_shard() */
+	guint32	scan_start_pg;
+	guint32	scan_end_pg;	/* 0 for no limit */
 	int  noskip_del;  /* don't skip deleted rows */
 	/* object allocation map */
 	guint32  map_base_pg;
@@ -385,12 +443,15 @@ typedef struct S_MdbTableDef {
 	guint32  freemap_base_pg;
 	size_t freemap_sz;
 	unsigned char *free_usage_map;
+	MdbFreeSpace *free_space;
 	/* query planner */
 	MdbSargNode *sarg_tree;
 	MdbStrategy strategy;
 	MdbIndex *scan_idx;
 	MdbHandle *mdbidx;
 	MdbIndexChain *chain;
+	GArray *bitmap_rows;	/* sorted page/row pointers of a bitmap scan */
+	unsigned int bitmap_pos;
 	MdbProperties	*props;
 	unsigned int num_var_cols;  /* to know if row has variable columns */
 	/* temp table */
@@ -398,6 +459,14 @@ typedef struct S_MdbTableDef {
 	GPtrArray     *temp_table_pages;
 } MdbTableDef;
 
+/* state of a batch of rows added with mdb_bulk_insert_*() */
+typedef struct {
+	MdbTableDef *table;
+	guint32 pg;		/* page being filled, 0 when none */
+	unsigned char pg_buf[MDB_PGSIZE];
+	unsigned long num_rows;	/* rows added so far */
+} MdbBulkInsert;
+
 struct mdbindex {
 	int		index_num;
 	char		name[MDB_MAX_OBJ_NAME+1];
@@ -409,6 +478,14 @@ struct mdbindex {
 	unsigned char	key_col_order[MDB_MAX_IDX_COLS];
 	unsigned char	flags;
 	MdbTableDef	*table;
+	guint32		usage_map_pg_row;
+	/* where first_pg is stored in the table definition, 0 if it
+	 * straddles two pages */
+	guint32		first_pg_tdef_pg;
+	int		first_pg_tdef_pos;
+	/* left out of date by a write that couldn't update it, not used
+	 * for scans */
+	int		stale;
 };
 
 typedef struct {
@@ -437,10 +514,12 @@ extern MDB_DEPRECATED(void, mdb_exit());
 /* file.c */
 extern ssize_t mdb_read_pg(MdbHandle *mdb, unsigned long pg);
 extern ssize_t mdb_read_alt_pg(MdbHandle *mdb, unsigned long pg);
+extern off_t mdb_file_size(MdbHandle *mdb);
 extern unsigned char mdb_get_byte(void *buf, int offset);
 extern int    mdb_get_int16(void *buf, int offset);
 extern long   mdb_get_int32(void *buf, int offset);
 extern long   mdb_get_int32_msb(void *buf, int offset);
+extern gint64 mdb_get_int64(void *buf, int offset);
 extern float  mdb_get_single(void *buf, int offset);
 extern double mdb_get_double(void *buf, int offset);
 extern unsigned char mdb_pg_get_byte(MdbHandle *mdb, int offset);
@@ -482,6 +561,9 @@ extern const char *mdb_col_get_prop(const MdbColumn *col, const gchar *key);
 extern int mdb_bind_column_by_name(MdbTableDef *table, gchar *col_name, void *bind_ptr, int *len_ptr);
 extern void mdb_data_dump(MdbTableDef *table);
 extern void mdb_date_to_tm(double td, struct tm *t);
+extern void mdb_tm_to_date(struct tm *t, double *td);
+extern int mdb_string_to_uuid(const char *s, unsigned char *uuid);
+extern int mdb_string_to_field(MdbHandle *mdb, MdbColumn *col, const char *s, MdbField *field);
 extern void mdb_bind_column(MdbTableDef *table, int col_num, void *bind_ptr, int *len_ptr);
 extern int mdb_rewind_table(MdbTableDef *table);
 extern int mdb_fetch_row(MdbTableDef *table);
@@ -497,6 +579,8 @@ extern size_t mdb_ole_read(MdbHandle *mdb, MdbColumn *col, void *ole_ptr, int ch
 extern void* mdb_ole_read_full(MdbHandle *mdb, MdbColumn *col, size_t *size);
 extern void mdb_set_date_fmt(const char *);
 extern int mdb_read_row(MdbTableDef *table, unsigned int row);
+extern int mdb_read_next_dpg(MdbTableDef *table);
+extern int mdb_table_set_shard(MdbTableDef *table, unsigned int shard, unsigned int num_shards);
 
 /* dump.c */
 extern void mdb_buffer_dump(const void *buf, int start, size_t len);
@@ -521,6 +605,8 @@ extern int mdb_find_indexable_sargs(MdbSargNode *node, gpointer data);
 extern int mdb_add_sarg_by_name(MdbTableDef *table, char *colname, MdbSarg *in_sarg);
 extern int mdb_test_string(MdbSargNode *node, char *s);
 extern int mdb_test_int(MdbSargNode *node, gint32 i);
+extern int mdb_test_double(MdbSargNode *node, double d);
+extern int mdb_test_uuid(MdbSargNode *node, unsigned char *uuid);
 extern int mdb_add_sarg(MdbColumn *col, MdbSarg *in_sarg);
 
 
@@ -537,7 +623,17 @@ extern int mdb_index_find_row(MdbHandle *mdb, MdbIndex *idx, MdbIndexChain *chai
 extern void mdb_index_swap_n(unsigned char *src, int sz, unsigned char *dest);
 extern void mdb_free_indices(GPtrArray *indices);
 void mdb_index_page_reset(MdbIndexPage *ipg);
-extern int mdb_index_pack_bitmap(MdbHandle *mdb, MdbIndexPage *ipg);
+extern int mdb_index_pack_bitmap(MdbHandle *mdb, guint16 *idx_starts);
+extern int mdb_index_unpack_bitmap(MdbHandle *mdb, unsigned char *pg_buf, guint16 *idx_starts);
+extern MdbDecodedPage *mdb_index_read_page(MdbHandle *mdb, guint32 pg);
+extern void mdb_index_cache_invalidate(MdbHandle *mdb, guint32 pg);
+extern void mdb_index_cache_release(MdbHandle *mdb);
+extern void mdb_index_cache_free(MdbFile *f);
+extern int mdb_index_key_size(MdbColumn *col);
+extern int mdb_index_encode_key(MdbColumn *col, int order, MdbField *field, unsigned char *key);
+extern int mdb_index_decode_key(MdbColumn *col, int order, unsigned char *key, int len, MdbField *field, unsigned char *buf);
+extern int mdb_index_is_covering(MdbTableDef *table, MdbIndex *idx);
+extern int mdb_index_test_sargs(MdbHandle *mdb, MdbIndex *idx, char *buf, int len);
 
 /* stats.c */
 extern void mdb_stats_on(MdbHandle *mdb);
@@ -548,6 +644,8 @@ extern void mdb_dump_stats(MdbHandle *mdb);
 extern int mdb_like_cmp(char *s, char *r);
 
 /* write.c */
+extern ssize_t mdb_write_pg(MdbHandle *mdb, unsigned long pg);
+extern int mdb_flush(MdbHandle *mdb);
 extern void mdb_put_int16(void *buf, guint32 offset, guint32 value);
 extern void mdb_put_int32(void *buf, guint32 offset, guint32 value);
 extern void mdb_put_int32_msb(void *buf, guint32 offset, guint32 value);
@@ -560,16 +658,43 @@ extern int mdb_replace_row(MdbTableDef *table, int row, void *new_row, int new_r
 extern int mdb_pg_get_freespace(MdbHandle *mdb);
 extern int mdb_update_row(MdbTableDef *table);
 extern void *mdb_new_data_pg(MdbCatalogEntry *entry);
+extern MdbBulkInsert *mdb_bulk_insert_begin(MdbTableDef *table);
+extern int mdb_bulk_insert_append(MdbBulkInsert *bulk, int num_fields, MdbField *fields);
+extern int mdb_bulk_insert_end(MdbBulkInsert *bulk);
+extern int mdb_index_rebuild(MdbTableDef *table, MdbIndex *idx);
+extern int mdb_compact_table(MdbTableDef *table);
+extern int mdb_create_index(MdbTableDef *table, const char *name, unsigned int num_keys, char **col_names, unsigned char *col_orders, int flags);
+extern long mdb_update_rows(MdbTableDef *table, unsigned int num_sets, MdbField *sets);
 
 /* map.c */
 extern guint32 mdb_map_find_next_freepage(MdbTableDef *table, int row_size);
+extern guint32 mdb_alloc_page(MdbTableDef *table);
+extern guint32 mdb_map_alloc_pages(MdbHandle *mdb, guint32 num_pgs);
+extern int mdb_map_free_pages(MdbHandle *mdb, GArray *pgs);
+extern int mdb_map_set_pages(MdbHandle *mdb, guint32 map_pg_row, GArray *pgs, int on);
+extern int mdb_map_replace_pages(MdbTableDef *table, GArray *old_pgs, GArray *new_pgs);
+extern void mdb_map_set_freespace(MdbTableDef *table, guint32 pg, int free_space);
+extern void mdb_map_free_freespace(MdbTableDef *table);
 extern gint32 mdb_map_find_next(MdbHandle *mdb, unsigned char *map, unsigned int map_sz, guint32 start_pg);
+extern guint32 mdb_map_count_pages(MdbHandle *mdb, unsigned char *map, unsigned int map_sz);
 
 /* props.c */
 extern void mdb_free_props(MdbProperties *props);
+extern MdbProperties *mdb_copy_props(MdbProperties *props);
 extern void mdb_dump_props(MdbProperties *props, FILE *outfile, int show_name);
 extern GArray* mdb_kkd_to_props(MdbHandle *mdb, void *kkd, size_t len);
 
+/* arrow.c */
+typedef void (*MdbArrowWriteFunc)(const void *buf, size_t len, gpointer user_data);
+typedef struct _MdbArrowWriter MdbArrowWriter;
+extern MdbArrowWriter *mdb_arrow_writer_new(MdbTableDef *table, MdbColumn **cols, unsigned int num_cols, MdbArrowWriteFunc write, gpointer user_data);
+extern void mdb_arrow_append_row(MdbArrowWriter *w);
+extern void mdb_arrow_writer_close(MdbArrowWriter *w);
+
+/* json.c */
+extern void mdb_json_append_string(GString *out, const char *s, size_t len);
+extern void mdb_json_append_value(MdbHandle *mdb, MdbColumn *col, GString *out);
+
 
 /* worktable.c */
 extern MdbTableDef *mdb_create_temp_table(MdbHandle *mdb, char *name);
@@ -585,6 +710,7 @@ extern void mdb_debug(int klass, char *fmt, ...);
 /* iconv.c */
 extern int mdb_unicode2ascii(MdbHandle *mdb, char *src, size_t slen, char *dest, size_t dlen);
 extern int mdb_ascii2unicode(MdbHandle *mdb, char *src, size_t slen, char *dest, size_t dlen);
+extern size_t mdb_unicode_compress(const char *src, size_t slen, char *dest);
 extern void mdb_iconv_init(MdbHandle *mdb);
 extern void mdb_iconv_close(MdbHandle *mdb);
 extern const char* mdb_target_charset(MdbHandle *mdb);
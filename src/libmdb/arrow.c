@@ -0,0 +1,667 @@
+/* MDB Tools - A library for reading MS Access database files
+ * Copyright (C) 2000 Brian Bruns
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Apache Arrow IPC stream writer.
+ *
+ * A stream is a Schema message, RecordBatch messages and an end marker.
+ * Each message is a continuation marker, the length of its metadata, the
+ * metadata as a flatbuffer and then the body holding the column buffers.
+ * The flatbuffers are small and fixed in shape, so they are laid out here
+ * front to back by hand rather than with the flatbuffers library: every
+ * table is written before the objects it refers to, which keeps all the
+ * (unsigned) offsets pointing forward, and those are patched in once the
+ * objects have been written.
+ */
+
+#include "mdbtools.h"
+
+#ifdef DMALLOC
+#include "dmalloc.h"
+#endif
+
+/* rows per record batch, fewer when variable length data grows large */
+#define MDB_ARROW_BATCH_ROWS 65536
+#define MDB_ARROW_BATCH_BYTES (256 * 1024 * 1024)
+
+/* from Schema.fbs and Message.fbs */
+#define ARROW_METADATA_V5 4
+#define ARROW_HEADER_SCHEMA 1
+#define ARROW_HEADER_RECORD_BATCH 3
+#define ARROW_TYPE_INT 2
+#define ARROW_TYPE_FLOATING_POINT 3
+#define ARROW_TYPE_BINARY 4
+#define ARROW_TYPE_UTF8 5
+#define ARROW_TYPE_BOOL 6
+#define ARROW_TYPE_DECIMAL 7
+#define ARROW_TYPE_TIMESTAMP 10
+#define ARROW_PRECISION_SINGLE 1
+#define ARROW_PRECISION_DOUBLE 2
+#define ARROW_TIMEUNIT_MICROSECOND 2
+
+/* days from the Jet epoch, 1899-12-30, to the Unix one */
+#define JET_UNIX_EPOCH_DAYS 25569
+
+/* size of a table field holding an offset to another object */
+#define FB_OFFSET -4
+#define FB_MAX_FIELDS 8
+
+/* a flatbuffer table being laid out */
+typedef struct {
+	int num_ids;
+	int size[FB_MAX_FIELDS];	/* 0 for absent fields */
+	guint64 value[FB_MAX_FIELDS];
+	guint pos[FB_MAX_FIELDS];	/* where each field was written */
+} FbTable;
+
+enum {
+	ARROW_KIND_BOOL,
+	ARROW_KIND_FIXED,
+	ARROW_KIND_VAR
+};
+
+typedef struct {
+	MdbColumn *col;
+	int kind;
+	int width;		/* bytes per value of fixed width kinds */
+	/* the Arrow type */
+	int type;
+	int bit_width;
+	int is_signed;
+	int precision;
+	int scale;
+	/* buffers of the batch being built */
+	GByteArray *validity;
+	GByteArray *values;	/* values, bits or offsets */
+	GByteArray *data;	/* variable length data */
+	gint64 null_count;
+} MdbArrowColumn;
+
+struct _MdbArrowWriter {
+	MdbTableDef *table;
+	unsigned int num_cols;
+	MdbArrowColumn *cols;
+	long num_rows;		/* rows in the batch being built */
+	size_t data_size;
+	MdbArrowWriteFunc write;
+	gpointer user_data;
+};
+
+static const guint8 zeros[8];
+
+static void
+fb_pad(GByteArray *b, guint align)
+{
+	g_byte_array_append(b, zeros, (align - b->len % align) % align);
+}
+static guint
+fb_put32(GByteArray *b, guint32 value)
+{
+	guint pos = b->len;
+	guint8 tmp[4];
+
+	mdb_put_int32(tmp, 0, value);
+	g_byte_array_append(b, tmp, 4);
+	return pos;
+}
+/* point the offset at pos to the object at target */
+static void
+fb_patch(GByteArray *b, guint pos, guint target)
+{
+	mdb_put_int32(b->data, pos, target - pos);
+}
+static void
+fb_field(FbTable *t, int id, int size, guint64 value)
+{
+	t->size[id] = size;
+	t->value[id] = value;
+	if (id >= t->num_ids)
+		t->num_ids = id + 1;
+}
+/*
+ * write the vtable and then the table, with the fields ordered by size so
+ * each is aligned.  Returns the position of the table.
+ */
+static guint
+fb_end_table(GByteArray *b, FbTable *t)
+{
+	static const int order[] = { 8, 4, FB_OFFSET, 2, 1 };
+	guint16 field_off[FB_MAX_FIELDS];
+	guint8 tmp[8];
+	guint vt_size = 4 + 2 * t->num_ids, vt_pos, tbl_pos, off = 4;
+	int i, j, size;
+
+	/* lay the fields out after the offset to the vtable */
+	memset(field_off, 0, sizeof(field_off));
+	for (j=0; j<5; j++) {
+		for (i=0; i<t->num_ids; i++) {
+			if (t->size[i] != order[j])
+				continue;
+			size = order[j] == FB_OFFSET ? 4 : order[j];
+			off = (off + size - 1) / size * size;
+			field_off[i] = off;
+			off += size;
+		}
+	}
+
+	/* the vtable goes right before the table, which starts 8 aligned */
+	g_byte_array_append(b, zeros, (8 - (b->len + vt_size) % 8) % 8);
+	vt_pos = b->len;
+	mdb_put_int16(tmp, 0, vt_size);
+	mdb_put_int16(tmp, 2, off);
+	g_byte_array_append(b, tmp, 4);
+	for (i=0; i<t->num_ids; i++) {
+		mdb_put_int16(tmp, 0, field_off[i]);
+		g_byte_array_append(b, tmp, 2);
+	}
+
+	tbl_pos = b->len;
+	g_byte_array_set_size(b, tbl_pos + off);
+	memset(b->data + tbl_pos, 0, off);
+	mdb_put_int32(b->data, tbl_pos, tbl_pos - vt_pos);
+	for (i=0; i<t->num_ids; i++) {
+		if (!t->size[i])
+			continue;
+		t->pos[i] = tbl_pos + field_off[i];
+		switch (t->size[i]) {
+			case 1:
+				b->data[t->pos[i]] = t->value[i];
+				break;
+			case 2:
+				mdb_put_int16(b->data, t->pos[i], t->value[i]);
+				break;
+			case 4:
+				mdb_put_int32(b->data, t->pos[i], t->value[i]);
+				break;
+			case 8:
+				mdb_put_int32(b->data, t->pos[i], t->value[i] & 0xffffffff);
+				mdb_put_int32(b->data, t->pos[i] + 4, t->value[i] >> 32);
+				break;
+		}
+	}
+	return tbl_pos;
+}
+/*
+ * a vector of count elements, copied from data or zeroed to be filled in
+ * later.  Returns the position of its length.
+ */
+static guint
+fb_vector(GByteArray *b, guint elem_size, guint count, guint align, const void *data)
+{
+	guint pos;
+
+	if (align < 4)
+		align = 4;
+	/* the elements, after the length, are aligned */
+	g_byte_array_append(b, zeros, (align - (b->len + 4) % align) % align);
+	pos = fb_put32(b, count);
+	if (data) {
+		g_byte_array_append(b, data, elem_size * count);
+	} else {
+		g_byte_array_set_size(b, b->len + elem_size * count);
+		memset(b->data + pos + 4, 0, elem_size * count);
+	}
+	return pos;
+}
+static guint
+fb_string(GByteArray *b, const char *s)
+{
+	guint pos;
+
+	fb_pad(b, 4);
+	pos = fb_put32(b, strlen(s));
+	g_byte_array_append(b, (const guint8 *)s, strlen(s) + 1);
+	return pos;
+}
+/*
+ * start a Message flatbuffer, returning the position of the offset to the
+ * header table to patch
+ */
+static guint
+mdb_arrow_message(GByteArray *b, int header_type, gint64 body_len)
+{
+	FbTable msg;
+	guint root, pos;
+
+	memset(&msg, 0, sizeof(msg));
+	root = fb_put32(b, 0);
+	fb_field(&msg, 0, 2, ARROW_METADATA_V5);
+	fb_field(&msg, 1, 1, header_type);
+	fb_field(&msg, 2, FB_OFFSET, 0);
+	fb_field(&msg, 3, 8, body_len);
+	pos = fb_end_table(b, &msg);
+	fb_patch(b, root, pos);
+	return msg.pos[2];
+}
+/* send the message metadata in b, then the body */
+static void
+mdb_arrow_send(MdbArrowWriter *w, GByteArray *b, GByteArray *body)
+{
+	guint8 prefix[8];
+
+	fb_pad(b, 8);
+	mdb_put_int32(prefix, 0, 0xffffffff);
+	mdb_put_int32(prefix, 4, b->len);
+	w->write(prefix, 8, w->user_data);
+	w->write(b->data, b->len, w->user_data);
+	if (body && body->len)
+		w->write(body->data, body->len, w->user_data);
+}
+static void
+mdb_arrow_write_schema(MdbArrowWriter *w)
+{
+	GByteArray *b = g_byte_array_new();
+	FbTable schema, field, type;
+	MdbArrowColumn *c;
+	guint header, fields, pos;
+	unsigned int i;
+
+	header = mdb_arrow_message(b, ARROW_HEADER_SCHEMA, 0);
+
+	memset(&schema, 0, sizeof(schema));
+	fb_field(&schema, 0, 2, 0);	/* little endian */
+	fb_field(&schema, 1, FB_OFFSET, 0);
+	fb_patch(b, header, fb_end_table(b, &schema));
+
+	fields = fb_vector(b, 4, w->num_cols, 4, NULL);
+	fb_patch(b, schema.pos[1], fields);
+
+	for (i=0; i<w->num_cols; i++) {
+		c = &w->cols[i];
+
+		memset(&field, 0, sizeof(field));
+		fb_field(&field, 0, FB_OFFSET, 0);	/* name */
+		fb_field(&field, 1, 1, 1);		/* nullable */
+		fb_field(&field, 2, 1, c->type);
+		fb_field(&field, 3, FB_OFFSET, 0);	/* type */
+		fb_field(&field, 5, FB_OFFSET, 0);	/* children */
+		fb_patch(b, fields + 4 + 4 * i, fb_end_table(b, &field));
+
+		fb_patch(b, field.pos[0], fb_string(b, c->col->name));
+
+		memset(&type, 0, sizeof(type));
+		switch (c->type) {
+			case ARROW_TYPE_INT:
+				fb_field(&type, 0, 4, c->bit_width);
+				fb_field(&type, 1, 1, c->is_signed);
+				break;
+			case ARROW_TYPE_FLOATING_POINT:
+				fb_field(&type, 0, 2, c->width == 4 ?
+					ARROW_PRECISION_SINGLE : ARROW_PRECISION_DOUBLE);
+				break;
+			case ARROW_TYPE_DECIMAL:
+				fb_field(&type, 0, 4, c->precision);
+				fb_field(&type, 1, 4, c->scale);
+				fb_field(&type, 2, 4, 128);
+				break;
+			case ARROW_TYPE_TIMESTAMP:
+				fb_field(&type, 0, 2, ARROW_TIMEUNIT_MICROSECOND);
+				break;
+		}
+		pos = fb_end_table(b, &type);
+		fb_patch(b, field.pos[3], pos);
+
+		/* readers insist on the children, even when there are none */
+		fb_patch(b, field.pos[5], fb_vector(b, 4, 0, 4, NULL));
+	}
+
+	mdb_arrow_send(w, b, NULL);
+	g_byte_array_free(b, TRUE);
+}
+/* append a buffer to the body and its position to the buffer list */
+static void
+mdb_arrow_add_buffer(GByteArray *body, GByteArray *buffers, GByteArray *buf)
+{
+	guint8 desc[16];
+
+	mdb_put_int32(desc, 0, body->len);
+	mdb_put_int32(desc, 4, 0);
+	mdb_put_int32(desc, 8, buf->len);
+	mdb_put_int32(desc, 12, 0);
+	g_byte_array_append(buffers, desc, 16);
+	g_byte_array_append(body, buf->data, buf->len);
+	fb_pad(body, 8);
+}
+static void
+mdb_arrow_start_batch(MdbArrowWriter *w)
+{
+	unsigned int i;
+
+	for (i=0; i<w->num_cols; i++) {
+		g_byte_array_set_size(w->cols[i].validity, 0);
+		g_byte_array_set_size(w->cols[i].values, 0);
+		g_byte_array_set_size(w->cols[i].data, 0);
+		w->cols[i].null_count = 0;
+		/* the first offset */
+		if (w->cols[i].kind == ARROW_KIND_VAR)
+			fb_put32(w->cols[i].values, 0);
+	}
+	w->num_rows = 0;
+	w->data_size = 0;
+}
+static void
+mdb_arrow_write_batch(MdbArrowWriter *w)
+{
+	GByteArray *b, *body, *nodes, *buffers;
+	MdbArrowColumn *c;
+	FbTable batch;
+	guint8 node[16];
+	guint header, pos;
+	unsigned int i;
+
+	if (!w->num_rows)
+		return;
+
+	body = g_byte_array_new();
+	nodes = g_byte_array_new();
+	buffers = g_byte_array_new();
+	for (i=0; i<w->num_cols; i++) {
+		c = &w->cols[i];
+		mdb_put_int32(node, 0, w->num_rows);
+		mdb_put_int32(node, 4, 0);
+		mdb_put_int32(node, 8, c->null_count);
+		mdb_put_int32(node, 12, 0);
+		g_byte_array_append(nodes, node, 16);
+		mdb_arrow_add_buffer(body, buffers, c->validity);
+		mdb_arrow_add_buffer(body, buffers, c->values);
+		if (c->kind == ARROW_KIND_VAR)
+			mdb_arrow_add_buffer(body, buffers, c->data);
+	}
+
+	b = g_byte_array_new();
+	header = mdb_arrow_message(b, ARROW_HEADER_RECORD_BATCH, body->len);
+
+	memset(&batch, 0, sizeof(batch));
+	fb_field(&batch, 0, 8, w->num_rows);
+	fb_field(&batch, 1, FB_OFFSET, 0);
+	fb_field(&batch, 2, FB_OFFSET, 0);
+	fb_patch(b, header, fb_end_table(b, &batch));
+
+	pos = fb_vector(b, 16, nodes->len / 16, 8, nodes->data);
+	fb_patch(b, batch.pos[1], pos);
+	pos = fb_vector(b, 16, buffers->len / 16, 8, buffers->data);
+	fb_patch(b, batch.pos[2], pos);
+
+	mdb_arrow_send(w, b, body);
+
+	g_byte_array_free(b, TRUE);
+	g_byte_array_free(body, TRUE);
+	g_byte_array_free(nodes, TRUE);
+	g_byte_array_free(buffers, TRUE);
+	mdb_arrow_start_batch(w);
+}
+static void
+mdb_arrow_set_type(MdbArrowColumn *c)
+{
+	MdbColumn *col = c->col;
+
+	c->kind = ARROW_KIND_FIXED;
+	c->is_signed = 1;
+	switch (col->col_type) {
+		case MDB_BOOL:
+			c->kind = ARROW_KIND_BOOL;
+			c->type = ARROW_TYPE_BOOL;
+			break;
+		case MDB_BYTE:
+			c->type = ARROW_TYPE_INT;
+			c->width = 1;
+			c->is_signed = 0;
+			break;
+		case MDB_INT:
+			c->type = ARROW_TYPE_INT;
+			c->width = 2;
+			break;
+		case MDB_LONGINT:
+		case MDB_COMPLEX:
+			c->type = ARROW_TYPE_INT;
+			c->width = 4;
+			break;
+		case MDB_FLOAT:
+			c->type = ARROW_TYPE_FLOATING_POINT;
+			c->width = 4;
+			break;
+		case MDB_DOUBLE:
+			c->type = ARROW_TYPE_FLOATING_POINT;
+			c->width = 8;
+			break;
+		case MDB_MONEY:
+			/* currency is a count of ten thousandths */
+			c->type = ARROW_TYPE_DECIMAL;
+			c->width = 16;
+			c->precision = 19;
+			c->scale = 4;
+			break;
+		case MDB_NUMERIC:
+			c->type = ARROW_TYPE_DECIMAL;
+			c->width = 16;
+			c->precision = col->col_prec;
+			c->scale = col->col_scale;
+			break;
+		case MDB_DATETIME:
+			c->type = ARROW_TYPE_TIMESTAMP;
+			c->width = 8;
+			break;
+		case MDB_TEXT:
+		case MDB_MEMO:
+			c->kind = ARROW_KIND_VAR;
+			c->type = ARROW_TYPE_UTF8;
+			break;
+		default:
+			/* BINARY, OLE, REPID, and anything unknown as is */
+			c->kind = ARROW_KIND_VAR;
+			c->type = ARROW_TYPE_BINARY;
+			break;
+	}
+	c->bit_width = c->width * 8;
+}
+/* the fixed width value of a field as Arrow has it */
+static void
+mdb_arrow_fixed_value(MdbHandle *mdb, MdbArrowColumn *c, guint8 *value)
+{
+	unsigned char *buf = mdb->pg_buf + c->col->cur_value_start;
+	guint64 lo, hi;
+	gint64 usecs;
+	double td;
+	int i;
+
+	switch (c->col->col_type) {
+		case MDB_MONEY:
+			lo = mdb_get_int64(buf, 0);
+			hi = (gint64)lo < 0 ? G_MAXUINT64 : 0;
+			break;
+		case MDB_NUMERIC:
+			/* sign byte, then 32 bit words from the most significant */
+			hi = ((guint64)(guint32)mdb_get_int32(buf, 1) << 32)
+				| (guint32)mdb_get_int32(buf, 5);
+			lo = ((guint64)(guint32)mdb_get_int32(buf, 9) << 32)
+				| (guint32)mdb_get_int32(buf, 13);
+			if (buf[0] & 0x80) {
+				/* two's complement of the 128 bits */
+				hi = ~hi;
+				lo = ~lo + 1;
+				if (!lo)
+					hi++;
+			}
+			break;
+		case MDB_DATETIME:
+			/* days, with the time of day as the fraction, which is
+			 * added to the day even when the days are negative */
+			td = mdb_get_double(buf, 0);
+			usecs = (gint64)td;
+			td -= usecs;
+			if (td < 0)
+				td = -td;
+			usecs = (usecs - JET_UNIX_EPOCH_DAYS) * G_GINT64_CONSTANT(86400000000)
+				+ (gint64)(td * 86400000000.0 + 0.5);
+			for (i=0; i<8; i++)
+				value[i] = (guint64)usecs >> (8 * i);
+			return;
+		default:
+			/* Jet stores these little endian, like Arrow */
+			memcpy(value, buf, c->width);
+			return;
+	}
+	for (i=0; i<8; i++) {
+		value[i] = lo >> (8 * i);
+		value[8 + i] = hi >> (8 * i);
+	}
+}
+/**
+ * mdb_arrow_writer_new:
+ * @table: Table whose rows will be written
+ * @cols: The columns to write, in order
+ * @num_cols: Number of columns
+ * @write: Called with every block of the stream
+ * @user_data: Passed on to @write
+ *
+ * Starts an Arrow IPC stream for rows of @table, by writing its schema.
+ * Jet types map to Arrow as: BOOL to bool, BYTE to uint8, INT to int16,
+ * LONGINT to int32, FLOAT and DOUBLE to float32 and float64, MONEY to
+ * decimal128(19,4), NUMERIC to decimal128 of its precision and scale,
+ * DATETIME to timestamp[us], TEXT and MEMO to utf8, and the rest to binary.
+ *
+ * Return value: the writer, to pass the rows to with mdb_arrow_append_row().
+ */
+MdbArrowWriter *
+mdb_arrow_writer_new(MdbTableDef *table, MdbColumn **cols, unsigned int num_cols, MdbArrowWriteFunc write, gpointer user_data)
+{
+	MdbArrowWriter *w;
+	unsigned int i;
+
+	w = g_malloc0(sizeof(MdbArrowWriter));
+	w->table = table;
+	w->num_cols = num_cols;
+	w->write = write;
+	w->user_data = user_data;
+	w->cols = g_new0(MdbArrowColumn, num_cols);
+	for (i=0; i<num_cols; i++) {
+		w->cols[i].col = cols[i];
+		mdb_arrow_set_type(&w->cols[i]);
+		w->cols[i].validity = g_byte_array_new();
+		w->cols[i].values = g_byte_array_new();
+		w->cols[i].data = g_byte_array_new();
+	}
+	mdb_arrow_start_batch(w);
+	mdb_arrow_write_schema(w);
+	return w;
+}
+/**
+ * mdb_arrow_append_row:
+ * @w: Arrow writer
+ *
+ * Adds the row last fetched from the writer's table to the stream.  The
+ * values are taken from where mdb_fetch_row() found them, so the columns
+ * need not be bound, except OLE ones: those are read through their bound
+ * buffer by mdb_ole_read_full(), and written empty when unbound.
+ */
+void
+mdb_arrow_append_row(MdbArrowWriter *w)
+{
+	MdbHandle *mdb = w->table->entry->mdb;
+	MdbArrowColumn *c;
+	MdbColumn *col;
+	guint8 value[16], bit;
+	char *s;
+	size_t len;
+	unsigned int i;
+	int valid;
+
+	bit = 1 << (w->num_rows % 8);
+	for (i=0; i<w->num_cols; i++) {
+		c = &w->cols[i];
+		col = c->col;
+		if (bit == 1) {
+			g_byte_array_append(c->validity, zeros, 1);
+			if (c->kind == ARROW_KIND_BOOL)
+				g_byte_array_append(c->values, zeros, 1);
+		}
+
+		/* booleans live in the null bitmap, set meaning false */
+		valid = c->kind == ARROW_KIND_BOOL || col->cur_value_len;
+		if (valid)
+			c->validity->data[c->validity->len - 1] |= bit;
+		else
+			c->null_count++;
+
+		switch (c->kind) {
+			case ARROW_KIND_BOOL:
+				if (!col->cur_value_len)
+					c->values->data[c->values->len - 1] |= bit;
+				break;
+			case ARROW_KIND_FIXED:
+				if (valid)
+					mdb_arrow_fixed_value(mdb, c, value);
+				else
+					memset(value, 0, c->width);
+				g_byte_array_append(c->values, value, c->width);
+				break;
+			case ARROW_KIND_VAR:
+				if (!valid) {
+					/* nothing to add */
+				} else if (c->type == ARROW_TYPE_UTF8) {
+					s = mdb_col_to_string(mdb, mdb->pg_buf,
+						col->cur_value_start, col->col_type,
+						col->cur_value_len);
+					g_byte_array_append(c->data, (guint8 *)s, strlen(s));
+					g_free(s);
+				} else if (col->col_type == MDB_OLE) {
+					if (col->bind_ptr && (s = mdb_ole_read_full(mdb, col, &len))) {
+						g_byte_array_append(c->data, (guint8 *)s, len);
+						free(s);
+					}
+				} else {
+					g_byte_array_append(c->data,
+						mdb->pg_buf + col->cur_value_start,
+						col->cur_value_len);
+				}
+				fb_put32(c->values, c->data->len);
+				if (c->data->len > w->data_size)
+					w->data_size = c->data->len;
+				break;
+		}
+	}
+	w->num_rows++;
+	if (w->num_rows >= MDB_ARROW_BATCH_ROWS || w->data_size >= MDB_ARROW_BATCH_BYTES)
+		mdb_arrow_write_batch(w);
+}
+/**
+ * mdb_arrow_writer_close:
+ * @w: Arrow writer
+ *
+ * Writes out the rows not written yet and the end of the stream, and
+ * frees the writer.
+ */
+void
+mdb_arrow_writer_close(MdbArrowWriter *w)
+{
+	guint8 eos[8];
+	unsigned int i;
+
+	mdb_arrow_write_batch(w);
+	mdb_put_int32(eos, 0, 0xffffffff);
+	mdb_put_int32(eos, 4, 0);
+	w->write(eos, 8, w->user_data);
+
+	for (i=0; i<w->num_cols; i++) {
+		g_byte_array_free(w->cols[i].validity, TRUE);
+		g_byte_array_free(w->cols[i].values, TRUE);
+		g_byte_array_free(w->cols[i].data, TRUE);
+	}
+	g_free(w->cols);
+	g_free(w);
+}
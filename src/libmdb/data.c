@@ -18,6 +18,7 @@
 
 #include <time.h>
 #include <math.h>
+#include <errno.h>
 #include "mdbtools.h"
 
 #ifdef DMALLOC
@@ -31,6 +32,7 @@ char *mdb_numeric_to_string(MdbHandle *mdb, int start, int prec, int scale);
 
 static int _mdb_attempt_bind(MdbHandle *mdb, 
 	MdbColumn *col, unsigned char isnull, int offset, int len);
+static int mdb_read_covering_row(MdbTableDef *table, unsigned char *key, int len);
 static char *mdb_date_to_string(void *buf, int start);
 #ifdef MDB_COPY_OLE
 static size_t mdb_copy_ole(MdbHandle *mdb, void *dest, int start, int size);
@@ -294,6 +296,58 @@ int mdb_read_row(MdbTableDef *table, unsigned int row)
 
 	return 1;
 }
+/*
+ * build a row from the key of the current entry of a covering index scan
+ * instead of reading it from its data page.  The data page buffer isn't
+ * used by the scan, so the decoded values are laid out there for the
+ * binding code to convert.
+ */
+static int
+mdb_read_covering_row(MdbTableDef *table, unsigned char *key, int len)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	MdbIndex *idx = table->scan_idx;
+	MdbField fields[MDB_MAX_IDX_COLS];
+	MdbColumn *col;
+	unsigned int i, j, num_fields = 0;
+	int c_len, pos = 0, start = 0;
+
+	mdb->cur_pg = 0;
+	for (i=0;i<idx->num_keys;i++) {
+		col = g_ptr_array_index(table->columns, idx->key_col_num[i]-1);
+		c_len = mdb_index_decode_key(col, idx->key_col_order[i],
+			key + pos, len - pos, &fields[num_fields],
+			mdb->pg_buf + start);
+		if (c_len < 0)
+			break;
+		pos += c_len;
+		if (!fields[num_fields].value && !fields[num_fields].is_null)
+			continue;
+		fields[num_fields].colnum = idx->key_col_num[i]-1;
+		fields[num_fields].start = start;
+		fields[num_fields].is_fixed = 1;
+		start += fields[num_fields].siz;
+		num_fields++;
+	}
+	if (!mdb_test_sargs(table, fields, num_fields)) return 0;
+
+	for (i = 0; i < num_fields; i++) {
+		col = g_ptr_array_index(table->columns,fields[i].colnum);
+		_mdb_attempt_bind(mdb, col, fields[i].is_null,
+			fields[i].start, fields[i].siz);
+	}
+	/* the other columns aren't needed, just clear them */
+	for (i = 0; i < table->num_cols; i++) {
+		for (j = 0; j < num_fields; j++)
+			if (fields[j].colnum == (int) i) break;
+		if (j == num_fields) {
+			col = g_ptr_array_index(table->columns, i);
+			if (col->bind_ptr || col->len_ptr)
+				_mdb_attempt_bind(mdb, col, 1, 0, 0);
+		}
+	}
+	return 1;
+}
 static int _mdb_attempt_bind(MdbHandle *mdb, 
 	MdbColumn *col, 
 	unsigned char isnull, 
@@ -322,6 +376,12 @@ int mdb_read_next_dpg(MdbTableDef *table)
 	MdbHandle *mdb = entry->mdb;
 	int next_pg;
 
+	/* a sharded scan starts at its first page, an empty shard has none */
+	if (table->scan_end_pg && table->scan_start_pg >= table->scan_end_pg)
+		return 0;
+	if (table->cur_phys_pg + 1 < table->scan_start_pg)
+		table->cur_phys_pg = table->scan_start_pg - 1;
+
 #ifndef SLOW_READ
 	while (1) {
 		next_pg = mdb_map_find_next(mdb, table->usage_map,
@@ -330,6 +390,8 @@ int mdb_read_next_dpg(MdbTableDef *table)
 			break; /* unknow map type: goto fallback */
 		if (!next_pg)
 			return 0;
+		if (table->scan_end_pg && (guint32)next_pg >= table->scan_end_pg)
+			return 0;
 
 		if (!mdb_read_pg(mdb, next_pg)) {
 			fprintf(stderr, "error: reading page %d failed.\n", next_pg);
@@ -349,13 +411,92 @@ int mdb_read_next_dpg(MdbTableDef *table)
 	fprintf(stderr, "Warning: defaulting to brute force read\n");
 #endif 
 	/* can't do a fast read, go back to the old way */
+	if (table->cur_phys_pg < table->scan_start_pg)
+		table->cur_phys_pg = table->scan_start_pg;
 	do {
+		if (table->scan_end_pg && table->cur_phys_pg >= table->scan_end_pg)
+			return 0;
 		if (!mdb_read_pg(mdb, table->cur_phys_pg++))
 			return 0;
 	} while (mdb->pg_buf[0]!=MDB_PAGE_DATA || mdb_get_int32(mdb->pg_buf, 4)!=entry->table_pg);
 	/* fprintf(stderr,"returning new page %ld\n", table->cur_phys_pg); */
 	return table->cur_phys_pg;
 }
+/*
+ * the idx-th data page of a table: from the usage map, or counting every
+ * page of the file when the map can't be read
+ */
+static guint32
+mdb_nth_data_pg(MdbTableDef *table, guint32 idx, int use_map)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	guint32 pg = 0;
+
+	if (!use_map)
+		return idx + 1;
+	do {
+		pg = mdb_map_find_next(mdb, table->usage_map, table->map_sz, pg);
+	} while (pg && idx--);
+	return pg;
+}
+/**
+ * mdb_table_set_shard:
+ * @table: Table to scan
+ * @shard: Which part of the table to scan, from 0
+ * @num_shards: How many parts the table is divided into
+ *
+ * Limits table scans of @table to one of @num_shards disjoint runs of its
+ * data pages.  The pages of the usage map are divided as evenly as they
+ * can be, the same way every time, so separate processes scanning each
+ * shard once between them see every row once, and in the order of a
+ * plain table scan if their output is concatenated in shard order.  Index
+ * and bitmap scans can't be limited to the shard's pages, so one already
+ * picked for table->sarg_tree is replaced by a table scan, which still
+ * applies the sargs.  Passing 0 for @num_shards removes the limit.
+ *
+ * Returns: 1 if successful, 0 if @shard is out of range.
+ */
+int mdb_table_set_shard(MdbTableDef *table, unsigned int shard, unsigned int num_shards)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	guint32 num_pgs, lo, hi;
+	int use_map = 1;
+
+	table->scan_start_pg = 0;
+	table->scan_end_pg = 0;
+	if (!num_shards)
+		return 1;
+	if (shard >= num_shards)
+		return 0;
+
+	/* every shard would see all the rows the index finds */
+	if (table->strategy != MDB_TABLE_SCAN) {
+		mdb_index_scan_free(table);
+		table->strategy = MDB_TABLE_SCAN;
+		table->scan_idx = NULL;
+	}
+
+	if (table->usage_map && (table->usage_map[0] == 0 || table->usage_map[0] == 1)) {
+		num_pgs = mdb_map_count_pages(mdb, table->usage_map, table->map_sz);
+	} else {
+		/* same fallback as mdb_read_next_dpg(), every page but the first */
+		use_map = 0;
+		num_pgs = mdb_file_size(mdb) / mdb->fmt->pg_size - 1;
+	}
+
+	lo = (guint64)num_pgs * shard / num_shards;
+	hi = (guint64)num_pgs * (shard + 1) / num_shards;
+	if (lo == hi) {
+		/* nothing left for this shard */
+		table->scan_start_pg = table->scan_end_pg = G_MAXUINT32;
+		return 1;
+	}
+	if (shard)
+		table->scan_start_pg = mdb_nth_data_pg(table, lo, use_map);
+	if (hi < num_pgs)
+		table->scan_end_pg = mdb_nth_data_pg(table, hi, use_map);
+	return 1;
+}
 int mdb_rewind_table(MdbTableDef *table)
 {
 	table->cur_pg_num=0;
@@ -380,7 +521,11 @@ mdb_fetch_row(MdbTableDef *table)
 	if (!table->cur_pg_num) {
 		table->cur_pg_num=1;
 		table->cur_row=0;
-		if ((!table->is_temp_table)&&(table->strategy!=MDB_INDEX_SCAN))
+		/* the bindings are known now, see if the index has it all */
+		if (table->strategy==MDB_INDEX_SCAN &&
+		    mdb_index_is_covering(table, table->scan_idx))
+			table->strategy = MDB_COVERING_SCAN;
+		if ((!table->is_temp_table)&&(table->strategy==MDB_TABLE_SCAN))
 			if (!mdb_read_next_dpg(table)) return 0;
 	}
 
@@ -406,6 +551,32 @@ mdb_fetch_row(MdbTableDef *table)
 				return 0;
 			}
 			mdb_read_pg(mdb, pg);
+		} else if (table->strategy==MDB_COVERING_SCAN) {
+			MdbIndexPage *ipg;
+
+			if (!mdb_index_find_next(table->mdbidx, table->scan_idx, table->chain, &pg, (guint16 *) &(table->cur_row))) {
+				mdb_index_scan_free(table);
+				return 0;
+			}
+			ipg = &table->chain->pages[table->chain->cur_depth - 1];
+			rc = mdb_read_covering_row(table, ipg->cache_value,
+				ipg->cache_len);
+			continue;
+		} else if (table->strategy==MDB_BITMAP_SCAN) {
+			GArray *bitmap = table->bitmap_rows;
+
+			if (!bitmap || table->bitmap_pos >= bitmap->len) {
+				mdb_index_scan_free(table);
+				return 0;
+			}
+			pg = g_array_index(bitmap, guint32, table->bitmap_pos++);
+			table->cur_row = pg & 0xff;
+			pg >>= 8;
+			/* rows are sorted by page, so each page is read once */
+			if (pg != table->cur_phys_pg) {
+				table->cur_phys_pg = pg;
+				mdb_read_pg(mdb, pg);
+			}
 		} else {
 			rows = mdb_get_int16(mdb->pg_buf,fmt->row_count_offset);
 
@@ -830,6 +1001,29 @@ mdb_date_to_tm(double td, struct tm *t)
 	t->tm_isdst = -1;
 }
 
+/* inverse of mdb_date_to_tm(), the time part is always added as a positive
+   fraction of the day as Access does for dates before 1899 */
+void
+mdb_tm_to_date(struct tm *t, double *td)
+{
+	long int day, yr;
+	int noleap_cal[] = {0,31,59,90,120,151,181,212,243,273,304,334,365};
+	int leap_cal[]   = {0,31,60,91,121,152,182,213,244,274,305,335,366};
+	int *cal;
+	double time;
+
+	yr = t->tm_year + 1900;
+	cal = ((yr)%4==0 && ((yr)%100!=0 || (yr)%400==0)) ?
+		leap_cal : noleap_cal;
+	yr--;
+	day = yr * 365 + yr / 4 - yr / 100 + yr / 400;
+	day += cal[t->tm_mon] + t->tm_mday - 1;
+	day -= 693593; /* Days from 1/1/1 to 12/31/1899 */
+
+	time = (t->tm_hour * 3600 + t->tm_min * 60 + t->tm_sec) / 86400.0;
+	*td = (day < 0) ? day - time : day + time;
+}
+
 static char *
 mdb_date_to_string(void *buf, int start)
 {
@@ -865,6 +1059,287 @@ mdb_uuid_to_string(MdbHandle *mdb, int start)
 	return text;
 }
 
+/* parse a guid in the form written by mdb_uuid_to_string() back into its
+   16 on-disk bytes, returns 0 if the string isn't a guid */
+int
+mdb_string_to_uuid(const char *s, unsigned char *uuid)
+{
+	unsigned int val = 0;
+	int digits = 0;
+
+	for (; *s && digits < 32; s++) {
+		if (*s == '{' || *s == '}' || *s == '-')
+			continue;
+		if (!g_ascii_isxdigit(*s))
+			return 0;
+		val = (val << 4) | g_ascii_xdigit_value(*s);
+		if (++digits % 4 == 0) {
+			uuid[digits/2 - 2] = val & 0xff;
+			uuid[digits/2 - 1] = (val >> 8) & 0xff;
+			val = 0;
+		}
+	}
+	return (digits == 32);
+}
+
+/* parse a decimal number into a 128 bit magnitude scaled by 10^scale,
+   least significant word first.  Digits beyond the scale are rounded. */
+static int
+mdb_string_to_decimal(const char *s, int scale, guint32 *mag, int *neg)
+{
+	guint64 carry;
+	int i, digits = 0, frac = -1, d, round = 0;
+
+	memset(mag, 0, 4 * sizeof(guint32));
+	while (g_ascii_isspace(*s)) s++;
+	*neg = (*s == '-');
+	if (*s == '-' || *s == '+') s++;
+	for (; *s; s++) {
+		if (*s == '.' && frac < 0) {
+			frac = 0;
+			continue;
+		}
+		if (!g_ascii_isdigit(*s))
+			break;
+		d = *s - '0';
+		digits++;
+		if (frac >= 0 && frac == scale) {
+			/* the first digit dropped decides the rounding */
+			if (!round)
+				round = (d >= 5) ? 1 : -1;
+			continue;
+		}
+		if (frac >= 0)
+			frac++;
+		for (i = 0, carry = d; i < 4; i++) {
+			carry += (guint64) mag[i] * 10;
+			mag[i] = carry & 0xffffffff;
+			carry >>= 32;
+		}
+		if (carry) return 0;
+	}
+	while (g_ascii_isspace(*s)) s++;
+	if (*s || !digits) return 0;
+	for (frac = (frac < 0) ? 0 : frac; frac < scale; frac++) {
+		for (i = 0, carry = 0; i < 4; i++) {
+			carry += (guint64) mag[i] * 10;
+			mag[i] = carry & 0xffffffff;
+			carry >>= 32;
+		}
+		if (carry) return 0;
+	}
+	if (round > 0) {
+		for (i = 0; i < 4 && ++mag[i] == 0; i++)
+			;
+		if (i == 4) return 0;
+	}
+	return 1;
+}
+
+/* parse a date as yyyy-mm-dd or mm/dd/yy[yy], optionally followed by a
+   time as hh:mm[:ss] */
+static int
+mdb_string_to_date(const char *s, double *td)
+{
+	struct tm t;
+	int n = 0, a, b, c;
+
+	memset(&t, 0, sizeof(t));
+	if (sscanf(s, "%d-%d-%d%n", &a, &b, &c, &n) == 3) {
+		t.tm_year = a - 1900;
+		t.tm_mon = b - 1;
+		t.tm_mday = c;
+	} else if (sscanf(s, "%d/%d/%d%n", &a, &b, &c, &n) == 3) {
+		/* two digit years are taken as strptime() does */
+		if (n > 0 && c < 100)
+			c += (c < 69) ? 2000 : 1900;
+		t.tm_year = c - 1900;
+		t.tm_mon = a - 1;
+		t.tm_mday = b;
+	} else {
+		return 0;
+	}
+	s += n;
+	if (*s == 'T' || *s == ' ') {
+		n = 0;
+		c = 0;
+		if (sscanf(s + 1, "%d:%d%n:%d%n", &a, &b, &n, &c, &n) < 2)
+			return 0;
+		t.tm_hour = a;
+		t.tm_min = b;
+		t.tm_sec = c;
+		s += n + 1;
+	}
+	while (g_ascii_isspace(*s)) s++;
+	if (*s || t.tm_mon < 0 || t.tm_mon > 11 || t.tm_mday < 1 || t.tm_mday > 31
+	 || t.tm_hour > 23 || t.tm_min > 59 || t.tm_sec > 59)
+		return 0;
+	mdb_tm_to_date(&t, td);
+	return 1;
+}
+
+/* number of characters of s once converted for the database */
+static size_t
+mdb_string_chars(const char *s)
+{
+	return g_utf8_validate(s, -1, NULL) ? g_utf8_strlen(s, -1) : strlen(s);
+}
+
+/**
+ * mdb_string_to_field:
+ * @mdb: Handle of the database the value is for
+ * @col: Column of the value
+ * @s: The value as text, in the forms mdb_col_to_string() writes, NULL
+ *     for a NULL
+ * @field: Field to fill in, its colnum is left to the caller
+ *
+ * Converts a text value into the on-disk form mdb_pack_row() expects for
+ * the type of @col.  Numbers are decimal, booleans 1/0, true/false or
+ * yes/no, dates yyyy-mm-dd or mm/dd/yy[yy] with an optional hh:mm[:ss].
+ * MEMO values are stored inline in the row, so longer than half a page
+ * they are truncated to fit.  OLE and binary columns aren't supported.
+ * The value is allocated and must be freed with g_free().
+ *
+ * Return value: 1 on success, 2 if a MEMO value was truncated, 0 if @s
+ * isn't valid for @col.
+ */
+int
+mdb_string_to_field(MdbHandle *mdb, MdbColumn *col, const char *s, MdbField *field)
+{
+	union { gfloat f; guint32 i; } f;
+	union { gdouble d; guint64 i; } d;
+	guint32 mag[4];
+	size_t len, max;
+	char *end;
+	long l;
+	int neg, i, truncated;
+
+	field->is_fixed = col->is_fixed;
+	field->is_null = 0;
+	field->value = NULL;
+	field->siz = 0;
+	if (!s) {
+		field->is_null = 1;
+		return 1;
+	}
+	switch (col->col_type) {
+		case MDB_BOOL:
+			if (!strcmp(s, "1") || !strcmp(s, "-1")
+			 || !g_ascii_strcasecmp(s, "true") || !g_ascii_strcasecmp(s, "yes"))
+				field->is_null = 0;
+			else if (!strcmp(s, "0") || !g_ascii_strcasecmp(s, "false")
+			 || !g_ascii_strcasecmp(s, "no"))
+				/* booleans are kept in the null mask */
+				field->is_null = 1;
+			else
+				goto bad;
+			return 1;
+		case MDB_BYTE:
+		case MDB_INT:
+		case MDB_LONGINT:
+			errno = 0;
+			l = strtol(s, &end, 10);
+			if (end == s || *end || errno)
+				goto bad;
+			field->siz = mdb_col_fixed_size(col);
+			field->value = g_malloc(field->siz);
+			if (col->col_type == MDB_BYTE) {
+				if (l < 0 || l > 255) goto bad;
+				((unsigned char *)field->value)[0] = l;
+			} else if (col->col_type == MDB_INT) {
+				if (l < -32768 || l > 32767) goto bad;
+				mdb_put_int16(field->value, 0, l);
+			} else {
+				if (l < G_MININT32 || l > G_MAXINT32) goto bad;
+				mdb_put_int32(field->value, 0, l);
+			}
+			return 1;
+		case MDB_FLOAT:
+		case MDB_DOUBLE:
+		case MDB_DATETIME:
+			if (col->col_type == MDB_DATETIME) {
+				if (!mdb_string_to_date(s, &d.d))
+					goto bad;
+			} else {
+				d.d = strtod(s, &end);
+				if (end == s || *end)
+					goto bad;
+			}
+			field->siz = mdb_col_fixed_size(col);
+			field->value = g_malloc(field->siz);
+			if (col->col_type == MDB_FLOAT) {
+				f.f = d.d;
+				mdb_put_int32(field->value, 0, f.i);
+			} else {
+				mdb_put_int32(field->value, 0, d.i & 0xffffffff);
+				mdb_put_int32(field->value, 4, d.i >> 32);
+			}
+			return 1;
+		case MDB_MONEY:
+			/* currency is a count of ten thousandths */
+			if (!mdb_string_to_decimal(s, 4, mag, &neg)
+			 || mag[3] || mag[2] || (mag[1] & 0x80000000))
+				goto bad;
+			d.i = ((guint64) mag[1] << 32) | mag[0];
+			if (neg)
+				d.i = -d.i;
+			field->siz = 8;
+			field->value = g_malloc(field->siz);
+			mdb_put_int32(field->value, 0, d.i & 0xffffffff);
+			mdb_put_int32(field->value, 4, d.i >> 32);
+			return 1;
+		case MDB_NUMERIC:
+			/* sign, then the 32 bit words most significant first */
+			if (!mdb_string_to_decimal(s, col->col_scale, mag, &neg))
+				goto bad;
+			field->siz = 17;
+			field->value = g_malloc(field->siz);
+			((unsigned char *)field->value)[0] = neg ? 0x80 : 0;
+			for (i = 0; i < 4; i++)
+				mdb_put_int32(field->value, 1 + 4*i, mag[3 - i]);
+			return 1;
+		case MDB_REPID:
+			field->siz = 16;
+			field->value = g_malloc(field->siz);
+			if (!mdb_string_to_uuid(s, field->value))
+				goto bad;
+			return 1;
+		case MDB_TEXT:
+			max = IS_JET3(mdb) ? col->col_size : col->col_size / 2;
+			if (mdb_string_chars(s) > max) {
+				fprintf(stderr, "Value too long for column %s\n", col->name);
+				return 0;
+			}
+			field->value = g_malloc0(col->col_size + 1);
+			field->siz = mdb_ascii2unicode(mdb, (char *) s, 0,
+				field->value, col->col_size);
+			return 1;
+		case MDB_MEMO:
+			max = mdb->fmt->pg_size / 2;
+			len = mdb_string_chars(s) * (IS_JET3(mdb) ? 1 : 2);
+			/* no LVAL pages are written, so a longer value is cut
+			 * where the conversion runs out of room */
+			truncated = len > max - MDB_MEMO_OVERHEAD;
+			field->value = g_malloc0(max);
+			len = mdb_ascii2unicode(mdb, (char *) s, 0,
+				(char *) field->value + MDB_MEMO_OVERHEAD,
+				max - MDB_MEMO_OVERHEAD);
+			/* inline memo, no LVAL page */
+			mdb_put_int32(field->value, 0, len | 0x80000000);
+			field->siz = MDB_MEMO_OVERHEAD + len;
+			return truncated ? 2 : 1;
+		default:
+			fprintf(stderr, "Conversion of type %s not supported yet\n",
+				mdb_get_colbacktype_string(col));
+			return 0;
+	}
+bad:
+	g_free(field->value);
+	field->value = NULL;
+	fprintf(stderr, "%s is not a valid value for column %s\n", s, col->name);
+	return 0;
+}
+
 #if 0
 int floor_log10(double f, int is_single)
 {
@@ -1007,7 +1482,7 @@ int mdb_col_fixed_size(MdbColumn *col)
 			return 1;
 		break;
 		case MDB_BYTE:
-			return -1;
+			return 1;
 		break;
 		case MDB_INT:
 			return 2;
@@ -1026,7 +1501,7 @@ int mdb_col_fixed_size(MdbColumn *col)
 			return -1;
 		break;
 		case MDB_DATETIME:
-			return 4;
+			return 8;
 		break;
 		case MDB_BINARY:
 			return -1;
@@ -1037,6 +1512,12 @@ int mdb_col_fixed_size(MdbColumn *col)
 		case MDB_MONEY:
 			return 8;
 		break;
+		case MDB_REPID:
+			return 16;
+		break;
+		case MDB_NUMERIC:
+			return 17;
+		break;
 	}
 	return 0;
 }
@@ -43,13 +43,19 @@ typedef struct {
 	guint16         tab_col_offset_var;
 	guint16         tab_col_offset_fixed;
 	guint16         tab_row_col_num_offset;
+	guint16         idx_pref_len_offset;
+	guint16         idx_bitmap_offset;
+	guint16         idx_entries_offset;
+	guint16         idx_next_pg_offset;
 } MdbFormatConstants; 
 */
 MdbFormatConstants MdbJet4Constants = {
-	4096, 0x0c, 16, 45, 47, 51, 55, 56, 63, 12, 15, 23, 5, 25, 59, 7, 21, 9
+	4096, 0x0c, 16, 45, 47, 51, 55, 56, 63, 12, 15, 23, 5, 25, 59, 7, 21, 9,
+	0x18, 0x1b, 0x1e0, 0x10
 };
 MdbFormatConstants MdbJet3Constants = {
-	2048, 0x08, 12, 25, 27, 31, 35, 36, 43, 8, 13, 16, 1, 18, 39, 3, 14, 5
+	2048, 0x08, 12, 25, 27, 31, 35, 36, 43, 8, 13, 16, 1, 18, 39, 3, 14, 5,
+	0x14, 0x16, 0xf8, 0x0c
 };
 
 typedef struct _RC4_KEY
@@ -162,7 +168,8 @@ static char *mdb_find_file(const char *file_name)
 /**
  * mdb_open:
  * @filename: path to MDB (database) file
- * @flags: MDB_NOFLAGS for read-only, MDB_WRITABLE for read/write
+ * @flags: MDB_NOFLAGS for read-only, MDB_WRITABLE for read/write, plus
+ * MDB_WRITEBACK to hold written pages in memory until mdb_flush()
  *
  * Opens an MDB file and returns an MdbHandle to it.  MDB File may be relative
  * to the current directory, a full path to the file, or relative to a 
@@ -188,6 +195,7 @@ MdbHandle *mdb_open(const char *filename, MdbFileFlags flags)
 	mdb->f = (MdbFile *) g_malloc0(sizeof(MdbFile));
 	mdb->f->refs = 1;
 	mdb->f->fd = -1;
+	g_mutex_init(&mdb->f->idx_lock);
 	mdb->f->filename = mdb_find_file(filename);
 	if (!mdb->f->filename) { 
 		fprintf(stderr, "File not found\n");
@@ -261,6 +269,9 @@ MdbHandle *mdb_open(const char *filename, MdbFileFlags flags)
 			return NULL;
 		}
 	}
+	if (mdb->f->writable && (flags & MDB_WRITEBACK))
+		mdb->f->dirty = g_hash_table_new_full(g_direct_hash,
+			g_direct_equal, NULL, g_free);
 
 	/* get the db password located at 0x42 bytes into the file */
 	for (pos=0;pos<14;pos++) {
@@ -293,10 +304,19 @@ mdb_close(MdbHandle *mdb)
 	g_free(mdb->backend_name);
 
 	if (mdb->f) {
-		if (mdb->f->refs > 1) {
-			mdb->f->refs--;
+		mdb_index_cache_release(mdb);
+		/* clones may be closed from other threads */
+		if (!g_atomic_int_dec_and_test(&mdb->f->refs)) {
+			/* still in use by another handle */
 		} else {
+			if (mdb->f->dirty) {
+				mdb_flush(mdb);
+				g_hash_table_destroy(mdb->f->dirty);
+			}
 			if (mdb->f->fd != -1) close(mdb->f->fd);
+			mdb_index_cache_free(mdb->f);
+			g_mutex_clear(&mdb->f->idx_lock);
+			g_free(mdb->f->free_map);
 			g_free(mdb->f->filename);
 			g_free(mdb->f);
 		}
@@ -311,7 +331,8 @@ mdb_close(MdbHandle *mdb)
  * @mdb: Handle to open MDB database file
  *
  * Clones an existing database handle.  Cloned handle shares the file descriptor
- * but has its own page buffer, page position, and similar internal variables.
+ * but has its own page buffer, page position, catalog, and iconv state, so
+ * separate threads may each read tables through their own clone.
  *
  * Return value: new handle to the database.
  */
@@ -319,21 +340,32 @@ MdbHandle *mdb_clone_handle(MdbHandle *mdb)
 {
 	MdbHandle *newmdb;
 	MdbCatalogEntry *entry, *data;
-	unsigned int i;
+	unsigned int i, j;
 
 	newmdb = (MdbHandle *) g_memdup(mdb, sizeof(MdbHandle));
 	newmdb->stats = NULL;
+	newmdb->idx_page = NULL;
 	newmdb->catalog = g_ptr_array_new();
 	for (i=0;i<mdb->num_catalog;i++) {
 		entry = g_ptr_array_index(mdb->catalog,i);
 		data = g_memdup(entry,sizeof(MdbCatalogEntry));
+		data->mdb = newmdb;
+		if (entry->props) {
+			data->props = g_array_sized_new(FALSE, FALSE,
+				sizeof(MdbProperties *), entry->props->len);
+			for (j=0;j<entry->props->len;j++) {
+				MdbProperties *props = mdb_copy_props(
+					g_array_index(entry->props, MdbProperties *, j));
+				g_array_append_val(data->props, props);
+			}
+		}
 		g_ptr_array_add(newmdb->catalog, data);
 	}
-	mdb->backend_name = NULL;
+	newmdb->backend_name = g_strdup(mdb->backend_name);
 	if (mdb->f) {
-		mdb->f->refs++;
+		g_atomic_int_inc(&mdb->f->refs);
 	}
-	mdb_iconv_init(mdb);
+	mdb_iconv_init(newmdb);
 
 	return newmdb;
 }
@@ -361,22 +393,49 @@ ssize_t mdb_read_alt_pg(MdbHandle *mdb, unsigned long pg)
 	len = _mdb_read_pg(mdb, mdb->alt_pg_buf, pg);
 	return len;
 }
+/**
+ * mdb_file_size:
+ * @mdb: Handle to open MDB database file
+ *
+ * Return value: the size of the database file in bytes, including pages
+ * added and not flushed yet when it was opened with MDB_WRITEBACK.
+ */
+off_t mdb_file_size(MdbHandle *mdb)
+{
+	struct stat status;
+
+	fstat(mdb->f->fd, &status);
+	if (mdb->f->dirty_end > status.st_size)
+		return mdb->f->dirty_end;
+	return status.st_size;
+}
 static ssize_t _mdb_read_pg(MdbHandle *mdb, void *pg_buf, unsigned long pg)
 {
 	ssize_t len;
-	struct stat status;
 	off_t offset = pg * mdb->fmt->pg_size;
+	void *dirty_pg;
 
-        fstat(mdb->f->fd, &status);
-        if (status.st_size < offset) { 
+        if (mdb_file_size(mdb) < offset) { 
                 fprintf(stderr,"offset %jd is beyond EOF\n",(intmax_t)offset);
                 return 0;
         }
 	if (mdb->stats && mdb->stats->collect) 
 		mdb->stats->pg_reads++;
 
+	/* written back pages are newer than what the file holds */
+	if (mdb->f->dirty &&
+	    (dirty_pg = g_hash_table_lookup(mdb->f->dirty, GUINT_TO_POINTER(pg)))) {
+		memcpy(pg_buf, dirty_pg, mdb->fmt->pg_size);
+		return mdb->fmt->pg_size;
+	}
+
+#ifdef HAVE_PREAD
+	/* no shared file position, so clones may read from several threads */
+	len = pread(mdb->f->fd, pg_buf, mdb->fmt->pg_size, offset);
+#else
 	lseek(mdb->f->fd, offset, SEEK_SET);
 	len = read(mdb->f->fd,pg_buf,mdb->fmt->pg_size);
+#endif
 	if (len==-1) {
 		perror("read");
 		return 0;
@@ -445,6 +504,12 @@ long mdb_get_int32(void *buf, int offset)
 	memcpy(&l, (char*)buf + offset, 4);
 	return (long)GINT32_FROM_LE(l);
 }
+gint64 mdb_get_int64(void *buf, int offset)
+{
+	gint64 l;
+	memcpy(&l, (char*)buf + offset, 8);
+	return GINT64_FROM_LE(l);
+}
 long mdb_pg_get_int32(MdbHandle *mdb, int offset)
 {
 	if (offset <0 || offset+4 > mdb->fmt->pg_size) return -1;
@@ -140,39 +140,12 @@ mdb_ascii2unicode(MdbHandle *mdb, char *src, size_t slen, char *dest, size_t dle
 
 	/* Unicode Compression */
 	if(!IS_JET3(mdb) && (dlen>4)) {
-		unsigned char *tmp = g_malloc(dlen);
-		unsigned int tptr = 0, dptr = 0;
-		int comp = 1;
-
-		tmp[tptr++] = 0xff;
-		tmp[tptr++] = 0xfe;
-		while((dptr < dlen) && (tptr < dlen)) {
-			if (((dest[dptr+1]==0) && (comp==0))
-			 || ((dest[dptr+1]!=0) && (comp==1))) {
-				/* switch encoding mode */
-				tmp[tptr++] = 0;
-				comp = (comp) ? 0 : 1;
-			} else if (dest[dptr]==0) {
-				/* this string cannot be compressed */
-				tptr = dlen;
-			} else if (comp==1) {
-				/* encode compressed character */
-				tmp[tptr++] = dest[dptr];
-				dptr += 2;
-			} else if (tptr+1 < dlen) {
-				/* encode uncompressed character */
-				tmp[tptr++] = dest[dptr];
-				tmp[tptr++] = dest[dptr+1];
-				dptr += 2;
-			} else {
-				/* could not encode uncompressed character
-				 * into single byte */
-				tptr = dlen;
-			}
-		}
-		if (tptr < dlen) {
-			memcpy(dest, tmp, tptr);
-			dlen = tptr;
+		char *tmp = g_malloc(dlen);
+		size_t tlen = mdb_unicode_compress(dest, dlen, tmp);
+
+		if (tlen) {
+			memcpy(dest, tmp, tlen);
+			dlen = tlen;
 		}
 		g_free(tmp);
 	}
@@ -180,6 +153,48 @@ mdb_ascii2unicode(MdbHandle *mdb, char *src, size_t slen, char *dest, size_t dle
 	return dlen;
 }
 
+/*
+ * Compresses the UCS-2 string src, as Jet4 stores text columns flagged for
+ * it, into dest which must hold slen bytes.  Returns the compressed length,
+ * or 0 if the string can't be compressed or wouldn't get shorter.
+ */
+size_t
+mdb_unicode_compress(const char *src, size_t slen, char *dest)
+{
+	size_t tptr = 0, dptr = 0;
+	int comp = 1;
+
+	if (slen <= 4)
+		return 0;
+	dest[tptr++] = 0xff;
+	dest[tptr++] = 0xfe;
+	while((dptr+1 < slen) && (tptr < slen)) {
+		if (((src[dptr+1]==0) && (comp==0))
+		 || ((src[dptr+1]!=0) && (comp==1))) {
+			/* switch encoding mode */
+			dest[tptr++] = 0;
+			comp = (comp) ? 0 : 1;
+		} else if (src[dptr]==0) {
+			/* this string cannot be compressed */
+			return 0;
+		} else if (comp==1) {
+			/* encode compressed character */
+			dest[tptr++] = src[dptr];
+			dptr += 2;
+		} else if (tptr+1 < slen) {
+			/* encode uncompressed character */
+			dest[tptr++] = src[dptr];
+			dest[tptr++] = src[dptr+1];
+			dptr += 2;
+		} else {
+			/* could not encode uncompressed character
+			 * into single byte */
+			return 0;
+		}
+	}
+	return (tptr < slen) ? tptr : 0;
+}
+
 const char*
 mdb_target_charset(MdbHandle *mdb)
 {
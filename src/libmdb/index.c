@@ -16,6 +16,7 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#include <math.h>
 #include "mdbtools.h"
 
 #ifdef DMALLOC
@@ -24,6 +25,7 @@
 
 MdbIndexPage *mdb_index_read_bottom_pg(MdbHandle *mdb, MdbIndex *idx, MdbIndexChain *chain);
 MdbIndexPage *mdb_chain_add_page(MdbHandle *mdb, MdbIndexChain *chain, guint32 pg);
+static int mdb_index_key_col_len(MdbColumn *col, int order, unsigned char *key, int len);
 
 char idx_to_text[] = {
 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, /* 0-7     0x00-0x07 */
@@ -190,8 +192,14 @@ mdb_read_indices(MdbTableDef *table)
 		}
 		pidx->num_keys = key_num;
 
-		cur_pos += 4;
-		//fprintf(stderr, "pidx->unknown_pre_first_pg:0x%08x\n", read_pg_if_32(mdb, &cur_pos));
+		/* usage map of the pages the index owns */
+		pidx->usage_map_pg_row = read_pg_if_32(mdb, &cur_pos);
+		/* remember where first_pg is, to update it */
+		read_pg_if_n(mdb, NULL, &cur_pos, 0);
+		if (cur_pos + 4 <= fmt->pg_size) {
+			pidx->first_pg_tdef_pg = mdb->cur_pg;
+			pidx->first_pg_tdef_pos = cur_pos;
+		}
 		pidx->first_pg = read_pg_if_32(mdb, &cur_pos);
 		pidx->flags = read_pg_if_8(mdb, &cur_pos);
 		//fprintf(stderr, "pidx->first_pg:%d pidx->flags:0x%02x\n",	pidx->first_pg, pidx->flags);
@@ -199,6 +207,11 @@ mdb_read_indices(MdbTableDef *table)
 	}
 	return NULL;
 }
+/*
+ * hash text with the Jet3 sort order.  Characters the table has no code
+ * for are kept as they are rather than turned into a 0, which would end
+ * the key there and make keys differing after it equal.
+ */
 void
 mdb_index_hash_text(char *text, char *hash)
 {
@@ -207,8 +220,8 @@ mdb_index_hash_text(char *text, char *hash)
 	for (k=0;k<strlen(text);k++) {
 		int c = ((unsigned char *)(text))[k];
 		hash[k] = idx_to_text[c];
-		if (!(hash[k])) fprintf(stderr, 
-				"No translation available for %02x %d\n", c, c);
+		if (!(hash[k]))
+			hash[k] = c;
 	}
 	hash[strlen(text)]='\0';
 }
@@ -224,61 +237,480 @@ mdb_index_swap_n(unsigned char *src, int sz, unsigned char *dest)
 		dest[j++] = src[i];
 	}
 }
-void 
-mdb_index_cache_sarg(MdbColumn *col, MdbSarg *sarg, MdbSarg *idx_sarg)
-{
-	//guint32 cache_int;
-	unsigned char *c;
+/*
+ * Index entries are built so that a plain memcmp() of two entries gives the
+ * index order.  Every key column starts with a flag byte followed by the
+ * encoded value, and descending columns have all of their bytes (flag
+ * included) inverted.
+ */
+#define MDB_IDX_FLAG_NULL	0x00
+#define MDB_IDX_FLAG_NOTNULL	0x7f
 
+/*
+ * size of the encoded value of a key column, not counting the flag byte.
+ * Returns 0 for variable length (text) keys and -1 for types we can't
+ * encode.
+ */
+int
+mdb_index_key_size(MdbColumn *col)
+{
 	switch (col->col_type) {
+		case MDB_BYTE:
+			return 1;
+		case MDB_INT:
+			return 2;
+		case MDB_LONGINT:
+		case MDB_COMPLEX:
+		case MDB_FLOAT:
+			return 4;
+		case MDB_MONEY:
+		case MDB_DOUBLE:
+		case MDB_DATETIME:
+			return 8;
+		case MDB_NUMERIC:
+			return 17;
+		case MDB_REPID:
+			return 18;
 		case MDB_TEXT:
-		mdb_index_hash_text(sarg->value.s, idx_sarg->value.s);
-		break;
+			return 0;
+	}
+	return -1;
+}
+/*
+ * mdb_index_encode_key
+ * @col: the key column
+ * @order: MDB_ASC or MDB_DESC
+ * @field: the value in its on-disk (little endian) form, text columns
+ *         take a plain ascii string of field->siz bytes.
+ * @key: receives the flag byte and the encoded value
+ *
+ * Integers are stored big endian with the sign bit flipped, floating point
+ * values (dates included) big endian with the sign bit set when positive
+ * and all bits flipped when negative.  Numerics are a sign byte followed by
+ * the 16 byte magnitude, guids are split in two blocks of eight separated
+ * by 0x09 and terminated by 0x08 and text is hashed and null terminated.
+ *
+ * Returns the number of bytes written to @key, or -1 if the column type
+ * can't be encoded.
+ */
+int
+mdb_index_encode_key(MdbColumn *col, int order, MdbField *field, unsigned char *key)
+{
+	unsigned char *val = field->value;
+	char tmpbuf[256];
+	int sz, i;
 
-		case MDB_LONGINT:
-		idx_sarg->value.i = GUINT32_SWAP_LE_BE(sarg->value.i);
-		//cache_int = sarg->value.i * -1;
-		c = (unsigned char *) &(idx_sarg->value.i);
-		c[0] |= 0x80;
-		//printf("int %08x %02x %02x %02x %02x\n", sarg->value.i, c[0], c[1], c[2], c[3]);
-		break;	
+	sz = mdb_index_key_size(col);
+	if (sz < 0) return -1;
 
+	if (field->is_null) {
+		key[0] = MDB_IDX_FLAG_NULL;
+		sz = 0;
+	} else {
+		key[0] = MDB_IDX_FLAG_NOTNULL;
+	}
+	if (!field->is_null) switch (col->col_type) {
+		case MDB_BYTE:
 		case MDB_INT:
-		break;	
+		case MDB_LONGINT:
+		case MDB_COMPLEX:
+		case MDB_MONEY:
+			mdb_index_swap_n(val, sz, &key[1]);
+			key[1] ^= 0x80;
+			break;
+		case MDB_FLOAT:
+		case MDB_DOUBLE:
+		case MDB_DATETIME:
+			mdb_index_swap_n(val, sz, &key[1]);
+			if (key[1] & 0x80) {
+				for (i=1;i<=sz;i++)
+					key[i] = ~key[i];
+			} else {
+				key[1] |= 0x80;
+			}
+			break;
+		case MDB_NUMERIC:
+			/* the magnitude is four little endian words, most
+			 * significant word first */
+			key[1] = 0xff;
+			for (i=0;i<16;i++)
+				key[2+i] = val[1 + 4*(i/4) + 3 - i%4];
+			if (val[0] & 0x80) {
+				for (i=1;i<=sz;i++)
+					key[i] = ~key[i];
+			}
+			break;
+		case MDB_REPID:
+			/* guids sort in string order */
+			key[1] = val[3]; key[2] = val[2];
+			key[3] = val[1]; key[4] = val[0];
+			key[5] = val[5]; key[6] = val[4];
+			key[7] = val[7]; key[8] = val[6];
+			key[9] = 0x09;
+			memcpy(&key[10], &val[8], 8);
+			key[18] = 0x08;
+			break;
+		case MDB_TEXT:
+			sz = field->siz > 253 ? 253 : field->siz;
+			memcpy(tmpbuf, val, sz);
+			tmpbuf[sz] = '\0';
+			mdb_index_hash_text(tmpbuf, (char *) &key[1]);
+			/* include the terminator */
+			sz = strlen(tmpbuf) + 1;
+			break;
+	}
+	if (order == MDB_DESC) {
+		for (i=0;i<=sz;i++)
+			key[i] = ~key[i];
+	}
+	return sz + 1;
+}
+/*
+ * mdb_index_decode_key
+ * The reverse of mdb_index_encode_key(), turns the key column at the start
+ * of @key back into its on-disk form in @buf.  Text keys are hashed and
+ * can't be decoded, field->value is left NULL for them.
+ *
+ * Returns the number of key bytes used, or -1 if the entry can't be
+ * parsed.
+ */
+int
+mdb_index_decode_key(MdbColumn *col, int order, unsigned char *key, int len, MdbField *field, unsigned char *buf)
+{
+	unsigned char tmpbuf[256];
+	int c_len, sz, i;
 
+	c_len = mdb_index_key_col_len(col, order, key, len);
+	if (c_len < 0) return -1;
+	for (i=0;i<c_len;i++)
+		tmpbuf[i] = (order == MDB_DESC) ? ~key[i] : key[i];
+
+	field->value = NULL;
+	field->siz = 0;
+	field->is_null = (tmpbuf[0] == MDB_IDX_FLAG_NULL);
+	if (field->is_null)
+		return c_len;
+
+	sz = mdb_index_key_size(col);
+	switch (col->col_type) {
+		case MDB_BYTE:
+		case MDB_INT:
+		case MDB_LONGINT:
+		case MDB_COMPLEX:
+		case MDB_MONEY:
+			tmpbuf[1] ^= 0x80;
+			mdb_index_swap_n(&tmpbuf[1], sz, buf);
+			break;
+		case MDB_FLOAT:
+		case MDB_DOUBLE:
+		case MDB_DATETIME:
+			if (tmpbuf[1] & 0x80) {
+				tmpbuf[1] &= 0x7f;
+			} else {
+				for (i=1;i<=sz;i++)
+					tmpbuf[i] = ~tmpbuf[i];
+			}
+			mdb_index_swap_n(&tmpbuf[1], sz, buf);
+			break;
+		case MDB_NUMERIC:
+			if (!tmpbuf[1]) {
+				for (i=1;i<=sz;i++)
+					tmpbuf[i] = ~tmpbuf[i];
+				buf[0] = 0x80;
+			} else {
+				buf[0] = 0;
+			}
+			for (i=0;i<16;i++)
+				buf[1 + 4*(i/4) + 3 - i%4] = tmpbuf[2+i];
+			break;
+		case MDB_REPID:
+			buf[3] = tmpbuf[1]; buf[2] = tmpbuf[2];
+			buf[1] = tmpbuf[3]; buf[0] = tmpbuf[4];
+			buf[5] = tmpbuf[5]; buf[4] = tmpbuf[6];
+			buf[7] = tmpbuf[7]; buf[6] = tmpbuf[8];
+			memcpy(&buf[8], &tmpbuf[10], 8);
+			sz = 16;
+			break;
 		default:
-		break;	
+			return c_len;
 	}
+	field->value = buf;
+	field->siz = sz;
+	return c_len;
 }
-#if 0
-int 
-mdb_index_test_sarg(MdbHandle *mdb, MdbColumn *col, MdbSarg *sarg, int offset, int len)
+/*
+ * length of a key column within an index entry, flag byte included.
+ * Returns -1 if the entry can't be parsed any further.
+ */
+static int
+mdb_index_key_col_len(MdbColumn *col, int order, unsigned char *key, int len)
 {
-char tmpbuf[256];
-int lastchar;
+	unsigned char term = (order == MDB_DESC) ? 0xff : 0x00;
+	int sz, i;
+
+	if (len < 1) return -1;
+	if (key[0] == term) return 1; /* null */
+	sz = mdb_index_key_size(col);
+	if (sz < 0) return -1;
+	if (!sz) {
+		for (i=1; i<len; i++) {
+			if (key[i] == term) return i + 1;
+		}
+		return -1;
+	}
+	if (sz + 1 > len) return -1;
+	return sz + 1;
+}
+/*
+ * turn a sarg value into the on-disk form of the column so it can be fed
+ * to mdb_index_encode_key().  Integers come in as value.i, floating point,
+ * money and numeric values as value.d, dates as a time_t and text and guids
+ * as strings.
+ */
+static int
+mdb_index_sarg_to_field(MdbColumn *col, MdbSarg *sarg, MdbField *field, unsigned char *buf)
+{
+	union {guint32 g; float f;} f;
+	union {guint64 g; double d;} d;
+	gint64 money;
+	double dval;
+	struct tm *t;
+	time_t tt;
+	int i;
 
+	field->value = buf;
+	field->is_null = FALSE;
 	switch (col->col_type) {
 		case MDB_BYTE:
-			return mdb_test_int(sarg, mdb_pg_get_byte(mdb, offset));
+			buf[0] = sarg->value.i;
+			field->siz = 1;
 			break;
 		case MDB_INT:
-			return mdb_test_int(sarg, mdb_pg_get_int16(mdb, offset));
+			mdb_put_int16(buf, 0, sarg->value.i);
+			field->siz = 2;
 			break;
 		case MDB_LONGINT:
-			return mdb_test_int(sarg, mdb_pg_get_int32(mdb, offset));
+		case MDB_COMPLEX:
+			mdb_put_int32(buf, 0, sarg->value.i);
+			field->siz = 4;
+			break;
+		case MDB_MONEY:
+			money = (gint64) floor(sarg->value.d * 10000 + 0.5);
+			for (i=0;i<8;i++)
+				buf[i] = (money >> (8 * i)) & 0xff;
+			field->siz = 8;
+			break;
+		case MDB_FLOAT:
+			f.f = sarg->value.d;
+			f.g = GUINT32_TO_LE(f.g);
+			memcpy(buf, &f, 4);
+			field->siz = 4;
+			break;
+		case MDB_DOUBLE:
+		case MDB_DATETIME:
+			if (col->col_type == MDB_DATETIME) {
+				tt = sarg->value.i;
+				if (!(t = localtime(&tt))) return -1;
+				mdb_tm_to_date(t, &d.d);
+			} else {
+				d.d = sarg->value.d;
+			}
+			d.g = GUINT64_TO_LE(d.g);
+			memcpy(buf, &d, 8);
+			field->siz = 8;
+			break;
+		case MDB_NUMERIC:
+			memset(buf, 0, 17);
+			dval = sarg->value.d;
+			if (dval < 0) {
+				buf[0] = 0x80;
+				dval = -dval;
+			}
+			for (i=0;i<col->col_scale;i++)
+				dval *= 10;
+			money = (gint64) floor(dval + 0.5);
+			/* low 64 bits go in the last two words */
+			mdb_put_int32(buf, 9, money >> 32);
+			mdb_put_int32(buf, 13, money & 0xffffffff);
+			field->siz = 17;
+			break;
+		case MDB_REPID:
+			if (!mdb_string_to_uuid(sarg->value.s, buf))
+				return -1;
+			field->siz = 16;
 			break;
 		case MDB_TEXT:
-			strncpy(tmpbuf, &mdb->pg_buf[offset],255);
-			lastchar = len > 255 ? 255 : len;
-			tmpbuf[lastchar]='\0';
-			return mdb_test_string(sarg, tmpbuf);
-		default:
-			fprintf(stderr, "Calling mdb_test_sarg on unknown type.  Add code to mdb_test_sarg() for type %d\n",col->col_type);
+			strcpy((char *) buf, sarg->value.s);
+			field->siz = strlen(sarg->value.s);
 			break;
+		default:
+			return -1;
+	}
+	return field->siz;
+}
+/*
+ * cache the ascending index encoding of a sarg value in idx_sarg, so
+ * entries can be tested with a memcmp().  For LIKE only the literal prefix
+ * up to the first wildcard is kept.
+ */
+void 
+mdb_index_cache_sarg(MdbColumn *col, MdbSarg *sarg, MdbSarg *idx_sarg)
+{
+	MdbField field;
+	unsigned char buf[256];
+	int len;
+
+	memset(idx_sarg->value.s, 0, sizeof(idx_sarg->value.s));
+	if (sarg->op == MDB_ISNULL || sarg->op == MDB_NOTNULL)
+		return;
+	if (mdb_index_sarg_to_field(col, sarg, &field, buf) < 0) {
+		/* can't use this one, let the row test handle it */
+		idx_sarg->op = MDB_NOTNULL;
+		return;
+	}
+	if (col->col_type == MDB_TEXT && sarg->op == MDB_LIKE) {
+		len = strcspn(sarg->value.s, "%_");
+		buf[len] = '\0';
+		field.siz = len;
+	}
+	mdb_index_encode_key(col, MDB_ASC, &field, (unsigned char *) idx_sarg->value.s);
+}
+/*
+ * test one key column of an index entry against a cached sarg.  Entries
+ * passing here still need to be tested against the whole row.
+ */
+static int
+mdb_index_test_key(MdbColumn *col, int order, MdbSarg *idx_sarg, unsigned char *key, int len)
+{
+	unsigned char tmpbuf[256];
+	unsigned char *sval = (unsigned char *) idx_sarg->value.s;
+	int i, rc, is_null, slen;
+
+	/* put the entry back in ascending order */
+	for (i=0;i<len;i++)
+		tmpbuf[i] = (order == MDB_DESC) ? ~key[i] : key[i];
+
+	is_null = (tmpbuf[0] == MDB_IDX_FLAG_NULL);
+	if (idx_sarg->op == MDB_ISNULL)
+		return is_null;
+	if (idx_sarg->op == MDB_NOTNULL)
+		return !is_null;
+	if (is_null)
+		return 0;
+
+	if (col->col_type == MDB_TEXT) {
+		/*
+		 * the hash folds case and drops characters, so only 
+		 * equality and like prefixes can be checked here.  The
+		 * characters end at the terminator or at the 0x01 marker
+		 * that separates them from the extra sort info.
+		 */
+		for (i=1; i<len && tmpbuf[i] > 0x01; i++);
+		slen = strlen((char *) &sval[1]);
+		switch (idx_sarg->op) {
+			case MDB_EQUAL:
+				return (i - 1 == slen && !memcmp(&tmpbuf[1], &sval[1], slen));
+			case MDB_LIKE:
+				return (i - 1 >= slen && !memcmp(&tmpbuf[1], &sval[1], slen));
+		}
+		return 1;
+	}
+
+	rc = memcmp(tmpbuf, sval, len);
+	switch (idx_sarg->op) {
+		case MDB_EQUAL:
+			return (rc == 0);
+		case MDB_GT:
+			return (rc > 0);
+		case MDB_LT:
+			return (rc < 0);
+		case MDB_GTEQ:
+			return (rc >= 0);
+		case MDB_LTEQ:
+			return (rc <= 0);
 	}
 	return 1;
 }
-#endif
+/*
+ * If we have no cached index values for this column, create them.
+ */
+static void
+mdb_index_cache_sargs(MdbColumn *col)
+{
+	MdbSarg *idx_sarg;
+	MdbSarg *sarg;
+	unsigned int j;
+
+	if (!col->num_sargs || col->idx_sarg_cache)
+		return;
+	col->idx_sarg_cache = g_ptr_array_new();
+	for (j=0;j<col->num_sargs;j++) {
+		sarg = g_ptr_array_index (col->sargs, j);
+		idx_sarg = g_memdup(sarg,sizeof(MdbSarg));
+		mdb_index_cache_sarg(col, sarg, idx_sarg);
+		g_ptr_array_add(col->idx_sarg_cache, idx_sarg);
+	}
+}
+/*
+ * check the leading key column of an entry against the range its sargs
+ * allow.  Returns -1 if the entry sorts before that range, 1 if it sorts
+ * after it and 0 if it is inside or we can't tell (text keys, which are
+ * only hashed).  Since the leading column drives the index order this
+ * lets scans skip whole subtrees and stop at the end of the range.
+ */
+int
+mdb_index_test_bounds(MdbIndex *idx, char *buf, int len)
+{
+	MdbColumn *col;
+	MdbSarg *idx_sarg;
+	unsigned char tmpbuf[256];
+	unsigned char *key = (unsigned char *) buf;
+	int order = idx->key_col_order[0];
+	int c_len, i, rc, pos = 0;
+	unsigned int j;
+
+	if (!idx->num_keys) return 0;
+	col=g_ptr_array_index(idx->table->columns,idx->key_col_num[0]-1);
+	if (!col->num_sargs || mdb_index_key_size(col) <= 0)
+		return 0;
+	c_len = mdb_index_key_col_len(col, order, key, len);
+	if (c_len < 0)
+		return 0;
+	for (i=0;i<c_len;i++)
+		tmpbuf[i] = (order == MDB_DESC) ? ~key[i] : key[i];
+
+	mdb_index_cache_sargs(col);
+	for (j=0;j<col->num_sargs;j++) {
+		idx_sarg = g_ptr_array_index (col->idx_sarg_cache, j);
+		rc = memcmp(tmpbuf, idx_sarg->value.s, c_len);
+		switch (idx_sarg->op) {
+			case MDB_EQUAL:
+				pos = rc;
+				break;
+			case MDB_GT:
+				if (rc <= 0) pos = -1;
+				break;
+			case MDB_GTEQ:
+				if (rc < 0) pos = -1;
+				break;
+			case MDB_LT:
+				if (rc >= 0) pos = 1;
+				break;
+			case MDB_LTEQ:
+				if (rc > 0) pos = 1;
+				break;
+		}
+		if (pos) break;
+	}
+	if (pos < 0) pos = -1;
+	if (pos > 0) pos = 1;
+	/* descending keys run the other way */
+	return (order == MDB_DESC) ? -pos : pos;
+}
+/*
+ * test a full index entry (@len bytes of key, the page/row pointer 
+ * stripped) against the sargs of every key column.
+ */
 int
 mdb_index_test_sargs(MdbHandle *mdb, MdbIndex *idx, char *buf, int len)
 {
@@ -286,157 +718,313 @@ mdb_index_test_sargs(MdbHandle *mdb, MdbIndex *idx, char *buf, int len)
 	MdbColumn *col;
 	MdbTableDef *table = idx->table;
 	MdbSarg *idx_sarg;
-	MdbSarg *sarg;
-	MdbField field;
-	MdbSargNode node;
-	//int c_offset = 0, 
-	int c_len;
-
-	//fprintf(stderr,"mdb_index_test_sargs called on ");
-	//for (i=0;i<len;i++)
-		//fprintf(stderr,"%02x ",buf[i]); //mdb->pg_buf[offset+i]);
-	//fprintf(stderr,"\n");
+	unsigned char *key = (unsigned char *) buf;
+	int c_len, pos = 0;
+
 	for (i=0;i<idx->num_keys;i++) {
-		//c_offset++; /* the per column null indicator/flags */
 		col=g_ptr_array_index(table->columns,idx->key_col_num[i]-1);
-		/*
-		 * This will go away eventually
-		 */
-		if (col->col_type==MDB_TEXT) {
-			//c_len = strlen(&mdb->pg_buf[offset + c_offset]);
-			c_len = strlen(buf);
-		} else {
-			c_len = col->col_size;
-			//fprintf(stderr,"Only text types currently supported.  How did we get here?\n");
-		}
-		/*
-		 * If we have no cached index values for this column, 
-		 * create them.
-		 */
-		if (col->num_sargs && !col->idx_sarg_cache) {
-			col->idx_sarg_cache = g_ptr_array_new();
-			for (j=0;j<col->num_sargs;j++) {
-				sarg = g_ptr_array_index (col->sargs, j);
-				idx_sarg = g_memdup(sarg,sizeof(MdbSarg));
-				//printf("calling mdb_index_cache_sarg\n");
-				mdb_index_cache_sarg(col, sarg, idx_sarg);
-				g_ptr_array_add(col->idx_sarg_cache, idx_sarg);
-			}
-		}
-
+		c_len = mdb_index_key_col_len(col, idx->key_col_order[i],
+			&key[pos], len - pos);
+		/* can't go any further, leave the rest to the row test */
+		if (c_len < 0)
+			break;
+		mdb_index_cache_sargs(col);
 		for (j=0;j<col->num_sargs;j++) {
-			sarg = g_ptr_array_index (col->idx_sarg_cache, j);
-			/* XXX - kludge */
-			node.op = sarg->op;
-			node.value = sarg->value;
-			//field.value = &mdb->pg_buf[offset + c_offset];
-			field.value = buf;
-		       	field.siz = c_len;
-		       	field.is_null = FALSE;
-			if (!mdb_test_sarg(mdb, col, &node, &field)) {
+			idx_sarg = g_ptr_array_index (col->idx_sarg_cache, j);
+			if (!mdb_index_test_key(col, idx->key_col_order[i],
+					idx_sarg, &key[pos], c_len)) {
 				/* sarg didn't match, no sense going on */
 				return 0;
 			}
 		}
+		pos += c_len;
 	}
 	return 1;
 }
 /*
- * pack the pages bitmap
+ * pack the pages bitmap from the list of entry starts (the first entry,
+ * one start per following entry, the end of the last one, then 0).
  */
 int
-mdb_index_pack_bitmap(MdbHandle *mdb, MdbIndexPage *ipg)
+mdb_index_pack_bitmap(MdbHandle *mdb, guint16 *idx_starts)
 {
-	int mask_bit = 0;
-	int mask_pos = 0x16;
-	int mask_byte = 0;
-	int elem = 0;
-	int len, start, i;
-
-	start = ipg->idx_starts[elem++];
-
-	while (start) {
-		//fprintf(stdout, "elem %d is %d\n", elem, ipg->idx_starts[elem]);
-		len = ipg->idx_starts[elem] - start;
-		//fprintf(stdout, "len is %d\n", len);
-		for (i=0; i < len; i++) {
-			mask_bit++;
-			if (mask_bit==8) {
-				mask_bit=0;
-				mdb->pg_buf[mask_pos++] = mask_byte;
-				mask_byte = 0;
-			}
-			/* upon reaching the len, set the bit */
-		}
-		mask_byte = (1 << mask_bit) | mask_byte;
-		//fprintf(stdout, "mask byte is %02x at %d\n", mask_byte, mask_pos);
-		start = ipg->idx_starts[elem++];
-	}
-	/* flush the last byte if any */
-	mdb->pg_buf[mask_pos++] = mask_byte;
-	/* remember to zero the rest of the bitmap */
-	for (i = mask_pos; i < 0xf8; i++) {
-		mdb->pg_buf[mask_pos++] = 0;
+	MdbFormatConstants *fmt = mdb->fmt;
+	int elem, bit;
+
+	memset(&mdb->pg_buf[fmt->idx_bitmap_offset], 0,
+		fmt->idx_entries_offset - fmt->idx_bitmap_offset);
+	for (elem = 1; idx_starts[elem]; elem++) {
+		bit = idx_starts[elem] - fmt->idx_entries_offset;
+		mdb->pg_buf[fmt->idx_bitmap_offset + bit / 8] |= 1 << (bit % 8);
 	}
 	return 0;
 }
 /*
- * unpack the pages bitmap
+ * unpack the pages bitmap into the list of entry starts, in the layout
+ * mdb_index_pack_bitmap takes.  Returns the number of starts, which is
+ * one more than the number of entries.
  */
 int
-mdb_index_unpack_bitmap(MdbHandle *mdb, MdbIndexPage *ipg)
+mdb_index_unpack_bitmap(MdbHandle *mdb, unsigned char *pg_buf, guint16 *idx_starts)
 {
-	int mask_bit = 0;
-	int mask_pos = 0x16;
-	int mask_byte;
-	int start = 0xf8;
+	MdbFormatConstants *fmt = mdb->fmt;
+	int start = fmt->idx_entries_offset;
+	int num_bits = (fmt->idx_entries_offset - fmt->idx_bitmap_offset) * 8;
 	int elem = 0;
-	int len = 0;
+	int i;
+	unsigned char mask_byte;
 
-	ipg->idx_starts[elem++]=start;
+	if (num_bits > fmt->pg_size - start)
+		num_bits = fmt->pg_size - start;
 
-	//fprintf(stdout, "Unpacking index page %lu\n", ipg->pg);
-	do {
-		len = 0;
-		do {
-			mask_bit++;
-			if (mask_bit==8) {
-				mask_bit=0;
-				mask_pos++;
-			}
-			mask_byte = mdb->pg_buf[mask_pos];
-			len++;
-		} while (mask_pos <= 0xf8 && !((1 << mask_bit) & mask_byte));
-		//fprintf(stdout, "%d %d %d %d\n", mask_pos, mask_bit, mask_byte, len);
+	idx_starts[elem++] = start;
+	for (i = 1; i < num_bits; i++) {
+		mask_byte = pg_buf[fmt->idx_bitmap_offset + i / 8];
+		if (!mask_byte) {
+			/* nothing starts in these 8 bytes */
+			i |= 7;
+			continue;
+		}
+		if (mask_byte & (1 << (i % 8)))
+			idx_starts[elem++] = start + i;
+	}
+	/* zero the next element, so we don't pick up the last pages starts */
+	idx_starts[elem] = 0;
 
-		start += len;
-		if (mask_pos < 0xf8) ipg->idx_starts[elem++]=start;
+	return elem;
+}
+/*
+ * upper bound on the number of decoded pages kept per file, past it the
+ * least recently used one is dropped.
+ */
+#define MDB_IDX_CACHE_PAGES 1024
 
-	} while (mask_pos < 0xf8);
+/*
+ * read an index page into the alternate buffer and unpack its entries:
+ * their offsets, their pointers and their keys with the prefix shared
+ * with the first entry put back.
+ */
+static MdbDecodedPage *
+mdb_index_decode_page(MdbHandle *mdb, guint32 pg)
+{
+	MdbFormatConstants *fmt = mdb->fmt;
+	unsigned char *buf = mdb->alt_pg_buf;
+	guint16 idx_starts[MDB_PGSIZE];
+	MdbDecodedPage *dpg;
+	unsigned int i, num_entries, key_tot = 0;
+	int ptr_len, pref_len, key_len, first_len = 0;
+	size_t sz;
+	unsigned char *p, *key;
+
+	if (!pg || !mdb_read_alt_pg(mdb, pg))
+		return NULL;
+	if (buf[0] != MDB_PAGE_INDEX && buf[0] != MDB_PAGE_LEAF)
+		return NULL;
 
-	/* if we zero the next element, so we don't pick up the last pages starts*/
-	ipg->idx_starts[elem]=0;
+	/* leaf entries end with the data page/row, interior entries
+	 * also carry the child page */
+	ptr_len = (buf[0] == MDB_PAGE_INDEX) ? 8 : 4;
+	num_entries = mdb_index_unpack_bitmap(mdb, buf, idx_starts) - 1;
+	pref_len = mdb_get_int16(buf, fmt->idx_pref_len_offset);
+
+	for (i = 0; i < num_entries; i++) {
+		key_len = idx_starts[i + 1] - idx_starts[i] - ptr_len;
+		if (key_len < 0) key_len = 0;
+		if (i == 0) {
+			first_len = key_len;
+			if (pref_len > first_len) pref_len = first_len;
+			if (pref_len > MDB_MAX_INDEX_KEY)
+				pref_len = MDB_MAX_INDEX_KEY;
+		} else {
+			key_len += pref_len;
+		}
+		if (key_len > MDB_MAX_INDEX_KEY) key_len = MDB_MAX_INDEX_KEY;
+		key_tot += key_len;
+	}
 
-	return elem;
+	sz = sizeof(MdbDecodedPage)
+		+ num_entries * sizeof(guint32) * (ptr_len == 8 ? 2 : 1)
+		+ (num_entries + 1) * sizeof(guint16) * 2
+		+ key_tot;
+	dpg = g_malloc(sz);
+	p = (unsigned char *) (dpg + 1);
+	dpg->pg_rows = (guint32 *) p;
+	p += num_entries * sizeof(guint32);
+	dpg->child_pgs = NULL;
+	if (ptr_len == 8) {
+		dpg->child_pgs = (guint32 *) p;
+		p += num_entries * sizeof(guint32);
+	}
+	dpg->entry_starts = (guint16 *) p;
+	p += (num_entries + 1) * sizeof(guint16);
+	dpg->key_starts = (guint16 *) p;
+	p += (num_entries + 1) * sizeof(guint16);
+	dpg->keys = p;
+
+	dpg->pg = pg;
+	dpg->pg_type = buf[0];
+	dpg->next_pg = mdb_get_int32(buf, fmt->idx_next_pg_offset);
+	dpg->num_entries = num_entries;
+
+	key = dpg->keys;
+	for (i = 0; i < num_entries; i++) {
+		int start = idx_starts[i];
+		int len = idx_starts[i + 1] - start;
+
+		dpg->entry_starts[i] = start;
+		dpg->key_starts[i] = key - dpg->keys;
+		key_len = len - ptr_len;
+		if (key_len < 0) key_len = 0;
+		if (i > 0) {
+			/* the first entry is complete, later ones drop
+			 * the prefix they share with it */
+			memcpy(key, dpg->keys, pref_len);
+			if (pref_len + key_len > MDB_MAX_INDEX_KEY)
+				key_len = MDB_MAX_INDEX_KEY - pref_len;
+			memcpy(key + pref_len, &buf[start], key_len);
+			key += pref_len + key_len;
+		} else {
+			if (key_len > MDB_MAX_INDEX_KEY) key_len = MDB_MAX_INDEX_KEY;
+			memcpy(key, &buf[start], key_len);
+			key += key_len;
+		}
+		if (ptr_len == 8) {
+			dpg->pg_rows[i] = mdb_get_int32_msb(buf, start + len - 8);
+			dpg->child_pgs[i] = mdb_get_int32_msb(buf, start + len - 4);
+		} else {
+			dpg->pg_rows[i] = mdb_get_int32_msb(buf, start + len - 4);
+		}
+	}
+	dpg->entry_starts[num_entries] = idx_starts[num_entries];
+	dpg->key_starts[num_entries] = key - dpg->keys;
+
+	return dpg;
+}
+static void
+mdb_index_page_unref(MdbDecodedPage *dpg)
+{
+	if (dpg && g_atomic_int_dec_and_test(&dpg->refs))
+		g_free(dpg);
+}
+/*
+ * add a freshly decoded page to the cache, unless another handle beat
+ * us to it.  Its reference is then the caller's alone.
+ */
+static void
+mdb_index_cache_add(MdbFile *f, MdbDecodedPage *dpg)
+{
+	MdbDecodedPage *old;
+	GList *link;
+
+	dpg->refs = 1;
+	dpg->lru.data = dpg;
+	dpg->lru.prev = dpg->lru.next = NULL;
+	g_mutex_lock(&f->idx_lock);
+	if (!f->idx_cache)
+		f->idx_cache = g_hash_table_new(g_direct_hash, g_direct_equal);
+	if (!g_hash_table_lookup(f->idx_cache, GUINT_TO_POINTER(dpg->pg))) {
+		g_atomic_int_inc(&dpg->refs);
+		g_hash_table_insert(f->idx_cache, GUINT_TO_POINTER(dpg->pg), dpg);
+		g_queue_push_head_link(&f->idx_lru, &dpg->lru);
+		while (f->idx_lru.length > MDB_IDX_CACHE_PAGES) {
+			link = g_queue_pop_tail_link(&f->idx_lru);
+			old = link->data;
+			g_hash_table_remove(f->idx_cache, GUINT_TO_POINTER(old->pg));
+			mdb_index_page_unref(old);
+		}
+	}
+	g_mutex_unlock(&f->idx_lock);
+}
+/*
+ * returns the decoded index page pg, from the cache shared by all the
+ * handles on the file when it has been read before.  The handle keeps a
+ * reference to the page, so it stays valid until the next call on the
+ * same handle even if other threads push it out of the cache; copy what
+ * is needed out of it.  Returns NULL if pg is not an index page.
+ */
+MdbDecodedPage *
+mdb_index_read_page(MdbHandle *mdb, guint32 pg)
+{
+	MdbFile *f = mdb->f;
+	MdbDecodedPage *dpg = NULL;
+
+	g_mutex_lock(&f->idx_lock);
+	if (f->idx_cache
+	 && (dpg = g_hash_table_lookup(f->idx_cache, GUINT_TO_POINTER(pg)))) {
+		g_queue_unlink(&f->idx_lru, &dpg->lru);
+		g_queue_push_head_link(&f->idx_lru, &dpg->lru);
+		g_atomic_int_inc(&dpg->refs);
+	}
+	g_mutex_unlock(&f->idx_lock);
+	if (!dpg) {
+		if (!(dpg = mdb_index_decode_page(mdb, pg)))
+			return NULL;
+		mdb_index_cache_add(f, dpg);
+	}
+
+	mdb_index_page_unref(mdb->idx_page);
+	mdb->idx_page = dpg;
+	return dpg;
+}
+/*
+ * drop a page from the cache, called whenever a page is written.
+ */
+void
+mdb_index_cache_invalidate(MdbHandle *mdb, guint32 pg)
+{
+	MdbFile *f = mdb->f;
+	MdbDecodedPage *dpg;
+
+	g_mutex_lock(&f->idx_lock);
+	if (f->idx_cache
+	 && (dpg = g_hash_table_lookup(f->idx_cache, GUINT_TO_POINTER(pg)))) {
+		g_hash_table_remove(f->idx_cache, GUINT_TO_POINTER(pg));
+		g_queue_unlink(&f->idx_lru, &dpg->lru);
+		mdb_index_page_unref(dpg);
+	}
+	g_mutex_unlock(&f->idx_lock);
+}
+/*
+ * let go of the last page handed out to a handle, before it is closed
+ */
+void
+mdb_index_cache_release(MdbHandle *mdb)
+{
+	mdb_index_page_unref(mdb->idx_page);
+	mdb->idx_page = NULL;
+}
+void
+mdb_index_cache_free(MdbFile *f)
+{
+	GList *link;
+
+	while ((link = g_queue_pop_head_link(&f->idx_lru)))
+		mdb_index_page_unref(link->data);
+	if (f->idx_cache)
+		g_hash_table_destroy(f->idx_cache);
+	f->idx_cache = NULL;
 }
 /*
  * find the next entry on a page (either index or leaf). Uses state information
- * stored in the MdbIndexPage across calls.
+ * stored in the MdbIndexPage across calls.  The entry's key goes to
+ * ipg->cache_value and its pointers to ipg->pg_row and ipg->child_pg.
  */
 int
 mdb_index_find_next_on_page(MdbHandle *mdb, MdbIndexPage *ipg)
 {
-	if (!ipg->pg) return 0;
-
-	/* if this page has not been unpacked to it */
-	if (!ipg->idx_starts[0]){
-		//fprintf(stdout, "Unpacking page %d\n", ipg->pg);
-		mdb_index_unpack_bitmap(mdb, ipg);
-	}
+	MdbDecodedPage *dpg;
+	unsigned int i = ipg->start_pos;
 
-	
-	if (ipg->idx_starts[ipg->start_pos + 1]==0) return 0; 
-	ipg->len = ipg->idx_starts[ipg->start_pos+1] - ipg->idx_starts[ipg->start_pos];
+	if (!ipg->pg) return 0;
+	if (!(dpg = mdb_index_read_page(mdb, ipg->pg))) return 0;
+	if (i >= dpg->num_entries) return 0;
+
+	ipg->offset = dpg->entry_starts[i];
+	ipg->len = dpg->entry_starts[i + 1] - ipg->offset;
+	ipg->pg_row = dpg->pg_rows[i];
+	ipg->child_pg = dpg->child_pgs ? dpg->child_pgs[i] : 0;
+	ipg->cache_len = dpg->key_starts[i + 1] - dpg->key_starts[i];
+	memcpy(ipg->cache_value, &dpg->keys[dpg->key_starts[i]], ipg->cache_len);
 	ipg->start_pos++;
 	//fprintf(stdout, "Start pos %d\n", ipg->start_pos);
 
@@ -444,10 +1032,10 @@ mdb_index_find_next_on_page(MdbHandle *mdb, MdbIndexPage *ipg)
 }
 void mdb_index_page_reset(MdbIndexPage *ipg)
 {
-	ipg->offset = 0xf8; /* start byte of the index entries */
+	ipg->offset = 0;
 	ipg->start_pos=0;
 	ipg->len = 0; 
-	ipg->idx_starts[0]=0;
+	ipg->cache_len = 0;
 }
 void mdb_index_page_init(MdbIndexPage *ipg)
 {
@@ -462,17 +1050,21 @@ MdbIndexPage *
 mdb_find_next_leaf(MdbHandle *mdb, MdbIndex *idx, MdbIndexChain *chain)
 {
 	MdbIndexPage *ipg, *newipg;
+	MdbDecodedPage *dpg;
 	guint32 pg;
+	guint32 skipped_pg = 0;
 	guint passed = 0;
 
 	ipg = mdb_index_read_bottom_pg(mdb, idx, chain);
+	if (!ipg || !(dpg = mdb_index_read_page(mdb, ipg->pg)))
+		return NULL;
 
 	/*
 	 * If we are at the first page deep and it's not an index page then
 	 * we are simply done. (there is no page to find
 	 */
 
-	if (mdb->pg_buf[0]==MDB_PAGE_LEAF) {
+	if (dpg->pg_type==MDB_PAGE_LEAF) {
 		/* Indexes can have leaves at the end that don't appear
 		 * in the upper tree, stash the last index found so
 		 * we can follow it at the end.  */
@@ -481,31 +1073,34 @@ mdb_find_next_leaf(MdbHandle *mdb, MdbIndex *idx, MdbIndexChain *chain)
 	}
 
 	/*
-	 * apply sargs here, currently we don't
+	 * each entry holds the last key of its subtree, skip the subtrees
+	 * that end before the range the sargs allow.  If they all do, still
+	 * go down the last one so last_leaf_found points at the real last
+	 * leaf for the clean up pass.
 	 */
 	do {
-		ipg->len = 0;
 		//printf("finding next on pg %lu\n", ipg->pg);
 		if (!mdb_index_find_next_on_page(mdb, ipg)) {
 			//printf("find_next_on_page returned 0\n");
-			return 0;
+			if (!skipped_pg)
+				return 0;
+			pg = skipped_pg;
+			break;
 		}
-		pg = mdb_get_int32_msb(mdb->pg_buf, ipg->offset + ipg->len - 3) >> 8;
+		pg = ipg->child_pg;
 		//printf("Looking at pg %lu at %lu %d\n", pg, ipg->offset, ipg->len);
-		ipg->offset += ipg->len;
-
-		/*
-		 * add to the chain and call this function
-		 * recursively.
-		 */
-		newipg = mdb_chain_add_page(mdb, chain, pg);
-		newipg = mdb_find_next_leaf(mdb, idx, chain);
-		//printf("returning pg %lu\n",newipg->pg);
-		return newipg;
+		passed = (mdb_index_test_bounds(idx, (char *)ipg->cache_value, ipg->cache_len) >= 0);
+		if (!passed) skipped_pg = pg;
 	} while (!passed);
-	/* no more pages */
-	return NULL;
 
+	/*
+	 * add to the chain and call this function
+	 * recursively.
+	 */
+	newipg = mdb_chain_add_page(mdb, chain, pg);
+	newipg = mdb_find_next_leaf(mdb, idx, chain);
+	//printf("returning pg %lu\n",newipg->pg);
+	return newipg;
 }
 MdbIndexPage *
 mdb_chain_add_page(MdbHandle *mdb, MdbIndexChain *chain, guint32 pg)
@@ -547,8 +1142,6 @@ mdb_index_read_bottom_pg(MdbHandle *mdb, MdbIndex *idx, MdbIndexChain *chain)
 		ipg->len = 0; 
 	}
 
-	mdb_read_pg(mdb, ipg->pg);
-
 	return ipg;
 }
 /*
@@ -597,19 +1190,16 @@ int
 mdb_index_find_next(MdbHandle *mdb, MdbIndex *idx, MdbIndexChain *chain, guint32 *pg, guint16 *row)
 {
 	MdbIndexPage *ipg;
+	MdbDecodedPage *dpg;
 	int passed = 0;
-	int idx_sz;
-	int idx_start = 0;
-	MdbColumn *col;
-	guint32 pg_row;
 
-	ipg = mdb_index_read_bottom_pg(mdb, idx, chain);
+	if (!(ipg = mdb_index_read_bottom_pg(mdb, idx, chain)))
+		return 0;
 
 	/*
 	 * loop while the sargs don't match
 	 */
 	do {
-		ipg->len = 0;
 		/*
 		 * if no more rows on this leaf, try to find a new leaf
 		 */
@@ -622,11 +1212,9 @@ mdb_index_find_next(MdbHandle *mdb, MdbIndex *idx, MdbIndexChain *chain, guint32
 				//fprintf(stdout,"in cleanup mode\n");
 
 				if (!chain->last_leaf_found) return 0;
-				mdb_read_pg(mdb, chain->last_leaf_found);
-				chain->last_leaf_found = mdb_get_int32(
-					mdb->pg_buf, 0x0c);
+				dpg = mdb_index_read_page(mdb, chain->last_leaf_found);
+				chain->last_leaf_found = dpg ? dpg->next_pg : 0;
 				//printf("next leaf %lu\n", chain->last_leaf_found);
-				mdb_read_pg(mdb, chain->last_leaf_found);
 				/* reuse the chain for cleanup mode */
 				chain->cur_depth = 1;
 				ipg = &chain->pages[0];
@@ -637,31 +1225,19 @@ mdb_index_find_next(MdbHandle *mdb, MdbIndex *idx, MdbIndexChain *chain, guint32
 					return 0;
 			}
 		}
-		pg_row = mdb_get_int32_msb(mdb->pg_buf, ipg->offset + ipg->len - 4);
-		*row = pg_row & 0xff;
-		*pg = pg_row >> 8;
+		*row = ipg->pg_row & 0xff;
+		*pg = ipg->pg_row >> 8;
 		//printf("row = %d pg = %lu ipg->pg = %lu offset = %lu len = %d\n", *row, *pg, ipg->pg, ipg->offset, ipg->len);
-		col=g_ptr_array_index(idx->table->columns,idx->key_col_num[0]-1);
-		idx_sz = mdb_col_fixed_size(col);
-		/* handle compressed indexes, single key indexes only? */
-		if (idx->num_keys==1 && idx_sz>0 && ipg->len - 4 < idx_sz) {
-			//printf("short index found\n");
-			//mdb_buffer_dump(ipg->cache_value, 0, idx_sz);
-			memcpy(&ipg->cache_value[idx_sz - (ipg->len - 4)], &mdb->pg_buf[ipg->offset], ipg->len);
-			//mdb_buffer_dump(ipg->cache_value, 0, idx_sz);
-		} else {
-			idx_start = ipg->offset + (ipg->len - 4 - idx_sz);
-			memcpy(ipg->cache_value, &mdb->pg_buf[idx_start], idx_sz);
+		if (mdb_index_test_bounds(idx, (char *)(ipg->cache_value), ipg->cache_len) > 0) {
+			/* past the end of the range, nothing left to find */
+			chain->clean_up_mode = 1;
+			chain->last_leaf_found = 0;
+			return 0;
 		}
-
-		//idx_start = ipg->offset + (ipg->len - 4 - idx_sz);
-		passed = mdb_index_test_sargs(mdb, idx, (char *)(ipg->cache_value), idx_sz);
-
-		ipg->offset += ipg->len;
+		passed = mdb_index_test_sargs(mdb, idx, (char *)(ipg->cache_value), ipg->cache_len);
 	} while (!passed);
 
 	//fprintf(stdout,"len = %d pos %d\n", ipg->len, ipg->mask_pos);
-	//mdb_buffer_dump(mdb->pg_buf, ipg->offset, ipg->len);
 
 	return ipg->len;
 }
@@ -678,12 +1254,11 @@ mdb_index_find_row(MdbHandle *mdb, MdbIndex *idx, MdbIndexChain *chain, guint32
 	MdbIndexPage *ipg;
 	int passed = 0;
 	guint32 pg_row = (pg << 8) | (row & 0xff);
-	guint32 datapg_row;
 
-	ipg = mdb_index_read_bottom_pg(mdb, idx, chain);
+	if (!(ipg = mdb_index_read_bottom_pg(mdb, idx, chain)))
+		return 0;
 
 	do {
-		ipg->len = 0;
 		/*
 		 * if no more rows on this leaf, try to find a new leaf
 		 */
@@ -706,11 +1281,9 @@ mdb_index_find_row(MdbHandle *mdb, MdbIndex *idx, MdbIndexChain *chain, guint32
 				return 0;
 		}
 		/* test row and pg */
-		datapg_row = mdb_get_int32_msb(mdb->pg_buf, ipg->offset + ipg->len - 4);
-		if (pg_row == datapg_row) {
+		if (pg_row == ipg->pg_row) {
 			passed = 1;
 		}
-		ipg->offset += ipg->len;
 	} while (!passed);
 
 	/* index chain from root to leaf should now be in "chain" */
@@ -761,28 +1334,68 @@ mdb_index_dump(MdbTableDef *table, MdbIndex *idx)
 	mdb_index_walk(table, idx);
 }
 /*
- * compute_cost tries to assign a cost to a given index using the sargs 
- * available in this query.
+ * the cost of reading a page at random, relative to the pages of a table
+ * scan which are read in order.
+ */
+#define MDB_RANDOM_PG_COST 4
+
+/*
+ * estimate the fraction of the index entries the sargs let through by
+ * testing the keys of the root page.  When the root is an interior page
+ * its entries are the last keys of each subtree, which makes them a cheap
+ * equi-depth histogram of the whole index.  Returns -1 if the root is not
+ * an index page.
+ */
+static double
+mdb_index_sample(MdbHandle *mdb, MdbIndex *idx, int *is_leaf, int *num_entries, int *avg_len)
+{
+	MdbIndexPage ipg;
+	MdbDecodedPage *dpg;
+	int tot_len = 0, passed = 0;
+
+	*num_entries = 0;
+	*avg_len = 0;
+	if (!(dpg = mdb_index_read_page(mdb, idx->first_pg)))
+		return -1;
+	*is_leaf = (dpg->pg_type == MDB_PAGE_LEAF);
+
+	mdb_index_page_init(&ipg);
+	ipg.pg = idx->first_pg;
+	while (mdb_index_find_next_on_page(mdb, &ipg)) {
+		if (mdb_index_test_sargs(mdb, idx, (char *)ipg.cache_value, ipg.cache_len))
+			passed++;
+		tot_len += ipg.len;
+		(*num_entries)++;
+	}
+
+	*avg_len = *num_entries ? tot_len / *num_entries : 0;
+	if (!*num_entries)
+		return 1.0;
+	if (*is_leaf)
+		return (double) passed / *num_entries;
+	/* the first and last subtrees matching are only partly in */
+	return (passed + 0.5) / (*num_entries + 1);
+}
+/*
+ * estimate the number of index pages read by a scan of this index using
+ * the sargs available in this query, and the number of rows it returns,
+ * from the index statistics and a sample of its keys.
  *
- * Indexes with no matching sargs are assigned 0
- * Unique indexes are preferred over non-uniques
- * Operator preference is equal, like, isnull, others 
+ * Indexes that can't be used (no sargs on the first key column, or a like
+ * with a leading wildcard) are assigned 0.
  */
-int mdb_index_compute_cost(MdbTableDef *table, MdbIndex *idx)
+static double
+mdb_index_estimate(MdbTableDef *table, MdbIndex *idx, double *est_rows)
 {
+	MdbHandle *mdb = table->entry->mdb;
 	unsigned int i;
 	MdbColumn *col;
 	MdbSarg *sarg = NULL;
-	int not_all_equal = 0;
+	int all_equal = 1;
+	int is_leaf, num_entries, avg_len;
+	double sel, rows, num_rows, leaf_pgs, depth, per_leaf;
 
-	if (!idx->num_keys) return 0;
-	if (idx->num_keys > 1) {
-		for (i=0;i<idx->num_keys;i++) {
-			col=g_ptr_array_index(table->columns,idx->key_col_num[i]-1);
-			if (col->sargs) sarg = g_ptr_array_index (col->sargs, 0);
-			if (!sarg || sarg->op != MDB_EQUAL) not_all_equal++;
-		}
-	}
+	if (!idx->num_keys || !idx->first_pg || idx->stale) return 0;
 
 	col=g_ptr_array_index(table->columns,idx->key_col_num[0]-1);
 	/* 
@@ -798,111 +1411,433 @@ int mdb_index_compute_cost(MdbTableDef *table, MdbIndex *idx)
 	if (sarg->op == MDB_LIKE && sarg->value.s[0]=='%')
 		return 0;
 
-	/*
-	 * this needs a lot of tweaking.
-	 */
-	if (idx->flags & MDB_IDX_UNIQUE) {
-		if (idx->num_keys == 1) {
-			//printf("op is %d\n", sarg->op);
-			switch (sarg->op) {
-				case MDB_EQUAL:
-					return 1; break;
-				case MDB_LIKE:
-					return 4; break;
-				case MDB_ISNULL:
-					return 12; break;
-				default:
-					return 8; break;
-			}
-		} else {
-			switch (sarg->op) {
-				case MDB_EQUAL:
-					if (not_all_equal) return 2; 
-					else return 1;
-					break;
-				case MDB_LIKE:
-					return 6; break;
-				case MDB_ISNULL:
-					return 12; break;
-				default:
-					return 9; break;
-			}
-		}
+	for (i=0;i<idx->num_keys;i++) {
+		col=g_ptr_array_index(table->columns,idx->key_col_num[i]-1);
+		sarg = col->num_sargs ? g_ptr_array_index (col->sargs, 0) : NULL;
+		if (!sarg || sarg->op != MDB_EQUAL) all_equal = 0;
+	}
+
+	num_rows = idx->num_rows > 0 ? idx->num_rows : table->num_rows;
+	if (num_rows < 1) num_rows = 1;
+
+	/* the root of a tiny table's index may not be an index page */
+	sel = mdb_index_sample(mdb, idx, &is_leaf, &num_entries, &avg_len);
+	if (sel < 0) return 0;
+	rows = sel * num_rows;
+	if ((idx->flags & MDB_IDX_UNIQUE) && all_equal)
+		rows = 1;
+	if (rows < 1) rows = 1;
+
+	/* size of the leaf level and the number of levels above it */
+	if (is_leaf) {
+		leaf_pgs = 1;
+		depth = 0;
 	} else {
-		if (idx->num_keys == 1) {
-			switch (sarg->op) {
-				case MDB_EQUAL:
-					return 2; break;
-				case MDB_LIKE:
-					return 5; break;
-				case MDB_ISNULL:
-					return 12; break;
-				default:
-					return 10; break;
-			}
+		/* interior entries carry 4 more bytes than leaf entries */
+		per_leaf = avg_len > 4 ? 
+			(mdb->fmt->pg_size - mdb->fmt->idx_entries_offset) / (double) (avg_len - 4) : 1;
+		leaf_pgs = num_rows / per_leaf + 1;
+		depth = (leaf_pgs > num_entries) ? 2 : 1;
+	}
+
+	/* the path down the tree and the part of the leaf level holding
+	 * the range */
+	*est_rows = rows;
+	return depth + 1 + leaf_pgs * (rows / num_rows);
+}
+/*
+ * compute_cost estimates the number of pages read by an index scan: the
+ * index pages plus a random data page read per row.  Returns 0 if the
+ * index can't be used.
+ */
+double mdb_index_compute_cost(MdbTableDef *table, MdbIndex *idx)
+{
+	double rows, cost;
+
+	if (!(cost = mdb_index_estimate(table, idx, &rows)))
+		return 0;
+	return cost + rows * MDB_RANDOM_PG_COST;
+}
+/*
+ * Bitmap scans answer the sarg tree from the indexes: each comparison is
+ * looked up in the best index on its column, the sorted page/row lists
+ * are intersected for AND and merged for OR, and the data pages are then
+ * read in physical order, each one once.  Comparisons are looked up alone,
+ * so while doing so the sargs of every column are swapped out for the one
+ * being looked up.
+ */
+typedef struct {
+	GPtrArray *sargs;
+	unsigned int num_sargs;
+	GPtrArray *idx_sarg_cache;
+} MdbSavedSargs;
+
+static void
+mdb_free_sarg_array(GPtrArray *sargs)
+{
+	unsigned int i;
+
+	if (!sargs) return;
+	for (i=0; i<sargs->len; i++)
+		g_free(g_ptr_array_index(sargs, i));
+	g_ptr_array_free(sargs, TRUE);
+}
+static MdbSavedSargs *
+mdb_bitmap_push_sarg(MdbTableDef *table, MdbSargNode *node)
+{
+	MdbSavedSargs *saved;
+	MdbColumn *col;
+	MdbSarg sarg;
+	unsigned int i;
+
+	saved = g_malloc(table->num_cols * sizeof(MdbSavedSargs));
+	for (i=0;i<table->num_cols;i++) {
+		col = g_ptr_array_index(table->columns, i);
+		saved[i].sargs = col->sargs;
+		saved[i].num_sargs = col->num_sargs;
+		saved[i].idx_sarg_cache = col->idx_sarg_cache;
+		col->sargs = NULL;
+		col->num_sargs = 0;
+		col->idx_sarg_cache = NULL;
+	}
+	sarg.op = node->op;
+	sarg.value = node->value;
+	mdb_add_sarg(node->col, &sarg);
+	return saved;
+}
+static void
+mdb_bitmap_pop_sargs(MdbTableDef *table, MdbSavedSargs *saved)
+{
+	MdbColumn *col;
+	unsigned int i;
+
+	for (i=0;i<table->num_cols;i++) {
+		col = g_ptr_array_index(table->columns, i);
+		mdb_free_sarg_array(col->sargs);
+		mdb_free_sarg_array(col->idx_sarg_cache);
+		col->sargs = saved[i].sargs;
+		col->num_sargs = saved[i].num_sargs;
+		col->idx_sarg_cache = saved[i].idx_sarg_cache;
+	}
+	g_free(saved);
+}
+/*
+ * pick the index to look up a single comparison in, its sarg must already
+ * be pushed.
+ */
+static MdbIndex *
+mdb_bitmap_choose(MdbTableDef *table, double *idx_pgs, double *rows)
+{
+	MdbIndex *idx, *best = NULL;
+	double cost, est_rows;
+	unsigned int i;
+
+	for (i=0;i<table->num_idxs;i++) {
+		idx = g_ptr_array_index (table->indices, i);
+		cost = mdb_index_estimate(table, idx, &est_rows);
+		if (cost > 0 && (!best || cost < *idx_pgs)) {
+			best = idx;
+			*idx_pgs = cost;
+			*rows = est_rows;
+		}
+	}
+	return best;
+}
+/*
+ * estimate the index pages read and the rows returned by a bitmap scan of
+ * the sarg tree below node.  Returns 0 if the indexes can't narrow it down.
+ */
+static int
+mdb_bitmap_estimate(MdbTableDef *table, MdbSargNode *node, double *idx_pgs, double *rows)
+{
+	MdbSavedSargs *saved;
+	double l_pgs = 0, l_rows = 0, r_pgs = 0, r_rows = 0;
+	int l, r, found;
+
+	if (!node) return 0;
+	if (mdb_is_relational_op(node->op)) {
+		if (!node->col) return 0;
+		saved = mdb_bitmap_push_sarg(table, node);
+		found = (mdb_bitmap_choose(table, idx_pgs, rows) != NULL);
+		mdb_bitmap_pop_sargs(table, saved);
+		return found;
+	}
+	if (node->op != MDB_AND && node->op != MDB_OR)
+		return 0;
+	l = mdb_bitmap_estimate(table, node->left, &l_pgs, &l_rows);
+	r = mdb_bitmap_estimate(table, node->right, &r_pgs, &r_rows);
+	if (node->op == MDB_OR) {
+		/* every branch needs an index */
+		if (!l || !r) return 0;
+		*idx_pgs = l_pgs + r_pgs;
+		*rows = l_rows + r_rows;
+		if (*rows > table->num_rows) *rows = table->num_rows;
+		return 1;
+	}
+	if (l && r) {
+		*idx_pgs = l_pgs + r_pgs;
+		/* assume the two sides are independent */
+		*rows = table->num_rows ? l_rows * r_rows / table->num_rows : 0;
+		if (*rows < 1) *rows = 1;
+	} else if (l) {
+		*idx_pgs = l_pgs;
+		*rows = l_rows;
+	} else if (r) {
+		*idx_pgs = r_pgs;
+		*rows = r_rows;
+	}
+	return (l || r);
+}
+static GArray *
+mdb_bitmap_merge(GArray *a, GArray *b, int intersect)
+{
+	GArray *out;
+	guint32 x, y;
+	unsigned int i = 0, j = 0;
+
+	out = g_array_sized_new(FALSE, FALSE, sizeof(guint32), 
+		intersect ? MIN(a->len, b->len) : a->len + b->len);
+	while (i < a->len && j < b->len) {
+		x = g_array_index(a, guint32, i);
+		y = g_array_index(b, guint32, j);
+		if (x == y) {
+			g_array_append_val(out, x);
+			i++; j++;
+		} else if (x < y) {
+			if (!intersect) g_array_append_val(out, x);
+			i++;
 		} else {
-			switch (sarg->op) {
-				case MDB_EQUAL:
-					if (not_all_equal) return 3; 
-					else return 2;
-					break;
-				case MDB_LIKE:
-					return 7; break;
-				case MDB_ISNULL:
-					return 12; break;
-				default:
-					return 11; break;
-			}
+			if (!intersect) g_array_append_val(out, y);
+			j++;
 		}
 	}
-	return 0;
+	if (!intersect) {
+		for (; i < a->len; i++)
+			g_array_append_val(out, g_array_index(a, guint32, i));
+		for (; j < b->len; j++)
+			g_array_append_val(out, g_array_index(b, guint32, j));
+	}
+	g_array_free(a, TRUE);
+	g_array_free(b, TRUE);
+	return out;
+}
+static gint
+mdb_bitmap_cmp(gconstpointer a, gconstpointer b)
+{
+	guint32 x = *(const guint32 *) a, y = *(const guint32 *) b;
+
+	return (x < y) ? -1 : (x > y);
+}
+/*
+ * collect the sorted page/row pointers of the rows matching the sargs of
+ * an index
+ */
+static GArray *
+mdb_bitmap_collect(MdbHandle *mdb, MdbIndex *idx)
+{
+	MdbIndexChain *chain;
+	GArray *rows;
+	guint32 pg, pg_row, last;
+	guint16 row;
+	unsigned int i, j;
+
+	rows = g_array_new(FALSE, FALSE, sizeof(guint32));
+	chain = g_malloc0(sizeof(MdbIndexChain));
+	while (mdb_index_find_next(mdb, idx, chain, &pg, &row)) {
+		pg_row = (pg << 8) | (row & 0xff);
+		g_array_append_val(rows, pg_row);
+	}
+	g_free(chain);
+
+	g_array_sort(rows, mdb_bitmap_cmp);
+	/* drop duplicates */
+	for (i=0, j=0; i<rows->len; i++) {
+		pg_row = g_array_index(rows, guint32, i);
+		if (j && pg_row == last) continue;
+		g_array_index(rows, guint32, j++) = last = pg_row;
+	}
+	g_array_set_size(rows, j);
+	return rows;
+}
+/*
+ * build the bitmap for the sarg tree below node, NULL if the indexes can't
+ * narrow it down (every row has to be considered).
+ */
+static GArray *
+mdb_bitmap_build(MdbHandle *mdb, MdbTableDef *table, MdbSargNode *node)
+{
+	MdbSavedSargs *saved;
+	MdbIndex *idx;
+	GArray *l, *r;
+	double idx_pgs, rows;
+
+	if (!node) return NULL;
+	if (mdb_is_relational_op(node->op)) {
+		if (!node->col) return NULL;
+		saved = mdb_bitmap_push_sarg(table, node);
+		l = NULL;
+		if ((idx = mdb_bitmap_choose(table, &idx_pgs, &rows)))
+			l = mdb_bitmap_collect(mdb, idx);
+		mdb_bitmap_pop_sargs(table, saved);
+		return l;
+	}
+	if (node->op != MDB_AND && node->op != MDB_OR)
+		return NULL;
+	l = mdb_bitmap_build(mdb, table, node->left);
+	r = mdb_bitmap_build(mdb, table, node->right);
+	if (l && r)
+		return mdb_bitmap_merge(l, r, node->op == MDB_AND);
+	if (node->op == MDB_OR) {
+		if (l) g_array_free(l, TRUE);
+		if (r) g_array_free(r, TRUE);
+		return NULL;
+	}
+	return l ? l : r;
 }
 /*
  * choose_index runs mdb_index_compute_cost for each available index and picks
- * the best.
+ * the best, then compares it with the pages read by a table scan and by a
+ * bitmap scan of the sarg tree.
  *
- * Returns strategy to use (table scan, or index scan)
+ * Returns strategy to use (table scan, index scan or bitmap scan)
  */
 MdbStrategy 
 mdb_choose_index(MdbTableDef *table, int *choice)
 {
+	MdbHandle *mdb = table->entry->mdb;
 	unsigned int i;
 	MdbIndex *idx;
-	int cost = 0;
-	int least = 99;
+	double cost = 0;
+	double least, tbl_pgs, idx_pgs, rows, data_pgs;
+
+	/* a table scan reads every data page once, in order */
+	tbl_pgs = mdb_map_count_pages(mdb, table->usage_map, table->map_sz);
+	if (tbl_pgs < 1) tbl_pgs = 1;
+	least = tbl_pgs;
 
 	*choice = -1;
 	for (i=0;i<table->num_idxs;i++) {
 		idx = g_ptr_array_index (table->indices, i);
 		cost = mdb_index_compute_cost(table, idx);
-		//printf("cost for %s is %d\n", idx->name, cost);
-		if (cost && cost < least) {
+		//printf("cost for %s is %f\n", idx->name, cost);
+		if (cost > 0 && cost < least) {
 			least = cost;
 			*choice = i;
 		}
 	}
+
+	/*
+	 * a bitmap scan reads each data page holding a match once, the more
+	 * of the table it touches the closer it gets to sequential reads.
+	 */
+	if (mdb_bitmap_estimate(table, table->sarg_tree, &idx_pgs, &rows)) {
+		data_pgs = (rows < tbl_pgs) ? rows : tbl_pgs;
+		cost = idx_pgs + data_pgs * (MDB_RANDOM_PG_COST - 
+			(MDB_RANDOM_PG_COST - 1) * data_pgs / tbl_pgs);
+		//printf("cost for bitmap scan is %f\n", cost);
+		if (cost < least) {
+			*choice = -1;
+			return MDB_BITMAP_SCAN;
+		}
+	}
 	/* and the winner is: *choice */
-	if (least==99) return MDB_TABLE_SCAN;
+	if (*choice == -1) return MDB_TABLE_SCAN;
 	return MDB_INDEX_SCAN;
 }
+static int
+mdb_index_find_sarg_cols(MdbSargNode *node, gpointer data)
+{
+	GPtrArray *cols = data;
+
+	if (mdb_is_relational_op(node->op) && node->col)
+		g_ptr_array_add(cols, node->col);
+	return 0;
+}
+static int
+mdb_index_has_key_col(MdbIndex *idx, MdbColumn *col)
+{
+	MdbColumn *key_col;
+	unsigned int i;
+
+	for (i=0;i<idx->num_keys;i++) {
+		key_col = g_ptr_array_index(idx->table->columns, idx->key_col_num[i]-1);
+		if (key_col != col)
+			continue;
+		/* text keys are hashed and can't be turned back into values */
+		return (mdb_index_key_size(col) > 0);
+	}
+	return 0;
+}
+/*
+ * an index covers a query when every bound column and every column the
+ * sargs look at can be decoded from its keys, the rows can then be built
+ * without reading the data pages.
+ */
+int
+mdb_index_is_covering(MdbTableDef *table, MdbIndex *idx)
+{
+	MdbColumn *col;
+	GPtrArray *sarg_cols;
+	unsigned int i;
+	int covered = 1;
+
+	for (i=0;i<table->num_cols && covered;i++) {
+		col = g_ptr_array_index(table->columns, i);
+		if ((col->bind_ptr || col->len_ptr) && !mdb_index_has_key_col(idx, col))
+			covered = 0;
+	}
+	if (covered && table->sarg_tree) {
+		sarg_cols = g_ptr_array_new();
+		mdb_sql_walk_tree(table->sarg_tree, mdb_index_find_sarg_cols, sarg_cols);
+		for (i=0;i<sarg_cols->len && covered;i++) {
+			col = g_ptr_array_index(sarg_cols, i);
+			if (!mdb_index_has_key_col(idx, col))
+				covered = 0;
+		}
+		g_ptr_array_free(sarg_cols, TRUE);
+	}
+	return covered;
+}
 void
 mdb_index_scan_init(MdbHandle *mdb, MdbTableDef *table)
 {
 	int i;
 
-	if (mdb_get_option(MDB_USE_INDEX) && mdb_choose_index(table, &i) == MDB_INDEX_SCAN) {
+	if (!mdb_get_option(MDB_USE_INDEX))
+		return;
+	switch (mdb_choose_index(table, &i)) {
+		case MDB_INDEX_SCAN:
 		table->strategy = MDB_INDEX_SCAN;
 		table->scan_idx = g_ptr_array_index (table->indices, i);
 		table->chain = g_malloc0(sizeof(MdbIndexChain));
 		table->mdbidx = mdb_clone_handle(mdb);
 		mdb_read_pg(table->mdbidx, table->scan_idx->first_pg);
 		//printf("best index is %s\n",table->scan_idx->name);
+		break;
+
+		case MDB_BITMAP_SCAN:
+		table->mdbidx = mdb_clone_handle(mdb);
+		table->bitmap_rows = mdb_bitmap_build(table->mdbidx, table, table->sarg_tree);
+		mdb_close(table->mdbidx);
+		table->mdbidx = NULL;
+		if (table->bitmap_rows) {
+			table->strategy = MDB_BITMAP_SCAN;
+			table->bitmap_pos = 0;
+		}
+		break;
+
+		default:
+		break;
 	}
 	//printf("TABLE SCAN? %d\n", table->strategy);
 }
 void 
 mdb_index_scan_free(MdbTableDef *table)
 {
+	if (table->bitmap_rows) {
+		g_array_free(table->bitmap_rows, TRUE);
+		table->bitmap_rows = NULL;
+	}
 	if (table->chain) {
 		g_free(table->chain);
 		table->chain = NULL;
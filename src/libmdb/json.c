@@ -0,0 +1,245 @@
+/* MDB Tools - A library for reading MS Access database files
+ * Copyright (C) 2000 Brian Bruns
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <time.h>
+#include <math.h>
+#include "mdbtools.h"
+
+#ifdef DMALLOC
+#include "dmalloc.h"
+#endif
+
+char *mdb_money_to_string(MdbHandle *mdb, int start);
+char *mdb_numeric_to_string(MdbHandle *mdb, int start, int prec, int scale);
+
+/* eight copies of a byte */
+#define BYTES8(b) (G_GUINT64_CONSTANT(0x0101010101010101) * (b))
+
+/* bytes that can't go in a JSON string as they are */
+static const unsigned char json_special[256] = {
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,	/* " */
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0,	/* \ */
+};
+
+/*
+ * length of the run of s that needs no escaping.  Eight bytes are tested
+ * at a time: a control character, a quote or a backslash in the word
+ * shows up as a high bit in t, with no false alarms.
+ */
+static size_t
+mdb_json_plain_len(const unsigned char *s, size_t len)
+{
+	guint64 w, t;
+	size_t i = 0;
+
+	while (i + 8 <= len) {
+		memcpy(&w, s + i, 8);
+		t = (w - BYTES8(0x20)) & ~w;
+		t |= ((w ^ BYTES8('"')) - BYTES8(0x01)) & ~(w ^ BYTES8('"'));
+		t |= ((w ^ BYTES8('\\')) - BYTES8(0x01)) & ~(w ^ BYTES8('\\'));
+		if (t & BYTES8(0x80))
+			break;
+		i += 8;
+	}
+	while (i < len && !json_special[s[i]])
+		i++;
+	return i;
+}
+/**
+ * mdb_json_append_string:
+ * @out: String to append to
+ * @s: UTF-8 text
+ * @len: Length of @s in bytes
+ *
+ * Appends @s to @out as a quoted JSON string.
+ */
+void
+mdb_json_append_string(GString *out, const char *s, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	const unsigned char *p = (const unsigned char *)s;
+	char esc[6] = { '\\', 'u', '0', '0' };
+	size_t run;
+
+	g_string_append_c(out, '"');
+	while (len) {
+		run = mdb_json_plain_len(p, len);
+		g_string_append_len(out, (const char *)p, run);
+		p += run;
+		len -= run;
+		if (!len)
+			break;
+		switch (*p) {
+			case '"': g_string_append_len(out, "\\\"", 2); break;
+			case '\\': g_string_append_len(out, "\\\\", 2); break;
+			case '\b': g_string_append_len(out, "\\b", 2); break;
+			case '\f': g_string_append_len(out, "\\f", 2); break;
+			case '\n': g_string_append_len(out, "\\n", 2); break;
+			case '\r': g_string_append_len(out, "\\r", 2); break;
+			case '\t': g_string_append_len(out, "\\t", 2); break;
+			default:
+				esc[4] = hex[*p >> 4];
+				esc[5] = hex[*p & 0xf];
+				g_string_append_len(out, esc, 6);
+				break;
+		}
+		p++;
+		len--;
+	}
+	g_string_append_c(out, '"');
+}
+static void
+mdb_json_append_int(GString *out, gint64 value)
+{
+	char digits[24], *p = digits + sizeof(digits);
+	guint64 u = value < 0 ? -(guint64)value : (guint64)value;
+
+	do {
+		*--p = '0' + u % 10;
+		u /= 10;
+	} while (u);
+	if (value < 0)
+		*--p = '-';
+	g_string_append_len(out, p, digits + sizeof(digits) - p);
+}
+/*
+ * the shortest of 15 or 17 (6 or 9 for singles) significant digits that
+ * reads back as the same value.  JSON has no NaN or infinity.
+ */
+static void
+mdb_json_append_double(GString *out, double value, int single)
+{
+	char buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+	if (!isfinite(value)) {
+		g_string_append_len(out, "null", 4);
+		return;
+	}
+	g_ascii_formatd(buf, sizeof(buf), single ? "%.6g" : "%.15g", value);
+	if (single ? (float)g_ascii_strtod(buf, NULL) != (float)value
+	           : g_ascii_strtod(buf, NULL) != value)
+		g_ascii_formatd(buf, sizeof(buf), single ? "%.9g" : "%.17g", value);
+	g_string_append(out, buf);
+}
+static void
+mdb_json_append_base64(GString *out, const void *data, size_t len)
+{
+	gint state = 0, save = 0;
+	gsize pos;
+
+	g_string_append_c(out, '"');
+	pos = out->len;
+	g_string_set_size(out, pos + (len / 3 + 1) * 4 + 4);
+	pos += g_base64_encode_step(data, len, FALSE, out->str + pos, &state, &save);
+	pos += g_base64_encode_close(FALSE, out->str + pos, &state, &save);
+	g_string_set_size(out, pos);
+	g_string_append_c(out, '"');
+}
+/**
+ * mdb_json_append_value:
+ * @mdb: Handle to open MDB database file
+ * @col: Column of the row last fetched
+ * @out: String to append to
+ *
+ * Appends the value of @col in the current row to @out as JSON: numbers
+ * (Currency and Decimal exactly) as numbers, Yes/No as true or false, dates
+ * as ISO 8601 strings, Binary and OLE as base64 strings, and NULL as null.
+ * The value is taken from the row data, so the column need not be bound,
+ * except an OLE column: that is read through its bound buffer, and comes
+ * out as null when unbound.
+ */
+void
+mdb_json_append_value(MdbHandle *mdb, MdbColumn *col, GString *out)
+{
+	int start = col->cur_value_start;
+	int len = col->cur_value_len;
+	char buf[32];
+	struct tm t;
+	char *s;
+	size_t size;
+
+	/* the null flag of a boolean is its value */
+	if (col->col_type == MDB_BOOL) {
+		if (len)
+			g_string_append_len(out, "false", 5);
+		else
+			g_string_append_len(out, "true", 4);
+		return;
+	}
+	if (!len) {
+		g_string_append_len(out, "null", 4);
+		return;
+	}
+
+	switch (col->col_type) {
+		case MDB_BYTE:
+			mdb_json_append_int(out, mdb_get_byte(mdb->pg_buf, start));
+			break;
+		case MDB_INT:
+			mdb_json_append_int(out, (gint16)mdb_get_int16(mdb->pg_buf, start));
+			break;
+		case MDB_LONGINT:
+		case MDB_COMPLEX:
+			mdb_json_append_int(out, (gint32)mdb_get_int32(mdb->pg_buf, start));
+			break;
+		case MDB_FLOAT:
+			mdb_json_append_double(out, mdb_get_single(mdb->pg_buf, start), 1);
+			break;
+		case MDB_DOUBLE:
+			mdb_json_append_double(out, mdb_get_double(mdb->pg_buf, start), 0);
+			break;
+		case MDB_MONEY:
+			s = mdb_money_to_string(mdb, start);
+			g_string_append(out, s);
+			g_free(s);
+			break;
+		case MDB_NUMERIC:
+			s = mdb_numeric_to_string(mdb, start, col->col_prec, col->col_scale);
+			g_string_append(out, s);
+			g_free(s);
+			break;
+		case MDB_DATETIME:
+			mdb_date_to_tm(mdb_get_double(mdb->pg_buf, start), &t);
+			snprintf(buf, sizeof(buf), "\"%04d-%02d-%02dT%02d:%02d:%02d\"",
+				t.tm_year + 1900, t.tm_mon + 1, t.tm_mday,
+				t.tm_hour, t.tm_min, t.tm_sec);
+			g_string_append(out, buf);
+			break;
+		case MDB_BINARY:
+			mdb_json_append_base64(out, mdb->pg_buf + start, len);
+			break;
+		case MDB_OLE:
+			if (!col->bind_ptr || !(s = mdb_ole_read_full(mdb, col, &size))) {
+				g_string_append_len(out, "null", 4);
+				break;
+			}
+			mdb_json_append_base64(out, s, size);
+			free(s);
+			break;
+		default:
+			/* text, memo and replication ids */
+			s = mdb_col_to_string(mdb, mdb->pg_buf, start, col->col_type, len);
+			mdb_json_append_string(out, s, strlen(s));
+			g_free(s);
+			break;
+	}
+}
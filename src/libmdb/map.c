@@ -97,42 +97,667 @@ mdb_map_find_next(MdbHandle *mdb, unsigned char *map, unsigned int map_sz, guint
 	fprintf(stderr, "Warning: unrecognized usage map type: %d\n", map[0]);
 	return -1;
 }
+static guint32
+mdb_map_count_bits(unsigned char *bitmap, unsigned int len)
+{
+	guint32 count = 0;
+	unsigned int i;
+	unsigned char c;
+
+	for (i=0; i<len; i++) {
+		for (c = bitmap[i]; c; c &= c - 1)
+			count++;
+	}
+	return count;
+}
+/*
+ * number of pages marked in a usage map
+ */
 guint32
-mdb_alloc_page(MdbTableDef *table)
+mdb_map_count_pages(MdbHandle *mdb, unsigned char *map, unsigned int map_sz)
 {
-	printf("Allocating new page\n");
+	guint32 count = 0, map_ind, map_pg;
+
+	if (map[0] == 0) {
+		return mdb_map_count_bits(map + 5, map_sz - 5);
+	} else if (map[0] == 1) {
+		for (map_ind=0; map_ind<(map_sz - 1) / 4; map_ind++) {
+			if (!(map_pg = mdb_get_int32(map, (map_ind*4)+1)))
+				continue;
+			if (mdb_read_alt_pg(mdb, map_pg) != mdb->fmt->pg_size)
+				break;
+			count += mdb_map_count_bits(mdb->alt_pg_buf + 4,
+				mdb->fmt->pg_size - 4);
+		}
+		return count;
+	}
+	fprintf(stderr, "Warning: unrecognized usage map type: %d\n", map[0]);
 	return 0;
 }
-guint32 
-mdb_map_find_next_freepage(MdbTableDef *table, int row_size)
+/*
+ * Page allocation.  The global usage map (page 1, row 0) has the bits of
+ * the pages the database has freed set; pages beyond what it covers are
+ * taken as free too.  A table's usage map has the bits of its pages set
+ * and its free space map those of its pages with room left.
+ */
+#define MDB_GLOBAL_MAP_PG_ROW (1 << 8)
+
+/* pages added to the file at once when a table needs room */
+#define MDB_MIN_EXTENT 4
+#define MDB_MAX_EXTENT 64
+
+/*
+ * write the contents of pg_buf as a new page at the end of the file.
+ * Returns its number, 0 on error.
+ */
+static guint32
+mdb_map_append_pg(MdbHandle *mdb)
+{
+	guint32 pg;
+
+	pg = mdb_file_size(mdb) / mdb->fmt->pg_size;
+	/* pg_buf holds the page now */
+	mdb->cur_pg = pg;
+	if (!mdb_write_pg(mdb, pg))
+		return 0;
+	return pg;
+}
+/*
+ * set up a usage map page (type 0x05) in pg_buf, its bits all set to fill
+ */
+static void
+mdb_map_init_map_pg(MdbHandle *mdb, unsigned char fill)
+{
+	memset(mdb->pg_buf, fill, mdb->fmt->pg_size);
+	mdb->pg_buf[0] = 0x05;
+	mdb->pg_buf[1] = 0x01;
+	mdb_put_int16(mdb->pg_buf, 2, 0);
+}
+/*
+ * remember a usage map page just added to the file, the global usage map
+ * takes it for a free one until its bit is turned off there
+ */
+static void
+mdb_map_add_new_pg(GArray **new_pgs, guint32 pg)
+{
+	if (!*new_pgs)
+		*new_pgs = g_array_new(FALSE, FALSE, sizeof(guint32));
+	g_array_append_val(*new_pgs, pg);
+}
+/*
+ * turn an inline (type 0) map into a reference (type 1) map of the same
+ * size, moving its bits to new usage map pages.
+ */
+static int
+mdb_map_to_reference(MdbHandle *mdb, unsigned char *map, unsigned int map_sz, unsigned char fill, GArray **new_pgs)
+{
+	guint32 pgs_per_map = (mdb->fmt->pg_size - 4) * 8;
+	guint32 start_pg, bitlen, map_ind, last_ind, i, map_pg;
+	unsigned char *old;
+	int ret = 1;
+
+	old = g_memdup(map, map_sz);
+	start_pg = mdb_get_int32(old, 1);
+	bitlen = (map_sz - 5) * 8;
+	last_ind = (start_pg + bitlen - 1) / pgs_per_map;
+	if (last_ind >= (map_sz - 1) / 4) {
+		fprintf(stderr, "Usage map too small to be converted\n");
+		g_free(old);
+		return 0;
+	}
+
+	memset(map, 0, map_sz);
+	map[0] = 1;
+	for (map_ind = start_pg / pgs_per_map; map_ind <= last_ind; map_ind++) {
+		mdb_map_init_map_pg(mdb, fill);
+		for (i = 0; i < bitlen; i++) {
+			guint32 bit = start_pg + i - map_ind * pgs_per_map;
+
+			if ((start_pg + i) / pgs_per_map != map_ind)
+				continue;
+			if (old[5 + i/8] & (1 << (i%8)))
+				mdb->pg_buf[4 + bit/8] |= 1 << (bit%8);
+			else
+				mdb->pg_buf[4 + bit/8] &= ~(1 << (bit%8));
+		}
+		if (!(map_pg = mdb_map_append_pg(mdb))) {
+			ret = 0;
+			break;
+		}
+		mdb_map_add_new_pg(new_pgs, map_pg);
+		mdb_put_int32(map, map_ind*4 + 1, map_pg);
+	}
+	g_free(old);
+	return ret;
+}
+/*
+ * turn the bit of page pg on or off in a usage map: in map itself for an
+ * inline map, in its usage map pages for a reference map.  An inline map
+ * not covering pg is moved when it is empty, otherwise turned into a
+ * reference map.  fill is the value taken by pages outside the map, 0 for
+ * table maps and 0xff for the global one.  The usage map pages added go
+ * to new_pgs.  Returns 0 on error.
+ */
+static int
+mdb_map_set_bit(MdbHandle *mdb, unsigned char *map, unsigned int map_sz, guint32 pg, int on, unsigned char fill, GArray **new_pgs)
+{
+	guint32 pgs_per_map = (mdb->fmt->pg_size - 4) * 8;
+	guint32 start_pg, bitlen, map_ind, map_pg, bit;
+
+	if (map[0] == 0) {
+		start_pg = mdb_get_int32(map, 1);
+		bitlen = (map_sz - 5) * 8;
+		if (pg >= start_pg && pg - start_pg < bitlen) {
+			bit = pg - start_pg;
+			if (on)
+				map[5 + bit/8] |= 1 << (bit%8);
+			else
+				map[5 + bit/8] &= ~(1 << (bit%8));
+			return 1;
+		}
+		if ((on ? 0xff : 0) == fill)
+			return 1;
+		if (!fill && !mdb_map_count_bits(map + 5, map_sz - 5)) {
+			/* nothing in it yet, start it at pg */
+			mdb_put_int32(map, 1, pg);
+			map[5] = 1;
+			return 1;
+		}
+		if (!mdb_map_to_reference(mdb, map, map_sz, fill, new_pgs))
+			return 0;
+	}
+	if (map[0] != 1) {
+		fprintf(stderr, "Warning: unrecognized usage map type: %d\n", map[0]);
+		return 0;
+	}
+
+	map_ind = pg / pgs_per_map;
+	if (map_ind >= (map_sz - 1) / 4) {
+		fprintf(stderr, "Usage map can't hold page %lu\n", (unsigned long) pg);
+		return 0;
+	}
+	if (!(map_pg = mdb_get_int32(map, map_ind*4 + 1))) {
+		if ((on ? 0xff : 0) == fill)
+			return 1;
+		mdb_map_init_map_pg(mdb, fill);
+		if (!(map_pg = mdb_map_append_pg(mdb)))
+			return 0;
+		mdb_map_add_new_pg(new_pgs, map_pg);
+		mdb_put_int32(map, map_ind*4 + 1, map_pg);
+	}
+	if (!mdb_read_pg(mdb, map_pg))
+		return 0;
+	bit = pg % pgs_per_map;
+	if (on)
+		mdb->pg_buf[4 + bit/8] |= 1 << (bit%8);
+	else
+		mdb->pg_buf[4 + bit/8] &= ~(1 << (bit%8));
+	return mdb_write_pg(mdb, map_pg) ? 1 : 0;
+}
+/*
+ * write a usage map back to the row holding it
+ */
+static int
+mdb_map_write(MdbHandle *mdb, guint32 pg_row, unsigned char *map, unsigned int map_sz)
+{
+	int row_start;
+	size_t len;
+
+	if (!mdb_read_pg(mdb, pg_row >> 8))
+		return 0;
+	mdb_find_row(mdb, pg_row & 0xff, &row_start, &len);
+	row_start &= 0x1fff;
+	if (len != map_sz) {
+		fprintf(stderr, "Usage map row changed size\n");
+		return 0;
+	}
+	memcpy(mdb->pg_buf + row_start, map, map_sz);
+	return mdb_write_pg(mdb, pg_row >> 8) ? 1 : 0;
+}
+static int
+mdb_map_read_global(MdbHandle *mdb)
+{
+	MdbFile *f = mdb->f;
+	void *buf;
+	int row_start;
+	size_t map_sz;
+
+	if (f->free_map)
+		return 1;
+	if (mdb_find_pg_row(mdb, MDB_GLOBAL_MAP_PG_ROW, &buf, &row_start, &map_sz))
+		return 0;
+	row_start &= 0x1fff;
+	f->free_map = g_memdup((char*)buf + row_start, map_sz);
+	f->map_sz = map_sz;
+	return 1;
+}
+/*
+ * mdb_map_set_bit(), then take the usage map pages it added out of the
+ * global usage map, as mdb_map_alloc_pages() does for other pages
+ */
+static int
+mdb_map_set_page(MdbHandle *mdb, unsigned char *map, unsigned int map_sz, guint32 pg, int on, unsigned char fill)
+{
+	MdbFile *f = mdb->f;
+	GArray *new_pgs = NULL;
+	unsigned int i;
+	int ret;
+
+	ret = mdb_map_set_bit(mdb, map, map_sz, pg, on, fill, &new_pgs);
+	if (!new_pgs)
+		return ret;
+	if (ret)
+		ret = mdb_map_read_global(mdb);
+	for (i = 0; ret && i < new_pgs->len; i++)
+		ret = mdb_map_set_page(mdb, f->free_map, f->map_sz,
+			g_array_index(new_pgs, guint32, i), 0, 0xff);
+	if (ret)
+		ret = mdb_map_write(mdb, MDB_GLOBAL_MAP_PG_ROW, f->free_map, f->map_sz);
+	g_array_free(new_pgs, TRUE);
+	return ret;
+}
+/*
+ * take a page the database freed out of the global usage map.  Only pages
+ * that don't look like live pages are reused.  The scan carries on from
+ * where the last one stopped, so pages found live are read once.  Returns
+ * 0 if there is none.
+ */
+static guint32
+mdb_map_claim_free_pg(MdbHandle *mdb)
+{
+	MdbFile *f = mdb->f;
+	guint32 num_pgs;
+	gint32 pg = f->free_scan_pg;
+
+	num_pgs = mdb_file_size(mdb) / mdb->fmt->pg_size;
+	while ((pg = mdb_map_find_next(mdb, f->free_map, f->map_sz, pg)) > 0) {
+		if ((guint32) pg >= num_pgs)
+			break;
+		/* pages 0 and 1 hold the header and the global map */
+		if (pg < 2)
+			continue;
+		if (mdb_read_alt_pg(mdb, pg) != mdb->fmt->pg_size)
+			break;
+		f->free_scan_pg = pg;
+		if (mdb->alt_pg_buf[0] >= MDB_PAGE_DATA && mdb->alt_pg_buf[0] <= 0x05)
+			continue;
+		if (!mdb_map_set_page(mdb, f->free_map, f->map_sz, pg, 0, 0xff))
+			break;
+		return pg;
+	}
+	return 0;
+}
+/**
+ * mdb_map_alloc_pages:
+ * @mdb: Handle to a writable database
+ * @num_pgs: Number of pages wanted
+ *
+ * Adds @num_pgs blank pages at the end of the file and takes them out of
+ * the global usage map.  Used directly for index trees, which are not in
+ * their table's maps.
+ *
+ * Return value: the first of the new pages, which follow each other, 0 on
+ * error.
+ */
+guint32
+mdb_map_alloc_pages(MdbHandle *mdb, guint32 num_pgs)
+{
+	guint32 first_pg = 0, pg, i;
+
+	if (!mdb->f->writable) {
+		fprintf(stderr, "File is not open for writing\n");
+		return 0;
+	}
+	if (!mdb_map_read_global(mdb)) {
+		fprintf(stderr, "Unable to read the global usage map\n");
+		return 0;
+	}
+	for (i = 0; i < num_pgs; i++) {
+		memset(mdb->pg_buf, 0, mdb->fmt->pg_size);
+		if (!(pg = mdb_map_append_pg(mdb))) {
+			fprintf(stderr, "Unable to extend file\n");
+			return 0;
+		}
+		if (!i) first_pg = pg;
+	}
+	for (i = 0; i < num_pgs; i++) {
+		if (!mdb_map_set_page(mdb, mdb->f->free_map, mdb->f->map_sz,
+				first_pg + i, 0, 0xff))
+			return 0;
+	}
+	if (!mdb_map_write(mdb, MDB_GLOBAL_MAP_PG_ROW, mdb->f->free_map, mdb->f->map_sz))
+		return 0;
+	mdb_debug(MDB_DEBUG_WRITE, "allocated %lu pages at %lu",
+		(unsigned long) num_pgs, (unsigned long) first_pg);
+
+	return first_pg;
+}
+/**
+ * mdb_map_free_pages:
+ * @mdb: Handle to a writable database
+ * @pgs: Array of the guint32 numbers of the pages
+ *
+ * Gives pages that are no longer used back to the database.  They are
+ * blanked and turned on in the global usage map, so later allocations
+ * can reuse them.
+ *
+ * Return value: 1 on success, 0 on error.
+ */
+int
+mdb_map_free_pages(MdbHandle *mdb, GArray *pgs)
+{
+	guint32 pg;
+	unsigned int i;
+
+	if (!mdb_map_read_global(mdb)) {
+		fprintf(stderr, "Unable to read the global usage map\n");
+		return 0;
+	}
+	for (i = 0; i < pgs->len; i++) {
+		pg = g_array_index(pgs, guint32, i);
+		memset(mdb->pg_buf, 0, mdb->fmt->pg_size);
+		mdb->cur_pg = pg;
+		if (!mdb_write_pg(mdb, pg))
+			return 0;
+		if (!mdb_map_set_page(mdb, mdb->f->free_map, mdb->f->map_sz, pg, 1, 0xff))
+			return 0;
+		/* blank now, the next scan may take it */
+		if (pg <= mdb->f->free_scan_pg)
+			mdb->f->free_scan_pg = pg - 1;
+	}
+	return mdb_map_write(mdb, MDB_GLOBAL_MAP_PG_ROW, mdb->f->free_map, mdb->f->map_sz);
+}
+/**
+ * mdb_map_set_pages:
+ * @mdb: Handle to a writable database
+ * @map_pg_row: Page and row of the usage map, as found in table definitions
+ * @pgs: Array of the guint32 numbers of the pages
+ * @on: Whether the pages are now in use
+ *
+ * Turns pages on or off in a usage map that is not kept in memory, such
+ * as the map of the pages an index owns.
+ *
+ * Return value: 1 on success, 0 on error.
+ */
+int
+mdb_map_set_pages(MdbHandle *mdb, guint32 map_pg_row, GArray *pgs, int on)
+{
+	unsigned char *map;
+	void *buf;
+	int row_start, ret = 1;
+	size_t map_sz;
+	unsigned int i;
+
+	if (!pgs->len || !map_pg_row)
+		return 1;
+	if (mdb_find_pg_row(mdb, map_pg_row, &buf, &row_start, &map_sz))
+		return 0;
+	row_start &= 0x1fff;
+	map = g_memdup((char*)buf + row_start, map_sz);
+	for (i = 0; ret && i < pgs->len; i++)
+		ret = mdb_map_set_page(mdb, map, map_sz,
+			g_array_index(pgs, guint32, i), on, 0);
+	if (ret)
+		ret = mdb_map_write(mdb, map_pg_row, map, map_sz);
+	g_free(map);
+	return ret;
+}
+/*
+ * write the usage and free space maps of a table back to their rows
+ */
+static int
+mdb_map_write_table(MdbTableDef *table)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	MdbFormatConstants *fmt = mdb->fmt;
+	guint32 usage_pg_row, free_pg_row;
+
+	if (!mdb_read_pg(mdb, table->entry->table_pg))
+		return 0;
+	usage_pg_row = mdb_get_int32(mdb->pg_buf, fmt->tab_usage_map_offset);
+	free_pg_row = mdb_get_int32(mdb->pg_buf, fmt->tab_free_map_offset);
+	return mdb_map_write(mdb, usage_pg_row, table->usage_map, table->map_sz)
+	 && mdb_map_write(mdb, free_pg_row, table->free_usage_map, table->freemap_sz);
+}
+/**
+ * mdb_alloc_page:
+ * @table: Table that needs a new data page
+ *
+ * Gives @table new empty data pages, a page the database freed if there is
+ * one, else an extent of pages added at the end of the file which grows
+ * with the table.  The pages are added to the usage and free space maps
+ * of the table and taken out of the global usage map.
+ *
+ * Return value: the first new page, 0 on error.
+ */
+guint32
+mdb_alloc_page(MdbTableDef *table)
 {
 	MdbCatalogEntry *entry = table->entry;
 	MdbHandle *mdb = entry->mdb;
-	guint32 pgnum;
-	guint32 cur_pg = 0;
-	int free_space;
-
-	do {
-		pgnum = mdb_map_find_next(mdb, 
-				table->free_usage_map, 
-				table->freemap_sz, cur_pg);
-		//printf("looking at page %d\n", pgnum);
-		if (!pgnum) {
-			/* allocate new page */
-			pgnum = mdb_alloc_page(table);
-			return pgnum;
-		} else if (pgnum==-1) {
-			fprintf(stderr, "Error: mdb_map_find_next_freepage error while reading maps.\n");
-			exit(1);
-		}
-		cur_pg = pgnum;
+	MdbFormatConstants *fmt = mdb->fmt;
+	guint32 first_pg, pg, num_pgs, i;
+	void *new_pg;
+	int ok = 1;
+
+	if (!mdb->f->writable) {
+		fprintf(stderr, "File is not open for writing\n");
+		return 0;
+	}
+	if (!mdb_map_read_global(mdb)) {
+		fprintf(stderr, "Unable to read the global usage map\n");
+		return 0;
+	}
+
+	if ((first_pg = mdb_map_claim_free_pg(mdb))) {
+		num_pgs = 1;
+		if (!mdb_map_write(mdb, MDB_GLOBAL_MAP_PG_ROW, mdb->f->free_map, mdb->f->map_sz))
+			return 0;
+	} else {
+		num_pgs = mdb_map_count_pages(mdb, table->usage_map, table->map_sz) / 4;
+		if (num_pgs < MDB_MIN_EXTENT) num_pgs = MDB_MIN_EXTENT;
+		if (num_pgs > MDB_MAX_EXTENT) num_pgs = MDB_MAX_EXTENT;
+		if (!(first_pg = mdb_map_alloc_pages(mdb, num_pgs)))
+			return 0;
+	}
+
+	new_pg = mdb_new_data_pg(entry);
+	for (i = 0; i < num_pgs; i++) {
+		memcpy(mdb->pg_buf, new_pg, fmt->pg_size);
+		mdb->cur_pg = first_pg + i;
+		if (!mdb_write_pg(mdb, first_pg + i))
+			break;
+	}
+	g_free(new_pg);
+	if (i < num_pgs) {
+		fprintf(stderr, "write failed!\n");
+		return 0;
+	}
 
-		mdb_read_pg(mdb, pgnum);
-		free_space = mdb_pg_get_freespace(mdb);
-		
-	} while (free_space < row_size);
+	for (i = 0; ok && i < num_pgs; i++) {
+		pg = first_pg + i;
+		ok = mdb_map_set_page(mdb, table->usage_map, table->map_sz, pg, 1, 0)
+		 && mdb_map_set_page(mdb, table->free_usage_map, table->freemap_sz, pg, 1, 0);
+	}
 
-	//printf("page %d has %d bytes left\n", pgnum, free_space);
+	if (!ok || !mdb_map_write_table(table)) {
+		fprintf(stderr, "Unable to update the usage maps\n");
+		return 0;
+	}
+	for (i = 0; i < num_pgs; i++)
+		mdb_map_set_freespace(table, first_pg + i,
+			fmt->pg_size - fmt->row_count_offset - 2);
+	return first_pg;
+}
+/**
+ * mdb_map_replace_pages:
+ * @table: Table whose rows were moved
+ * @old_pgs: Array of the guint32 numbers of the pages the rows left
+ * @new_pgs: Array of the guint32 numbers of the pages holding them now,
+ * all full but the last one
+ *
+ * Updates the usage and free space maps of @table, in memory and in the
+ * file, after its rows were rewritten to other pages, and gives @old_pgs
+ * back to the database.
+ *
+ * Return value: 1 on success, 0 on error.
+ */
+int
+mdb_map_replace_pages(MdbTableDef *table, GArray *old_pgs, GArray *new_pgs)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	guint32 pg;
+	unsigned int i;
+	int ok = 1;
+
+	for (i = 0; ok && i < old_pgs->len; i++) {
+		pg = g_array_index(old_pgs, guint32, i);
+		ok = mdb_map_set_page(mdb, table->usage_map, table->map_sz, pg, 0, 0)
+		 && mdb_map_set_page(mdb, table->free_usage_map, table->freemap_sz, pg, 0, 0);
+	}
+	for (i = 0; ok && i < new_pgs->len; i++) {
+		pg = g_array_index(new_pgs, guint32, i);
+		ok = mdb_map_set_page(mdb, table->usage_map, table->map_sz, pg, 1, 0)
+		 && mdb_map_set_page(mdb, table->free_usage_map, table->freemap_sz,
+			pg, i == new_pgs->len - 1, 0);
+	}
+	if (!ok || !mdb_map_write_table(table)) {
+		fprintf(stderr, "Unable to update the usage maps\n");
+		return 0;
+	}
+	/* the free space of the pages is read again when needed */
+	mdb_map_free_freespace(table);
+	return mdb_map_free_pages(mdb, old_pgs);
+}
+/*
+ * Free space.  Rather than reading the pages of the free space map one by
+ * one on every insert, a table keeps its pages with room left in buckets
+ * of free bytes, read once and then kept up to date by the writes.
+ */
+static int
+mdb_map_freespace_bucket(MdbHandle *mdb, int free_space)
+{
+	int b;
+
+	if (free_space < 0) free_space = 0;
+	b = free_space * MDB_FREE_SPACE_BUCKETS / mdb->fmt->pg_size;
+	return b < MDB_FREE_SPACE_BUCKETS ? b : MDB_FREE_SPACE_BUCKETS - 1;
+}
+static int
+mdb_map_pg_freespace(MdbHandle *mdb)
+{
+	MdbFormatConstants *fmt = mdb->fmt;
+
+	/* mdb_pg_get_freespace() needs a row to find the end of the
+	 * free space */
+	if (!mdb_get_int16(mdb->pg_buf, fmt->row_count_offset))
+		return fmt->pg_size - fmt->row_count_offset - 2;
+	return mdb_pg_get_freespace(mdb);
+}
+static MdbFreeSpace *
+mdb_map_read_freespace(MdbTableDef *table)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	MdbFreeSpace *fs;
+	gint32 pgnum;
+	int i;
+
+	if (table->free_space)
+		return table->free_space;
+
+	fs = g_malloc0(sizeof(MdbFreeSpace));
+	fs->pg_free = g_hash_table_new(g_direct_hash, g_direct_equal);
+	for (i = 0; i < MDB_FREE_SPACE_BUCKETS; i++)
+		fs->buckets[i] = g_hash_table_new(g_direct_hash, g_direct_equal);
+	table->free_space = fs;
+
+	pgnum = 0;
+	while ((pgnum = mdb_map_find_next(mdb, table->free_usage_map,
+			table->freemap_sz, pgnum)) > 0) {
+		if (!mdb_read_pg(mdb, pgnum))
+			break;
+		if (mdb->pg_buf[0] != MDB_PAGE_DATA)
+			continue;
+		mdb_map_set_freespace(table, pgnum, mdb_map_pg_freespace(mdb));
+	}
+	if (pgnum == -1) {
+		fprintf(stderr, "Error: mdb_map_find_next_freepage error while reading maps.\n");
+		exit(1);
+	}
+	return fs;
+}
+/**
+ * mdb_map_set_freespace:
+ * @table: Table the page belongs to
+ * @pg: Data page of @table
+ * @free_space: Bytes left on @pg
+ *
+ * Records the free space of a page after a row was written to it, so that
+ * mdb_map_find_next_freepage() can pick pages without reading them.
+ */
+void
+mdb_map_set_freespace(MdbTableDef *table, guint32 pg, int free_space)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	MdbFreeSpace *fs = table->free_space;
+	gpointer key = GUINT_TO_POINTER(pg);
+	gpointer old;
+
+	/* not read yet, it will be read from the pages */
+	if (!fs)
+		return;
+	if ((old = g_hash_table_lookup(fs->pg_free, key))) {
+		g_hash_table_remove(fs->buckets[mdb_map_freespace_bucket(mdb,
+			GPOINTER_TO_INT(old) - 1)], key);
+	}
+	/* stored plus one, so a full page is not a NULL value */
+	g_hash_table_insert(fs->pg_free, key, GINT_TO_POINTER(free_space + 1));
+	g_hash_table_insert(fs->buckets[mdb_map_freespace_bucket(mdb,
+		free_space)], key, key);
+}
+void
+mdb_map_free_freespace(MdbTableDef *table)
+{
+	MdbFreeSpace *fs = table->free_space;
+	int i;
+
+	if (!fs)
+		return;
+	g_hash_table_destroy(fs->pg_free);
+	for (i = 0; i < MDB_FREE_SPACE_BUCKETS; i++)
+		g_hash_table_destroy(fs->buckets[i]);
+	g_free(fs);
+	table->free_space = NULL;
+}
+/*
+ * returns a page of the table with at least row_size bytes free, the one
+ * with the least room that fits so pages fill up, or a newly allocated
+ * page when none is left.  The page is not read.
+ */
+guint32 
+mdb_map_find_next_freepage(MdbTableDef *table, int row_size)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	MdbFreeSpace *fs = mdb_map_read_freespace(table);
+	GHashTableIter iter;
+	gpointer key, value;
+	int b, first;
+
+	/* every page in the buckets above the one of row_size fits, some
+	 * in that one may */
+	first = mdb_map_freespace_bucket(mdb, row_size);
+	g_hash_table_iter_init(&iter, fs->buckets[first]);
+	while (g_hash_table_iter_next(&iter, &key, NULL)) {
+		value = g_hash_table_lookup(fs->pg_free, key);
+		if (GPOINTER_TO_INT(value) - 1 >= row_size)
+			return GPOINTER_TO_UINT(key);
+	}
+	for (b = first + 1; b < MDB_FREE_SPACE_BUCKETS; b++) {
+		g_hash_table_iter_init(&iter, fs->buckets[b]);
+		if (g_hash_table_iter_next(&iter, &key, NULL))
+			return GPOINTER_TO_UINT(key);
+	}
 
-	return pgnum;
+	/* allocate new page */
+	return mdb_alloc_page(table);
 }
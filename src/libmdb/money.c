@@ -106,6 +106,27 @@ char *mdb_numeric_to_string(MdbHandle *mdb, int start, int prec, int scale) {
        return array_to_string(product, scale, neg);
 }
 
+/**
+ * mdb_numeric_to_double
+ * @buf: the 17 byte numeric value, sign byte first
+ * @scale: number of decimals
+ *
+ * Returns: the value as a double, precision beyond 53 bits is lost.
+ */
+double mdb_numeric_to_double(void *buf, int scale)
+{
+	unsigned char *bytes = (unsigned char *)buf + 1;
+	double d = 0;
+	int i;
+
+	for (i=0;i<4;i++)
+		d = d * 4294967296.0 + (guint32)mdb_get_int32(bytes, 4*i);
+	for (i=0;i<scale;i++)
+		d /= 10;
+	if (((unsigned char *)buf)[0] & 0x80) d = -d;
+	return d;
+}
+
 static int multiply_byte(unsigned char *product, int num, unsigned char *multiplier)
 {
 	unsigned char number[3];
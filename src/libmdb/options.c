@@ -66,6 +66,7 @@ load_options()
         	if (!strcmp(opt, "debug_ole")) opts |= MDB_DEBUG_OLE;
         	if (!strcmp(opt, "debug_row")) opts |= MDB_DEBUG_ROW;
         	if (!strcmp(opt, "debug_props")) opts |= MDB_DEBUG_PROPS;
+        	if (!strcmp(opt, "debug_index")) opts |= MDB_DEBUG_INDEX;
         	if (!strcmp(opt, "debug_all")) {
 				opts |= MDB_DEBUG_LIKE;
 				opts |= MDB_DEBUG_WRITE;
@@ -73,6 +74,7 @@ load_options()
 				opts |= MDB_DEBUG_OLE;
 				opts |= MDB_DEBUG_ROW;
 				opts |= MDB_DEBUG_PROPS;
+				opts |= MDB_DEBUG_INDEX;
 			}
 			opt = strtok(NULL,":");
 		}
@@ -84,6 +84,30 @@ mdb_alloc_props()
 
 	return props;
 }
+static void
+copy_hash_entry(gpointer key, gpointer value, gpointer user_data)
+{
+	g_hash_table_insert((GHashTable *)user_data, g_strdup(key), g_strdup(value));
+}
+/*
+ * mdb_copy_props: deep copy of a property block, so a cloned handle can
+ * free its catalog without touching the original's.
+ */
+MdbProperties *
+mdb_copy_props(MdbProperties *props)
+{
+	MdbProperties *copy;
+
+	if (!props) return NULL;
+
+	copy = mdb_alloc_props();
+	copy->name = g_strdup(props->name);
+	if (props->hash) {
+		copy->hash = g_hash_table_new(g_str_hash, g_str_equal);
+		g_hash_table_foreach(props->hash, copy_hash_entry, copy->hash);
+	}
+	return copy;
+}
 static MdbProperties *
 mdb_read_props(MdbHandle *mdb, GPtrArray *names, gchar *kkd, int len)
 {
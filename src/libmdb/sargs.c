@@ -33,6 +33,8 @@
 #include "dmalloc.h"
 #endif
 
+double mdb_numeric_to_double(void *buf, int scale);
+
 void
 mdb_sql_walk_tree(MdbSargNode *node, MdbSargTreeFunc func, gpointer data)
 {
@@ -141,6 +143,70 @@ mdb_test_date(MdbSargNode *node, double td)
 	return 0;
 }
 
+int mdb_test_double(MdbSargNode *node, double d)
+{
+	double val = node->value.d;
+
+	switch (node->op) {
+		case MDB_EQUAL:
+			if (val == d) return 1;
+			break;
+		case MDB_GT:
+			if (val < d) return 1;
+			break;
+		case MDB_LT:
+			if (val > d) return 1;
+			break;
+		case MDB_GTEQ:
+			if (val <= d) return 1;
+			break;
+		case MDB_LTEQ:
+			if (val >= d) return 1;
+			break;
+		default:
+			fprintf(stderr, "Calling mdb_test_sarg on unknown operator.  Add code to mdb_test_double() for operator %d\n",node->op);
+			break;
+	}
+	return 0;
+}
+/*
+ * guids compare in string order, the first three groups are stored
+ * little endian
+ */
+int mdb_test_uuid(MdbSargNode *node, unsigned char *uuid)
+{
+	unsigned char asked[16];
+	static const int order[16] = {3,2,1,0,5,4,7,6,8,9,10,11,12,13,14,15};
+	int i, rc = 0;
+
+	if (!mdb_string_to_uuid(node->value.s, asked))
+		return 0;
+	for (i=0; i<16 && !rc; i++)
+		rc = asked[order[i]] - uuid[order[i]];
+
+	switch (node->op) {
+		case MDB_EQUAL:
+			if (rc==0) return 1;
+			break;
+		case MDB_GT:
+			if (rc<0) return 1;
+			break;
+		case MDB_LT:
+			if (rc>0) return 1;
+			break;
+		case MDB_GTEQ:
+			if (rc<=0) return 1;
+			break;
+		case MDB_LTEQ:
+			if (rc>=0) return 1;
+			break;
+		default:
+			fprintf(stderr, "Calling mdb_test_sarg on unknown operator.  Add code to mdb_test_uuid() for operator %d\n",node->op);
+			break;
+	}
+	return 0;
+}
+
 
 int
 mdb_find_indexable_sargs(MdbSargNode *node, gpointer data)
@@ -176,11 +242,11 @@ mdb_test_sarg(MdbHandle *mdb, MdbColumn *col, MdbSargNode *node, MdbField *field
 	char tmpbuf[256];
 
 	if (node->op == MDB_ISNULL) {
-		if (field->is_null) return 0;
-		else return 1;
-	} else if (node->op == MDB_NOTNULL) {
 		if (field->is_null) return 1;
 		else return 0;
+	} else if (node->op == MDB_NOTNULL) {
+		if (field->is_null) return 0;
+		else return 1;
 	}
 	switch (col->col_type) {
 		case MDB_BOOL:
@@ -200,6 +266,16 @@ mdb_test_sarg(MdbHandle *mdb, MdbColumn *col, MdbSargNode *node, MdbField *field
 			return mdb_test_string(node, tmpbuf);
 		case MDB_DATETIME:
 			return mdb_test_date(node, mdb_get_double(field->value, 0));
+		case MDB_FLOAT:
+			return mdb_test_double(node, mdb_get_single(field->value, 0));
+		case MDB_DOUBLE:
+			return mdb_test_double(node, mdb_get_double(field->value, 0));
+		case MDB_MONEY:
+			return mdb_test_double(node, mdb_get_int64(field->value, 0) / 10000.0);
+		case MDB_NUMERIC:
+			return mdb_test_double(node, mdb_numeric_to_double(field->value, col->col_scale));
+		case MDB_REPID:
+			return mdb_test_uuid(node, field->value);
 		default:
 			fprintf(stderr, "Calling mdb_test_sarg on unknown type.  Add code to mdb_test_sarg() for type %d\n",col->col_type);
 			break;
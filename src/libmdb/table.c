@@ -68,6 +68,7 @@ void mdb_free_tabledef(MdbTableDef *table)
 	mdb_free_indices(table->indices);
 	g_free(table->usage_map);
 	g_free(table->free_usage_map);
+	mdb_map_free_freespace(table);
 	g_free(table);
 }
 MdbTableDef *mdb_read_table(MdbCatalogEntry *entry)
@@ -213,6 +214,12 @@ void mdb_free_columns(GPtrArray *columns)
 			}
 			g_ptr_array_free(col->sargs, TRUE);
 		}
+		if (col->idx_sarg_cache) {
+			for (j=0; j<col->idx_sarg_cache->len; j++) {
+				g_free( g_ptr_array_index(col->idx_sarg_cache, j));
+			}
+			g_ptr_array_free(col->idx_sarg_cache, TRUE);
+		}
 		g_free(col);
 	}
 	g_ptr_array_free(columns, TRUE);
@@ -274,6 +281,9 @@ GPtrArray *mdb_read_columns(MdbTableDef *table)
 		pcol->is_fixed = col[fmt->col_flags_offset] & 0x01 ? 1 : 0;
 		pcol->is_long_auto = col[fmt->col_flags_offset] & 0x04 ? 1 : 0;
 		pcol->is_uuid_auto = col[fmt->col_flags_offset] & 0x40 ? 1 : 0;
+		/* misc_flags follow the column flags in Jet4 */
+		if (!IS_JET3(mdb))
+			pcol->is_compressed = col[fmt->col_flags_offset + 1] & 0x01 ? 1 : 0;
 
 		// tab_col_offset_fixed == 14 or 21
 		pcol->fixed_offset = mdb_get_int16(col, fmt->tab_col_offset_fixed);
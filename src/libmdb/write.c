@@ -20,6 +20,9 @@
 #include <math.h>
 #include <inttypes.h>
 #include "mdbtools.h"
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
 
 #ifdef DMALLOC
 #include "dmalloc.h"
@@ -71,19 +74,142 @@ __attribute__((alias("mdb_put_int32_msb")));
 { mdb_put_int32_msb(buf, offset, value); }
 #endif
 
+/*
+ * Write-back.  With MDB_WRITEBACK, mdb_write_pg() only copies the page to
+ * f->dirty, so a page changed many times is written once.  The pages go
+ * to the file in page order, consecutive ones in a single writev(), when
+ * too many are waiting or on mdb_flush().
+ */
+#define MDB_WRITEBACK_PAGES 1024
+#define MDB_WRITEBACK_IOV 64
+
+static gint
+mdb_pg_cmp(gconstpointer a, gconstpointer b)
+{
+	guint32 pa = *(guint32 *) a, pb = *(guint32 *) b;
+
+	return (pa > pb) - (pa < pb);
+}
+static int
+mdb_write_back(MdbHandle *mdb)
+{
+	MdbFile *f = mdb->f;
+	ssize_t pg_size = mdb->fmt->pg_size;
+	GHashTableIter iter;
+	gpointer key, value;
+	GArray *pgs;
+	guint32 *pg;
+	unsigned int i, j, n;
+	ssize_t len;
+	int ret = 1;
+#ifdef HAVE_SYS_UIO_H
+	struct iovec iov[MDB_WRITEBACK_IOV];
+#endif
+
+	if (!g_hash_table_size(f->dirty))
+		return 1;
+	pgs = g_array_sized_new(FALSE, FALSE, sizeof(guint32),
+		g_hash_table_size(f->dirty));
+	g_hash_table_iter_init(&iter, f->dirty);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		guint32 k = GPOINTER_TO_UINT(key);
+		g_array_append_val(pgs, k);
+	}
+	g_array_sort(pgs, mdb_pg_cmp);
+	pg = (guint32 *) pgs->data;
+
+	for (i = 0; i < pgs->len; i += n) {
+		/* a run of consecutive pages */
+		for (n = 1; i + n < pgs->len && n < MDB_WRITEBACK_IOV
+				&& pg[i + n] == pg[i] + n; n++)
+			;
+		lseek(f->fd, (off_t) pg[i] * pg_size, SEEK_SET);
+#ifdef HAVE_SYS_UIO_H
+		for (j = 0; j < n; j++) {
+			iov[j].iov_base = g_hash_table_lookup(f->dirty, GUINT_TO_POINTER(pg[i + j]));
+			iov[j].iov_len = pg_size;
+		}
+		len = writev(f->fd, iov, n);
+#else
+		for (j = 0, len = 0; j < n; j++) {
+			ssize_t l = write(f->fd,
+				g_hash_table_lookup(f->dirty, GUINT_TO_POINTER(pg[i + j])), pg_size);
+			if (l != pg_size) {
+				len = l;
+				break;
+			}
+			len += l;
+		}
+#endif
+		if (len == -1) {
+			perror("write");
+			ret = 0;
+			break;
+		} else if (len < (ssize_t) n * pg_size) {
+			ret = 0;
+			break;
+		}
+	}
+	if (ret) {
+		g_hash_table_remove_all(f->dirty);
+		f->dirty_end = 0;
+	}
+	g_array_free(pgs, TRUE);
+	return ret;
+}
+/**
+ * mdb_flush:
+ * @mdb: Handle to open MDB database file
+ *
+ * Writes the pages held back by MDB_WRITEBACK to the file, and asks the
+ * system to put the file on disk.  Everything written before a successful
+ * call survives a crash.
+ *
+ * Return value: 1 on success, 0 on error.
+ */
+int
+mdb_flush(MdbHandle *mdb)
+{
+	if (!mdb->f->writable)
+		return 1;
+	if (mdb->f->dirty && !mdb_write_back(mdb))
+		return 0;
+#ifndef _WIN32
+	if (fsync(mdb->f->fd) == -1) {
+		perror("fsync");
+		return 0;
+	}
+#endif
+	return 1;
+}
 ssize_t
 mdb_write_pg(MdbHandle *mdb, unsigned long pg)
 {
 	ssize_t len;
-	struct stat status;
 	off_t offset = pg * mdb->fmt->pg_size;
+	void *dirty_pg;
 
-	fstat(mdb->f->fd, &status);
 	/* is page beyond current size + 1 ? */
-	if (status.st_size < offset + mdb->fmt->pg_size) {
+	if (mdb_file_size(mdb) < offset) {
 		fprintf(stderr,"offset %jd is beyond EOF\n",(intmax_t)offset);
 		return 0;
 	}
+	if (mdb->f->dirty) {
+		dirty_pg = g_hash_table_lookup(mdb->f->dirty, GUINT_TO_POINTER(pg));
+		if (!dirty_pg) {
+			dirty_pg = g_malloc(mdb->fmt->pg_size);
+			g_hash_table_insert(mdb->f->dirty, GUINT_TO_POINTER(pg), dirty_pg);
+		}
+		memcpy(dirty_pg, mdb->pg_buf, mdb->fmt->pg_size);
+		if (offset + mdb->fmt->pg_size > mdb->f->dirty_end)
+			mdb->f->dirty_end = offset + mdb->fmt->pg_size;
+		mdb_index_cache_invalidate(mdb, pg);
+		mdb->cur_pos = 0;
+		if (g_hash_table_size(mdb->f->dirty) >= MDB_WRITEBACK_PAGES
+		 && !mdb_write_back(mdb))
+			return 0;
+		return mdb->fmt->pg_size;
+	}
 	lseek(mdb->f->fd, offset, SEEK_SET);
 	len = write(mdb->f->fd,mdb->pg_buf,mdb->fmt->pg_size);
 	if (len==-1) {
@@ -93,6 +219,7 @@ mdb_write_pg(MdbHandle *mdb, unsigned long pg)
 	/* fprintf(stderr,"EOF reached %d bytes returned.\n",len, mdb->pg_size); */
 		return 0;
 	}
+	mdb_index_cache_invalidate(mdb, pg);
 	mdb->cur_pos = 0;
 	return len;
 }
@@ -284,6 +411,30 @@ mdb_pack_null_mask(unsigned char *buffer, int num_fields, MdbField *fields)
 	
 	return pos;
 }
+/*
+ * copy a variable length value to a Jet4 row.  Text given as plain UCS-2
+ * is stored compressed when its column is flagged for it and that makes
+ * it shorter; values already compressed are copied as they are.
+ */
+static int
+mdb_pack_var4(MdbTableDef *table, MdbField *field, unsigned char *dest)
+{
+	MdbColumn *col;
+	unsigned char *value = field->value;
+	size_t len;
+
+	if (!table->is_temp_table && field->colnum < (int) table->num_cols) {
+		col = g_ptr_array_index(table->columns, field->colnum);
+		if (col->col_type == MDB_TEXT && col->is_compressed
+		 && !(field->siz >= 2 && value[0] == 0xff && value[1] == 0xfe)) {
+			len = mdb_unicode_compress(field->value, field->siz, (char *) dest);
+			if (len)
+				return len;
+		}
+	}
+	memcpy(dest, field->value, field->siz);
+	return field->siz;
+}
 /* fields must be ordered with fixed columns first, then vars, subsorted by 
  * column number */
 static int
@@ -317,8 +468,7 @@ mdb_pack_row4(MdbTableDef *table, unsigned char *row_buffer, unsigned int num_fi
 			var_cols++;
 			fields[i].offset = pos;
 			if (! fields[i].is_null) {
-				memcpy(&row_buffer[pos], fields[i].value, fields[i].siz);
-				pos += fields[i].siz;
+				pos += mdb_pack_var4(table, &fields[i], &row_buffer[pos]);
 			}
 		}
 	}
@@ -570,6 +720,8 @@ mdb_insert_row(MdbTableDef *table, int num_fields, MdbField *fields)
 		fprintf(stderr, "Unable to allocate new page.\n");
 		return 0;
 	}
+	if (!mdb_read_pg(mdb, pgnum))
+		return 0;
 
 	rownum = mdb_add_row_to_pg(table, row_buffer, new_row_size);
 
@@ -582,6 +734,7 @@ mdb_insert_row(MdbTableDef *table, int num_fields, MdbField *fields)
 		fprintf(stderr, "write failed!\n");
 		return 0;
 	}
+	mdb_map_set_freespace(table, pgnum, mdb_pg_get_freespace(mdb));
 
 	mdb_update_indexes(table, num_fields, fields, pgnum, rownum);
  
@@ -653,179 +806,2631 @@ mdb_add_row_to_pg(MdbTableDef *table, unsigned char *row_buffer, int new_row_siz
 
 	return num_rows;
 }
-int 
-mdb_update_row(MdbTableDef *table)
+/*
+ * Index rebuild.  The keys of every row are encoded and sorted, in runs
+ * spilled to temporary files when they don't fit in memory, and written
+ * out as full leaf pages.  The last entry of each page then goes up a
+ * level to build the interior pages the same way, until a single root is
+ * left.
+ */
+#define MDB_SORT_MEM (32 * 1024 * 1024)
+#define MDB_MAX_INDEX_ENTRY (MDB_MAX_INDEX_KEY + 8)
+
+/* pages reserved for the tree at once */
+#define MDB_INDEX_EXTENT 32
+
+typedef struct {
+	FILE *f;
+	guint16 len;	/* of the current entry, 0 when exhausted */
+	unsigned char buf[MDB_MAX_INDEX_ENTRY];
+} MdbSortRun;
+
+typedef struct {
+	unsigned char *arena;	/* entries, each preceded by its guint16 length */
+	size_t used;
+	GArray *recs;		/* guint32 offsets of the entries in arena */
+	unsigned int pos;
+	GPtrArray *runs;	/* spilled runs, if any */
+	unsigned char out[MDB_MAX_INDEX_ENTRY];
+} MdbKeySorter;
+
+typedef struct {
+	MdbTableDef *table;
+	unsigned char pg_type;
+	int ptr_len;
+	/* entries of the page being filled, not compressed yet */
+	GByteArray *ents;
+	GArray *starts;
+	int first_key_len;
+	int pref_len;
+	size_t sum_len;
+	guint32 cur_pg;
+	guint32 prev_pg;
+	unsigned int num_pgs;
+	/* entries for the level above */
+	FILE *up;
+	/* pages allocated and not used yet */
+	guint32 free_pg;
+	guint32 num_free;
+	GArray *new_pgs;
+	/* set to check the leaves of a unique index for equal keys */
+	MdbIndex *unique;
+	unsigned char last[MDB_MAX_INDEX_ENTRY];
+	int last_len;
+} MdbIndexBuilder;
+
+static gint
+mdb_sort_cmp(gconstpointer a, gconstpointer b, gpointer arena)
 {
-int row_start, row_end;
-unsigned int i;
-MdbColumn *col;
-MdbCatalogEntry *entry = table->entry;
-MdbHandle *mdb = entry->mdb;
-MdbField fields[256];
-unsigned char row_buffer[4096];
-	size_t old_row_size, new_row_size;
-unsigned int num_fields;
-
-	if (!mdb->f->writable) {
-		fprintf(stderr, "File is not open for writing\n");
+	unsigned char *ra = (unsigned char *) arena + *(guint32 *) a;
+	unsigned char *rb = (unsigned char *) arena + *(guint32 *) b;
+	guint16 la, lb;
+	int r;
+
+	memcpy(&la, ra, 2);
+	memcpy(&lb, rb, 2);
+	r = memcmp(ra + 2, rb + 2, MIN(la, lb));
+	return r ? r : la - lb;
+}
+static void
+mdb_sort_read_run(MdbSortRun *run)
+{
+	if (fread(&run->len, 2, 1, run->f) != 1
+	 || run->len > MDB_MAX_INDEX_ENTRY
+	 || fread(run->buf, run->len, 1, run->f) != 1)
+		run->len = 0;
+}
+/* write out the entries in memory as a sorted run */
+static int
+mdb_sort_spill(MdbKeySorter *sorter)
+{
+	MdbSortRun *run;
+	unsigned int i;
+	guint32 off;
+	guint16 len;
+
+	g_qsort_with_data(sorter->recs->data, sorter->recs->len,
+		sizeof(guint32), mdb_sort_cmp, sorter->arena);
+	run = g_malloc0(sizeof(MdbSortRun));
+	if (!(run->f = tmpfile())) {
+		fprintf(stderr, "Unable to create a temporary file for sorting\n");
+		g_free(run);
 		return 0;
 	}
-	mdb_find_row(mdb, table->cur_row-1, &row_start, &old_row_size);
-	row_end = row_start + old_row_size - 1;
-
-	row_start &= 0x0FFF; /* remove flags */
-
-	mdb_debug(MDB_DEBUG_WRITE,"page %lu row %d start %d end %d", (unsigned long) table->cur_phys_pg, table->cur_row-1, row_start, row_end);
-	if (mdb_get_option(MDB_DEBUG_LIKE))
-		mdb_buffer_dump(mdb->pg_buf, row_start, old_row_size);
-
-	for (i=0;i<table->num_cols;i++) {
-		col = g_ptr_array_index(table->columns,i);
-		if (col->bind_ptr && mdb_is_col_indexed(table,i)) {
-			fprintf(stderr, "Attempting to update column that is part of an index\n");
+	for (i = 0; i < sorter->recs->len; i++) {
+		off = g_array_index(sorter->recs, guint32, i);
+		memcpy(&len, sorter->arena + off, 2);
+		if (fwrite(sorter->arena + off, len + 2, 1, run->f) != 1) {
+			fprintf(stderr, "Unable to write a temporary file for sorting\n");
+			fclose(run->f);
+			g_free(run);
 			return 0;
 		}
 	}
-	num_fields = mdb_crack_row(table, row_start, row_end, fields);
+	rewind(run->f);
+	g_ptr_array_add(sorter->runs, run);
+	g_array_set_size(sorter->recs, 0);
+	sorter->used = 0;
+	return 1;
+}
+static int
+mdb_sort_add(MdbKeySorter *sorter, unsigned char *ent, guint16 len)
+{
+	guint32 off;
 
-	if (mdb_get_option(MDB_DEBUG_WRITE)) {
-		for (i=0;i<num_fields;i++) {
-			//printf("col %d %d start %d siz %d fixed 5d\n", i, fields[i].colnum, fields[i].start, fields[i].siz, fields[i].is_fixed);
-		}
+	if (sorter->used + len + 2 > MDB_SORT_MEM && !mdb_sort_spill(sorter))
+		return 0;
+	off = sorter->used;
+	memcpy(sorter->arena + off, &len, 2);
+	memcpy(sorter->arena + off + 2, ent, len);
+	sorter->used += len + 2;
+	g_array_append_val(sorter->recs, off);
+	return 1;
+}
+/* done adding, sort what is in memory or get ready to merge the runs */
+static int
+mdb_sort_finish(MdbKeySorter *sorter)
+{
+	unsigned int i;
+
+	if (!sorter->runs->len) {
+		g_qsort_with_data(sorter->recs->data, sorter->recs->len,
+			sizeof(guint32), mdb_sort_cmp, sorter->arena);
+		return 1;
 	}
-	for (i=0;i<table->num_cols;i++) {
-		col = g_ptr_array_index(table->columns,i);
-		if (col->bind_ptr) {
-			fields[i].value = col->bind_ptr;
-			fields[i].siz = *(col->len_ptr);
+	if (sorter->recs->len && !mdb_sort_spill(sorter))
+		return 0;
+	for (i = 0; i < sorter->runs->len; i++)
+		mdb_sort_read_run(g_ptr_array_index(sorter->runs, i));
+	return 1;
+}
+/* next entry in order, valid until the next call.  Returns its length,
+ * 0 at the end */
+static int
+mdb_sort_next(MdbKeySorter *sorter, unsigned char **ent)
+{
+	MdbSortRun *run, *min = NULL;
+	unsigned int i;
+	guint16 len;
+	int r;
+
+	if (!sorter->runs->len) {
+		if (sorter->pos >= sorter->recs->len)
+			return 0;
+		*ent = sorter->arena + g_array_index(sorter->recs, guint32, sorter->pos++);
+		memcpy(&len, *ent, 2);
+		*ent += 2;
+		return len;
+	}
+	for (i = 0; i < sorter->runs->len; i++) {
+		run = g_ptr_array_index(sorter->runs, i);
+		if (!run->len)
+			continue;
+		if (min) {
+			r = memcmp(run->buf, min->buf, MIN(run->len, min->len));
+			if (r > 0 || (!r && run->len >= min->len))
+				continue;
 		}
+		min = run;
 	}
-
-	new_row_size = mdb_pack_row(table, row_buffer, num_fields, fields);
-	if (mdb_get_option(MDB_DEBUG_WRITE)) 
-		mdb_buffer_dump(row_buffer, 0, new_row_size);
-	if (new_row_size > (old_row_size + mdb_pg_get_freespace(mdb))) {
-		fprintf(stderr, "No space left on this page, update will not occur\n");
+	if (!min)
 		return 0;
-	}
-	/* do it! */
-	mdb_replace_row(table, table->cur_row-1, row_buffer, new_row_size);
-	return 0; /* FIXME */
+	len = min->len;
+	memcpy(sorter->out, min->buf, len);
+	mdb_sort_read_run(min);
+	*ent = sorter->out;
+	return len;
 }
+static void
+mdb_sort_init(MdbKeySorter *sorter, int in_memory)
+{
+	memset(sorter, 0, sizeof(MdbKeySorter));
+	if (in_memory)
+		sorter->arena = g_malloc(MDB_SORT_MEM);
+	sorter->recs = g_array_new(FALSE, FALSE, sizeof(guint32));
+	sorter->runs = g_ptr_array_new();
+}
+static void
+mdb_sort_free(MdbKeySorter *sorter)
+{
+	MdbSortRun *run;
+	unsigned int i;
 
-/* WARNING the return code is opposite to convention used elsewhere:
- * returns 0 on success
- * returns 1 on failure
- * This might change on next ABI break.
+	for (i = 0; i < sorter->runs->len; i++) {
+		run = g_ptr_array_index(sorter->runs, i);
+		fclose(run->f);
+		g_free(run);
+	}
+	g_ptr_array_free(sorter->runs, TRUE);
+	g_array_free(sorter->recs, TRUE);
+	g_free(sorter->arena);
+}
+/*
+ * the leaf entry of a row: the keys of its fields, as cracked by
+ * mdb_crack_row(), followed by its page and row number.  Returns its
+ * length.
  */
-int 
-mdb_replace_row(MdbTableDef *table, int row, void *new_row, int new_row_size)
+static int
+mdb_index_row_entry(MdbTableDef *table, MdbIndex *idx, MdbField *fields, guint32 pg_row, unsigned char *ent)
 {
-MdbCatalogEntry *entry = table->entry;
-MdbHandle *mdb = entry->mdb;
-int pg_size = mdb->fmt->pg_size;
-int rco = mdb->fmt->row_count_offset;
-	void *new_pg;
-guint16 num_rows;
-	int row_start;
-	size_t row_size;
-int i, pos;
+	MdbHandle *mdb = table->entry->mdb;
+	MdbField field;
+	MdbColumn *col;
+	unsigned char key[MDB_MAX_INDEX_KEY + 1];
+	char text[256];
+	int len = 0, key_len;
+	unsigned int i;
 
-	if (mdb_get_option(MDB_DEBUG_WRITE)) {
-		mdb_buffer_dump(mdb->pg_buf, 0, 40);
-		mdb_buffer_dump(mdb->pg_buf, pg_size - 160, 160);
+	for (i = 0; i < idx->num_keys; i++) {
+		col = g_ptr_array_index(table->columns, idx->key_col_num[i]-1);
+		field = fields[idx->key_col_num[i]-1];
+		if (col->col_type == MDB_TEXT && !field.is_null) {
+			mdb_unicode2ascii(mdb, field.value, field.siz, text, sizeof(text));
+			field.value = text;
+			field.siz = strlen(text);
+		}
+		key_len = mdb_index_encode_key(col, idx->key_col_order[i], &field, key);
+		if (len + key_len > MDB_MAX_INDEX_KEY)
+			key_len = MDB_MAX_INDEX_KEY - len;
+		memcpy(ent + len, key, key_len);
+		len += key_len;
 	}
-	mdb_debug(MDB_DEBUG_WRITE,"updating row %d on page %lu", row, (unsigned long) table->cur_phys_pg);
-	new_pg = mdb_new_data_pg(entry);
-
-	num_rows = mdb_get_int16(mdb->pg_buf, rco);
-	mdb_put_int16(new_pg, rco, num_rows);
-
-	pos = pg_size;
+	mdb_put_int32_msb(ent, len, pg_row);
+	return len + 4;
+}
+/*
+ * encode the key of every row of the table and add it, followed by the
+ * row's page and row number, to the sorter.
+ */
+static int
+mdb_index_extract_keys(MdbTableDef *table, MdbIndex *idx, MdbKeySorter *sorter, guint32 *num_keys)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	MdbFormatConstants *fmt = mdb->fmt;
+	MdbField fields[256];
+	unsigned char ent[MDB_MAX_INDEX_ENTRY];
+	gint32 pg = 0;
+	int rows, row, row_start, len;
+	size_t row_size;
 
-	/* rows before */
-	for (i=0;i<row;i++) {
-		mdb_find_row(mdb, i, &row_start, &row_size);
-		pos -= row_size;
-		memcpy((char*)new_pg + pos, mdb->pg_buf + row_start, row_size);
-		mdb_put_int16(new_pg, rco + 2 + i*2, pos);
-	}
-	
-	/* our row */
-	pos -= new_row_size;
-	memcpy((char*)new_pg + pos, new_row, new_row_size);
-	mdb_put_int16(new_pg, rco + 2 + row*2, pos);
-	
-	/* rows after */
-	for (i=row+1;i<num_rows;i++) {
-		mdb_find_row(mdb, i, &row_start, &row_size);
-		pos -= row_size;
-		memcpy((char*)new_pg + pos, mdb->pg_buf + row_start, row_size);
-		mdb_put_int16(new_pg, rco + 2 + i*2, pos);
+	*num_keys = 0;
+	while ((pg = mdb_map_find_next(mdb, table->usage_map, table->map_sz, pg)) > 0) {
+		if (!mdb_read_pg(mdb, pg))
+			return 0;
+		if (mdb->pg_buf[0] != MDB_PAGE_DATA
+		 || mdb_get_int32(mdb->pg_buf, 4) != table->entry->table_pg)
+			continue;
+		rows = mdb_get_int16(mdb->pg_buf, fmt->row_count_offset);
+		for (row = 0; row < rows; row++) {
+			mdb_find_row(mdb, row, &row_start, &row_size);
+			/* deleted */
+			if (row_start & 0x4000)
+				continue;
+			row_start &= 0x1fff;
+			mdb_crack_row(table, row_start, row_start + row_size - 1, fields);
+			len = mdb_index_row_entry(table, idx, fields, (pg << 8) | row, ent);
+			if (!mdb_sort_add(sorter, ent, len))
+				return 0;
+			(*num_keys)++;
+		}
 	}
+	return pg == 0;
+}
+/* a page for the tree, taken from the pages allocated ahead */
+static guint32
+mdb_index_builder_pg(MdbIndexBuilder *b)
+{
+	MdbHandle *mdb = b->table->entry->mdb;
+	guint32 pg;
 
-	/* almost done, copy page over current */
-	memcpy(mdb->pg_buf, new_pg, pg_size);
-
-	g_free(new_pg);
-
-	mdb_put_int16(mdb->pg_buf, 2, mdb_pg_get_freespace(mdb));
-	if (mdb_get_option(MDB_DEBUG_WRITE)) {
-		mdb_buffer_dump(mdb->pg_buf, 0, 40);
-		mdb_buffer_dump(mdb->pg_buf, pg_size - 160, 160);
+	if (!b->num_free) {
+		if (!(b->free_pg = mdb_map_alloc_pages(mdb, MDB_INDEX_EXTENT)))
+			return 0;
+		b->num_free = MDB_INDEX_EXTENT;
 	}
-	/* drum roll, please */
-	if (!mdb_write_pg(mdb, table->cur_phys_pg)) {
-		fprintf(stderr, "write failed!\n");
-		return 1;
+	pg = b->free_pg++;
+	b->num_free--;
+	g_array_append_val(b->new_pgs, pg);
+	return pg;
+}
+/*
+ * lay out an index page in the handle's buffer from its n entries, back
+ * to back in ents at the offsets in starts
+ */
+static void
+mdb_index_pack_page(MdbTableDef *table, unsigned char pg_type, guint32 prev_pg, guint32 next_pg, unsigned char *ents, guint32 *starts, unsigned int n, int pref_len)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	MdbFormatConstants *fmt = mdb->fmt;
+	guint16 idx_starts[MDB_PGSIZE];
+	unsigned int i;
+	int pos, len, skip;
+
+	memset(mdb->pg_buf, 0, fmt->pg_size);
+	mdb->pg_buf[0] = pg_type;
+	mdb->pg_buf[1] = 0x01;
+	mdb_put_int32(mdb->pg_buf, 4, table->entry->table_pg);
+	mdb_put_int32(mdb->pg_buf, fmt->idx_next_pg_offset - 4, prev_pg);
+	mdb_put_int32(mdb->pg_buf, fmt->idx_next_pg_offset, next_pg);
+	mdb_put_int16(mdb->pg_buf, fmt->idx_pref_len_offset, pref_len);
+
+	/* later entries drop the prefix they share with the first one */
+	pos = fmt->idx_entries_offset;
+	for (i = 0; i < n; i++) {
+		len = starts[i+1] - starts[i];
+		skip = i ? pref_len : 0;
+		idx_starts[i] = pos;
+		memcpy(mdb->pg_buf + pos, ents + starts[i] + skip, len - skip);
+		pos += len - skip;
 	}
-	return 0;
+	idx_starts[n] = pos;
+	idx_starts[n+1] = 0;
+	mdb_index_pack_bitmap(mdb, idx_starts);
+	mdb_put_int16(mdb->pg_buf, 2, fmt->pg_size - pos);
 }
+/*
+ * write the page being filled, linked to the next one unless it is the
+ * last of its level, and pass its last entry up.
+ */
 static int
-mdb_add_row_to_leaf_pg(MdbTableDef *table, MdbIndex *idx, MdbIndexPage *ipg, MdbField *idx_fields, guint32 pgnum, guint16 rownum) 
-/*,  guint32 pgnum, guint16 rownum) 
-static int
-mdb_copy_index_pg(MdbTableDef *table, MdbIndex *idx, MdbIndexPage *ipg)
-*/
+mdb_index_builder_flush(MdbIndexBuilder *b, int last)
 {
-	MdbCatalogEntry *entry = table->entry;
-	MdbHandle *mdb = entry->mdb;
-	MdbColumn *col;
-	guint32 pg_row;
-	guint16 row = 0;
-	void *new_pg;
-	unsigned char key_hash[256];
-	int keycol;
-
-	new_pg = mdb_new_leaf_pg(entry);
+	MdbHandle *mdb = b->table->entry->mdb;
+	guint32 *starts = (guint32 *) b->starts->data;
+	guint32 next_pg = 0;
+	unsigned char *ent;
+	unsigned int n = b->starts->len - 1;
+	int len, pref_len = (n > 1) ? b->pref_len : 0;
+	guint16 up_len;
+	unsigned char up[MDB_MAX_INDEX_ENTRY];
+
+	if (!last && !(next_pg = mdb_index_builder_pg(b)))
+		return 0;
 
-	/* reinitial ipg pointers to start of page */
-	mdb_index_page_reset(ipg);
-	mdb_read_pg(mdb, ipg->pg);
+	mdb_index_pack_page(b->table, b->pg_type, b->prev_pg, next_pg,
+		b->ents->data, starts, n, pref_len);
 
-	/* do we support this index type yet? */
-	if (idx->num_keys > 1) {
-		fprintf(stderr,"multikey indexes not yet supported, aborting\n");
-		return 0;
-	}
-	keycol = idx->key_col_num[0];
-	col = g_ptr_array_index (table->columns, keycol - 1);
-	if (!col->is_fixed) {
-		fprintf(stderr,"variable length key columns not yet supported, aborting\n");
+	mdb->cur_pg = b->cur_pg;
+	if (!mdb_write_pg(mdb, b->cur_pg)) {
+		fprintf(stderr, "write failed!\n");
 		return 0;
 	}
 
-	while (mdb_index_find_next_on_page(mdb, ipg)) {
-
-		/* check for compressed indexes.  */
-		if (ipg->len < col->col_size + 1) {
-			fprintf(stderr,"compressed indexes not yet supported, aborting\n");
+	/* the level above gets the key and row of the last entry and the
+	 * page holding it */
+	if (n) {
+		ent = b->ents->data + starts[n-1];
+		len = starts[n] - starts[n-1] - (b->ptr_len - 4);
+		memcpy(up, ent, len);
+		mdb_put_int32_msb(up, len, b->cur_pg);
+		up_len = len + 4;
+		if (fwrite(&up_len, 2, 1, b->up) != 1
+		 || fwrite(up, up_len, 1, b->up) != 1) {
+			fprintf(stderr, "Unable to write a temporary file for sorting\n");
 			return 0;
 		}
+	}
 
-		pg_row = mdb_get_int32_msb(mdb->pg_buf, ipg->offset + ipg->len - 4);
+	b->num_pgs++;
+	b->prev_pg = b->cur_pg;
+	b->cur_pg = next_pg;
+	g_byte_array_set_size(b->ents, 0);
+	g_array_set_size(b->starts, 1);
+	b->sum_len = 0;
+	b->pref_len = 0;
+	return 1;
+}
+static int
+mdb_index_builder_add(MdbIndexBuilder *b, unsigned char *ent, int len)
+{
+	MdbFormatConstants *fmt = b->table->entry->mdb->fmt;
+	unsigned int n = b->starts->len - 1;
+	int key_len = len - b->ptr_len;
+	int pref_len = b->pref_len, common;
+	guint32 end;
+
+	if (n) {
+		/* the prefix shared by all the keys on the page */
+		common = 0;
+		while (common < key_len && common < b->first_key_len
+		 && b->ents->data[common] == ent[common])
+			common++;
+		if (n == 1 || common < pref_len)
+			pref_len = common;
+		if (b->sum_len + len - n * pref_len
+				> (size_t) (fmt->pg_size - fmt->idx_entries_offset)) {
+			if (!mdb_index_builder_flush(b, 0))
+				return 0;
+			n = 0;
+		}
+	}
+	if (!n) {
+		b->first_key_len = key_len;
+		pref_len = 0;
+	}
+	g_byte_array_append(b->ents, ent, len);
+	end = b->ents->len;
+	g_array_append_val(b->starts, end);
+	b->sum_len += len;
+	b->pref_len = pref_len;
+	return 1;
+}
+/*
+ * whether two leaf entries have the same key.  Keys with all their
+ * columns NULL, a flag byte each, are not duplicates of each other.
+ */
+static int
+mdb_index_same_key(MdbIndex *idx, unsigned char *a, int a_len, unsigned char *b, int b_len)
+{
+	return a_len == b_len && a_len - 4 > (int) idx->num_keys
+	 && !memcmp(a, b, a_len - 4);
+}
+/*
+ * write one level of the tree from the entries of the sorter, checking
+ * the leaves of a unique index for equal keys.  Returns the number of
+ * pages written, 0 on error.
+ */
+static unsigned int
+mdb_index_build_level(MdbIndexBuilder *b, MdbKeySorter *sorter, unsigned char pg_type)
+{
+	unsigned char *ent;
+	guint32 start = 0;
+	int len;
+
+	b->pg_type = pg_type;
+	b->ptr_len = (pg_type == MDB_PAGE_LEAF) ? 4 : 8;
+	b->num_pgs = 0;
+	b->prev_pg = 0;
+	g_byte_array_set_size(b->ents, 0);
+	g_array_set_size(b->starts, 0);
+	g_array_append_val(b->starts, start);
+	b->sum_len = 0;
+	b->pref_len = 0;
+	if (!(b->up = tmpfile())) {
+		fprintf(stderr, "Unable to create a temporary file for sorting\n");
+		return 0;
+	}
+	if (!(b->cur_pg = mdb_index_builder_pg(b)))
+		return 0;
+
+	b->last_len = 0;
+	while ((len = mdb_sort_next(sorter, &ent))) {
+		if (b->unique && pg_type == MDB_PAGE_LEAF) {
+			if (mdb_index_same_key(b->unique, ent, len, b->last, b->last_len)) {
+				fprintf(stderr, "Unique index %s has rows with equal keys\n", b->unique->name);
+				return 0;
+			}
+			memcpy(b->last, ent, len);
+			b->last_len = len;
+		}
+		if (!mdb_index_builder_add(b, ent, len))
+			return 0;
+	}
+	if (!mdb_index_builder_flush(b, 1))
+		return 0;
+	rewind(b->up);
+	return b->num_pgs;
+}
+/*
+ * look for rows with equal keys in idx, which doesn't need a tree.
+ * Returns 1 if there are, 0 if not and -1 on error.
+ */
+static int
+mdb_index_find_duplicates(MdbTableDef *table, MdbIndex *idx)
+{
+	MdbKeySorter sorter;
+	unsigned char last[MDB_MAX_INDEX_ENTRY], *ent;
+	guint32 num_keys;
+	int len, last_len = 0, ret = -1;
+
+	mdb_sort_init(&sorter, 1);
+	if (!mdb_index_extract_keys(table, idx, &sorter, &num_keys)
+	 || !mdb_sort_finish(&sorter))
+		goto out;
+	ret = 0;
+	while ((len = mdb_sort_next(&sorter, &ent))) {
+		if (mdb_index_same_key(idx, ent, len, last, last_len)) {
+			ret = 1;
+			break;
+		}
+		memcpy(last, ent, len);
+		last_len = len;
+	}
+out:
+	mdb_sort_free(&sorter);
+	return ret;
+}
+/* the pages of an index tree, leaves missing from the upper levels
+ * included */
+static void
+mdb_index_tree_pages(MdbHandle *mdb, guint32 pg, GHashTable *seen, GArray *pgs)
+{
+	MdbDecodedPage *dpg;
+	guint32 *children, next_pg;
+	unsigned int i, num_children;
+
+	while (pg && !g_hash_table_lookup(seen, GUINT_TO_POINTER(pg))) {
+		if (!(dpg = mdb_index_read_page(mdb, pg)))
+			return;
+		g_hash_table_insert(seen, GUINT_TO_POINTER(pg), GUINT_TO_POINTER(1));
+		g_array_append_val(pgs, pg);
+		next_pg = dpg->next_pg;
+		if (dpg->child_pgs) {
+			/* the decoded page doesn't survive the reads below */
+			num_children = dpg->num_entries;
+			children = g_memdup(dpg->child_pgs, num_children * sizeof(guint32));
+			for (i = 0; i < num_children; i++)
+				mdb_index_tree_pages(mdb, children[i], seen, pgs);
+			g_free(children);
+		}
+		pg = next_pg;
+	}
+}
+/*
+ * text keys are only encoded with the Jet3 sort order (see
+ * mdb_index_hash_text()).  Keys built that way in a Jet4 database would
+ * not be the ones Access looks for, so such indexes are left alone and
+ * marked stale with mdb_index_mark_stale().
+ */
+static int
+mdb_index_keys_encodable(MdbTableDef *table, MdbIndex *idx)
+{
+	MdbColumn *col;
+	unsigned int i;
+
+	if (IS_JET3(table->entry->mdb))
+		return 1;
+	for (i = 0; i < idx->num_keys; i++) {
+		col = g_ptr_array_index(table->columns, idx->key_col_num[i]-1);
+		if (col->col_type == MDB_TEXT)
+			return 0;
+	}
+	return 1;
+}
+/*
+ * an index whose keys can't be written is left as it was, pointing at
+ * rows that may have changed or moved.  Access rebuilds it when the
+ * database is compacted and repaired.
+ */
+static void
+mdb_index_mark_stale(MdbTableDef *table, MdbIndex *idx)
+{
+	if (!idx->stale)
+		fprintf(stderr, "Warning: index %s of table %s has text keys, which can't be written in Jet4 databases.  "
+			"It is out of date until the database is compacted and repaired in Access.\n",
+			idx->name, table->name);
+	idx->stale = 1;
+}
+/**
+ * mdb_index_rebuild:
+ * @table: Table of the index, with its columns and indexes read
+ * @idx: Index to rebuild
+ *
+ * Writes a new tree for @idx from the rows of @table, with full pages, and
+ * points the table definition at it.  The pages of the old tree are given
+ * back to the database.  Much faster than adding rows to an index one at a
+ * time, which is what bulk inserts use it for.  A unique index fails if
+ * rows have equal keys, leaving the old tree in place.
+ *
+ * Return value: 1 on success, 0 on error.
+ */
+int
+mdb_index_rebuild(MdbTableDef *table, MdbIndex *idx)
+{
+	MdbCatalogEntry *entry = table->entry;
+	MdbHandle *mdb = entry->mdb;
+	MdbFormatConstants *fmt = mdb->fmt;
+	MdbKeySorter sorter, up_sorter;
+	MdbIndexBuilder b;
+	MdbColumn *col;
+	GArray *old_pgs, *unused_pgs;
+	GHashTable *seen;
+	guint32 num_keys, root = 0, i;
+	unsigned char pg_type = MDB_PAGE_LEAF;
+	unsigned int num_pgs;
+	int ret = 0;
+
+	if (!mdb->f->writable) {
+		fprintf(stderr, "File is not open for writing\n");
+		return 0;
+	}
+	if (!idx->num_keys) {
+		fprintf(stderr, "Index %s has no key columns\n", idx->name);
+		return 0;
+	}
+	if (!idx->first_pg_tdef_pg) {
+		fprintf(stderr, "Can't update the definition of index %s\n", idx->name);
+		return 0;
+	}
+	for (i = 0; i < idx->num_keys; i++) {
+		col = g_ptr_array_index(table->columns, idx->key_col_num[i]-1);
+		if (mdb_index_key_size(col) < 0) {
+			fprintf(stderr, "Can't index column %s of type %s\n",
+				col->name, mdb_get_colbacktype_string(col));
+			return 0;
+		}
+	}
+	if (!mdb_index_keys_encodable(table, idx)) {
+		fprintf(stderr, "Index %s has text keys, which can't be written in Jet4 databases\n", idx->name);
+		return 0;
+	}
+
+	/* the old tree, to give its pages back at the end */
+	old_pgs = g_array_new(FALSE, FALSE, sizeof(guint32));
+	seen = g_hash_table_new(g_direct_hash, g_direct_equal);
+	mdb_index_tree_pages(mdb, idx->first_pg, seen, old_pgs);
+	g_hash_table_destroy(seen);
+
+	memset(&b, 0, sizeof(b));
+	b.table = table;
+	b.ents = g_byte_array_new();
+	b.starts = g_array_new(FALSE, FALSE, sizeof(guint32));
+	b.new_pgs = g_array_new(FALSE, FALSE, sizeof(guint32));
+	if (idx->flags & MDB_IDX_UNIQUE)
+		b.unique = idx;
+
+	mdb_sort_init(&sorter, 1);
+	if (!mdb_index_extract_keys(table, idx, &sorter, &num_keys)
+	 || !mdb_sort_finish(&sorter)) {
+		mdb_sort_free(&sorter);
+		goto out;
+	}
+
+	/* leaves, then interior levels until a level fits in one page */
+	num_pgs = mdb_index_build_level(&b, &sorter, pg_type);
+	mdb_sort_free(&sorter);
+	while (num_pgs > 1) {
+		mdb_sort_init(&up_sorter, 0);
+		g_ptr_array_add(up_sorter.runs, g_malloc0(sizeof(MdbSortRun)));
+		((MdbSortRun *) g_ptr_array_index(up_sorter.runs, 0))->f = b.up;
+		b.up = NULL;
+		mdb_sort_finish(&up_sorter);
+		pg_type = MDB_PAGE_INDEX;
+		num_pgs = mdb_index_build_level(&b, &up_sorter, pg_type);
+		mdb_sort_free(&up_sorter);
+	}
+	if (!num_pgs)
+		goto out;
+	root = b.prev_pg;
+
+	/* point the table definition at the new tree */
+	if (!mdb_read_pg(mdb, idx->first_pg_tdef_pg))
+		goto out;
+	mdb_put_int32(mdb->pg_buf, idx->first_pg_tdef_pos, root);
+	if (!mdb_write_pg(mdb, idx->first_pg_tdef_pg))
+		goto out;
+	if (!mdb_read_pg(mdb, entry->table_pg))
+		goto out;
+	mdb_put_int32(mdb->pg_buf, fmt->tab_cols_start_offset +
+		idx->index_num * fmt->tab_ridx_entry_size, num_keys);
+	if (!mdb_write_pg(mdb, entry->table_pg))
+		goto out;
+	idx->first_pg = root;
+	idx->num_rows = num_keys;
+
+	/* the index's own map of its pages */
+	unused_pgs = g_array_new(FALSE, FALSE, sizeof(guint32));
+	for (i = 0; i < b.num_free; i++) {
+		guint32 pg = b.free_pg + i;
+		g_array_append_val(unused_pgs, pg);
+	}
+	ret = mdb_map_set_pages(mdb, idx->usage_map_pg_row, old_pgs, 0)
+	 && mdb_map_set_pages(mdb, idx->usage_map_pg_row, b.new_pgs, 1)
+	 && mdb_map_free_pages(mdb, old_pgs)
+	 && mdb_map_free_pages(mdb, unused_pgs);
+	g_array_free(unused_pgs, TRUE);
+	b.num_free = 0;
+
+out:
+	/* a tree the table doesn't point at gives its pages back */
+	if (!ret && idx->first_pg != root) {
+		for (i = 0; i < b.num_free; i++) {
+			guint32 pg = b.free_pg + i;
+			g_array_append_val(b.new_pgs, pg);
+		}
+		mdb_map_free_pages(mdb, b.new_pgs);
+	}
+	if (b.up)
+		fclose(b.up);
+	g_byte_array_free(b.ents, TRUE);
+	g_array_free(b.starts, TRUE);
+	g_array_free(b.new_pgs, TRUE);
+	g_array_free(old_pgs, TRUE);
+	if (!ret)
+		fprintf(stderr, "Rebuilding index %s failed\n", idx->name);
+	return ret;
+}
+/*
+ * Index maintenance.  Rather than rebuilding a whole index for a few
+ * changed rows, their entries are taken out of and put into the leaf
+ * pages they belong to, rewriting each page touched once per entry.
+ * Interior entries hold the last entry of their subtree, so they follow
+ * when a leaf's last entry changes.  A page that overflows is split in
+ * two and the new page added to its parent, up to a new root.  Anything
+ * else, such as a leaf left empty or one of the leaves Access leaves out
+ * of the upper levels, is reported so the caller can rebuild the index.
+ */
+typedef struct {
+	guint32 pg;
+	unsigned char pg_type;
+	guint32 prev_pg;
+	guint32 next_pg;
+	GByteArray *ents;	/* whole entries, pointers included */
+	GArray *starts;		/* guint32 offsets in ents, plus the end */
+} MdbIndexNode;
+
+typedef struct {
+	MdbTableDef *table;
+	MdbIndex *idx;
+	unsigned int depth;	/* levels above the leaf */
+	guint32 pgs[MDB_MAX_INDEX_DEPTH];
+	unsigned int pos[MDB_MAX_INDEX_DEPTH];	/* of the child taken */
+} MdbIndexPath;
+
+#define mdb_index_node_count(node) ((node)->starts->len - 1)
+#define mdb_index_node_start(node, i) g_array_index((node)->starts, guint32, i)
+
+static int
+mdb_index_ent_cmp(const unsigned char *a, int alen, const unsigned char *b, int blen)
+{
+	int r = memcmp(a, b, MIN(alen, blen));
+
+	return r ? r : alen - blen;
+}
+static void
+mdb_index_node_free(MdbIndexNode *node)
+{
+	g_byte_array_free(node->ents, TRUE);
+	g_array_free(node->starts, TRUE);
+}
+static void
+mdb_index_node_init(MdbIndexNode *node, guint32 pg, unsigned char pg_type)
+{
+	guint32 end = 0;
+
+	node->pg = pg;
+	node->pg_type = pg_type;
+	node->prev_pg = node->next_pg = 0;
+	node->ents = g_byte_array_new();
+	node->starts = g_array_new(FALSE, FALSE, sizeof(guint32));
+	g_array_append_val(node->starts, end);
+}
+static void
+mdb_index_node_insert(MdbIndexNode *node, unsigned int i, unsigned char *ent, int len)
+{
+	guint32 at = mdb_index_node_start(node, i);
+	guint32 *starts;
+	unsigned int j;
+
+	g_byte_array_set_size(node->ents, node->ents->len + len);
+	memmove(node->ents->data + at + len, node->ents->data + at,
+		node->ents->len - len - at);
+	memcpy(node->ents->data + at, ent, len);
+	g_array_insert_val(node->starts, i, at);
+	starts = (guint32 *) node->starts->data;
+	for (j = i + 1; j < node->starts->len; j++)
+		starts[j] += len;
+}
+static void
+mdb_index_node_remove(MdbIndexNode *node, unsigned int i)
+{
+	guint32 at = mdb_index_node_start(node, i);
+	guint32 len = mdb_index_node_start(node, i + 1) - at;
+	guint32 *starts;
+	unsigned int j;
+
+	g_byte_array_remove_range(node->ents, at, len);
+	g_array_remove_index(node->starts, i);
+	starts = (guint32 *) node->starts->data;
+	for (j = i; j < node->starts->len; j++)
+		starts[j] -= len;
+}
+/*
+ * read an index page as a list of whole entries.  Returns 0 if pg is not
+ * an index page.
+ */
+static int
+mdb_index_node_read(MdbHandle *mdb, guint32 pg, MdbIndexNode *node)
+{
+	MdbDecodedPage *dpg;
+	unsigned char ptrs[8];
+	unsigned int i;
+	guint32 end;
+
+	if (!(dpg = mdb_index_read_page(mdb, pg)))
+		return 0;
+	mdb_index_node_init(node, pg, dpg->pg_type);
+	node->next_pg = dpg->next_pg;
+	for (i = 0; i < dpg->num_entries; i++) {
+		g_byte_array_append(node->ents, dpg->keys + dpg->key_starts[i],
+			dpg->key_starts[i+1] - dpg->key_starts[i]);
+		mdb_put_int32_msb(ptrs, 0, dpg->pg_rows[i]);
+		if (dpg->child_pgs)
+			mdb_put_int32_msb(ptrs, 4, dpg->child_pgs[i]);
+		g_byte_array_append(node->ents, ptrs, dpg->child_pgs ? 8 : 4);
+		end = node->ents->len;
+		g_array_append_val(node->starts, end);
+	}
+	/* the decoded page doesn't keep the previous page */
+	if (mdb_read_alt_pg(mdb, pg) != mdb->fmt->pg_size) {
+		mdb_index_node_free(node);
+		return 0;
+	}
+	node->prev_pg = mdb_get_int32(mdb->alt_pg_buf, mdb->fmt->idx_next_pg_offset - 4);
+	return 1;
+}
+/*
+ * bytes the entries take on the page, with the prefix the keys share with
+ * the first one left out of the others, as mdb_index_builder_add() does
+ */
+static int
+mdb_index_node_size(MdbIndexNode *node, int *pref_len)
+{
+	int ptr_len = (node->pg_type == MDB_PAGE_LEAF) ? 4 : 8;
+	unsigned int i, n = mdb_index_node_count(node);
+	unsigned char *ents = node->ents->data;
+	int key_len, common, pref;
+
+	*pref_len = 0;
+	if (n < 2)
+		return node->ents->len;
+	pref = mdb_index_node_start(node, 1) - ptr_len;
+	for (i = 1; i < n; i++) {
+		key_len = mdb_index_node_start(node, i + 1)
+			- mdb_index_node_start(node, i) - ptr_len;
+		common = 0;
+		while (common < pref && common < key_len
+		 && ents[mdb_index_node_start(node, i) + common] == ents[common])
+			common++;
+		pref = common;
+	}
+	*pref_len = pref;
+	return node->ents->len - (n - 1) * pref;
+}
+static int
+mdb_index_node_write(MdbTableDef *table, MdbIndexNode *node)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	int pref_len;
+
+	mdb_index_node_size(node, &pref_len);
+	mdb_index_pack_page(table, node->pg_type, node->prev_pg, node->next_pg,
+		node->ents->data, (guint32 *) node->starts->data,
+		mdb_index_node_count(node), pref_len);
+	mdb->cur_pg = node->pg;
+	if (!mdb_write_pg(mdb, node->pg)) {
+		fprintf(stderr, "write failed!\n");
+		return 0;
+	}
+	return 1;
+}
+/*
+ * the entry of a page in its parent: its last entry, with the page in
+ * place of the child pointer of an interior one
+ */
+static int
+mdb_index_node_up(MdbIndexNode *node, unsigned char *up)
+{
+	unsigned int n = mdb_index_node_count(node);
+	int len = mdb_index_node_start(node, n) - mdb_index_node_start(node, n - 1);
+
+	if (node->pg_type != MDB_PAGE_LEAF)
+		len -= 4;
+	memcpy(up, node->ents->data + mdb_index_node_start(node, n - 1), len);
+	mdb_put_int32_msb(up, len, node->pg);
+	return len + 4;
+}
+static guint32
+mdb_index_new_pg(MdbIndexPath *path)
+{
+	MdbHandle *mdb = path->table->entry->mdb;
+	GArray *pgs;
+	guint32 pg;
+	int ok;
+
+	if (!(pg = mdb_map_alloc_pages(mdb, 1)))
+		return 0;
+	pgs = g_array_new(FALSE, FALSE, sizeof(guint32));
+	g_array_append_val(pgs, pg);
+	ok = mdb_map_set_pages(mdb, path->idx->usage_map_pg_row, pgs, 1);
+	g_array_free(pgs, TRUE);
+	return ok ? pg : 0;
+}
+/*
+ * find the leaf an entry belongs on, reading it into node.  Returns 1 when
+ * found, 0 on error and -1 when the tree is not one this can change.
+ */
+static int
+mdb_index_descend(MdbIndexPath *path, unsigned char *ent, int len, MdbIndexNode *node)
+{
+	MdbHandle *mdb = path->table->entry->mdb;
+	guint32 pg = path->idx->first_pg;
+	unsigned int i, n;
+	int past_end = 0;
+
+	path->depth = 0;
+	for (;;) {
+		if (!mdb_index_node_read(mdb, pg, node))
+			return -1;
+		if (node->pg_type == MDB_PAGE_LEAF)
+			break;
+		n = mdb_index_node_count(node);
+		if (!n || path->depth == MDB_MAX_INDEX_DEPTH - 1) {
+			mdb_index_node_free(node);
+			return -1;
+		}
+		/* the first subtree ending at or after the entry */
+		for (i = 0; i < n; i++) {
+			if (mdb_index_ent_cmp(ent, len,
+			 node->ents->data + mdb_index_node_start(node, i),
+			 mdb_index_node_start(node, i + 1) - mdb_index_node_start(node, i) - 4) <= 0)
+				break;
+		}
+		if (i == n) {
+			i = n - 1;
+			past_end = 1;
+		}
+		path->pgs[path->depth] = pg;
+		path->pos[path->depth] = i;
+		path->depth++;
+		pg = mdb_get_int32_msb(node->ents->data, mdb_index_node_start(node, i + 1) - 4);
+		mdb_index_node_free(node);
+	}
+	/* leaves past the last one the upper levels know of */
+	if ((past_end || !path->depth) && node->next_pg) {
+		mdb_index_node_free(node);
+		return -1;
+	}
+	path->pgs[path->depth] = pg;
+	return 1;
+}
+/*
+ * write back a page of the path after its entries changed, splitting it
+ * if they no longer fit, and bring its parent up to date.  last_changed
+ * tells whether its last entry is a different one now.  Returns as
+ * mdb_index_descend() does.
+ */
+static int
+mdb_index_put_node(MdbIndexPath *path, unsigned int level, MdbIndexNode *node, int last_changed)
+{
+	MdbTableDef *table = path->table;
+	MdbHandle *mdb = table->entry->mdb;
+	MdbFormatConstants *fmt = mdb->fmt;
+	MdbIndexNode right, parent;
+	unsigned char up[MDB_MAX_INDEX_ENTRY];
+	unsigned int i, j, n;
+	guint32 new_pg, at;
+	int pref_len, len, ret;
+
+	if (mdb_index_node_size(node, &pref_len) <= fmt->pg_size - fmt->idx_entries_offset) {
+		if (!mdb_index_node_write(table, node))
+			return 0;
+		if (!last_changed || !level)
+			return 1;
+		if (!mdb_index_node_read(mdb, path->pgs[level - 1], &parent))
+			return -1;
+		i = path->pos[level - 1];
+		len = mdb_index_node_up(node, up);
+		mdb_index_node_remove(&parent, i);
+		mdb_index_node_insert(&parent, i, up, len);
+		ret = mdb_index_put_node(path, level - 1, &parent,
+			i == mdb_index_node_count(&parent) - 1);
+		mdb_index_node_free(&parent);
+		return ret;
+	}
+	if (!level && !path->idx->first_pg_tdef_pg)
+		return -1;
+
+	/* the entries past the middle of the page go to a new one */
+	if (!(new_pg = mdb_index_new_pg(path)))
+		return 0;
+	n = mdb_index_node_count(node);
+	for (i = 1; i < n - 1 && mdb_index_node_start(node, i) < node->ents->len / 2; i++)
+		;
+	mdb_index_node_init(&right, new_pg, node->pg_type);
+	right.prev_pg = node->pg;
+	right.next_pg = node->next_pg;
+	at = mdb_index_node_start(node, i);
+	g_byte_array_append(right.ents, node->ents->data + at, node->ents->len - at);
+	for (j = i + 1; j <= n; j++) {
+		guint32 end = mdb_index_node_start(node, j) - at;
+		g_array_append_val(right.starts, end);
+	}
+	g_byte_array_set_size(node->ents, at);
+	g_array_set_size(node->starts, i + 1);
+	node->next_pg = new_pg;
+	ret = 0;
+	if (!mdb_index_node_write(table, node) || !mdb_index_node_write(table, &right))
+		goto out;
+	if (right.next_pg) {
+		if (!mdb_read_pg(mdb, right.next_pg))
+			goto out;
+		mdb_put_int32(mdb->pg_buf, fmt->idx_next_pg_offset - 4, new_pg);
+		if (!mdb_write_pg(mdb, right.next_pg))
+			goto out;
+	}
+
+	if (!level) {
+		/* a new root above the two halves */
+		if (!(new_pg = mdb_index_new_pg(path)))
+			goto out;
+		mdb_index_node_init(&parent, new_pg, MDB_PAGE_INDEX);
+		len = mdb_index_node_up(node, up);
+		mdb_index_node_insert(&parent, 0, up, len);
+		len = mdb_index_node_up(&right, up);
+		mdb_index_node_insert(&parent, 1, up, len);
+		ret = mdb_index_node_write(table, &parent);
+		mdb_index_node_free(&parent);
+		if (!ret || !mdb_read_pg(mdb, path->idx->first_pg_tdef_pg)) {
+			ret = 0;
+			goto out;
+		}
+		mdb_put_int32(mdb->pg_buf, path->idx->first_pg_tdef_pos, new_pg);
+		if (!(ret = mdb_write_pg(mdb, path->idx->first_pg_tdef_pg) ? 1 : 0))
+			goto out;
+		path->idx->first_pg = new_pg;
+		goto out;
+	}
+	ret = -1;
+	if (!mdb_index_node_read(mdb, path->pgs[level - 1], &parent))
+		goto out;
+	i = path->pos[level - 1];
+	mdb_index_node_remove(&parent, i);
+	len = mdb_index_node_up(node, up);
+	mdb_index_node_insert(&parent, i, up, len);
+	len = mdb_index_node_up(&right, up);
+	mdb_index_node_insert(&parent, i + 1, up, len);
+	ret = mdb_index_put_node(path, level - 1, &parent,
+		i + 1 == mdb_index_node_count(&parent) - 1);
+	mdb_index_node_free(&parent);
+out:
+	mdb_index_node_free(&right);
+	return ret;
+}
+/*
+ * take an entry, key and pointer, out of an index.  Returns as
+ * mdb_index_descend() does.
+ */
+static int
+mdb_index_delete_entry(MdbTableDef *table, MdbIndex *idx, unsigned char *ent, int len)
+{
+	MdbIndexPath path;
+	MdbIndexNode node;
+	unsigned int i, n;
+	int ret;
+
+	path.table = table;
+	path.idx = idx;
+	if ((ret = mdb_index_descend(&path, ent, len, &node)) != 1)
+		return ret;
+	n = mdb_index_node_count(&node);
+	for (i = 0; i < n; i++) {
+		if (!mdb_index_ent_cmp(ent, len,
+		 node.ents->data + mdb_index_node_start(&node, i),
+		 mdb_index_node_start(&node, i + 1) - mdb_index_node_start(&node, i)))
+			break;
+	}
+	/* not found, or the leaf would be left empty */
+	if (i == n || (n == 1 && path.depth)) {
+		mdb_index_node_free(&node);
+		return -1;
+	}
+	mdb_index_node_remove(&node, i);
+	ret = mdb_index_put_node(&path, path.depth, &node, i == n - 1);
+	mdb_index_node_free(&node);
+	return ret;
+}
+/*
+ * add an entry, key and pointer, to an index.  Returns as
+ * mdb_index_descend() does.
+ */
+static int
+mdb_index_insert_entry(MdbTableDef *table, MdbIndex *idx, unsigned char *ent, int len)
+{
+	MdbIndexPath path;
+	MdbIndexNode node;
+	unsigned int i, n;
+	int ret;
+
+	path.table = table;
+	path.idx = idx;
+	if ((ret = mdb_index_descend(&path, ent, len, &node)) != 1)
+		return ret;
+	n = mdb_index_node_count(&node);
+	for (i = 0; i < n; i++) {
+		if (mdb_index_ent_cmp(ent, len,
+		 node.ents->data + mdb_index_node_start(&node, i),
+		 mdb_index_node_start(&node, i + 1) - mdb_index_node_start(&node, i)) < 0)
+			break;
+	}
+	mdb_index_node_insert(&node, i, ent, len);
+	ret = mdb_index_put_node(&path, path.depth, &node, i == n);
+	mdb_index_node_free(&node);
+	return ret;
+}
+/*
+ * check one level of a tree, from its first page along the next page
+ * links.  The pages must be linked back, hold entries in order, and be
+ * the children, in order, the level above points at.  Interior entries
+ * must be those of their children, which go to next_children, and leaf
+ * entries those coming out of the sorter.  Returns what is wrong, NULL if
+ * nothing is.
+ */
+static const char *
+mdb_index_verify_level(MdbTableDef *table, guint32 *pg, GArray *children, GArray *next_children, MdbKeySorter *sorter)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	MdbIndexNode node, child;
+	unsigned char up[MDB_MAX_INDEX_ENTRY], last[MDB_MAX_INDEX_ENTRY];
+	unsigned char *ent, *exp;
+	guint32 prev_pg = 0, child_pg;
+	unsigned int i, n, k = 0;
+	int len, last_len = 0, pg_type = -1;
+	const char *err = NULL;
+
+	while (*pg && !err) {
+		if (!mdb_index_node_read(mdb, *pg, &node))
+			return "not an index page";
+		n = mdb_index_node_count(&node);
+		if (node.prev_pg != prev_pg)
+			err = "wrong previous page";
+		else if (pg_type >= 0 && node.pg_type != pg_type)
+			err = "page type differs from the rest of its level";
+		else if (children && k < children->len
+		 && g_array_index(children, guint32, k) != *pg)
+			err = "page out of order with its parent's entries";
+		else if (!n && (prev_pg || node.next_pg || children))
+			err = "empty page";
+		pg_type = node.pg_type;
+		k++;
+		for (i = 0; i < n && !err; i++) {
+			ent = node.ents->data + mdb_index_node_start(&node, i);
+			len = mdb_index_node_start(&node, i + 1) - mdb_index_node_start(&node, i);
+			if (last_len && mdb_index_ent_cmp(ent, len, last, last_len) <= 0)
+				err = "entries out of order";
+			memcpy(last, ent, len);
+			last_len = len;
+			if (err)
+				break;
+			if (node.pg_type == MDB_PAGE_LEAF) {
+				if (mdb_sort_next(sorter, &exp) != len || memcmp(exp, ent, len))
+					err = "leaf entries don't match the rows of the table";
+				continue;
+			}
+			child_pg = mdb_get_int32_msb(ent, len - 4);
+			g_array_append_val(next_children, child_pg);
+			if (!mdb_index_node_read(mdb, child_pg, &child)) {
+				err = "entry points at a page that is not an index page";
+				break;
+			}
+			if (!mdb_index_node_count(&child)
+			 || mdb_index_node_up(&child, up) != len || memcmp(up, ent, len))
+				err = "entry differs from the last one of its page";
+			mdb_index_node_free(&child);
+		}
+		if (!err) {
+			prev_pg = *pg;
+			*pg = node.next_pg;
+		}
+		mdb_index_node_free(&node);
+	}
+	if (!err && children && k < children->len)
+		err = "pages the level above points at are not linked";
+	if (!err && pg_type == MDB_PAGE_LEAF && mdb_sort_next(sorter, &exp))
+		err = "rows missing from the leaves";
+	return err;
+}
+/*
+ * check a tree changed in place against the rows of its table, level by
+ * level, for MDBOPTS=debug_index.  Returns 1 if it is sound.
+ */
+static int
+mdb_index_verify(MdbTableDef *table, MdbIndex *idx)
+{
+	MdbKeySorter sorter;
+	GArray *children = NULL, *next_children;
+	guint32 pg = idx->first_pg, first_pg, num_keys;
+	unsigned int depth;
+	const char *err = NULL;
+
+	mdb_sort_init(&sorter, 1);
+	if (!mdb_index_extract_keys(table, idx, &sorter, &num_keys)
+	 || !mdb_sort_finish(&sorter)) {
+		mdb_sort_free(&sorter);
+		return 0;
+	}
+	for (depth = 0; pg && !err; depth++) {
+		if (depth == MDB_MAX_INDEX_DEPTH) {
+			err = "tree too deep";
+			break;
+		}
+		first_pg = pg;
+		next_children = g_array_new(FALSE, FALSE, sizeof(guint32));
+		err = mdb_index_verify_level(table, &pg, children, next_children, &sorter);
+		if (children)
+			g_array_free(children, TRUE);
+		children = next_children;
+		/* the first child starts the level below, none below leaves */
+		pg = children->len ? g_array_index(children, guint32, 0) : 0;
+		if (err)
+			fprintf(stderr, "Index %s, level %u from page %lu: %s\n",
+				idx->name, depth, (unsigned long) first_pg, err);
+	}
+	if (children)
+		g_array_free(children, TRUE);
+	mdb_sort_free(&sorter);
+	return !err;
+}
+/* rows are numbered in a byte of the pg_row pointers */
+#define MDB_MAX_PG_ROWS 256
+
+/*
+ * Bulk inserts.  mdb_insert_row() rebuilds and writes the target page and
+ * updates the indexes for every row; a bulk insert instead fills a copy
+ * of the page in memory, writes it once when it is full, and rebuilds the
+ * indexes from scratch once the data is written.
+ */
+/**
+ * mdb_bulk_insert_begin:
+ * @table: Table to add rows to, with its columns and indexes read
+ *
+ * Starts adding rows to @table with mdb_bulk_insert_append().  Nothing is
+ * guaranteed to be on disk until mdb_bulk_insert_end() is called.
+ *
+ * Return value: the state of the insert, NULL on error.
+ */
+MdbBulkInsert *
+mdb_bulk_insert_begin(MdbTableDef *table)
+{
+	MdbBulkInsert *bulk;
+
+	if (!table->entry->mdb->f->writable) {
+		fprintf(stderr, "File is not open for writing\n");
+		return NULL;
+	}
+	bulk = g_malloc0(sizeof(MdbBulkInsert));
+	bulk->table = table;
+
+	return bulk;
+}
+/*
+ * write the page being filled, through the handle's page buffer
+ */
+static int
+mdb_bulk_insert_flush(MdbBulkInsert *bulk)
+{
+	MdbHandle *mdb = bulk->table->entry->mdb;
+
+	if (!bulk->pg)
+		return 1;
+	memcpy(mdb->pg_buf, bulk->pg_buf, mdb->fmt->pg_size);
+	mdb->cur_pg = bulk->pg;
+	mdb_debug(MDB_DEBUG_WRITE, "writing page %d", bulk->pg);
+	if (!mdb_write_pg(mdb, bulk->pg)) {
+		fprintf(stderr, "write failed!\n");
+		return 0;
+	}
+	/* a page with all its row numbers taken has no room left */
+	mdb_map_set_freespace(bulk->table, bulk->pg,
+		mdb_get_int16(bulk->pg_buf, mdb->fmt->row_count_offset) >= MDB_MAX_PG_ROWS ?
+		0 : mdb_get_int16(bulk->pg_buf, 2));
+	return 1;
+}
+/*
+ * make the page being filled one with at least row_size bytes and a row
+ * number free, writing out the current one when it is full.
+ */
+static int
+mdb_bulk_insert_next_pg(MdbBulkInsert *bulk, int row_size)
+{
+	MdbTableDef *table = bulk->table;
+	MdbHandle *mdb = table->entry->mdb;
+	MdbFormatConstants *fmt = mdb->fmt;
+	guint32 pgnum;
+
+	if (bulk->pg) {
+		if (mdb_get_int16(bulk->pg_buf, 2) >= row_size + 2
+		 && mdb_get_int16(bulk->pg_buf, fmt->row_count_offset) < MDB_MAX_PG_ROWS)
+			return 1;
+		if (!mdb_bulk_insert_flush(bulk))
+			return 0;
+		bulk->pg = 0;
+	}
+	for (;;) {
+		pgnum = mdb_map_find_next_freepage(table, row_size + 2);
+		if (!pgnum) {
+			fprintf(stderr, "Unable to allocate new page.\n");
+			return 0;
+		}
+		if (!mdb_read_pg(mdb, pgnum))
+			return 0;
+		if (mdb->pg_buf[0] != MDB_PAGE_DATA
+		 || mdb_get_int16(mdb->pg_buf, fmt->row_count_offset) < MDB_MAX_PG_ROWS)
+			break;
+		/* room left but no row number, don't pick it again */
+		mdb_map_set_freespace(table, pgnum, 0);
+	}
+	bulk->pg = pgnum;
+	if (mdb->pg_buf[0] == MDB_PAGE_DATA) {
+		memcpy(bulk->pg_buf, mdb->pg_buf, mdb->fmt->pg_size);
+	} else {
+		/* a freshly allocated page */
+		void *new_pg = mdb_new_data_pg(table->entry);
+		memcpy(bulk->pg_buf, new_pg, mdb->fmt->pg_size);
+		g_free(new_pg);
+	}
+	return 1;
+}
+/*
+ * add a row below the last one of a data page in memory, which the caller
+ * checked has room for it
+ */
+static void
+mdb_pg_append_row(MdbFormatConstants *fmt, unsigned char *pg_buf, unsigned char *row_buffer, int new_row_size)
+{
+	int num_rows, pos;
+
+	/* rows are stored from the end of the page down, the new one goes
+	 * below the last one */
+	num_rows = mdb_get_int16(pg_buf, fmt->row_count_offset);
+	pos = (num_rows == 0) ? fmt->pg_size :
+		mdb_get_int16(pg_buf, fmt->row_count_offset + (num_rows*2)) & 0x1fff;
+	pos -= new_row_size;
+	memcpy(pg_buf + pos, row_buffer, new_row_size);
+	mdb_put_int16(pg_buf, (fmt->row_count_offset + 2) + (num_rows*2), pos);
+	num_rows++;
+	mdb_put_int16(pg_buf, fmt->row_count_offset, num_rows);
+	mdb_put_int16(pg_buf, 2, pos - fmt->row_count_offset - 2 - (num_rows*2));
+}
+/*
+ * add a packed row to the page being filled, or the next one with room
+ * and a row number left.  Returns its page and row, 0 on error.
+ */
+static guint32
+mdb_bulk_insert_add(MdbBulkInsert *bulk, unsigned char *row_buffer, int new_row_size)
+{
+	MdbFormatConstants *fmt = bulk->table->entry->mdb->fmt;
+	guint32 row;
+
+	if (!mdb_bulk_insert_next_pg(bulk, new_row_size))
+		return 0;
+	row = mdb_get_int16(bulk->pg_buf, fmt->row_count_offset);
+	mdb_pg_append_row(fmt, bulk->pg_buf, row_buffer, new_row_size);
+	return (bulk->pg << 8) | row;
+}
+/**
+ * mdb_bulk_insert_append:
+ * @bulk: State returned by mdb_bulk_insert_begin()
+ * @num_fields: Number of fields in @fields
+ * @fields: Values of the new row, as for mdb_insert_row()
+ *
+ * Adds a row to the page being filled, moving on to the next page with
+ * enough free space when it doesn't fit.
+ *
+ * Return value: 1 on success, 0 on error.
+ */
+int
+mdb_bulk_insert_append(MdbBulkInsert *bulk, int num_fields, MdbField *fields)
+{
+	MdbTableDef *table = bulk->table;
+	unsigned char row_buffer[4096];
+	int new_row_size;
+
+	new_row_size = mdb_pack_row(table, row_buffer, num_fields, fields);
+	if (mdb_get_option(MDB_DEBUG_WRITE)) {
+		mdb_buffer_dump(row_buffer, 0, new_row_size);
+	}
+	if (!mdb_bulk_insert_add(bulk, row_buffer, new_row_size))
+		return 0;
+	bulk->num_rows++;
+
+	return 1;
+}
+/*
+ * rebuild an index after its table changed, or mark it stale when its
+ * keys can't be written
+ */
+static int
+mdb_index_refresh(MdbTableDef *table, MdbIndex *idx)
+{
+	if (!mdb_index_keys_encodable(table, idx)) {
+		mdb_index_mark_stale(table, idx);
+		return 1;
+	}
+	return mdb_index_rebuild(table, idx);
+}
+/*
+ * rebuild all the indexes of a table that have a tree
+ */
+static int
+mdb_rebuild_indexes(MdbTableDef *table)
+{
+	MdbIndex *idx;
+	unsigned int i;
+
+	for (i = 0; i < table->num_idxs; i++) {
+		idx = g_ptr_array_index(table->indices, i);
+		/* foreign key references have no tree of their own */
+		if (idx->index_type == 2)
+			continue;
+		if (!mdb_index_refresh(table, idx))
+			return 0;
+	}
+	return 1;
+}
+/**
+ * mdb_bulk_insert_end:
+ * @bulk: State returned by mdb_bulk_insert_begin()
+ *
+ * Writes the last page filled, adds the new rows to the row count of the
+ * table, rebuilds its indexes with mdb_index_rebuild() and frees @bulk.
+ * Indexes with text keys in Jet4 databases are left out of date, with a
+ * warning.
+ *
+ * Return value: 1 on success, 0 on error.
+ */
+int
+mdb_bulk_insert_end(MdbBulkInsert *bulk)
+{
+	MdbTableDef *table = bulk->table;
+	MdbCatalogEntry *entry = table->entry;
+	MdbHandle *mdb = entry->mdb;
+	int ret = 0;
+
+	if (!mdb_bulk_insert_flush(bulk))
+		goto out;
+
+	if (bulk->num_rows) {
+		/* row count in the table definition */
+		if (!mdb_read_pg(mdb, entry->table_pg))
+			goto out;
+		table->num_rows += bulk->num_rows;
+		mdb_put_int32(mdb->pg_buf, mdb->fmt->tab_num_rows_offset,
+			table->num_rows);
+		if (!mdb_write_pg(mdb, entry->table_pg)) {
+			fprintf(stderr, "write failed!\n");
+			goto out;
+		}
+		if (!mdb_rebuild_indexes(table))
+			goto out;
+	}
+	ret = 1;
+out:
+	g_free(bulk);
+	return ret;
+}
+/*
+ * Compaction.  The live rows of a table are copied as they are, without
+ * cracking them, to a run of new pages filled as much as they can be.
+ * The old pages are then given back and the indexes rebuilt for the new
+ * row locations.
+ */
+typedef struct {
+	guint32 pg_row;
+	guint16 size;
+} MdbCompactRow;
+
+/*
+ * list the rows to keep in old_rows, and the pages of the table in
+ * old_pgs.  Deleted rows are dropped.  A lookup entry is replaced by the
+ * row it points to, unless that one is gone.
+ */
+static int
+mdb_compact_collect(MdbTableDef *table, GArray *old_pgs, GArray *old_rows)
+{
+	MdbCatalogEntry *entry = table->entry;
+	MdbHandle *mdb = entry->mdb;
+	MdbFormatConstants *fmt = mdb->fmt;
+	MdbCompactRow r;
+	GArray *rows, *targets;
+	GHashTable *moved;
+	gint32 pg = 0;
+	guint32 target;
+	void *buf;
+	int num_rows, row, row_start;
+	size_t row_size;
+	unsigned int i;
+
+	rows = g_array_new(FALSE, FALSE, sizeof(MdbCompactRow));
+	targets = g_array_new(FALSE, FALSE, sizeof(guint32));
+	moved = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	while ((pg = mdb_map_find_next(mdb, table->usage_map, table->map_sz, pg)) > 0) {
+		if (!mdb_read_pg(mdb, pg))
+			break;
+		if (mdb->pg_buf[0] != MDB_PAGE_DATA
+		 || mdb_get_int32(mdb->pg_buf, 4) != entry->table_pg)
+			continue;
+		g_array_append_val(old_pgs, pg);
+		num_rows = mdb_get_int16(mdb->pg_buf, fmt->row_count_offset);
+		for (row = 0; row < num_rows; row++) {
+			mdb_find_row(mdb, row, &row_start, &row_size);
+			if (row_start & 0x4000)
+				continue;
+			if ((row_start & 0x8000) && row_size == 4) {
+				target = mdb_get_int32(mdb->pg_buf, row_start & 0x1fff);
+				g_array_append_val(targets, target);
+				g_hash_table_insert(moved, GUINT_TO_POINTER(target),
+					GINT_TO_POINTER(1));
+				continue;
+			}
+			r.pg_row = (pg << 8) | row;
+			r.size = row_size;
+			g_array_append_val(rows, r);
+		}
+	}
+	if (pg != 0) {
+		fprintf(stderr, "Unable to read the pages of table %s\n", entry->object_name);
+		g_array_free(rows, TRUE);
+		g_array_free(targets, TRUE);
+		g_hash_table_destroy(moved);
+		return 0;
+	}
+
+	/* rows pointed to by a lookup entry are copied once, from there */
+	for (i = 0; i < rows->len; i++) {
+		r = g_array_index(rows, MdbCompactRow, i);
+		if (!g_hash_table_lookup(moved, GUINT_TO_POINTER(r.pg_row)))
+			g_array_append_val(old_rows, r);
+	}
+	for (i = 0; i < targets->len; i++) {
+		target = g_array_index(targets, guint32, i);
+		if (GPOINTER_TO_INT(g_hash_table_lookup(moved, GUINT_TO_POINTER(target))) != 1)
+			continue;
+		g_hash_table_insert(moved, GUINT_TO_POINTER(target), GINT_TO_POINTER(2));
+		if (mdb_find_pg_row(mdb, target, &buf, &row_start, &row_size))
+			continue;
+		/* stale entry */
+		if ((target & 0xff) >= (guint32) mdb_get_int16(buf, fmt->row_count_offset)
+		 || (row_start & 0x4000))
+			continue;
+		r.pg_row = target;
+		r.size = row_size;
+		g_array_append_val(old_rows, r);
+	}
+	g_array_free(rows, TRUE);
+	g_array_free(targets, TRUE);
+	g_hash_table_destroy(moved);
+	return 1;
+}
+/**
+ * mdb_compact_table:
+ * @table: Table to compact, with its columns and indexes read
+ *
+ * Rewrites the rows of @table to consecutive pages at the end of the file,
+ * filled as much as they can be, and gives the pages they were on back to
+ * the database.  Deleted rows and lookup entries are dropped along the
+ * way, the usage maps and the row count of the table are rewritten, and
+ * its indexes are rebuilt, but for those with text keys in Jet4 databases,
+ * which are left out of date with a warning.  Meant to be run on a
+ * database nobody else has open.
+ *
+ * Return value: 1 on success, 0 on error.
+ */
+int
+mdb_compact_table(MdbTableDef *table)
+{
+	MdbCatalogEntry *entry = table->entry;
+	MdbHandle *mdb = entry->mdb;
+	MdbFormatConstants *fmt = mdb->fmt;
+	unsigned char pg_buf[MDB_PGSIZE];
+	MdbCompactRow *r;
+	GArray *old_pgs, *old_rows, *new_pgs;
+	guint32 first_pg = 0, num_pgs, pg, src_pg = 0;
+	void *new_pg;
+	int free_space, pg_rows, row_start, ret = 0;
+	size_t row_size;
+	unsigned int i;
+
+	if (!mdb->f->writable) {
+		fprintf(stderr, "File is not open for writing\n");
+		return 0;
+	}
+	if (table->num_idxs && !table->indices) {
+		fprintf(stderr, "Indexes of table %s not read\n", entry->object_name);
+		return 0;
+	}
+	old_pgs = g_array_new(FALSE, FALSE, sizeof(guint32));
+	old_rows = g_array_new(FALSE, FALSE, sizeof(MdbCompactRow));
+	new_pgs = g_array_new(FALSE, FALSE, sizeof(guint32));
+	if (!mdb_compact_collect(table, old_pgs, old_rows))
+		goto out;
+
+	/* count the pages first, to allocate them in one piece */
+	num_pgs = 0;
+	free_space = pg_rows = 0;
+	for (i = 0; i < old_rows->len; i++) {
+		r = &g_array_index(old_rows, MdbCompactRow, i);
+		if (!num_pgs || free_space < r->size + 2 || pg_rows == MDB_MAX_PG_ROWS) {
+			num_pgs++;
+			free_space = fmt->pg_size - fmt->row_count_offset - 2;
+			pg_rows = 0;
+		}
+		free_space -= r->size + 2;
+		pg_rows++;
+	}
+	if (num_pgs && !(first_pg = mdb_map_alloc_pages(mdb, num_pgs)))
+		goto out;
+
+	new_pg = mdb_new_data_pg(entry);
+	pg = first_pg;
+	memcpy(pg_buf, new_pg, fmt->pg_size);
+	for (i = 0; i < old_rows->len; i++) {
+		r = &g_array_index(old_rows, MdbCompactRow, i);
+		if (mdb_get_int16(pg_buf, 2) < r->size + 2
+		 || mdb_get_int16(pg_buf, fmt->row_count_offset) == MDB_MAX_PG_ROWS) {
+			memcpy(mdb->pg_buf, pg_buf, fmt->pg_size);
+			mdb->cur_pg = pg;
+			if (!mdb_write_pg(mdb, pg))
+				break;
+			g_array_append_val(new_pgs, pg);
+			pg++;
+			memcpy(pg_buf, new_pg, fmt->pg_size);
+		}
+		/* the old pages are only read through alt_pg_buf, pg_buf
+		 * is needed for the writes */
+		if (r->pg_row >> 8 != src_pg) {
+			src_pg = r->pg_row >> 8;
+			if (!mdb_read_alt_pg(mdb, src_pg))
+				break;
+		}
+		mdb_swap_pgbuf(mdb);
+		mdb_find_row(mdb, r->pg_row & 0xff, &row_start, &row_size);
+		mdb_swap_pgbuf(mdb);
+		mdb_pg_append_row(fmt, pg_buf, mdb->alt_pg_buf + (row_start & 0x1fff), r->size);
+	}
+	if (i == old_rows->len && num_pgs) {
+		memcpy(mdb->pg_buf, pg_buf, fmt->pg_size);
+		mdb->cur_pg = pg;
+		if (mdb_write_pg(mdb, pg))
+			g_array_append_val(new_pgs, pg);
+		else
+			i = 0;
+	}
+	g_free(new_pg);
+	if (i < old_rows->len || new_pgs->len != num_pgs) {
+		fprintf(stderr, "write failed!\n");
+		goto out;
+	}
+
+	if (!mdb_read_pg(mdb, entry->table_pg))
+		goto out;
+	table->num_rows = old_rows->len;
+	mdb_put_int32(mdb->pg_buf, fmt->tab_num_rows_offset, table->num_rows);
+	if (!mdb_write_pg(mdb, entry->table_pg)) {
+		fprintf(stderr, "write failed!\n");
+		goto out;
+	}
+	if (!mdb_map_replace_pages(table, old_pgs, new_pgs))
+		goto out;
+	ret = mdb_rebuild_indexes(table);
+out:
+	g_array_free(old_pgs, TRUE);
+	g_array_free(old_rows, TRUE);
+	g_array_free(new_pgs, TRUE);
+	return ret;
+}
+/*
+ * Index creation.  The definition of a table may span several pages; it
+ * is read into one buffer, the pages after the first without their 8 byte
+ * header so positions in it are the ones read_pg_if_n() uses, the new
+ * index is spliced into each of its blocks, and the buffer is written back
+ * over the same pages, plus new ones if it grew past them.
+ */
+#define MDB_IDX_MAP_SIZE 64
+
+static GByteArray *
+mdb_tdef_read(MdbTableDef *table, GArray *pgs)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	int pg_size = mdb->fmt->pg_size;
+	GByteArray *def = g_byte_array_new();
+	guint32 pg = table->entry->table_pg;
+
+	while (pg) {
+		if (pgs->len > 1000 || !mdb_read_pg(mdb, pg) || mdb->pg_buf[0] != 0x02) {
+			fprintf(stderr, "Unable to read the definition of table %s\n", table->name);
+			g_byte_array_free(def, TRUE);
+			return NULL;
+		}
+		if (!pgs->len)
+			g_byte_array_append(def, mdb->pg_buf, pg_size);
+		else
+			g_byte_array_append(def, mdb->pg_buf + 8, pg_size - 8);
+		g_array_append_val(pgs, pg);
+		pg = mdb_get_int32(mdb->pg_buf, 4);
+	}
+	return def;
+}
+/* skip n names, returns the position after them, -1 past the end */
+static int
+mdb_tdef_skip_names(MdbHandle *mdb, GByteArray *def, int pos, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		if (pos + 2 > (int) def->len)
+			return -1;
+		if (IS_JET3(mdb))
+			pos += 1 + def->data[pos];
+		else
+			pos += 2 + mdb_get_int16(def->data, pos);
+	}
+	return pos <= (int) def->len ? pos : -1;
+}
+static int
+mdb_tdef_write(MdbTableDef *table, GByteArray *def, GArray *pgs)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	int pg_size = mdb->fmt->pg_size;
+	guint32 pg, next_pg;
+	unsigned int i, pos, len;
+	unsigned char hdr[4];
+
+	memcpy(hdr, def->data, 4);
+	/* more pages if it doesn't fit anymore */
+	for (i = 1, pos = pg_size; pos < def->len; i++, pos += pg_size - 8) {
+		if (i < pgs->len)
+			continue;
+		if (!(pg = mdb_map_alloc_pages(mdb, 1)))
+			return 0;
+		g_array_append_val(pgs, pg);
+	}
+	for (i = 0, pos = 0; i < pgs->len; i++) {
+		pg = g_array_index(pgs, guint32, i);
+		next_pg = (i + 1 < pgs->len) ? g_array_index(pgs, guint32, i + 1) : 0;
+		memset(mdb->pg_buf, 0, pg_size);
+		if (!i) {
+			len = MIN(def->len, (unsigned int) pg_size);
+			memcpy(mdb->pg_buf, def->data, len);
+		} else {
+			len = (pos < def->len) ?
+				MIN(def->len - pos, (unsigned int) pg_size - 8) : 0;
+			memcpy(mdb->pg_buf, hdr, 4);
+			memcpy(mdb->pg_buf + 8, def->data + pos, len);
+			len += 8;
+		}
+		pos += i ? len - 8 : len;
+		/* jet4 keeps the free space of the page minus 8 there */
+		if (!IS_JET3(mdb))
+			mdb_put_int16(mdb->pg_buf, 2, MAX(pg_size - (int) len - 8, 0));
+		mdb_put_int32(mdb->pg_buf, 4, next_pg);
+		mdb->cur_pg = pg;
+		if (!mdb_write_pg(mdb, pg)) {
+			fprintf(stderr, "write failed!\n");
+			return 0;
+		}
+	}
+	return 1;
+}
+/*
+ * add an empty usage map for the new index, next to the usage map of the
+ * table if there is room for it there.  Returns its pg_row, 0 on error.
+ */
+static guint32
+mdb_new_usage_map(MdbTableDef *table)
+{
+	MdbCatalogEntry *entry = table->entry;
+	MdbHandle *mdb = entry->mdb;
+	MdbFormatConstants *fmt = mdb->fmt;
+	unsigned char map[MDB_IDX_MAP_SIZE];
+	guint32 pg;
+	void *new_pg;
+
+	memset(map, 0, sizeof(map));
+	if (!mdb_read_pg(mdb, entry->table_pg))
+		return 0;
+	pg = mdb_get_int32(mdb->pg_buf, fmt->tab_usage_map_offset) >> 8;
+	if (!mdb_read_pg(mdb, pg))
+		return 0;
+	if (mdb->pg_buf[0] != MDB_PAGE_DATA
+	 || mdb_get_int16(mdb->pg_buf, 2) < MDB_IDX_MAP_SIZE + 2
+	 || mdb_get_int16(mdb->pg_buf, fmt->row_count_offset) >= MDB_MAX_PG_ROWS) {
+		if (!(pg = mdb_map_alloc_pages(mdb, 1)))
+			return 0;
+		new_pg = mdb_new_data_pg(entry);
+		memcpy(mdb->pg_buf, new_pg, fmt->pg_size);
+		g_free(new_pg);
+		mdb->cur_pg = pg;
+	}
+	mdb_pg_append_row(fmt, mdb->pg_buf, map, MDB_IDX_MAP_SIZE);
+	if (!mdb_write_pg(mdb, pg)) {
+		fprintf(stderr, "write failed!\n");
+		return 0;
+	}
+	return (pg << 8) | (mdb_get_int16(mdb->pg_buf, fmt->row_count_offset) - 1);
+}
+/**
+ * mdb_create_index:
+ * @table: Table to index, with its columns and indexes read
+ * @name: Name of the new index
+ * @num_keys: Number of key columns, at most MDB_MAX_IDX_COLS
+ * @col_names: Names of the key columns
+ * @col_orders: MDB_ASC or MDB_DESC for each key column
+ * @flags: MDB_IDX_UNIQUE, MDB_IDX_IGNORENULLS and MDB_IDX_REQUIRED, or 0
+ *
+ * Adds an index to the definition of @table and builds it from the rows
+ * of the table with mdb_index_rebuild().  The columns and indexes of
+ * @table are read again, so bindings have to be set up again.  A unique
+ * index is refused when rows have equal keys, unless they are all NULL.
+ *
+ * Return value: 1 on success, 0 on error.
+ */
+int
+mdb_create_index(MdbTableDef *table, const char *name, unsigned int num_keys, char **col_names, unsigned char *col_orders, int flags)
+{
+	MdbCatalogEntry *entry = table->entry;
+	MdbHandle *mdb = entry->mdb;
+	MdbFormatConstants *fmt = mdb->fmt;
+	MdbColumn *cols[MDB_MAX_IDX_COLS], *col;
+	MdbIndex *idx, new_idx;
+	GByteArray *def, *new_def;
+	GArray *pgs;
+	unsigned char buf[MDB_MAX_OBJ_NAME * 2 + 52];
+	unsigned char *p;
+	unsigned int i, j, num_cols, num_idxs, num_ridxs;
+	int ridx_end, names_end, ridefs_end, idefs_end, inames_end, end;
+	int ridef_sz = IS_JET3(mdb) ? 39 : 52;
+	int idef_sz = IS_JET3(mdb) ? 20 : 28;
+	guint32 map_pg_row;
+	gunichar2 *uname;
+	glong name_len;
+	int ret = 0;
+
+	if (!mdb->f->writable) {
+		fprintf(stderr, "File is not open for writing\n");
+		return 0;
+	}
+	if (!table->columns || (table->num_idxs && !table->indices)) {
+		fprintf(stderr, "Columns and indexes of table %s not read\n", table->name);
+		return 0;
+	}
+	if (!num_keys || num_keys > MDB_MAX_IDX_COLS) {
+		fprintf(stderr, "An index has 1 to %d columns\n", MDB_MAX_IDX_COLS);
+		return 0;
+	}
+	if (strlen(name) > MDB_MAX_OBJ_NAME / 4) {
+		fprintf(stderr, "Index name %s is too long\n", name);
+		return 0;
+	}
+	for (i = 0; i < table->num_idxs; i++) {
+		idx = g_ptr_array_index(table->indices, i);
+		if (!g_ascii_strcasecmp(idx->name, name)) {
+			fprintf(stderr, "Table %s already has an index %s\n", table->name, name);
+			return 0;
+		}
+	}
+	memset(&new_idx, 0, sizeof(new_idx));
+	snprintf(new_idx.name, sizeof(new_idx.name), "%s", name);
+	new_idx.table = table;
+	new_idx.num_keys = num_keys;
+	for (i = 0; i < num_keys; i++) {
+		cols[i] = NULL;
+		for (j = 0; j < table->num_cols; j++) {
+			col = g_ptr_array_index(table->columns, j);
+			if (!g_ascii_strcasecmp(col->name, col_names[i])) {
+				cols[i] = col;
+				new_idx.key_col_num[i] = j + 1;
+			}
+		}
+		new_idx.key_col_order[i] = (col_orders && col_orders[i] == MDB_DESC) ? MDB_DESC : MDB_ASC;
+		if (!cols[i]) {
+			fprintf(stderr, "Column %s not found\n", col_names[i]);
+			return 0;
+		}
+		if (mdb_index_key_size(cols[i]) < 0) {
+			fprintf(stderr, "Can't index column %s of type %s\n",
+				cols[i]->name, mdb_get_colbacktype_string(cols[i]));
+			return 0;
+		}
+		if (cols[i]->col_type == MDB_TEXT && !IS_JET3(mdb)) {
+			fprintf(stderr, "Text keys can't be written in Jet4 databases\n");
+			return 0;
+		}
+	}
+	/* a unique index over equal keys is a corrupt file to Access, look
+	 * before the definition is changed */
+	if ((flags & MDB_IDX_UNIQUE)) {
+		switch (mdb_index_find_duplicates(table, &new_idx)) {
+		case 0:
+			break;
+		case 1:
+			fprintf(stderr, "Rows of table %s have equal keys, can't create unique index %s\n", table->name, name);
+			/* fall through */
+		default:
+			return 0;
+		}
+	}
+
+	pgs = g_array_new(FALSE, FALSE, sizeof(guint32));
+	if (!(def = mdb_tdef_read(table, pgs))) {
+		g_array_free(pgs, TRUE);
+		return 0;
+	}
+	new_def = g_byte_array_new();
+
+	/* find the blocks of the definition */
+	num_cols = mdb_get_int16(def->data, fmt->tab_num_cols_offset);
+	num_idxs = mdb_get_int32(def->data, fmt->tab_num_idxs_offset);
+	num_ridxs = mdb_get_int32(def->data, fmt->tab_num_ridxs_offset);
+	ridx_end = fmt->tab_cols_start_offset + num_ridxs * fmt->tab_ridx_entry_size;
+	names_end = mdb_tdef_skip_names(mdb, def,
+		ridx_end + num_cols * fmt->tab_col_entry_size, num_cols);
+	ridefs_end = names_end + num_ridxs * ridef_sz;
+	idefs_end = ridefs_end + num_idxs * idef_sz;
+	inames_end = (names_end < 0) ? -1 :
+		mdb_tdef_skip_names(mdb, def, idefs_end, num_idxs);
+	/* then the variable column usage maps, up to 0xffff */
+	end = inames_end;
+	while (end >= 0 && end + 2 <= (int) def->len
+			&& mdb_get_int16(def->data, end) != 0xffff)
+		end += 10;
+	if (end < 0 || end + 2 > (int) def->len) {
+		fprintf(stderr, "Unable to parse the definition of table %s\n", table->name);
+		goto out;
+	}
+	end += 2;
+
+	if (!(map_pg_row = mdb_new_usage_map(table)))
+		goto out;
+
+	/* row count block: the first 4 bytes seem to match those of the
+	 * other entries */
+	g_byte_array_append(new_def, def->data, ridx_end);
+	memset(buf, 0, sizeof(buf));
+	if (num_ridxs)
+		memcpy(buf, def->data + fmt->tab_cols_start_offset, 4);
+	g_byte_array_append(new_def, buf, fmt->tab_ridx_entry_size);
+
+	/* columns, their names and the existing index columns */
+	g_byte_array_append(new_def, def->data + ridx_end, ridefs_end - ridx_end);
+	memset(buf, 0, sizeof(buf));
+	p = buf;
+	if (!IS_JET3(mdb)) {
+		if (num_ridxs)
+			memcpy(p, def->data + names_end, 4);
+		p += 4;
+	}
+	for (i = 0; i < MDB_MAX_IDX_COLS; i++, p += 3) {
+		if (i < num_keys) {
+			mdb_put_int16(p, 0, cols[i]->col_num);
+			p[2] = (col_orders && col_orders[i] == MDB_DESC) ? 0 : 1;
+		} else {
+			mdb_put_int16(p, 0, 0xffff);
+		}
+	}
+	mdb_put_int32(p, 0, map_pg_row);
+	/* first page, written by mdb_index_rebuild() */
+	mdb_put_int32(p, 4, 0);
+	p[8] = flags;
+	g_byte_array_append(new_def, buf, ridef_sz);
+
+	/* logical indexes */
+	g_byte_array_append(new_def, def->data + ridefs_end, idefs_end - ridefs_end);
+	memset(buf, 0, sizeof(buf));
+	p = buf;
+	if (!IS_JET3(mdb)) {
+		if (num_idxs)
+			memcpy(p, def->data + ridefs_end, 4);
+		p += 4;
+	}
+	mdb_put_int32(p, 0, num_ridxs);		/* index_num */
+	mdb_put_int32(p, 4, num_ridxs);		/* index_num2 */
+	p[8] = 0;				/* rel_tbl_type */
+	mdb_put_int32(p, 9, 0xffffffff);	/* rel_idx_num */
+	mdb_put_int32(p, 13, 0);		/* rel_tbl_page */
+	g_byte_array_append(new_def, buf, idef_sz);
+
+	/* index names */
+	g_byte_array_append(new_def, def->data + idefs_end, inames_end - idefs_end);
+	if (IS_JET3(mdb)) {
+		buf[0] = mdb_ascii2unicode(mdb, (char *) name, 0, (char *) buf + 1, MDB_MAX_OBJ_NAME);
+		g_byte_array_append(new_def, buf, 1 + buf[0]);
+	} else {
+		/* not compressed */
+		uname = g_utf8_to_utf16(name, -1, NULL, &name_len, NULL);
+		if (!uname) {
+			fprintf(stderr, "Invalid index name %s\n", name);
+			goto out;
+		}
+		mdb_put_int16(buf, 0, name_len * 2);
+		for (i = 0; i < (unsigned int) name_len; i++)
+			mdb_put_int16(buf, 2 + i * 2, uname[i]);
+		g_free(uname);
+		g_byte_array_append(new_def, buf, 2 + name_len * 2);
+	}
+
+	/* variable columns */
+	g_byte_array_append(new_def, def->data + inames_end, end - inames_end);
+
+	mdb_put_int32(new_def->data, fmt->tab_num_idxs_offset, num_idxs + 1);
+	mdb_put_int32(new_def->data, fmt->tab_num_ridxs_offset, num_ridxs + 1);
+	mdb_put_int32(new_def->data, 8, mdb_get_int32(def->data, 8) + new_def->len - end);
+	if (!mdb_tdef_write(table, new_def, pgs))
+		goto out;
+
+	/* read the definition again to get the new index */
+	table->num_idxs = num_idxs + 1;
+	table->num_real_idxs = num_ridxs + 1;
+	mdb_free_indices(table->indices);
+	table->indices = NULL;
+	mdb_free_columns(table->columns);
+	mdb->cur_pg = 0;
+	if (!mdb_read_pg(mdb, entry->table_pg))
+		goto out;
+	mdb_read_columns(table);
+	mdb_read_indices(table);
+	for (i = 0; i < table->num_idxs; i++) {
+		idx = g_ptr_array_index(table->indices, i);
+		if (!g_ascii_strcasecmp(idx->name, name)) {
+			ret = mdb_index_rebuild(table, idx);
+			break;
+		}
+	}
+	if (i == table->num_idxs)
+		fprintf(stderr, "Index %s not found after writing it\n", name);
+out:
+	g_byte_array_free(def, TRUE);
+	g_byte_array_free(new_def, TRUE);
+	g_array_free(pgs, TRUE);
+	return ret;
+}
+/*
+ * Set-based updates.  The rows to change are located first, through the
+ * same index or table scan a query would use, so that moving rows can't
+ * make the scan see them twice.  Each data page is then rebuilt in memory
+ * with all of its changed rows and written once; rows that no longer fit
+ * on their page are marked deleted there and added to other pages.  When
+ * few rows change, the old and new index entries of each are kept, and
+ * only the entries that differ are replaced in the indexes afterwards.
+ */
+/* past this share of the table the indexes are rebuilt instead */
+#define MDB_UPDATE_REBUILD_SHARE 8
+
+typedef struct {
+	unsigned char *buf;	/* new row, kept while it has to move */
+	int size;
+	guint32 pg_row;		/* where it ends up */
+	/* for each index kept up to date, the old entry then the new one,
+	 * each preceded by its guint16 length */
+	GByteArray *ents;
+} MdbUpdateRow;
+
+static GArray *
+mdb_update_collect(MdbTableDef *table)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	GArray *rows;
+	guint32 pg, pg_row;
+	guint16 row;
+
+	rows = g_array_new(FALSE, FALSE, sizeof(guint32));
+	mdb_rewind_table(table);
+	mdb_index_scan_init(mdb, table);
+	if (table->strategy == MDB_INDEX_SCAN) {
+		/* the locations of the rows are needed, so the index
+		 * can't be used as a covering one */
+		while (mdb_index_find_next(table->mdbidx, table->scan_idx, table->chain, &pg, &row)) {
+			if (!mdb_read_pg(mdb, pg))
+				break;
+			if (!mdb_read_row(table, row))
+				continue;
+			pg_row = (pg << 8) | row;
+			g_array_append_val(rows, pg_row);
+		}
+	} else {
+		while (mdb_fetch_row(table)) {
+			pg_row = (mdb->cur_pg << 8) | (table->cur_row - 1);
+			g_array_append_val(rows, pg_row);
+		}
+	}
+	mdb_index_scan_free(table);
+	table->strategy = MDB_TABLE_SCAN;
+	g_array_sort(rows, mdb_pg_cmp);
+
+	return rows;
+}
+static void
+mdb_update_add_entry(GByteArray *ents, unsigned char *ent, int len)
+{
+	guint16 len16 = len;
+
+	g_byte_array_append(ents, (guint8 *) &len16, 2);
+	g_byte_array_append(ents, ent, len);
+}
+/*
+ * build the new version of a row of the page in the handle's buffer, and
+ * its old and new entries in the indexes of idxs
+ */
+static int
+mdb_update_pack(MdbTableDef *table, int row, unsigned int num_sets, MdbField *sets, GPtrArray *idxs, MdbUpdateRow *u)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	MdbField fields[256], new_fields[256];
+	unsigned char row_buffer[4096], ent[MDB_MAX_INDEX_ENTRY];
+	int row_start, len;
+	size_t row_size;
+	unsigned int i;
+
+	mdb_find_row(mdb, row, &row_start, &row_size);
+	row_start &= 0x1fff;
+	mdb_crack_row(table, row_start, row_start + row_size - 1, fields);
+	memcpy(new_fields, fields, table->num_cols * sizeof(MdbField));
+	for (i = 0; i < num_sets; i++) {
+		MdbField *f = &fields[sets[i].colnum];
+		MdbColumn *col = g_ptr_array_index(table->columns, sets[i].colnum);
+
+		/* the LVAL pages of the old value would be lost */
+		if (col->col_type == MDB_MEMO && !f->is_null
+		 && f->siz >= MDB_MEMO_OVERHEAD
+		 && !(mdb_get_int32(f->value, 0) & 0x80000000)
+		 && (mdb_get_int32(f->value, 0) & 0x3fffffff)) {
+			fprintf(stderr, "Column %s has a value stored outside its row, which can't be replaced\n", col->name);
+			return 0;
+		}
+		new_fields[sets[i].colnum] = sets[i];
+	}
+	/* the new entries get the row's final place once it is known */
+	for (i = 0; idxs && i < idxs->len; i++) {
+		if (!u->ents)
+			u->ents = g_byte_array_new();
+		len = mdb_index_row_entry(table, g_ptr_array_index(idxs, i), fields, u->pg_row, ent);
+		mdb_update_add_entry(u->ents, ent, len);
+		len = mdb_index_row_entry(table, g_ptr_array_index(idxs, i), new_fields, u->pg_row, ent);
+		mdb_update_add_entry(u->ents, ent, len);
+	}
+	u->size = mdb_pack_row(table, row_buffer, table->num_cols, new_fields);
+	if (u->size > mdb->fmt->pg_size - mdb->fmt->row_count_offset - 4) {
+		fprintf(stderr, "Updated row is too large for a page\n");
+		return 0;
+	}
+	u->buf = g_memdup(row_buffer, u->size);
+	return 1;
+}
+/*
+ * lay out the rows of the page in the handle's buffer again, with the
+ * new versions of the updated ones.  Rows in moved are left out and
+ * marked deleted.  Returns 0 if they don't fit.
+ */
+static int
+mdb_update_layout(MdbHandle *mdb, unsigned char *pg_buf, MdbUpdateRow *updated, unsigned char *moved)
+{
+	MdbFormatConstants *fmt = mdb->fmt;
+	int rco = fmt->row_count_offset;
+	int num_rows, row_start, pos, i;
+	size_t row_size;
+	unsigned char *src;
+	unsigned int flags;
+
+	num_rows = mdb_get_int16(mdb->pg_buf, rco);
+	memcpy(pg_buf, mdb->pg_buf, rco + 2);
+	pos = fmt->pg_size;
+	for (i = 0; i < num_rows; i++) {
+		mdb_find_row(mdb, i, &row_start, &row_size);
+		flags = row_start & 0xc000;
+		src = mdb->pg_buf + (row_start & 0x1fff);
+		if (moved[i]) {
+			flags = 0x4000;
+			row_size = 0;
+		} else if (updated[i].buf) {
+			src = updated[i].buf;
+			row_size = updated[i].size;
+		}
+		if (pos - (int) row_size < rco + 2 + num_rows * 2)
+			return 0;
+		pos -= row_size;
+		memcpy(pg_buf + pos, src, row_size);
+		mdb_put_int16(pg_buf, rco + 2 + i*2, pos | flags);
+	}
+	mdb_put_int16(pg_buf, 2, pos - rco - 2 - num_rows*2);
+	return 1;
+}
+/*
+ * change the rows of one page, writing it once.  The rows that have to go
+ * to another page are set aside in relocated, and all the changed rows
+ * go to done when idxs has indexes to keep up to date.  With check, only
+ * tell whether the rows can be changed.
+ */
+static int
+mdb_update_pg(MdbTableDef *table, guint32 pg, guint32 *pg_rows, unsigned int n, unsigned int num_sets, MdbField *sets, GPtrArray *idxs, GPtrArray *done, GPtrArray *relocated, int check)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	MdbUpdateRow updated[MDB_MAX_PG_ROWS];
+	unsigned char moved[MDB_MAX_PG_ROWS];
+	unsigned char *pg_buf;
+	unsigned int i, row, grown;
+	int ret = 0;
+
+	if (!mdb_read_pg(mdb, pg))
+		return 0;
+	memset(updated, 0, sizeof(updated));
+	memset(moved, 0, sizeof(moved));
+	for (i = 0; i < n; i++) {
+		updated[pg_rows[i] & 0xff].pg_row = pg_rows[i];
+		if (!mdb_update_pack(table, pg_rows[i] & 0xff, num_sets, sets,
+		 check ? NULL : idxs, &updated[pg_rows[i] & 0xff]))
+			goto out;
+	}
+
+	if (check) {
+		ret = 1;
+		goto out;
+	}
+	pg_buf = g_malloc0(mdb->fmt->pg_size);
+	/* move the rows that grew the most off the page until the rest fit */
+	while (!mdb_update_layout(mdb, pg_buf, updated, moved)) {
+		int row_start, max_growth = G_MININT;
+		size_t row_size;
+
+		grown = MDB_MAX_PG_ROWS;
+		for (i = 0; i < n; i++) {
+			row = pg_rows[i] & 0xff;
+			if (moved[row])
+				continue;
+			mdb_find_row(mdb, row, &row_start, &row_size);
+			if (updated[row].size - (int) row_size > max_growth) {
+				max_growth = updated[row].size - row_size;
+				grown = row;
+			}
+		}
+		if (grown == MDB_MAX_PG_ROWS) {
+			fprintf(stderr, "Unable to fit the rows of page %lu\n", (unsigned long) pg);
+			g_free(pg_buf);
+			goto out;
+		}
+		moved[grown] = 1;
+	}
+	memcpy(mdb->pg_buf, pg_buf, mdb->fmt->pg_size);
+	g_free(pg_buf);
+	mdb->cur_pg = pg;
+	if (!mdb_write_pg(mdb, pg)) {
+		fprintf(stderr, "write failed!\n");
+		goto out;
+	}
+	mdb_map_set_freespace(table, pg, mdb_pg_get_freespace(mdb));
+
+	/* the moved rows are added to other pages once all are updated */
+	for (i = 0; i < n; i++) {
+		MdbUpdateRow *u;
+
+		row = pg_rows[i] & 0xff;
+		if (!moved[row] && !updated[row].ents)
+			continue;
+		u = g_memdup(&updated[row], sizeof(MdbUpdateRow));
+		if (moved[row]) {
+			g_ptr_array_add(relocated, u);
+		} else {
+			g_free(u->buf);
+			u->buf = NULL;
+		}
+		g_ptr_array_add(done, u);
+		updated[row].buf = NULL;
+		updated[row].ents = NULL;
+	}
+	ret = 1;
+out:
+	for (i = 0; i < MDB_MAX_PG_ROWS; i++) {
+		g_free(updated[i].buf);
+		if (updated[i].ents)
+			g_byte_array_free(updated[i].ents, TRUE);
+	}
+	return ret;
+}
+/*
+ * add the rows moved off their pages to pages with room and row numbers
+ * left for them
+ */
+static int
+mdb_update_relocate(MdbTableDef *table, GPtrArray *relocated)
+{
+	MdbBulkInsert *bulk;
+	MdbUpdateRow *u;
+	unsigned int i;
+	int ret = 0;
+
+	bulk = mdb_bulk_insert_begin(table);
+	if (!bulk)
+		return 0;
+	for (i = 0; i < relocated->len; i++) {
+		u = g_ptr_array_index(relocated, i);
+		if (!(u->pg_row = mdb_bulk_insert_add(bulk, u->buf, u->size)))
+			goto out;
+	}
+	ret = mdb_bulk_insert_flush(bulk);
+out:
+	g_free(bulk);
+	return ret;
+}
+/*
+ * replace the entries of the changed rows in the k-th index kept up to
+ * date.  Returns 1 when done, 0 on error and -1 if the index has to be
+ * rebuilt instead.
+ */
+static int
+mdb_update_index_entries(MdbTableDef *table, MdbIndex *idx, unsigned int k, GPtrArray *done)
+{
+	MdbUpdateRow *u;
+	unsigned char *old_ent, *new_ent;
+	guint16 old_len, new_len;
+	unsigned int i, j;
+	int ret;
+
+	for (i = 0; i < done->len; i++) {
+		u = g_ptr_array_index(done, i);
+		old_ent = u->ents->data;
+		for (j = 0; ; j++) {
+			memcpy(&old_len, old_ent, 2);
+			new_ent = old_ent + 2 + old_len;
+			memcpy(&new_len, new_ent, 2);
+			old_ent += 2;
+			new_ent += 2;
+			if (j == k)
+				break;
+			old_ent = new_ent + new_len;
+		}
+		mdb_put_int32_msb(new_ent, new_len - 4, u->pg_row);
+		if (old_len == new_len && !memcmp(old_ent, new_ent, old_len))
+			continue;
+		if ((ret = mdb_index_delete_entry(table, idx, old_ent, old_len)) != 1
+		 || (ret = mdb_index_insert_entry(table, idx, new_ent, new_len)) != 1)
+			return ret;
+	}
+	return 1;
+}
+/**
+ * mdb_update_rows:
+ * @table: Table to update, with its columns and indexes read
+ * @num_sets: Number of values in @sets
+ * @sets: New values, with colnum the position of their column in
+ *        table->columns as in the fields of mdb_crack_row()
+ *
+ * Changes every row of @table matching table->sarg_tree, or all of them
+ * when there is none.  Rows are found through an index when one applies,
+ * each data page holding some of them is written once.  The entries of
+ * the changed rows are then replaced in the indexes over the changed
+ * columns, in all of them if rows had to move to another page.  When more
+ * than an eighth of the table changed, or an index tree can't be changed
+ * in place, the index is rebuilt instead.  OLE columns can't be set, and
+ * MEMO columns only where their current value is stored in the row, as
+ * there is no freeing of LVAL pages yet; nothing is changed otherwise.
+ * Indexes with text keys can't be written in Jet4 databases, those that
+ * would have to change are marked stale instead.
+ *
+ * Return value: the number of rows changed, -1 on error.
+ */
+long
+mdb_update_rows(MdbTableDef *table, unsigned int num_sets, MdbField *sets)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	MdbColumn *col;
+	MdbIndex *idx;
+	GArray *rows;
+	GPtrArray *relocated, *done, *idxs = NULL;
+	guint32 pg, *pg_rows;
+	unsigned int i, j, k, start;
+	int moved = 0, memo = 0, changed, check, r;
+	long ret = -1;
+
+	if (!mdb->f->writable) {
+		fprintf(stderr, "File is not open for writing\n");
+		return -1;
+	}
+	for (i = 0; i < num_sets; i++) {
+		col = g_ptr_array_index(table->columns, sets[i].colnum);
+		if (col->col_type == MDB_OLE) {
+			fprintf(stderr, "Updating OLE columns is not supported\n");
+			return -1;
+		}
+		if (col->col_type == MDB_MEMO)
+			memo = 1;
+	}
+	rows = mdb_update_collect(table);
+	relocated = g_ptr_array_new();
+	done = g_ptr_array_new();
+	pg_rows = (guint32 *) rows->data;
+	if (rows->len && rows->len * MDB_UPDATE_REBUILD_SHARE <= (guint32) table->num_rows) {
+		idxs = g_ptr_array_new();
+		for (i = 0; i < table->num_idxs; i++) {
+			idx = g_ptr_array_index(table->indices, i);
+			if (idx->index_type != 2 && mdb_index_keys_encodable(table, idx))
+				g_ptr_array_add(idxs, idx);
+		}
+	}
+	/* old MEMO values may have LVAL pages, make sure none has before
+	 * changing anything */
+	for (check = memo; check >= 0; check--) {
+		for (start = 0; start < rows->len; start = i) {
+			pg = pg_rows[start] >> 8;
+			for (i = start; i < rows->len && pg_rows[i] >> 8 == pg; i++)
+				;
+			if (!mdb_update_pg(table, pg, &pg_rows[start], i - start,
+			 num_sets, sets, idxs, done, relocated, check))
+				goto out;
+		}
+	}
+	if (relocated->len) {
+		if (!mdb_update_relocate(table, relocated))
+			goto out;
+		moved = 1;
+	}
+
+	/* the rows are where they'll stay, bring the indexes up to date */
+	for (i = 0; rows->len && i < table->num_idxs; i++) {
+		idx = g_ptr_array_index(table->indices, i);
+		if (idx->index_type == 2)
+			continue;
+		changed = moved;
+		for (j = 0; j < idx->num_keys && !changed; j++) {
+			for (k = 0; k < num_sets; k++) {
+				if (idx->key_col_num[j] == sets[k].colnum + 1)
+					changed = 1;
+			}
+		}
+		if (!changed)
+			continue;
+		r = -1;
+		for (k = 0; idxs && k < idxs->len; k++) {
+			if (g_ptr_array_index(idxs, k) == idx)
+				r = mdb_update_index_entries(table, idx, k, done);
+		}
+		/* a tree changed in place that doesn't check out is rebuilt */
+		if (r > 0 && mdb_get_option(MDB_DEBUG_INDEX) && !mdb_index_verify(table, idx))
+			r = -1;
+		if (!r || (r < 0 && !mdb_index_refresh(table, idx)))
+			goto out;
+	}
+	ret = rows->len;
+out:
+	for (i = 0; i < done->len; i++) {
+		MdbUpdateRow *u = g_ptr_array_index(done, i);
+		g_free(u->buf);
+		if (u->ents)
+			g_byte_array_free(u->ents, TRUE);
+		g_free(u);
+	}
+	g_ptr_array_free(done, TRUE);
+	g_ptr_array_free(relocated, TRUE);
+	if (idxs)
+		g_ptr_array_free(idxs, TRUE);
+	g_array_free(rows, TRUE);
+	return ret;
+}
+int 
+mdb_update_row(MdbTableDef *table)
+{
+int row_start, row_end;
+unsigned int i;
+MdbColumn *col;
+MdbCatalogEntry *entry = table->entry;
+MdbHandle *mdb = entry->mdb;
+MdbField fields[256];
+unsigned char row_buffer[4096];
+	size_t old_row_size, new_row_size;
+unsigned int num_fields;
+
+	if (!mdb->f->writable) {
+		fprintf(stderr, "File is not open for writing\n");
+		return 0;
+	}
+	mdb_find_row(mdb, table->cur_row-1, &row_start, &old_row_size);
+	row_end = row_start + old_row_size - 1;
+
+	row_start &= 0x0FFF; /* remove flags */
+
+	mdb_debug(MDB_DEBUG_WRITE,"page %lu row %d start %d end %d", (unsigned long) table->cur_phys_pg, table->cur_row-1, row_start, row_end);
+	if (mdb_get_option(MDB_DEBUG_LIKE))
+		mdb_buffer_dump(mdb->pg_buf, row_start, old_row_size);
+
+	for (i=0;i<table->num_cols;i++) {
+		col = g_ptr_array_index(table->columns,i);
+		if (col->bind_ptr && mdb_is_col_indexed(table,i)) {
+			fprintf(stderr, "Attempting to update column that is part of an index\n");
+			return 0;
+		}
+	}
+	num_fields = mdb_crack_row(table, row_start, row_end, fields);
+
+	if (mdb_get_option(MDB_DEBUG_WRITE)) {
+		for (i=0;i<num_fields;i++) {
+			//printf("col %d %d start %d siz %d fixed 5d\n", i, fields[i].colnum, fields[i].start, fields[i].siz, fields[i].is_fixed);
+		}
+	}
+	for (i=0;i<table->num_cols;i++) {
+		col = g_ptr_array_index(table->columns,i);
+		if (col->bind_ptr) {
+			fields[i].value = col->bind_ptr;
+			fields[i].siz = *(col->len_ptr);
+		}
+	}
+
+	new_row_size = mdb_pack_row(table, row_buffer, num_fields, fields);
+	if (mdb_get_option(MDB_DEBUG_WRITE)) 
+		mdb_buffer_dump(row_buffer, 0, new_row_size);
+	if (new_row_size > (old_row_size + mdb_pg_get_freespace(mdb))) {
+		fprintf(stderr, "No space left on this page, update will not occur\n");
+		return 0;
+	}
+	/* do it! */
+	mdb_replace_row(table, table->cur_row-1, row_buffer, new_row_size);
+	return 0; /* FIXME */
+}
+
+/* WARNING the return code is opposite to convention used elsewhere:
+ * returns 0 on success
+ * returns 1 on failure
+ * This might change on next ABI break.
+ */
+int 
+mdb_replace_row(MdbTableDef *table, int row, void *new_row, int new_row_size)
+{
+MdbCatalogEntry *entry = table->entry;
+MdbHandle *mdb = entry->mdb;
+int pg_size = mdb->fmt->pg_size;
+int rco = mdb->fmt->row_count_offset;
+	void *new_pg;
+guint16 num_rows;
+	int row_start;
+	size_t row_size;
+int i, pos;
+
+	if (mdb_get_option(MDB_DEBUG_WRITE)) {
+		mdb_buffer_dump(mdb->pg_buf, 0, 40);
+		mdb_buffer_dump(mdb->pg_buf, pg_size - 160, 160);
+	}
+	mdb_debug(MDB_DEBUG_WRITE,"updating row %d on page %lu", row, (unsigned long) table->cur_phys_pg);
+	new_pg = mdb_new_data_pg(entry);
+
+	num_rows = mdb_get_int16(mdb->pg_buf, rco);
+	mdb_put_int16(new_pg, rco, num_rows);
+
+	pos = pg_size;
+
+	/* rows before */
+	for (i=0;i<row;i++) {
+		mdb_find_row(mdb, i, &row_start, &row_size);
+		pos -= row_size;
+		memcpy((char*)new_pg + pos, mdb->pg_buf + row_start, row_size);
+		mdb_put_int16(new_pg, rco + 2 + i*2, pos);
+	}
+	
+	/* our row */
+	pos -= new_row_size;
+	memcpy((char*)new_pg + pos, new_row, new_row_size);
+	mdb_put_int16(new_pg, rco + 2 + row*2, pos);
+	
+	/* rows after */
+	for (i=row+1;i<num_rows;i++) {
+		mdb_find_row(mdb, i, &row_start, &row_size);
+		pos -= row_size;
+		memcpy((char*)new_pg + pos, mdb->pg_buf + row_start, row_size);
+		mdb_put_int16(new_pg, rco + 2 + i*2, pos);
+	}
+
+	/* almost done, copy page over current */
+	memcpy(mdb->pg_buf, new_pg, pg_size);
+
+	g_free(new_pg);
+
+	mdb_put_int16(mdb->pg_buf, 2, mdb_pg_get_freespace(mdb));
+	if (mdb_get_option(MDB_DEBUG_WRITE)) {
+		mdb_buffer_dump(mdb->pg_buf, 0, 40);
+		mdb_buffer_dump(mdb->pg_buf, pg_size - 160, 160);
+	}
+	/* drum roll, please */
+	if (!mdb_write_pg(mdb, table->cur_phys_pg)) {
+		fprintf(stderr, "write failed!\n");
+		return 1;
+	}
+	mdb_map_set_freespace(table, table->cur_phys_pg, mdb_pg_get_freespace(mdb));
+	return 0;
+}
+static int
+mdb_add_row_to_leaf_pg(MdbTableDef *table, MdbIndex *idx, MdbIndexPage *ipg, MdbField *idx_fields, guint32 pgnum, guint16 rownum) 
+/*,  guint32 pgnum, guint16 rownum) 
+static int
+mdb_copy_index_pg(MdbTableDef *table, MdbIndex *idx, MdbIndexPage *ipg)
+*/
+{
+	MdbCatalogEntry *entry = table->entry;
+	MdbHandle *mdb = entry->mdb;
+	MdbColumn *col;
+	guint32 pg_row;
+	void *new_pg;
+	unsigned char key_hash[256];
+	/* entry starts in page order, as mdb_index_pack_bitmap() takes them */
+	guint16 idx_starts[MDB_PGSIZE];
+	unsigned int num_ents = 0;
+	int keycol;
+
+	new_pg = mdb_new_leaf_pg(entry);
+
+	/* reinitial ipg pointers to start of page */
+	mdb_index_page_reset(ipg);
+	mdb_read_pg(mdb, ipg->pg);
+
+	/* do we support this index type yet? */
+	if (idx->num_keys > 1) {
+		fprintf(stderr,"multikey indexes not yet supported, aborting\n");
+		return 0;
+	}
+	keycol = idx->key_col_num[0];
+	col = g_ptr_array_index (table->columns, keycol - 1);
+	if (!col->is_fixed) {
+		fprintf(stderr,"variable length key columns not yet supported, aborting\n");
+		return 0;
+	}
+
+	while (mdb_index_find_next_on_page(mdb, ipg)) {
+
+		/* check for compressed indexes.  */
+		if (ipg->len < col->col_size + 1) {
+			fprintf(stderr,"compressed indexes not yet supported, aborting\n");
+			return 0;
+		}
+
+		pg_row = mdb_get_int32_msb(mdb->pg_buf, ipg->offset + ipg->len - 4);
 		/* guint32 pg = pg_row >> 8; */
-		row = pg_row & 0xff;
+		/* guint16 row = pg_row & 0xff; */
 		/* unsigned char iflag = mdb->pg_buf[ipg->offset]; */
 
 		/* turn the key hash back into a value */
@@ -839,13 +3444,12 @@ mdb_copy_index_pg(MdbTableDef *table, MdbIndex *idx, MdbIndexPage *ipg)
 		}
 
 		memcpy((char*)new_pg + ipg->offset, mdb->pg_buf + ipg->offset, ipg->len);
+		idx_starts[num_ents++] = ipg->offset;
 		ipg->offset += ipg->len;
 		ipg->len = 0;
-
-		row++;
 	}
 
-	if (!row) {
+	if (!num_ents) {
 		fprintf(stderr,"missing indexes not yet supported, aborting\n");
 		return 0;
 	}
@@ -865,14 +3469,15 @@ mdb_copy_index_pg(MdbTableDef *table, MdbIndex *idx, MdbIndexPage *ipg)
 	((char *)new_pg)[ipg->offset] = 0x7f;
 	memcpy((char*)new_pg + ipg->offset + 1, key_hash, col->col_size);
 	pg_row = (pgnum << 8) | ((rownum-1) & 0xff);
-	mdb_put_int32_msb(new_pg, ipg->offset + 5, pg_row);
-	ipg->idx_starts[row++] = ipg->offset + ipg->len;
-	//ipg->idx_starts[row] = ipg->offset + ipg->len;
+	mdb_put_int32_msb(new_pg, ipg->offset + 1 + col->col_size, pg_row);
+	idx_starts[num_ents++] = ipg->offset;
+	idx_starts[num_ents++] = ipg->offset + col->col_size + 5;
+	idx_starts[num_ents] = 0;
 	if (mdb_get_option(MDB_DEBUG_WRITE)) {
 		mdb_buffer_dump(mdb->pg_buf, 0, mdb->fmt->pg_size);
 	}
 	memcpy(mdb->pg_buf, new_pg, mdb->fmt->pg_size);
-	mdb_index_pack_bitmap(mdb, ipg);
+	mdb_index_pack_bitmap(mdb, idx_starts);
 	if (mdb_get_option(MDB_DEBUG_WRITE)) {
 		mdb_buffer_dump(mdb->pg_buf, 0, mdb->fmt->pg_size);
 	}
@@ -44,6 +44,7 @@ int yyparse (void);
 int yyparse ();
 #endif
 #endif /* ! YYPARSE_PARAM */
+void mdb_sql_lex_reset(void);
 
 void
 mdb_sql_error(MdbSQL* sql, char *fmt, ...)
@@ -80,6 +81,7 @@ MdbSQL *sql;
 	sql->sarg_tree = NULL;
 	sql->sarg_stack = NULL;
 	sql->max_rows = -1;
+	sql->rows_affected = -1;
 
 	return sql;
 }
@@ -109,6 +111,8 @@ mdb_sql_run_query (MdbSQL* sql, const gchar* querystr) {
 	/* begin unsafe */
 	_mdb_sql (sql);
 	sql->error_msg[0]='\0';
+	sql->rows_affected = -1;
+	mdb_sql_lex_reset();
 	if (yyparse()) {
 		/* end unsafe */
 		mdb_sql_error (sql, _("Could not parse '%s' command"), querystr);
@@ -116,6 +120,10 @@ mdb_sql_run_query (MdbSQL* sql, const gchar* querystr) {
 		return NULL;
 	}
 
+	/* statements changing the database have no result */
+	if (sql->cur_table == NULL && sql->rows_affected >= 0)
+		return sql;
+
 	if (sql->cur_table == NULL) {
 		/* Invalid column name? (should get caught by mdb_sql_select,
 		 * but it appeared to happen anyway with 0.5) */
@@ -140,6 +148,7 @@ static void mdb_sql_free_columns(GPtrArray *columns)
 	for (i=0; i<columns->len; i++) {
 		MdbSQLColumn *c = (MdbSQLColumn *)g_ptr_array_index(columns, i);
 		g_free(c->name);
+		g_free(c->value);
 		g_free(c);
 	}
 	g_ptr_array_free(columns, TRUE);
@@ -181,10 +190,10 @@ MdbHandle *mdb_sql_open(MdbSQL *sql, char *db_name)
 	
 #endif
 
-	sql->mdb = mdb_open(db_namep, MDB_NOFLAGS);
+	sql->mdb = mdb_open(db_namep, sql->writable ? MDB_WRITABLE : MDB_NOFLAGS);
 	if ((!sql->mdb) && (!strstr(db_namep, ".mdb"))) {
 		char *tmpstr = (char *) g_strconcat(db_namep, ".mdb", NULL);
-		sql->mdb = mdb_open(tmpstr, MDB_NOFLAGS);
+		sql->mdb = mdb_open(tmpstr, sql->writable ? MDB_WRITABLE : MDB_NOFLAGS);
 		g_free(tmpstr);
 	}
 	if (!sql->mdb) {
@@ -399,15 +408,16 @@ mdb_sql_add_sarg(MdbSQL *sql, char *col_name, int op, char *constant)
 		mdb_sql_push_node(sql, node);
 		return 0;
 	}
-	/* FIX ME -- we should probably just be storing the ascii value until the 
-	** column definition can be checked for validity
+	/* 
+	** keep the ascii value until the column type is known, 
+	** mdb_sql_find_sargcol() converts it
 	*/
 	if (constant[0]=='\'') {
 		lastchar = strlen(constant) > 256 ? 256 : strlen(constant);
 		strncpy(node->value.s, &constant[1], lastchar - 2);;
 		node->value.s[lastchar - 1]='\0';
 	} else {
-		node->value.i = atoi(constant);
+		strncpy(node->value.s, constant, sizeof(node->value.s) - 1);
 	}
 
 	mdb_sql_push_node(sql, node);
@@ -429,6 +439,24 @@ int mdb_sql_add_column(MdbSQL *sql, char *column_name)
 	sql->num_columns++;
 	return 0;
 }
+int mdb_sql_add_index_column(MdbSQL *sql, char *column_name, int order)
+{
+	MdbSQLColumn *c;
+
+	mdb_sql_add_column(sql, column_name);
+	c = g_ptr_array_index(sql->columns, sql->num_columns - 1);
+	c->order = order;
+	return 0;
+}
+int mdb_sql_add_set(MdbSQL *sql, char *column_name, char *constant)
+{
+	MdbSQLColumn *c;
+
+	mdb_sql_add_column(sql, column_name);
+	c = g_ptr_array_index(sql->columns, sql->num_columns - 1);
+	c->value = g_strdup(constant);
+	return 0;
+}
 int mdb_sql_add_table(MdbSQL *sql, char *table_name)
 {
 	MdbSQLTable *t;
@@ -509,6 +537,7 @@ void mdb_sql_reset(MdbSQL *sql)
 
 	sql->all_columns = 0;
 	sql->max_rows = -1;
+	sql->rows_affected = -1;
 }
 static void print_break(int sz, int first)
 {
@@ -646,6 +675,58 @@ void mdb_sql_describe_table(MdbSQL *sql)
 	sql->cur_table = ttable;
 }
 
+void mdb_sql_create_index(MdbSQL *sql, char *index_name, int unique)
+{
+	MdbTableDef *table;
+	MdbSQLTable *sql_tab;
+	MdbSQLColumn *sqlcol;
+	MdbHandle *mdb = sql->mdb;
+	char *col_names[MDB_MAX_IDX_COLS];
+	unsigned char col_orders[MDB_MAX_IDX_COLS];
+	unsigned int i;
+
+	if (!mdb) {
+		mdb_sql_error(sql, "You must connect to a database first");
+		return;
+	}
+	if (!mdb->f->writable) {
+		mdb_sql_error(sql, "The database is not open for writing");
+		mdb_sql_reset(sql);
+		return;
+	}
+	if (sql->num_columns > MDB_MAX_IDX_COLS) {
+		mdb_sql_error(sql, "An index has at most %d columns", MDB_MAX_IDX_COLS);
+		mdb_sql_reset(sql);
+		return;
+	}
+
+	sql_tab = g_ptr_array_index(sql->tables,0);
+
+	table = mdb_read_table_by_name(mdb, sql_tab->name, MDB_TABLE);
+	if (!table) {
+		mdb_sql_error(sql, "%s is not a table in this database", sql_tab->name);
+		/* the column and table names are no good now */
+		mdb_sql_reset(sql);
+		return;
+	}
+	mdb_read_columns(table);
+	mdb_read_indices(table);
+
+	for (i=0;i<sql->num_columns;i++) {
+		sqlcol = g_ptr_array_index(sql->columns,i);
+		col_names[i] = sqlcol->name;
+		col_orders[i] = sqlcol->order;
+	}
+	if (mdb_create_index(table, index_name, sql->num_columns, col_names,
+			col_orders, unique ? MDB_IDX_UNIQUE : 0)) {
+		sql->rows_affected = table->num_rows;
+	} else {
+		mdb_sql_error(sql, "Unable to create index %s", index_name);
+		mdb_sql_reset(sql);
+	}
+	mdb_free_tabledef(table);
+}
+
 int mdb_sql_find_sargcol(MdbSargNode *node, gpointer data)
 {
 	MdbTableDef *table = data;
@@ -662,8 +743,135 @@ int mdb_sql_find_sargcol(MdbSargNode *node, gpointer data)
 			break;
 		}
 	}
+	if (!node->col) return 0;
+
+	/* the literal is still text, read it the way the column is tested */
+	switch (node->col->col_type) {
+		case MDB_TEXT:
+		case MDB_MEMO:
+		case MDB_REPID:
+			break;
+		case MDB_FLOAT:
+		case MDB_DOUBLE:
+		case MDB_MONEY:
+		case MDB_NUMERIC:
+			node->value.d = g_ascii_strtod(node->value.s, NULL);
+			break;
+		default:
+			node->value.i = atoi(node->value.s);
+			break;
+	}
 	return 0;
 }
+/*
+ * turn a literal of an UPDATE into the value of a field of col
+ */
+static int
+mdb_sql_convert_value(MdbSQL *sql, MdbColumn *col, char *constant, MdbField *field)
+{
+	char *s;
+	size_t i, j, len;
+	int ret;
+
+	/* strip the quotes of a string and undouble the ones inside */
+	if (constant && constant[0]=='\'') {
+		len = strlen(constant);
+		s = g_malloc(len);
+		for (i=1, j=0; i<len-1; i++) {
+			s[j++] = constant[i];
+			if (constant[i]=='\'' && constant[i+1]=='\'')
+				i++;
+		}
+		s[j] = '\0';
+	} else {
+		s = g_strdup(constant);
+	}
+	ret = mdb_string_to_field(sql->mdb, col, s, field);
+	if (!ret)
+		mdb_sql_error(sql, "%s is not a valid value for column %s", s, col->name);
+	else if (ret == 2)
+		fprintf(stderr, "Warning: MEMO value for column %s truncated to fit in the row\n", col->name);
+	g_free(s);
+	return ret;
+}
+void mdb_sql_update(MdbSQL *sql)
+{
+	MdbTableDef *table;
+	MdbSQLTable *sql_tab;
+	MdbSQLColumn *sqlcol;
+	MdbColumn *col;
+	MdbHandle *mdb = sql->mdb;
+	MdbField *sets;
+	unsigned int i, j;
+	long rows;
+
+	if (!mdb) {
+		mdb_sql_error(sql, "You must connect to a database first");
+		return;
+	}
+	if (!mdb->f->writable) {
+		mdb_sql_error(sql, "The database is not open for writing");
+		mdb_sql_reset(sql);
+		return;
+	}
+
+	sql_tab = g_ptr_array_index(sql->tables,0);
+
+	table = mdb_read_table_by_name(mdb, sql_tab->name, MDB_TABLE);
+	if (!table) {
+		mdb_sql_error(sql, "%s is not a table in this database", sql_tab->name);
+		/* the column and table names are no good now */
+		mdb_sql_reset(sql);
+		return;
+	}
+	mdb_read_columns(table);
+	mdb_read_indices(table);
+
+	sets = g_malloc0(sql->num_columns * sizeof(MdbField));
+	for (i=0;i<sql->num_columns;i++) {
+		sqlcol = g_ptr_array_index(sql->columns,i);
+		for (j=0;j<table->num_cols;j++) {
+			col=g_ptr_array_index(table->columns,j);
+			if (!g_ascii_strcasecmp(sqlcol->name, col->name))
+				break;
+		}
+		if (j == table->num_cols) {
+			mdb_sql_error(sql, "Column %s not found",sqlcol->name);
+			goto out;
+		}
+		sets[i].colnum = j;
+		if (!mdb_sql_convert_value(sql, col, sqlcol->value, &sets[i]))
+			goto out;
+	}
+
+	/* 
+	 * resolve column names to MdbColumn structs
+	 */
+	if (sql->sarg_tree) {
+		mdb_sql_walk_tree(sql->sarg_tree, mdb_sql_find_sargcol, table);
+		mdb_sql_walk_tree(sql->sarg_tree, mdb_find_indexable_sargs, NULL);
+	}
+	table->sarg_tree = sql->sarg_tree;
+	sql->sarg_tree = NULL;
+
+	rows = mdb_update_rows(table, sql->num_columns, sets);
+	if (rows < 0)
+		mdb_sql_error(sql, "Unable to update table %s", sql_tab->name);
+	else
+		sql->rows_affected = rows;
+
+	if (table->sarg_tree) {
+		mdb_sql_free_tree(table->sarg_tree);
+		table->sarg_tree = NULL;
+	}
+out:
+	for (i=0;i<sql->num_columns;i++)
+		g_free(sets[i].value);
+	g_free(sets);
+	mdb_free_tabledef(table);
+	if (mdb_sql_has_error(sql))
+		mdb_sql_reset(sql);
+}
 void 
 mdb_sql_select(MdbSQL *sql)
 {
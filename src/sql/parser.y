@@ -45,11 +45,15 @@ static MdbSQL *g_sql;
 %token SELECT FROM WHERE CONNECT DISCONNECT TO LIST TABLES AND OR NOT
 %token DESCRIBE TABLE
 %token LTEQ GTEQ LIKE IS NUL
+%token CREATE UNIQUE INDEX ON ASC DESC
+%token UPDATE SET
 
 %type <name> database
 %type <name> constant
 %type <ival> operator
 %type <ival> nulloperator
+%type <ival> unique
+%type <ival> sort_order
 %type <name> identifier
 
 %%
@@ -75,6 +79,53 @@ query:
 	|	LIST TABLES { 
 			mdb_sql_listtables(_mdb_sql(NULL)); 
 		}
+	|	CREATE unique INDEX identifier ON table '(' index_column_list ')' {
+			mdb_sql_create_index(_mdb_sql(NULL), $4, $2);
+			free($4);
+		}
+	|	UPDATE table SET set_list where_clause {
+			mdb_sql_update(_mdb_sql(NULL));
+		}
+	;
+
+set_list:
+	set_item
+	|	set_item ',' set_list
+	;
+
+set_item:
+	identifier '=' constant {
+			mdb_sql_add_set(_mdb_sql(NULL), $1, $3);
+			free($1);
+			free($3);
+		}
+	|	identifier '=' NUL {
+			mdb_sql_add_set(_mdb_sql(NULL), $1, NULL);
+			free($1);
+		}
+	;
+
+unique:
+	/* empty */	{ $$ = 0; }
+	| UNIQUE	{ $$ = 1; }
+	;
+
+index_column_list:
+	index_column
+	|	index_column ',' index_column_list
+	;
+
+index_column:
+	identifier sort_order {
+			mdb_sql_add_index_column(_mdb_sql(NULL), $1, $2);
+			free($1);
+		}
+	;
+
+sort_order:
+	/* empty */	{ $$ = MDB_ASC; }
+	| ASC	{ $$ = MDB_ASC; }
+	| DESC	{ $$ = MDB_DESC; }
 	;
 
 where_clause:
@@ -0,0 +1,117 @@
+/* MDB Tools - A library for reading MS Access database file
+ * Copyright (C) 2000 Brian Bruns
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/* this utility rewrites the rows of tables to densely packed pages */
+
+#include "mdbtools.h"
+
+#ifdef DMALLOC
+#include "dmalloc.h"
+#endif
+
+static int
+compact_table(MdbCatalogEntry *entry, int verbose)
+{
+	MdbTableDef *table;
+	int ret;
+
+	table = mdb_read_table(entry);
+	if (!table) {
+		fprintf(stderr, "Unable to read table %s\n", entry->object_name);
+		return 0;
+	}
+	mdb_read_columns(table);
+	mdb_read_indices(table);
+	ret = mdb_compact_table(table);
+	if (ret && verbose)
+		printf("%s: %u rows\n", entry->object_name, table->num_rows);
+	else if (!ret)
+		fprintf(stderr, "Compacting table %s failed\n", entry->object_name);
+	mdb_free_tabledef(table);
+	return ret;
+}
+int
+main(int argc, char **argv)
+{
+	MdbHandle *mdb;
+	MdbCatalogEntry *entry;
+	unsigned int i;
+	int verbose = 0, found = 0, ret = 0;
+
+	GOptionEntry entries[] = {
+		{ "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose, "Print each table compacted", NULL},
+		{ NULL },
+	};
+	GError *error = NULL;
+	GOptionContext *opt_context;
+
+	opt_context = g_option_context_new("<file> [<table>] - rewrite tables to densely packed pages");
+	g_option_context_add_main_entries(opt_context, entries, NULL /*i18n*/);
+	// g_option_context_set_strict_posix(opt_context, TRUE); /* options first, requires glib 2.44 */
+	if (!g_option_context_parse (opt_context, &argc, &argv, &error))
+	{
+		fprintf(stderr, "option parsing failed: %s\n", error->message);
+		fputs(g_option_context_get_help(opt_context, TRUE, NULL), stderr);
+		exit (1);
+	}
+
+	if (argc < 2 || argc > 3) {
+		fputs("Wrong number of arguments.\n\n", stderr);
+		fputs(g_option_context_get_help(opt_context, TRUE, NULL), stderr);
+		exit(1);
+	}
+
+	if (!(mdb = mdb_open(argv[1], MDB_WRITABLE | MDB_WRITEBACK))) {
+		fprintf(stderr, "Couldn't open database.\n");
+		exit(1);
+	}
+	if (!mdb_read_catalog(mdb, MDB_TABLE)) {
+		fprintf(stderr, "File does not appear to be an Access database\n");
+		exit(1);
+	}
+
+	/* the named table, or all the user tables */
+	for (i = 0; i < mdb->num_catalog; i++) {
+		entry = g_ptr_array_index(mdb->catalog, i);
+		if (entry->object_type != MDB_TABLE)
+			continue;
+		if (argc == 3) {
+			if (g_ascii_strcasecmp(entry->object_name, argv[2]))
+				continue;
+		} else if (mdb_is_system_table(entry)) {
+			continue;
+		}
+		found = 1;
+		if (!compact_table(entry, verbose)) {
+			ret = 1;
+			break;
+		}
+	}
+	if (argc == 3 && !found) {
+		fprintf(stderr, "Table %s not found in database\n", argv[2]);
+		ret = 1;
+	}
+	if (!mdb_flush(mdb)) {
+		fprintf(stderr, "Writing the database failed\n");
+		ret = 1;
+	}
+
+	mdb_close(mdb);
+	g_option_context_free(opt_context);
+	return ret;
+}
@@ -16,7 +16,17 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <errno.h>
 #include "mdbtools.h"
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef SQL
+#include "mdbsql.h"
+#endif
 
 #ifdef DMALLOC
 #include "dmalloc.h"
@@ -31,89 +41,1319 @@
 static char *escapes(char *s);
 
 //#define DONT_ESCAPE_ESCAPE
+
+/* output is gathered here and written out in large blocks */
+#define EXPORT_BUFFER_SIZE (1024 * 1024)
+
+enum {
+	EXPORT_COMPRESS_NONE,
+	EXPORT_COMPRESS_GZIP,
+	EXPORT_COMPRESS_ZSTD
+};
+
+typedef struct _ExportCompressor ExportCompressor;
+
+/* a block of output, compressed on a thread of the pool by itself */
+typedef struct {
+	ExportCompressor *z;
+	char *in;	/* EXPORT_BUFFER_SIZE bytes, taken from the ExportBuffer */
+	size_t in_len;
+	char *out;
+	size_t out_size;
+	size_t out_len;
+	int done;	/* guarded by the compressor's lock */
+} ExportBlock;
+
+/* how many blocks the compressors of every file being written may hold
+ * between them, so memory doesn't grow with the number of files */
+typedef struct {
+	GMutex lock;
+	GCond cond;
+	guint left;
+} ExportBlockBudget;
+
+/*
+ * compresses the output to a file a block at a time, each into a gzip
+ * member or zstd frame of its own so the blocks don't depend on each other
+ * and can be compressed at once.  The members of a file written this way
+ * form a single valid stream.  Finished blocks are written in order by the
+ * thread doing the export.
+ */
+struct _ExportCompressor {
+	FILE *f;
+	int method;
+	int level;
+	GThreadPool *pool;
+	ExportBlockBudget *budget;
+	ExportBlock *blocks;	/* a ring of num_blocks */
+	guint num_blocks;
+	guint head;		/* the next block to write */
+	guint tail;		/* the next block to fill */
+	GMutex lock;
+	GCond cond;
+	size_t written;
+};
+
+/* with f NULL the buffer grows instead, to hold a chunk of a pipelined
+ * export until its turn to be written */
+typedef struct {
+	FILE *f;
+	ExportCompressor *z;	/* when the output is compressed */
+	char *buf;
+	size_t len;
+	size_t size;
+	size_t total;	/* bytes written to f so far */
+} ExportBuffer;
+
+/* how text-like fields are quoted, worked out once */
+typedef struct {
+	char *quote;
+	size_t quote_len;
+	char *escape;
+	size_t escape_len;	/* 0 when quotes are doubled */
+	int bin_mode;
+	/* bytes that may need more than copying, and a single one of them
+	 * when there is only one so memchr() can look for it */
+	unsigned char special[256];
+	unsigned char special_octal[256];
+	int single;
+} ExportQuoting;
+
+/* the \ooo escapes of octal binary mode */
+static char octal_escapes[256][5];
+
+/* thread pool function: compress a block */
 static void
-print_col(FILE *outfile, gchar *col_val, int quote_text, int col_type, int bin_len, char *quote_char, char *escape_char, int bin_mode)
-/* quote_text: Don't quote if 0.
+compress_block(gpointer data, gpointer user_data)
+{
+	ExportBlock *b = data;
+	ExportCompressor *z = b->z;
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+	size_t bound;
+#endif
+#ifdef HAVE_ZLIB
+	z_stream strm;
+#endif
+
+	switch (z->method) {
+#ifdef HAVE_ZLIB
+	case EXPORT_COMPRESS_GZIP:
+		memset(&strm, 0, sizeof(strm));
+		/* 16 more window bits for a gzip header and trailer */
+		if (deflateInit2(&strm, z->level, Z_DEFLATED, 15 + 16, 8,
+		    Z_DEFAULT_STRATEGY) != Z_OK) {
+			fprintf(stderr, "Error: could not start compression\n");
+			exit(1);
+		}
+		bound = deflateBound(&strm, b->in_len);
+		if (b->out_size < bound) {
+			b->out_size = bound;
+			b->out = g_realloc(b->out, b->out_size);
+		}
+		strm.next_in = (Bytef *)b->in;
+		strm.avail_in = b->in_len;
+		strm.next_out = (Bytef *)b->out;
+		strm.avail_out = b->out_size;
+		if (deflate(&strm, Z_FINISH) != Z_STREAM_END) {
+			fprintf(stderr, "Error: compression failed\n");
+			exit(1);
+		}
+		b->out_len = strm.total_out;
+		deflateEnd(&strm);
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case EXPORT_COMPRESS_ZSTD:
+		bound = ZSTD_compressBound(b->in_len);
+		if (b->out_size < bound) {
+			b->out_size = bound;
+			b->out = g_realloc(b->out, b->out_size);
+		}
+		b->out_len = ZSTD_compress(b->out, b->out_size, b->in, b->in_len, z->level);
+		if (ZSTD_isError(b->out_len)) {
+			fprintf(stderr, "Error: compression failed: %s\n",
+				ZSTD_getErrorName(b->out_len));
+			exit(1);
+		}
+		break;
+#endif
+	}
+
+	g_mutex_lock(&z->lock);
+	b->done = 1;
+	g_cond_broadcast(&z->cond);
+	g_mutex_unlock(&z->lock);
+}
+static ExportBlockBudget *
+budget_new(guint blocks)
+{
+	ExportBlockBudget *budget = g_new0(ExportBlockBudget, 1);
+
+	g_mutex_init(&budget->lock);
+	g_cond_init(&budget->cond);
+	budget->left = blocks;
+	return budget;
+}
+static void
+budget_free(ExportBlockBudget *budget)
+{
+	g_mutex_clear(&budget->lock);
+	g_cond_clear(&budget->cond);
+	g_free(budget);
+}
+/* take a block from the budget, waiting for one if wait is set */
+static int
+budget_take(ExportBlockBudget *budget, int wait)
+{
+	int taken = 0;
+
+	g_mutex_lock(&budget->lock);
+	while (wait && !budget->left)
+		g_cond_wait(&budget->cond, &budget->lock);
+	if (budget->left) {
+		budget->left--;
+		taken = 1;
+	}
+	g_mutex_unlock(&budget->lock);
+	return taken;
+}
+static void
+budget_give(ExportBlockBudget *budget)
+{
+	g_mutex_lock(&budget->lock);
+	budget->left++;
+	g_cond_signal(&budget->cond);
+	g_mutex_unlock(&budget->lock);
+}
+static ExportCompressor *
+compressor_new(FILE *f, int method, int level, GThreadPool *pool, ExportBlockBudget *budget)
+{
+	ExportCompressor *z = g_new0(ExportCompressor, 1);
+	guint i;
+
+	z->f = f;
+	z->method = method;
+	z->level = level;
+	z->pool = pool;
+	z->budget = budget;
+	/* enough to keep every thread busy while the writer catches up, if
+	 * the budget allows */
+	z->num_blocks = 2 * g_thread_pool_get_max_threads(pool) + 1;
+	z->blocks = g_new0(ExportBlock, z->num_blocks);
+	for (i=0; i<z->num_blocks; i++)
+		z->blocks[i].z = z;
+	g_mutex_init(&z->lock);
+	g_cond_init(&z->cond);
+	return z;
+}
+/*
+ * write out the finished blocks, in order, waiting for them until no more
+ * than keep are left in the pool
  */
+static void
+compressor_drain(ExportCompressor *z, guint keep)
+{
+	ExportBlock *b;
+	int ready;
+
+	while (z->head != z->tail) {
+		b = &z->blocks[z->head % z->num_blocks];
+		g_mutex_lock(&z->lock);
+		while (!b->done && z->tail - z->head > keep)
+			g_cond_wait(&z->cond, &z->lock);
+		ready = b->done;
+		g_mutex_unlock(&z->lock);
+		if (!ready)
+			return;
+		if (fwrite(b->out, 1, b->out_len, z->f) != b->out_len) {
+			fprintf(stderr, "Error writing output\n");
+			exit(1);
+		}
+		z->written += b->out_len;
+		z->head++;
+		/* give the memory back with the block */
+		g_free(b->in);
+		g_free(b->out);
+		b->in = b->out = NULL;
+		b->out_size = 0;
+		budget_give(z->budget);
+	}
+}
+/* hand the buffered output to the pool, in a block of the budget */
+static void
+compressor_submit(ExportCompressor *z, ExportBuffer *out)
+{
+	ExportBlock *b;
+
+	compressor_drain(z, z->num_blocks - 1);
+	/* only wait on the other files when none of our blocks can be
+	 * written to free one, so they can't all wait on each other */
+	while (!budget_take(z->budget, z->head == z->tail))
+		compressor_drain(z, z->tail - z->head - 1);
+	b = &z->blocks[z->tail % z->num_blocks];
+	b->in = out->buf;
+	b->in_len = out->len;
+	b->done = 0;
+	out->buf = g_malloc(out->size);
+	z->tail++;
+	g_thread_pool_push(z->pool, b, NULL);
+	/* write what is ready, without waiting */
+	compressor_drain(z, z->num_blocks);
+}
+/* write the rest and free the compressor, returning the bytes written */
+static size_t
+compressor_close(ExportCompressor *z, ExportBuffer *out)
+{
+	size_t written;
+	guint i;
+
+	/* an empty file is not a valid stream, an empty member is */
+	if (out->len || !z->tail)
+		compressor_submit(z, out);
+	compressor_drain(z, 0);
+	written = z->written;
+	for (i=0; i<z->num_blocks; i++) {
+		g_free(z->blocks[i].in);
+		g_free(z->blocks[i].out);
+	}
+	g_free(z->blocks);
+	g_mutex_clear(&z->lock);
+	g_cond_clear(&z->cond);
+	g_free(z);
+	out->z = NULL;
+	out->len = 0;
+	return written;
+}
+static void
+buf_flush(ExportBuffer *out)
+{
+	if (out->z) {
+		if (out->len)
+			compressor_submit(out->z, out);
+	} else if (out->len && fwrite(out->buf, 1, out->len, out->f) != out->len) {
+		fprintf(stderr, "Error writing output\n");
+		exit(1);
+	}
+	out->total += out->len;
+	out->len = 0;
+}
+static void
+buf_init(ExportBuffer *out, FILE *f)
 {
-	size_t quote_len = strlen(quote_char); /* multibyte */
+	out->f = f;
+	out->z = NULL;
+	out->size = EXPORT_BUFFER_SIZE;
+	out->buf = g_malloc(out->size);
+	out->len = 0;
+	out->total = 0;
+}
+static inline void
+buf_write(ExportBuffer *out, const char *s, size_t len)
+{
+	size_t part;
 
-	size_t orig_escape_len = escape_char ? strlen(escape_char) : 0;
+	if (out->len + len > out->size) {
+		if (!out->f) {
+			while (out->len + len > out->size)
+				out->size *= 2;
+			out->buf = g_realloc(out->buf, out->size);
+		} else if (out->z) {
+			/* compressed output goes through the buffer a block at a time */
+			while (out->len + len > out->size) {
+				part = out->size - out->len;
+				memcpy(out->buf + out->len, s, part);
+				out->len += part;
+				s += part;
+				len -= part;
+				buf_flush(out);
+			}
+		} else {
+			buf_flush(out);
+			if (len > out->size) {
+				if (fwrite(s, 1, len, out->f) != len) {
+					fprintf(stderr, "Error writing output\n");
+					exit(1);
+				}
+				out->total += len;
+				return;
+			}
+		}
+	}
+	memcpy(out->buf + out->len, s, len);
+	out->len += len;
+}
+static inline void
+buf_puts(ExportBuffer *out, const char *s)
+{
+	buf_write(out, s, strlen(s));
+}
+static void
+init_quoting(ExportQuoting *q, char *quote_char, char *escape_char, int bin_mode)
+{
+	unsigned int c;
+	int num_special = 0;
 
+	memset(q, 0, sizeof(ExportQuoting));
+	q->quote = quote_char;
+	q->quote_len = strlen(quote_char); /* multibyte */
+	q->escape_len = escape_char ? strlen(escape_char) : 0;
 	/* double the quote char if no escape char passed */
-	if (!escape_char)
-		escape_char = quote_char;
-
-	if (quote_text && is_quote_type(col_type)) {
-		fputs(quote_char, outfile);
-		while (1) {
-			if (is_binary_type(col_type)) {
-				if (bin_mode == MDB_BINEXPORT_STRIP)
-					break;
-				if (!bin_len--)
-					break;
-			} else /* use \0 sentry */
-				if (!*col_val)
-					break;
-
-			if (quote_len && !strncmp(col_val, quote_char, quote_len)) {
-				fprintf(outfile, "%s%s", escape_char, quote_char);
-				col_val += quote_len;
+	q->escape = escape_char ? escape_char : quote_char;
+	q->bin_mode = bin_mode;
+	q->single = -1;
+
+	if (q->quote_len)
+		q->special[(unsigned char)quote_char[0]] = 1;
+#ifndef DONT_ESCAPE_ESCAPE
+	if (q->escape_len)
+		q->special[(unsigned char)escape_char[0]] = 1;
+#endif
+	for (c=0;c<256;c++) {
+		if (q->special[c]) {
+			num_special++;
+			q->single = c;
+		}
+		q->special_octal[c] = q->special[c] || (signed char)c <= 0;
+		sprintf(octal_escapes[c], "\\%03o", c);
+	}
+	if (num_special != 1)
+		q->single = -1;
+}
+/*
+ * find the next byte that may need escaping
+ */
+static inline const char *
+next_special(const char *p, const char *end, const ExportQuoting *q, const unsigned char *special)
+{
+	const char *s;
+
+	if (special == q->special && q->single >= 0) {
+		s = memchr(p, q->single, end - p);
+		return s ? s : end;
+	}
+	while (p < end && !special[(unsigned char)*p])
+		p++;
+	return p;
+}
+
+static void
+print_col(ExportBuffer *out, gchar *col_val, int quote_text, int col_type, int bin_len, const ExportQuoting *q)
+/* quote_text: Don't quote if 0.
+ */
+{
+	const unsigned char *special = q->special;
+	const char *p = col_val, *end, *run;
+	int octal = 0;
+
+	if (!quote_text || !is_quote_type(col_type)) {
+		buf_puts(out, col_val);
+		return;
+	}
+	buf_write(out, q->quote, q->quote_len);
+	if (is_binary_type(col_type)) {
+		end = (q->bin_mode == MDB_BINEXPORT_STRIP) ? p : p + bin_len;
+		if (q->bin_mode == MDB_BINEXPORT_OCTAL) {
+			special = q->special_octal;
+			octal = 1;
+		}
+	} else {
+		/* use \0 sentry */
+		end = p + strlen(p);
+	}
+	while (p < end) {
+		/* copy the run of plain bytes as it is */
+		run = p;
+		p = next_special(p, end, q, special);
+		buf_write(out, run, p - run);
+		if (p == end)
+			break;
+
+		if (q->quote_len && (size_t)(end - p) >= q->quote_len
+		 && !memcmp(p, q->quote, q->quote_len)) {
+			buf_write(out, q->escape, q->escape_len ? q->escape_len : q->quote_len);
+			buf_write(out, q->quote, q->quote_len);
+			p += q->quote_len;
 #ifndef DONT_ESCAPE_ESCAPE
-			} else if (orig_escape_len && !strncmp(col_val, escape_char, orig_escape_len)) {
-				fprintf(outfile, "%s%s", escape_char, escape_char);
-				col_val += orig_escape_len;
+		} else if (q->escape_len && (size_t)(end - p) >= q->escape_len
+		 && !memcmp(p, q->escape, q->escape_len)) {
+			buf_write(out, q->escape, q->escape_len);
+			buf_write(out, q->escape, q->escape_len);
+			p += q->escape_len;
 #endif
-			} else if (is_binary_type(col_type) && *col_val <= 0 && bin_mode == MDB_BINEXPORT_OCTAL)
-				fprintf(outfile, "\\%03o", *(unsigned char*)col_val++);
+		} else if (octal && (signed char)*p <= 0) {
+			buf_write(out, octal_escapes[(unsigned char)*p], 4);
+			p++;
+		} else {
+			buf_write(out, p++, 1);
+		}
+	}
+	buf_write(out, q->quote, q->quote_len);
+}
+/*
+ * a field in the text format of PostgreSQL's COPY: backslash escapes for
+ * the bytes that would end the field or the row, bytea hex for binaries
+ */
+static void
+print_copy_col(ExportBuffer *out, gchar *col_val, int col_type, int bin_len, int bin_mode)
+{
+	static const char hex[] = "0123456789abcdef";
+	const char *p = col_val;
+	size_t run;
+	char esc[2];
+	int i;
+
+	if (is_binary_type(col_type)) {
+		if (bin_mode == MDB_BINEXPORT_STRIP)
+			return;
+		/* the backslash of \x is escaped itself */
+		buf_write(out, "\\\\x", 3);
+		for (i=0; i<bin_len; i++) {
+			esc[0] = hex[(unsigned char)p[i] >> 4];
+			esc[1] = hex[(unsigned char)p[i] & 0x0f];
+			buf_write(out, esc, 2);
+		}
+		return;
+	}
+	esc[0] = '\\';
+	while (*p) {
+		run = strcspn(p, "\\\n\r\t");
+		buf_write(out, p, run);
+		p += run;
+		if (!*p)
+			break;
+		switch (*p++) {
+			case '\n': esc[1] = 'n'; break;
+			case '\r': esc[1] = 'r'; break;
+			case '\t': esc[1] = 't'; break;
+			default: esc[1] = '\\'; break;
+		}
+		buf_write(out, esc, 2);
+	}
+}
+enum {
+	EXPORT_FORMAT_CSV,	/* or SQL with -I */
+	EXPORT_FORMAT_ARROW,
+	EXPORT_FORMAT_JSON	/* JSON lines */
+};
+
+/* what every table is exported with */
+typedef struct {
+	int format;
+	char *delimiter;
+	char *row_delimiter;
+	int header_row;
+	int quote_text;
+	char *insert_dialect;
+	char *namespace;
+	unsigned int shard;
+	unsigned int num_shards;	/* 0 to export whole tables */
+	char **columns;		/* names of the columns to export, NULL for all */
+	int batch_size;		/* rows per INSERT statement */
+	int copy;		/* COPY FROM stdin instead of INSERTs */
+	int transaction;	/* wrap each table in BEGIN and COMMIT */
+	int compress;		/* EXPORT_COMPRESS_* */
+	int compress_level;
+	GThreadPool *compress_pool;	/* shared by every file being written */
+	ExportBlockBudget *compress_budget;	/* likewise */
+	ExportQuoting quoting;
+} ExportOptions;
+
+/* tables shared out to the worker threads of a multi-table export */
+typedef struct {
+	GArray *entries;	/* catalog indexes of the tables */
+	gint next;
+	const char *output_dir;
+	char *suffix;
+	const ExportOptions *opts;
+	FILE *manifest;
+	GMutex lock;		/* guards manifest and failed */
+	int failed;
+} ExportJobs;
+
+typedef struct {
+	MdbHandle *mdb;
+	ExportJobs *jobs;
+} ExportWorker;
+
+/* columns of a table bound for export */
+typedef struct {
+	unsigned int num_cols;
+	MdbColumn **cols;
+	char **values;
+	int *lens;
+	/* start of each INSERT, or the COPY statement, with quoted names */
+	char *statement;
+	int batch_rows;		/* rows in the INSERT being written */
+	/* JSON: each column's quoted name, after a { or a comma, and the row
+	 * being put together */
+	char **keys;
+	GString *json;
+} ExportBinding;
+
+/* pages handed to a decode thread at once */
+#define EXPORT_CHUNK_PAGES 64
+
+/*
+ * a run of data pages of a pipelined export: the reader copies the pages
+ * in, a decode thread formats their rows into text, and the writer puts
+ * the text out in seq order
+ */
+typedef struct {
+	guint seq;
+	unsigned int num_pgs;
+	guint32 pgs[EXPORT_CHUNK_PAGES];
+	unsigned char *pg_bufs;	/* num_pgs pages of pg_size bytes */
+	ExportBuffer text;
+	long rows;
+} ExportChunk;
+
+/* the stages of a pipelined export */
+typedef struct {
+	MdbTableDef *table;	/* read by the reader through the main handle */
+	unsigned int entry_num;	/* catalog index, for the decode threads */
+	const ExportOptions *opts;
+	int num_decoders;
+	GAsyncQueue *free_chunks;
+	GAsyncQueue *full_chunks;
+	GAsyncQueue *done_chunks;
+	guint num_chunks;	/* set by the reader when it is done */
+} ExportPipeline;
+
+typedef struct {
+	ExportPipeline *pipe;
+	MdbHandle *mdb;
+} ExportDecoder;
+
+/* tells a decode thread to stop, and the writer how many chunks to expect */
+static ExportChunk end_of_pages;
+
+/*
+ * bind the columns named in columns, or all of them when it is NULL.  Only
+ * bound columns are converted to text as rows are read; for Arrow and
+ * JSON only their lengths are bound, so the index code still knows which
+ * columns are wanted while the values stay as they are.  Returns 0 if a column
+ * does not exist.
+ */
+static int
+bind_columns(MdbTableDef *table, const ExportOptions *opts, ExportBinding *bind)
+{
+	MdbBackend *backend = table->entry->mdb->default_backend;
+	char **columns = opts->columns;
+	MdbColumn *col;
+	GString *stmt;
+	char *quoted_name;
+	unsigned int i, j;
+
+	bind->num_cols = columns ? g_strv_length(columns) : table->num_cols;
+	bind->cols = g_new0(MdbColumn *, bind->num_cols);
+	for (i=0;i<bind->num_cols;i++) {
+		if (!columns) {
+			bind->cols[i] = g_ptr_array_index(table->columns,i);
+			continue;
+		}
+		for (j=0;j<table->num_cols;j++) {
+			col=g_ptr_array_index(table->columns,j);
+			if (!g_ascii_strcasecmp(col->name, columns[i]))
+				bind->cols[i] = col;
+		}
+		if (!bind->cols[i]) {
+			fprintf(stderr, "Error: Column %s does not exist in table %s.\n", columns[i], table->name);
+			g_free(bind->cols);
+			return 0;
+		}
+	}
+	bind->values = (char **) g_malloc0(bind->num_cols * sizeof(char *));
+	bind->lens = (int *) g_malloc(bind->num_cols * sizeof(int));
+	for (i=0;i<bind->num_cols;i++) {
+		/* OLE is read through its bound buffer, Arrow or not */
+		if (opts->format != EXPORT_FORMAT_CSV && bind->cols[i]->col_type != MDB_OLE) {
+			bind->cols[i]->bind_ptr = NULL;
+			bind->cols[i]->len_ptr = &bind->lens[i];
+			continue;
+		}
+		/* bind columns */
+		bind->values[i] = (char *) g_malloc0(MDB_BIND_SIZE);
+		bind->cols[i]->bind_ptr = bind->values[i];
+		bind->cols[i]->len_ptr = &bind->lens[i];
+	}
+
+	/* the names are quoted once here rather than for every row */
+	bind->statement = NULL;
+	bind->batch_rows = 0;
+	bind->keys = NULL;
+	bind->json = NULL;
+	if (opts->format == EXPORT_FORMAT_JSON) {
+		bind->keys = g_new0(char *, bind->num_cols + 1);
+		stmt = g_string_new(NULL);
+		for (i=0;i<bind->num_cols;i++) {
+			g_string_assign(stmt, i ? "," : "{");
+			mdb_json_append_string(stmt, bind->cols[i]->name, strlen(bind->cols[i]->name));
+			g_string_append_c(stmt, ':');
+			bind->keys[i] = g_strdup(stmt->str);
+		}
+		g_string_free(stmt, TRUE);
+		bind->json = g_string_sized_new(1024);
+	}
+	if (opts->insert_dialect) {
+		stmt = g_string_new(opts->copy ? "COPY " : "INSERT INTO ");
+		quoted_name = backend->quote_schema_name(opts->namespace, table->name);
+		g_string_append(stmt, quoted_name);
+		free(quoted_name);
+		g_string_append(stmt, " (");
+		for (i=0;i<bind->num_cols;i++) {
+			if (i>0) g_string_append(stmt, ", ");
+			quoted_name = backend->quote_schema_name(NULL, bind->cols[i]->name);
+			g_string_append(stmt, quoted_name);
+			free(quoted_name);
+		} 
+		g_string_append(stmt, opts->copy ? ") FROM stdin;\n" : ") VALUES ");
+		bind->statement = g_string_free(stmt, FALSE);
+	}
+	return 1;
+}
+static void
+free_bindings(ExportBinding *bind)
+{
+	unsigned int i;
+
+	/* free the memory used to bind */
+	for (i=0;i<bind->num_cols;i++) {
+		g_free(bind->values[i]);
+	}
+	g_free(bind->values);
+	g_free(bind->lens);
+	g_free(bind->cols);
+	g_free(bind->statement);
+	g_strfreev(bind->keys);
+	if (bind->json)
+		g_string_free(bind->json, TRUE);
+}
+static void
+export_header(ExportBuffer *out, ExportBinding *bind, const ExportOptions *opts)
+{
+	unsigned int i;
+
+	for (i=0; i<bind->num_cols; i++) {
+		if (i)
+			buf_puts(out, opts->delimiter);
+		buf_puts(out, bind->cols[i]->name);
+	}
+	buf_puts(out, opts->row_delimiter);
+}
+/* a JSON object of the row just read, on a line of its own */
+static void
+export_json_row(ExportBuffer *out, MdbHandle *mdb, ExportBinding *bind)
+{
+	GString *row = bind->json;
+	unsigned int i;
+
+	g_string_assign(row, bind->num_cols ? "" : "{");
+	for (i=0;i<bind->num_cols;i++) {
+		g_string_append(row, bind->keys[i]);
+		mdb_json_append_value(mdb, bind->cols[i], row);
+	}
+	g_string_append_len(row, "}\n", 2);
+	buf_write(out, row->str, row->len);
+}
+/*
+ * format the row just read into the bound columns
+ */
+static void
+export_row(ExportBuffer *out, MdbTableDef *table, ExportBinding *bind, const ExportOptions *opts)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	MdbColumn *col;
+	char *value;
+	size_t length;
+	unsigned int i;
+
+	if (opts->format == EXPORT_FORMAT_JSON) {
+		export_json_row(out, mdb, bind);
+		return;
+	}
+
+	if (opts->insert_dialect && !opts->copy) {
+		/* continue the INSERT of the batch, or start a new one */
+		if (bind->batch_rows) {
+			buf_puts(out, ",");
+			buf_puts(out, opts->row_delimiter);
+		} else {
+			buf_puts(out, bind->statement);
+		}
+		buf_puts(out, "(");
+	}
+
+	for (i=0;i<bind->num_cols;i++) {
+		if (i>0)
+			buf_puts(out, opts->copy ? "\t" : opts->delimiter);
+		col=bind->cols[i];
+		if (!bind->lens[i]) {
+			/* Don't quote NULLs */
+			if (opts->copy)
+				buf_puts(out, "\\N");
+			else if (opts->insert_dialect)
+				buf_puts(out, "NULL");
+		} else {
+			if (col->col_type == MDB_OLE) {
+				value = mdb_ole_read_full(mdb, col, &length);
+			} else {
+				value = bind->values[i];
+				length = bind->lens[i];
+			}
+			if (opts->copy)
+				print_copy_col(out, value, col->col_type, length, opts->quoting.bin_mode);
 			else
-				putc(*col_val++, outfile);
+				print_col(out, value, opts->quote_text, col->col_type, length, &opts->quoting);
+			if (col->col_type == MDB_OLE)
+				free(value);
+		}
+	}
+	if (opts->copy) {
+		buf_puts(out, "\n");
+	} else if (opts->insert_dialect) {
+		buf_puts(out, ")");
+		if (++bind->batch_rows >= opts->batch_size) {
+			buf_puts(out, ";");
+			buf_puts(out, opts->row_delimiter);
+			bind->batch_rows = 0;
 		}
-		fputs(quote_char, outfile);
-	} else
-		fputs(col_val, outfile);
+	} else {
+		buf_puts(out, opts->row_delimiter);
+	}
+}
+/*
+ * what goes before the rows of a table: the header, or the BEGIN and COPY
+ * statements
+ */
+static void
+export_begin(ExportBuffer *out, ExportBinding *bind, const ExportOptions *opts)
+{
+	/* the shards of a table are concatenated after the first one */
+	if (opts->header_row && !opts->shard)
+		export_header(out, bind, opts);
+	if (opts->transaction) {
+		buf_puts(out, "BEGIN;");
+		buf_puts(out, opts->row_delimiter);
+	}
+	if (opts->copy)
+		buf_puts(out, bind->statement);
 }
+/*
+ * and what goes after them: the end of the last INSERT, of the COPY data
+ * and of the transaction
+ */
+static void
+export_end(ExportBuffer *out, ExportBinding *bind, const ExportOptions *opts)
+{
+	if (bind->batch_rows) {
+		buf_puts(out, ";");
+		buf_puts(out, opts->row_delimiter);
+		bind->batch_rows = 0;
+	}
+	if (opts->copy)
+		buf_puts(out, "\\.\n");
+	if (opts->transaction) {
+		buf_puts(out, "COMMIT;");
+		buf_puts(out, opts->row_delimiter);
+	}
+}
+/*
+ * reader stage: walk the table's data pages the way a table scan does and
+ * copy them into chunks
+ */
+static gpointer
+pipeline_reader(gpointer data)
+{
+	ExportPipeline *pipe = data;
+	MdbTableDef *table = pipe->table;
+	MdbHandle *mdb = table->entry->mdb;
+	ExportChunk *chunk = NULL;
+	guint seq = 0;
+	int i;
+
+	mdb_rewind_table(table);
+	while (table->num_rows && mdb_read_next_dpg(table)) {
+		if (!chunk) {
+			chunk = g_async_queue_pop(pipe->free_chunks);
+			chunk->seq = seq++;
+			chunk->num_pgs = 0;
+		}
+		memcpy(chunk->pg_bufs + chunk->num_pgs * mdb->fmt->pg_size,
+			mdb->pg_buf, mdb->fmt->pg_size);
+		chunk->pgs[chunk->num_pgs++] = table->cur_phys_pg;
+		if (chunk->num_pgs == EXPORT_CHUNK_PAGES) {
+			g_async_queue_push(pipe->full_chunks, chunk);
+			chunk = NULL;
+		}
+	}
+	if (chunk)
+		g_async_queue_push(pipe->full_chunks, chunk);
+
+	pipe->num_chunks = seq;
+	for (i=0; i<pipe->num_decoders; i++)
+		g_async_queue_push(pipe->full_chunks, &end_of_pages);
+	g_async_queue_push(pipe->done_chunks, &end_of_pages);
+	return NULL;
+}
+/*
+ * decode stage: format the rows of each chunk's pages through a handle
+ * and table definition of the thread's own
+ */
+static gpointer
+pipeline_decoder(gpointer data)
+{
+	ExportDecoder *decoder = data;
+	ExportPipeline *pipe = decoder->pipe;
+	MdbHandle *mdb = decoder->mdb;
+	MdbTableDef *table;
+	ExportBinding bind;
+	ExportChunk *chunk;
+	unsigned int i, row, num_rows;
+
+	table = mdb_read_table(g_ptr_array_index(mdb->catalog, pipe->entry_num));
+	mdb_read_columns(table);
+	mdb_rewind_table(table);
+	/* the column names were checked against the main handle's table */
+	bind_columns(table, pipe->opts, &bind);
+
+	while ((chunk = g_async_queue_pop(pipe->full_chunks)) != &end_of_pages) {
+		chunk->text.len = 0;
+		chunk->rows = 0;
+		for (i=0; i<chunk->num_pgs; i++) {
+			memcpy(mdb->pg_buf, chunk->pg_bufs + i * mdb->fmt->pg_size,
+				mdb->fmt->pg_size);
+			mdb->cur_pg = chunk->pgs[i];
+			table->cur_phys_pg = chunk->pgs[i];
+			num_rows = mdb_get_int16(mdb->pg_buf, mdb->fmt->row_count_offset);
+			for (row=0; row<num_rows; row++) {
+				if (!mdb_read_row(table, row))
+					continue;
+				export_row(&chunk->text, table, &bind, pipe->opts);
+				chunk->rows++;
+			}
+		}
+		g_async_queue_push(pipe->done_chunks, chunk);
+	}
+
+	free_bindings(&bind);
+	mdb_free_tabledef(table);
+	return NULL;
+}
+/*
+ * export a table through a reader thread, num_decoders decode threads and
+ * the calling thread as the writer.  Chunks come back from the decoders in
+ * any order and are held until the ones before them have been written, so
+ * the output is the same as that of a plain table scan.
+ */
+static void
+export_pipelined(MdbTableDef *table, ExportBuffer *out, const ExportOptions *opts, int num_decoders, long *rows)
+{
+	MdbHandle *mdb = table->entry->mdb;
+	ExportPipeline pipe;
+	ExportChunk *chunks, *chunk, **pending;
+	ExportDecoder *decoders;
+	GThread *reader, **threads;
+	unsigned int i, num_chunks;
+	guint next = 0;
+	int done = 0;
+
+	memset(&pipe, 0, sizeof(pipe));
+	pipe.table = table;
+	pipe.opts = opts;
+	pipe.num_decoders = num_decoders;
+	for (i=0; i<mdb->num_catalog; i++)
+		if (g_ptr_array_index(mdb->catalog, i) == table->entry)
+			pipe.entry_num = i;
+	pipe.free_chunks = g_async_queue_new();
+	pipe.full_chunks = g_async_queue_new();
+	pipe.done_chunks = g_async_queue_new();
+
+	/* enough to keep every decoder busy while the writer waits on one */
+	num_chunks = 2 * num_decoders + 2;
+	chunks = g_new0(ExportChunk, num_chunks);
+	pending = g_new0(ExportChunk *, num_chunks);
+	for (i=0; i<num_chunks; i++) {
+		chunks[i].pg_bufs = g_malloc(EXPORT_CHUNK_PAGES * mdb->fmt->pg_size);
+		buf_init(&chunks[i].text, NULL);
+		g_async_queue_push(pipe.free_chunks, &chunks[i]);
+	}
+
+	/* clone the handles before the reader starts using the main one */
+	decoders = g_new0(ExportDecoder, num_decoders);
+	threads = g_new0(GThread *, num_decoders);
+	for (i=0; i<(unsigned int)num_decoders; i++) {
+		decoders[i].pipe = &pipe;
+		decoders[i].mdb = mdb_clone_handle(mdb);
+	}
+	for (i=0; i<(unsigned int)num_decoders; i++)
+		threads[i] = g_thread_new("mdb-export decode", pipeline_decoder, &decoders[i]);
+	reader = g_thread_new("mdb-export read", pipeline_reader, &pipe);
+
+	/* at most num_chunks are out at once, so seq picks a unique slot */
+	while (!done || next < pipe.num_chunks) {
+		chunk = g_async_queue_pop(pipe.done_chunks);
+		if (chunk == &end_of_pages) {
+			done = 1;
+		} else {
+			pending[chunk->seq % num_chunks] = chunk;
+		}
+		while ((chunk = pending[next % num_chunks]) && chunk->seq == next) {
+			buf_write(out, chunk->text.buf, chunk->text.len);
+			*rows += chunk->rows;
+			pending[next % num_chunks] = NULL;
+			g_async_queue_push(pipe.free_chunks, chunk);
+			next++;
+		}
+	}
+
+	g_thread_join(reader);
+	for (i=0; i<(unsigned int)num_decoders; i++) {
+		g_thread_join(threads[i]);
+		mdb_close(decoders[i].mdb);
+	}
+	g_free(threads);
+	g_free(decoders);
+
+	for (i=0; i<num_chunks; i++) {
+		g_free(chunks[i].pg_bufs);
+		g_free(chunks[i].text.buf);
+	}
+	g_free(chunks);
+	g_free(pending);
+	g_async_queue_unref(pipe.free_chunks);
+	g_async_queue_unref(pipe.full_chunks);
+	g_async_queue_unref(pipe.done_chunks);
+}
+static void
+arrow_write(const void *buf, size_t len, gpointer data)
+{
+	buf_write((ExportBuffer *)data, buf, len);
+}
+/* write the rows as an Arrow stream, straight from the row data */
+static void
+export_arrow(ExportBuffer *out, MdbTableDef *table, ExportBinding *bind, long *rows)
+{
+	MdbArrowWriter *w;
+
+	w = mdb_arrow_writer_new(table, bind->cols, bind->num_cols, arrow_write, out);
+	while(mdb_fetch_row(table)) {
+		mdb_arrow_append_row(w);
+		(*rows)++;
+	}
+	mdb_arrow_writer_close(w);
+}
+/*
+ * export_table: write all rows of table to outfile, pipelined over
+ * num_threads decode threads when there is more than one and the rows come
+ * from a plain table scan.  The columns of table must have been read.  The
+ * row count and the number of bytes written are returned in rows and
+ * bytes.  Returns 0 on success, 1 if a column to export does not exist.
+ */
+static int
+export_table(MdbTableDef *table, FILE *outfile, const ExportOptions *opts, int num_threads, long *rows, size_t *bytes)
+{
+	ExportBinding bind;
+	ExportBuffer out;
+
+	*rows = 0;
+	*bytes = 0;
+	if (!bind_columns(table, opts, &bind))
+		return 1;
+
+	mdb_table_set_shard(table, opts->shard, opts->num_shards);
+	mdb_rewind_table(table);
+
+	buf_init(&out, outfile);
+	if (opts->compress)
+		out.z = compressor_new(outfile, opts->compress, opts->compress_level,
+			opts->compress_pool, opts->compress_budget);
+
+	if (opts->format == EXPORT_FORMAT_ARROW) {
+		export_arrow(&out, table, &bind, rows);
+	} else {
+		export_begin(&out, &bind, opts);
+
+		/* batches of INSERTs depend on the rows before them */
+		if (num_threads > 1 && !table->is_temp_table && opts->batch_size <= 1
+		 && table->strategy == MDB_TABLE_SCAN && !table->sarg_tree) {
+			export_pipelined(table, &out, opts, num_threads, rows);
+		} else {
+			while(mdb_fetch_row(table)) {
+				export_row(&out, table, &bind, opts);
+				(*rows)++;
+			}
+		}
+		export_end(&out, &bind, opts);
+	}
+	free_bindings(&bind);
+	buf_flush(&out);
+	if (out.z)
+		*bytes = compressor_close(out.z, &out);
+	else
+		*bytes = out.total;
+	g_free(out.buf);
+	return 0;
+}
+/*
+ * the file a table goes to: its name, with anything that would leave
+ * output_dir replaced, plus the suffix
+ */
+static char *
+table_file_name(const char *output_dir, const char *name, const char *suffix)
+{
+	char *base, *p, *path;
+
+	base = g_strconcat(name, suffix, NULL);
+	for (p=base; *p; p++)
+		if (*p == '/' || *p == '\\')
+			*p = '_';
+	path = g_build_filename(output_dir, base, NULL);
+	g_free(base);
+	return path;
+}
+/*
+ * worker thread: take the next table until there are none left, exporting
+ * each one through the worker's own handle and recording it in the manifest
+ */
+static gpointer
+export_worker(gpointer data)
+{
+	ExportWorker *worker = data;
+	ExportJobs *jobs = worker->jobs;
+	MdbCatalogEntry *entry;
+	MdbTableDef *table;
+	FILE *outfile;
+	char *path;
+	const char *status;
+	long rows;
+	size_t bytes;
+	gint64 start;
+	guint n;
+
+	while ((n = g_atomic_int_add(&jobs->next, 1)) < jobs->entries->len) {
+		entry = g_ptr_array_index(worker->mdb->catalog,
+			g_array_index(jobs->entries, guint, n));
+		path = table_file_name(jobs->output_dir, entry->object_name, jobs->suffix);
+		start = g_get_monotonic_time();
+		rows = 0;
+		bytes = 0;
+
+		if (!(outfile = fopen(path, "w"))) {
+			status = g_strerror(errno);
+		} else if (!(table = mdb_read_table(entry))) {
+			fclose(outfile);
+			status = "unreadable";
+		} else {
+			status = "ok";
+			mdb_read_columns(table);
+			if (export_table(table, outfile, jobs->opts, 1, &rows, &bytes))
+				status = "missing column";
+			mdb_free_tabledef(table);
+			if (fclose(outfile))
+				status = g_strerror(errno);
+		}
+
+		g_mutex_lock(&jobs->lock);
+		if (strcmp(status, "ok")) {
+			fprintf(stderr, "Error: could not export %s to %s: %s\n",
+				entry->object_name, path, status);
+			jobs->failed = 1;
+		}
+		if (jobs->manifest) {
+			fprintf(jobs->manifest, "%s\t%s\t%ld\t%lu\t%.3f\t%s\n",
+				entry->object_name, path, rows, (unsigned long)bytes,
+				(g_get_monotonic_time() - start) / 1000000.0, status);
+			fflush(jobs->manifest);
+		}
+		g_mutex_unlock(&jobs->lock);
+		g_free(path);
+	}
+	return NULL;
+}
+/*
+ * export the tables at the given catalog indexes into output_dir, one file
+ * each, on num_jobs threads.  Returns 0 if every table was exported.
+ */
+static int
+export_tables(MdbHandle *mdb, GArray *entries, const char *output_dir, const char *manifest_file, int num_jobs, const ExportOptions *opts)
+{
+	ExportJobs jobs;
+	ExportWorker *workers;
+	GThread **threads;
+	const char *suffix;
+	int i;
+
+	if (g_mkdir_with_parents(output_dir, 0777)) {
+		fprintf(stderr, "Error: could not create %s: %s\n", output_dir, g_strerror(errno));
+		return 1;
+	}
+
+	memset(&jobs, 0, sizeof(jobs));
+	jobs.entries = entries;
+	jobs.output_dir = output_dir;
+	if (opts->format == EXPORT_FORMAT_ARROW)
+		suffix = ".arrow";
+	else if (opts->format == EXPORT_FORMAT_JSON)
+		suffix = ".jsonl";
+	else
+		suffix = opts->insert_dialect ? ".sql" : ".csv";
+	if (opts->compress == EXPORT_COMPRESS_GZIP)
+		jobs.suffix = g_strconcat(suffix, ".gz", NULL);
+	else if (opts->compress == EXPORT_COMPRESS_ZSTD)
+		jobs.suffix = g_strconcat(suffix, ".zst", NULL);
+	else
+		jobs.suffix = g_strdup(suffix);
+	jobs.opts = opts;
+	g_mutex_init(&jobs.lock);
+	if (manifest_file) {
+		if (!(jobs.manifest = fopen(manifest_file, "w"))) {
+			fprintf(stderr, "Error: could not open %s: %s\n", manifest_file, g_strerror(errno));
+			return 1;
+		}
+		fputs("# table\tfile\trows\tbytes\tseconds\tstatus\n", jobs.manifest);
+		fflush(jobs.manifest);
+	}
+
+	if (num_jobs > (int)entries->len)
+		num_jobs = entries->len;
+	if (num_jobs < 1)
+		num_jobs = 1;
+
+	workers = g_new0(ExportWorker, num_jobs);
+	threads = g_new0(GThread *, num_jobs);
+	for (i=0; i<num_jobs; i++) {
+		workers[i].mdb = mdb_clone_handle(mdb);
+		workers[i].jobs = &jobs;
+		threads[i] = g_thread_new("mdb-export", export_worker, &workers[i]);
+	}
+	for (i=0; i<num_jobs; i++) {
+		g_thread_join(threads[i]);
+		mdb_close(workers[i].mdb);
+	}
+	g_free(threads);
+	g_free(workers);
+
+	if (jobs.manifest && fclose(jobs.manifest)) {
+		fprintf(stderr, "Error writing %s\n", manifest_file);
+		jobs.failed = 1;
+	}
+	g_mutex_clear(&jobs.lock);
+	g_free(jobs.suffix);
+	return jobs.failed;
+}
+#ifdef SQL
+/* identifiers in double quotes, as the SQL lexer reads them */
+static void
+append_quoted_name(GString *s, const char *name)
+{
+	g_string_append_c(s, '"');
+	for (; *name; name++) {
+		if (*name == '"')
+			g_string_append_c(s, '"');
+		g_string_append_c(s, *name);
+	}
+	g_string_append_c(s, '"');
+}
+/*
+ * open a table through the SQL engine, so the where clause becomes the
+ * table's sarg tree and an index is picked for it the way mdb-sql does
+ */
+static MdbTableDef *
+select_table(MdbSQL *sql, const char *name, char **columns, const char *where)
+{
+	GString *query = g_string_new("SELECT ");
+	unsigned int i;
+
+	if (columns) {
+		for (i=0; columns[i]; i++) {
+			if (i)
+				g_string_append(query, ", ");
+			append_quoted_name(query, columns[i]);
+		}
+	} else {
+		g_string_append_c(query, '*');
+	}
+	g_string_append(query, " FROM ");
+	append_quoted_name(query, name);
+	g_string_append(query, " WHERE ");
+	g_string_append(query, where);
+
+	if (!mdb_sql_run_query(sql, query->str)) {
+		g_string_free(query, TRUE);
+		return NULL;
+	}
+	g_string_free(query, TRUE);
+	return sql->cur_table;
+}
+#endif
 int
 main(int argc, char **argv)
 {
 	unsigned int i;
+	int j;
 	MdbHandle *mdb;
 	MdbTableDef *table;
-	MdbColumn *col;
-	char **bound_values;
-	int  *bound_lens; 
-	FILE *outfile = stdout;
-	char *delimiter = NULL;
-	char *row_delimiter = NULL;
+	MdbCatalogEntry *entry;
+	ExportOptions opts;
 	char *quote_char = NULL;
 	char *escape_char = NULL;
-	int header_row = 1;
-	int quote_text = 1;
-	char *insert_dialect = NULL;
 	char *date_fmt = NULL;
-	char *namespace = NULL;
 	char *str_bin_mode = NULL;
+	char *str_shard = NULL;
+	char *str_columns = NULL;
+	char *str_format = NULL;
+	char *str_compress = NULL;
+	char *p, *end;
+	int max_level = 0;
+	char *where = NULL;
+#ifdef SQL
+	MdbSQL *sql = NULL;
+#endif
+	char c;
 	int bin_mode = MDB_BINEXPORT_RAW;
-	char *value;
-	size_t length;
+	int all_tables = 0;
+	char *output_dir = NULL;
+	char *manifest_file = NULL;
+	int num_jobs = 0;
+	GArray *tables;
+	long rows;
+	size_t bytes;
+	int ret = 0;
 
 	GOptionEntry entries[] = {
-		{ "no-header", 'H', G_OPTION_FLAG_REVERSE, G_OPTION_ARG_NONE, &header_row, "Suppress header row.", NULL},
-		{ "no-quote", 'Q', G_OPTION_FLAG_REVERSE, G_OPTION_ARG_NONE, &quote_text, "Don't wrap text-like fields in quotes.", NULL},
-		{ "delimiter", 'd', 0, G_OPTION_ARG_STRING, &delimiter, "Specify an alternative column delimiter. Default is comma.", "char"},
-		{ "row-delimiter", 'R', 0, G_OPTION_ARG_STRING, &row_delimiter, "Specify a row delimiter", "char"},
+		{ "no-header", 'H', G_OPTION_FLAG_REVERSE, G_OPTION_ARG_NONE, &opts.header_row, "Suppress header row.", NULL},
+		{ "no-quote", 'Q', G_OPTION_FLAG_REVERSE, G_OPTION_ARG_NONE, &opts.quote_text, "Don't wrap text-like fields in quotes.", NULL},
+		{ "delimiter", 'd', 0, G_OPTION_ARG_STRING, &opts.delimiter, "Specify an alternative column delimiter. Default is comma.", "char"},
+		{ "row-delimiter", 'R', 0, G_OPTION_ARG_STRING, &opts.row_delimiter, "Specify a row delimiter", "char"},
 		{ "quote", 'q', 0, G_OPTION_ARG_STRING, &quote_char, "Use <char> to wrap text-like fields. Default is double quote.", "char"},
-		{ "backend", 'I', 0, G_OPTION_ARG_STRING, &insert_dialect, "INSERT statements (instead of CSV)", "backend"},
+		{ "backend", 'I', 0, G_OPTION_ARG_STRING, &opts.insert_dialect, "INSERT statements (instead of CSV)", "backend"},
 		{ "date_format", 'D', 0, G_OPTION_ARG_STRING, &date_fmt, "Set the date format (see strftime(3) for details)", "format"},
 		{ "escape", 'X', 0, G_OPTION_ARG_STRING, &escape_char, "Use <char> to escape quoted characters within a field. Default is doubling.", "format"},
-		{ "namespace", 'N', 0, G_OPTION_ARG_STRING, &namespace, "Prefix identifiers with namespace", "namespace"},
+		{ "namespace", 'N', 0, G_OPTION_ARG_STRING, &opts.namespace, "Prefix identifiers with namespace", "namespace"},
 		{ "bin", 'b', 0, G_OPTION_ARG_STRING, &str_bin_mode, "Binary export mode", "strip|raw|octal"},
+		{ "all-tables", 'A', 0, G_OPTION_ARG_NONE, &all_tables, "Export every user table, one file each.", NULL},
+		{ "output-dir", 'o', 0, G_OPTION_ARG_FILENAME, &output_dir, "Write one file per table into <dir>. Default is the current directory.", "dir"},
+		{ "jobs", 'j', 0, G_OPTION_ARG_INT, &num_jobs, "Export <n> tables at a time, or decode a single table on <n> threads. Default is the number of processors.", "n"},
+		{ "manifest", 'M', 0, G_OPTION_ARG_FILENAME, &manifest_file, "Record each exported table in <file>.", "file"},
+		{ "shard", 0, 0, G_OPTION_ARG_STRING, &str_shard, "Export only part <i> (from 0) of the <n> parts of each table.", "i/n"},
+		{ "columns", 'c', 0, G_OPTION_ARG_STRING, &str_columns, "Export only the named columns, in that order.", "col,col,..."},
+		{ "batch-size", 'B', 0, G_OPTION_ARG_INT, &opts.batch_size, "With -I, insert <n> rows per INSERT statement. Default is 1.", "n"},
+		{ "copy", 'C', 0, G_OPTION_ARG_NONE, &opts.copy, "With -I postgres, write COPY FROM stdin data instead of INSERTs.", NULL},
+		{ "transaction", 'T', 0, G_OPTION_ARG_NONE, &opts.transaction, "With -I, wrap the statements of each table in a transaction.", NULL},
+		{ "format", 'F', 0, G_OPTION_ARG_STRING, &str_format, "Output format. Default is csv.", "csv|arrow|json"},
+		{ "compress", 'z', 0, G_OPTION_ARG_STRING, &str_compress, "Compress the output, in blocks on as many threads as -j.", "gzip|zstd[:level]"},
+		{ "where", 'w', 0, G_OPTION_ARG_STRING, &where, "Export only the rows matching <condition>, written as in mdb-sql.", "condition"},
 		{ NULL },
 	};
 	GError *error = NULL;
 	GOptionContext *opt_context;
 
-	opt_context = g_option_context_new("<file> <table> - export data from MDB file");
+	memset(&opts, 0, sizeof(opts));
+	opts.header_row = 1;
+	opts.quote_text = 1;
+	opts.batch_size = 1;
+
+	opt_context = g_option_context_new("<file> <table> [<table>...] - export data from MDB file");
 	g_option_context_add_main_entries(opt_context, entries, NULL /*i18n*/);
 	// g_option_context_set_strict_posix(opt_context, TRUE); /* options first, requires glib 2.44 */
 	if (!g_option_context_parse (opt_context, &argc, &argv, &error))
@@ -123,7 +1363,7 @@ main(int argc, char **argv)
 		exit (1);
 	}
 
-	if (argc != 3) {
+	if (all_tables ? argc != 2 : argc < 3) {
 		fputs("Wrong number of arguments.\n\n", stderr);
 		fputs(g_option_context_get_help(opt_context, TRUE, NULL), stderr);
 		exit(1);
@@ -135,21 +1375,21 @@ main(int argc, char **argv)
 	else
 		quote_char = g_strdup("\"");
 
-	if (delimiter)
-		delimiter = escapes(delimiter);
+	if (opts.delimiter)
+		opts.delimiter = escapes(opts.delimiter);
 	else
-		delimiter = g_strdup(",");
+		opts.delimiter = g_strdup(",");
 
-	if (row_delimiter)
-		row_delimiter = escapes(row_delimiter);
+	if (opts.row_delimiter)
+		opts.row_delimiter = escapes(opts.row_delimiter);
 	else
-		row_delimiter = g_strdup("\n");
+		opts.row_delimiter = g_strdup("\n");
 
 	if (escape_char)
 		escape_char = escapes(escape_char);
 
-	if (insert_dialect)
-		header_row = 0;
+	if (opts.insert_dialect)
+		opts.header_row = 0;
 
 	if (date_fmt)
 		mdb_set_date_fmt(date_fmt);
@@ -167,109 +1407,213 @@ main(int argc, char **argv)
 		}
 	}
 
-	/* Open file */
-	if (!(mdb = mdb_open(argv[1], MDB_NOFLAGS))) {
-		/* Don't bother clean up memory before exit */
-		exit(1);
+	if (str_format) {
+		if (!strcmp(str_format, "csv"))
+			opts.format = EXPORT_FORMAT_CSV;
+		else if (!strcmp(str_format, "arrow"))
+			opts.format = EXPORT_FORMAT_ARROW;
+		else if (!strcmp(str_format, "json"))
+			opts.format = EXPORT_FORMAT_JSON;
+		else {
+			fputs("Invalid format\n", stderr);
+			exit(1);
+		}
+		if (opts.format != EXPORT_FORMAT_CSV && opts.insert_dialect) {
+			fputs("-I writes SQL, it cannot be used with --format\n", stderr);
+			exit(1);
+		}
+		if (opts.format != EXPORT_FORMAT_CSV)
+			opts.header_row = 0;
 	}
 
-	if (insert_dialect)
-		if (!mdb_set_default_backend(mdb, insert_dialect)) {
-			fputs("Invalid backend type\n", stderr);
-			/* Don't bother clean up memory before exit */
+	if (str_compress) {
+		if ((p = strchr(str_compress, ':')))
+			*p++ = '\0';
+		if (!strcmp(str_compress, "gzip")) {
+#ifdef HAVE_ZLIB
+			opts.compress = EXPORT_COMPRESS_GZIP;
+			opts.compress_level = Z_DEFAULT_COMPRESSION;
+			max_level = Z_BEST_COMPRESSION;
+#endif
+		} else if (!strcmp(str_compress, "zstd")) {
+#ifdef HAVE_ZSTD
+			opts.compress = EXPORT_COMPRESS_ZSTD;
+			opts.compress_level = ZSTD_CLEVEL_DEFAULT;
+			max_level = ZSTD_maxCLevel();
+#endif
+		} else {
+			fputs("Invalid compression method\n", stderr);
+			exit(1);
+		}
+		if (!opts.compress) {
+			fprintf(stderr, "mdb-export was built without %s support\n", str_compress);
+			exit(1);
+		}
+		if (p) {
+			opts.compress_level = strtol(p, &end, 10);
+			if (!*p || *end || opts.compress_level < 1 || opts.compress_level > max_level) {
+				fprintf(stderr, "Invalid compression level, expected 1 to %d\n", max_level);
+				exit(1);
+			}
+		}
+	}
+
+	if (str_shard) {
+		if (sscanf(str_shard, "%u/%u%c", &opts.shard, &opts.num_shards, &c) != 2
+		 || opts.shard >= opts.num_shards) {
+			fputs("Invalid shard, expected i/n with 0 <= i < n\n", stderr);
 			exit(1);
 		}
+	}
 
-	table = mdb_read_table_by_name(mdb, argv[2], MDB_TABLE);
-	if (!table) {
-		fprintf(stderr, "Error: Table %s does not exist in this database.\n", argv[2]);
-		/* Don't bother clean up memory before exit */
+	if (opts.batch_size < 1) {
+		fputs("Invalid batch size\n", stderr);
+		exit(1);
+	}
+	if ((opts.copy || opts.transaction || opts.batch_size > 1) && !opts.insert_dialect) {
+		fputs("--batch-size, --copy and --transaction need -I\n", stderr);
+		exit(1);
+	}
+	if (opts.copy && strcmp(opts.insert_dialect, "postgres")) {
+		fputs("--copy needs -I postgres\n", stderr);
 		exit(1);
 	}
 
-	/* read table */
-	mdb_read_columns(table);
-	mdb_rewind_table(table);
-	
-	bound_values = (char **) g_malloc(table->num_cols * sizeof(char *));
-	bound_lens = (int *) g_malloc(table->num_cols * sizeof(int));
-	for (i=0;i<table->num_cols;i++) {
-		/* bind columns */
-		bound_values[i] = (char *) g_malloc0(MDB_BIND_SIZE);
-		mdb_bind_column(table, i+1, bound_values[i], &bound_lens[i]);
+	if (str_columns) {
+		opts.columns = g_strsplit(str_columns, ",", -1);
+		for (i=0; opts.columns[i]; i++)
+			g_strstrip(opts.columns[i]);
 	}
-	if (header_row) {
-		for (i=0; i<table->num_cols; i++) {
-			col=g_ptr_array_index(table->columns,i);
-			if (i)
-				fputs(delimiter, outfile);
-			fputs(col->name, outfile);
+
+	if (where) {
+#ifdef SQL
+		if (argc != 3 || all_tables) {
+			fputs("--where needs a single table\n", stderr);
+			exit(1);
 		}
-		fputs(row_delimiter, outfile);
+#else
+		fputs("--where needs mdbtools built with the SQL engine\n", stderr);
+		exit(1);
+#endif
 	}
 
-	while(mdb_fetch_row(table)) {
+	if (num_jobs < 0) {
+		fputs("Invalid number of jobs\n", stderr);
+		exit(1);
+	}
+	if (!num_jobs)
+		num_jobs = g_get_num_processors();
+	if (opts.compress) {
+		opts.compress_pool = g_thread_pool_new(compress_block, NULL, num_jobs, FALSE, NULL);
+		opts.compress_budget = budget_new(2 * num_jobs);
+	}
 
-		if (insert_dialect) {
-			char *quoted_name;
-			quoted_name = mdb->default_backend->quote_schema_name(namespace, argv[2]);
-			fprintf(outfile, "INSERT INTO %s (", quoted_name);
-			free(quoted_name);
-			for (i=0;i<table->num_cols;i++) {
-				if (i>0) fputs(", ", outfile);
-				col=g_ptr_array_index(table->columns,i);
-				quoted_name = mdb->default_backend->quote_schema_name(NULL, col->name);
-				fputs(quoted_name, outfile);
-				free(quoted_name);
-			} 
-			fputs(") VALUES (", outfile);
-		}
-
-		for (i=0;i<table->num_cols;i++) {
-			if (i>0)
-				fputs(delimiter, outfile);
-			col=g_ptr_array_index(table->columns,i);
-			if (!bound_lens[i]) {
-				/* Don't quote NULLs */
-				if (insert_dialect)
-					fputs("NULL", outfile);
-			} else {
-				if (col->col_type == MDB_OLE) {
-					value = mdb_ole_read_full(mdb, col, &length);
-				} else {
-					value = bound_values[i];
-					length = bound_lens[i];
+	/* Open file */
+	if (!(mdb = mdb_open(argv[1], MDB_NOFLAGS))) {
+		/* Don't bother clean up memory before exit */
+		exit(1);
+	}
+
+	if (opts.insert_dialect)
+		if (!mdb_set_default_backend(mdb, opts.insert_dialect)) {
+			fputs("Invalid backend type\n", stderr);
+			/* Don't bother clean up memory before exit */
+			exit(1);
+		}
+
+	init_quoting(&opts.quoting, quote_char, escape_char, bin_mode);
+
+	if (argc == 3 && !output_dir && !manifest_file) {
+		/* a single table goes to stdout */
+		table = NULL;
+#ifdef SQL
+		if (where) {
+			sql = mdb_sql_init();
+			sql->mdb = mdb;
+			if (!(table = select_table(sql, argv[2], opts.columns, where))) {
+				/* the SQL engine has said why */
+				exit(1);
+			}
+		}
+#endif
+		if (!table) {
+			table = mdb_read_table_by_name(mdb, argv[2], MDB_TABLE);
+			if (!table) {
+				fprintf(stderr, "Error: Table %s does not exist in this database.\n", argv[2]);
+				/* Don't bother clean up memory before exit */
+				exit(1);
+			}
+			mdb_read_columns(table);
+		}
+		ret = export_table(table, stdout, &opts, num_jobs, &rows, &bytes);
+#ifdef SQL
+		if (sql) {
+			/* the handle is ours, the table goes with the SQL engine */
+			sql->mdb = NULL;
+			mdb_sql_exit(sql);
+			table = NULL;
+		}
+#endif
+		if (table)
+			mdb_free_tabledef(table);
+	} else {
+		/* the catalog is read once here, then cloned for every worker */
+		if (!mdb_read_catalog(mdb, MDB_TABLE)) {
+			fputs("Error: could not read the catalog\n", stderr);
+			exit(1);
+		}
+		tables = g_array_new(FALSE, FALSE, sizeof(guint));
+		if (all_tables) {
+			for (i=0; i<mdb->num_catalog; i++) {
+				entry = g_ptr_array_index(mdb->catalog, i);
+				if (mdb_is_user_table(entry))
+					g_array_append_val(tables, i);
+			}
+		} else {
+			for (j=2; j<argc; j++) {
+				for (i=0; i<mdb->num_catalog; i++) {
+					entry = g_ptr_array_index(mdb->catalog, i);
+					if (!g_ascii_strcasecmp(entry->object_name, argv[j]))
+						break;
+				}
+				if (i == mdb->num_catalog) {
+					fprintf(stderr, "Error: Table %s does not exist in this database.\n", argv[j]);
+					/* Don't bother clean up memory before exit */
+					exit(1);
 				}
-				print_col(outfile, value, quote_text, col->col_type, length, quote_char, escape_char, bin_mode);
-				if (col->col_type == MDB_OLE)
-					free(value);
+				g_array_append_val(tables, i);
 			}
 		}
-		if (insert_dialect) fputs(");", outfile);
-		fputs(row_delimiter, outfile);
+		ret = export_tables(mdb, tables, output_dir ? output_dir : ".",
+			manifest_file, num_jobs, &opts);
+		g_array_free(tables, TRUE);
 	}
-	
-	/* free the memory used to bind */
-	for (i=0;i<table->num_cols;i++) {
-		g_free(bound_values[i]);
-	}
-	g_free(bound_values);
-	g_free(bound_lens);
-	mdb_free_tabledef(table);
 
 	mdb_close(mdb);
 	g_option_context_free(opt_context);
+	if (opts.compress_pool) {
+		g_thread_pool_free(opts.compress_pool, FALSE, TRUE);
+		budget_free(opts.compress_budget);
+	}
 
 	// g_free ignores NULL
 	g_free(quote_char);
-	g_free(delimiter);
-	g_free(row_delimiter);
-	g_free(insert_dialect);
+	g_free(opts.delimiter);
+	g_free(opts.row_delimiter);
+	g_free(opts.insert_dialect);
 	g_free(date_fmt);
 	g_free(escape_char);
-	g_free(namespace);
+	g_free(opts.namespace);
 	g_free(str_bin_mode);
-	return 0;
+	g_free(str_shard);
+	g_free(str_columns);
+	g_free(str_format);
+	g_free(str_compress);
+	g_free(where);
+	g_strfreev(opts.columns);
+	g_free(output_dir);
+	g_free(manifest_file);
+	return ret;
 }
 
 static char *escapes(char *s)
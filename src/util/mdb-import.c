@@ -18,150 +18,242 @@
 
 #include "mdbtools.h"
 
-#define MAX_ROW_SIZE 4096
+/* rows handed from the parsing thread to the inserting one at a time */
+#define IMPORT_BATCH_ROWS 1024
+/* batches the parsing thread can get ahead by */
+#define IMPORT_BATCHES 4
 
-void
-free_values(MdbField *fields, int num_fields)
-{
-	int i;
+typedef struct {
+	FILE *in;
+	char delimiter;
+	char buf[65536];
+	size_t len, pos;
+	unsigned long line;
+	GString *field;
+	/* the fields of the last record, NULL for empty unquoted ones */
+	GPtrArray *record;
+} CsvReader;
 
-	for (i=0;i<num_fields;i++) {
-		if (!fields[i].is_null)
-			g_free(fields[i].value);
+typedef struct {
+	MdbField *fields;
+	unsigned int num_rows;
+	int last;
+	int failed;
+} ImportBatch;
+
+typedef struct {
+	MdbHandle *mdb;
+	MdbTableDef *table;
+	CsvReader *csv;
+	GAsyncQueue *free_batches;
+	GAsyncQueue *full_batches;
+	unsigned long row;
+	/* set by the inserting thread to have the parsing one finish early */
+	gint stop;
+} ImportState;
+
+static int
+csv_getc(CsvReader *csv)
+{
+	if (csv->pos == csv->len) {
+		csv->len = fread(csv->buf, 1, sizeof(csv->buf), csv->in);
+		csv->pos = 0;
+		if (!csv->len)
+			return EOF;
 	}
+	return (unsigned char) csv->buf[csv->pos++];
 }
-int
-convert_field(MdbColumn *col, char *s, MdbField *field)
+static void
+csv_end_field(CsvReader *csv, int quoted)
 {
-	char *c;
-	MdbAny any;
-
-	field->colnum = col->col_num;
-	field->is_fixed = col->is_fixed;
-	switch (col->col_type) {
-		case MDB_TEXT:
-			field->value = g_strdup(s);
-			field->siz = strlen(s);
-			break;
-		case MDB_BYTE:
-			any.i = strtol(s, &c, 16);
-			if (*c) return 1;
-			field->siz = mdb_col_fixed_size(col);
-			field->value = g_malloc(field->siz);
-			((unsigned char *)field->value)[0] = any.i;
-			break;
-		case MDB_INT:
-			any.i = strtol(s, &c, 16);
-			if (*c) return 1;
-			field->siz = mdb_col_fixed_size(col);
-			field->value = g_malloc(field->siz);
-			mdb_put_int16(field->value, 0, any.i);
-			break;
-		case MDB_LONGINT:
-			any.i = strtol(s, &c, 16);
-			if (*c) return 1;
-			field->siz = mdb_col_fixed_size(col);
-			field->value = g_malloc(field->siz);
-			mdb_put_int32(field->value, 0, any.i);
-			break;
-		case MDB_BOOL:
-			if (*s == '1') {
-				field->is_null = 1;
-			} else if (*s == '0') {
-				field->is_null = 0;
-			} else {
-				fprintf(stderr, "%c is not a valid value for type BOOLEAN\n", *s);
-				return 1;
+	if (!quoted && !csv->field->len)
+		g_ptr_array_add(csv->record, NULL);
+	else
+		g_ptr_array_add(csv->record, g_strndup(csv->field->str, csv->field->len));
+	g_string_truncate(csv->field, 0);
+}
+static void
+csv_clear_record(CsvReader *csv)
+{
+	unsigned int i;
+
+	for (i=0;i<csv->record->len;i++)
+		g_free(g_ptr_array_index(csv->record, i));
+	g_ptr_array_set_size(csv->record, 0);
+}
+/*
+ * read the next record as RFC 4180 has it: fields may be quoted, with
+ * doubled quotes, delimiters and line breaks inside.  Returns 1 for a
+ * record, 0 at the end of the file and -1 on error.
+ */
+static int
+csv_read_record(CsvReader *csv)
+{
+	int c, quoted = 0, in_quotes = 0, any = 0;
+
+	csv_clear_record(csv);
+	g_string_truncate(csv->field, 0);
+	while (1) {
+		c = csv_getc(csv);
+		if (c == EOF) {
+			if (in_quotes) {
+				fprintf(stderr, "Unterminated quoted field at line %lu\n", csv->line);
+				return -1;
 			}
-			/*
-		case MDB_FLOAT:
-			any.d = strtod(s, &c);
-			if (*c) return 1;
-			field.value = g_malloc(mdb_col_fixed_size(col));
-			mdb_put_single(field.value, 0, any.i);
-			break;
-		case MDB_DOUBLE:
-			any.d = strtod(s, &c);
-			if (*c) return 1;
-			field.value = g_malloc(mdb_col_fixed_size(col));
-			mdb_put_double(field.value, 0, any.i);
-			break;
-		*/
-			/*
-		case MDB_MONEY:
-		case MDB_SDATETIME:
-		case MDB_OLE:
-		case MDB_MEMO:
-		case MDB_REPID:
-		case MDB_NUMERIC:
-			*/
-		default:
-			fprintf(stderr,"Conversion of type %02x not supported yet.\n", col->col_type);
+			if (!any)
+				return 0;
+			csv_end_field(csv, quoted);
 			return 1;
-			break;
+		}
+		any = 1;
+		if (in_quotes) {
+			if (c == '"') {
+				c = csv_getc(csv);
+				if (c == '"') {
+					g_string_append_c(csv->field, '"');
+					continue;
+				}
+				in_quotes = 0;
+				/* look at the character after the quote again */
+				if (c != EOF)
+					csv->pos--;
+				continue;
+			}
+			if (c == '\n')
+				csv->line++;
+			g_string_append_c(csv->field, c);
+		} else if (c == '"' && !csv->field->len && !quoted) {
+			quoted = in_quotes = 1;
+		} else if (c == csv->delimiter) {
+			csv_end_field(csv, quoted);
+			quoted = 0;
+		} else if (c == '\n') {
+			csv->line++;
+			csv_end_field(csv, quoted);
+			return 1;
+		} else if (c != '\r') {
+			g_string_append_c(csv->field, c);
+		}
 	}
-	return 0;
 }
-int
-prep_row(MdbTableDef *table, char *line, MdbField *fields, char *delim)
+static void
+free_values(MdbField *fields, int num_fields)
+{
+	int i;
+
+	for (i=0;i<num_fields;i++) {
+		g_free(fields[i].value);
+		fields[i].value = NULL;
+	}
+}
+/*
+ * turn the last record read into the fields of a row
+ */
+static int
+prep_row(ImportState *st, MdbField *fields)
 {
+	MdbTableDef *table = st->table;
+	GPtrArray *record = st->csv->record;
 	MdbColumn *col;
-	char **sarray, *s;
 	unsigned int i;
 
-	/*
-	 * pull apart the row and turn it into something respectable
-	 */
-	g_strdelimit(line, delim, '\n');
-	sarray = g_strsplit (line, "\n", 0);
-	for (i=0; (s = sarray[i]); i++) {
-		if (!strlen(s)) continue;
-		if (i >= table->num_cols) {
-			fprintf(stderr, "Number of columns in file exceeds number in table.\n");
-			g_strfreev(sarray);
-			return 0;
-		}
-		if (s[0]=='"' && s[strlen(s)-1]=='"') {
-			s[strlen(s)-1] = '\0';
-			memmove(s+1, s, strlen(s));
-		}
-		printf("field = %s\n", s);
-		col = g_ptr_array_index (table->columns, i);
-		if (convert_field(col, s, &fields[i])) {
-			fprintf(stderr, "Format error in column %d\n", i+1);
-			g_strfreev(sarray);
+	if (record->len != table->num_cols) {
+		fprintf(stderr, "Row %lu has %d columns, but table has %d\n",
+			st->row, record->len, table->num_cols);
+		return 0;
+	}
+	for (i=0;i<table->num_cols;i++) {
+		col = g_ptr_array_index(table->columns, i);
+		fields[i].colnum = i;
+		switch (mdb_string_to_field(st->mdb, col, g_ptr_array_index(record, i), &fields[i])) {
+		case 0:
+			fprintf(stderr, "Format error in column %d of row %lu\n", i+1, st->row);
+			free_values(fields, i);
 			return 0;
+		case 2:
+			fprintf(stderr, "Warning: MEMO value in column %d of row %lu truncated to fit in the row\n", i+1, st->row);
+			break;
 		}
 	}
-	g_strfreev(sarray);
+	return 1;
+}
+/*
+ * The parsing thread.  Only the text conversions of the handle are used
+ * here, the inserting thread doesn't touch them.
+ */
+static gpointer
+parse_rows(gpointer data)
+{
+	ImportState *st = data;
+	unsigned int num_cols = st->table->num_cols;
+	ImportBatch *batch;
+	int rc;
 
-	/*
-	 * verify number of columns in table against number in row
-	 */
-	if (i < table->num_cols) {
-		fprintf(stderr, "Row has %d columns, but table has %d\n", i, table->num_cols);
-		free_values(fields, i);
-		return 0;
-	}
-	return i-1;
+	do {
+		batch = g_async_queue_pop(st->free_batches);
+		batch->num_rows = 0;
+		while (batch->num_rows < IMPORT_BATCH_ROWS) {
+			if (g_atomic_int_get(&st->stop)) {
+				batch->last = 1;
+				break;
+			}
+			rc = csv_read_record(st->csv);
+			if (rc <= 0) {
+				batch->failed = (rc < 0);
+				batch->last = 1;
+				break;
+			}
+			/* skip blank lines */
+			if (st->csv->record->len == 1 && !g_ptr_array_index(st->csv->record, 0))
+				continue;
+			st->row++;
+			if (!prep_row(st, &batch->fields[batch->num_rows * num_cols])) {
+				batch->failed = 1;
+				batch->last = 1;
+				break;
+			}
+			batch->num_rows++;
+		}
+		g_async_queue_push(st->full_batches, batch);
+	} while (!batch->last);
+
+	return NULL;
 }
+static void
+print_progress(unsigned long rows, gint64 start, int done)
+{
+	double secs = (g_get_monotonic_time() - start) / 1000000.0;
+
+	if (done)
+		fprintf(stderr, "\rImported %lu rows in %.1f s (%.0f rows/s)\n",
+			rows, secs, secs > 0 ? rows / secs : 0);
+	else
+		fprintf(stderr, "\r%lu rows (%.0f rows/s)", rows, secs > 0 ? rows / secs : 0);
+}
+
 int
 main(int argc, char **argv)
 {
-	int i, row;
+	int i;
 	MdbHandle *mdb;
 	MdbTableDef *table;
-	MdbField fields[256];
-	char line[MAX_ROW_SIZE];
-	int num_fields;
-	/* doesn't handle tables > 256 columns.  Can that happen? */
-	FILE *in;
-	char *delimiter;
+	MdbBulkInsert *bulk;
+	ImportBatch batches[IMPORT_BATCHES], *batch;
+	ImportState st;
+	CsvReader csv;
+	GThread *parser;
+	unsigned long rows = 0, stop_row = 0;
+	unsigned int r;
+	gint64 start, last_report;
+	int last = 0, failed = 0;
+	char *delimiter = NULL;
 	int header_rows = 0;
+	int progress = 0;
 
 	GOptionEntry entries[] = {
 		{ "header", 'H', 0, G_OPTION_ARG_INT, &header_rows, "skip <rows> header rows", "row"},
 		{ "delimiter", 'd', 0, G_OPTION_ARG_STRING, &delimiter, "Specify a column delimiter", "char"},
+		{ "progress", 'p', 0, G_OPTION_ARG_NONE, &progress, "Report rows imported and throughput on stderr", NULL},
 		{ NULL },
 	};
 	GError *error = NULL;
@@ -179,13 +271,13 @@ main(int argc, char **argv)
 
 	if (!delimiter)
 		delimiter = g_strdup(",");
-	if (argc != 4) {
+	if (argc != 4 || strlen(delimiter) != 1) {
 		fputs("Wrong number of arguments.\n\n", stderr);
 		fputs(g_option_context_get_help(opt_context, TRUE, NULL), stderr);
 		exit(1);
 	}
 
-	if (!(mdb = mdb_open(argv[1], MDB_WRITABLE))) {
+	if (!(mdb = mdb_open(argv[1], MDB_WRITABLE | MDB_WRITEBACK))) {
 		exit(1);
 	}
 	
@@ -201,36 +293,100 @@ main(int argc, char **argv)
 	/*
 	 * open the CSV file and read any header rows
 	 */
-	in = fopen(argv[3], "r");
-	if (!in) {
+	memset(&csv, 0, sizeof(csv));
+	if (!strcmp(argv[3], "-"))
+		csv.in = stdin;
+	else
+		csv.in = fopen(argv[3], "r");
+	if (!csv.in) {
 		fprintf(stderr, "Can not open file %s\n", argv[3]);
 		exit(1);
 	}
+	csv.delimiter = delimiter[0];
+	csv.line = 1;
+	csv.field = g_string_new(NULL);
+	csv.record = g_ptr_array_new();
 	for (i=0;i<header_rows;i++)
-		if (!fgets(line, MAX_ROW_SIZE, in)) {
+		if (csv_read_record(&csv) != 1) {
 			fprintf(stderr, "Error while reading header column #%d. Check -H parameter.\n", i);
 			exit(1);
 		}
 
-	row = 1;
-	while (fgets(line, MAX_ROW_SIZE, in)) {
-		num_fields = prep_row(table, line, fields, delimiter);
-		if (!num_fields) {
-			fprintf(stderr, "Aborting import at row %d\n", row);
-			exit(1);
+	if (!(bulk = mdb_bulk_insert_begin(table)))
+		exit(1);
+
+	/*
+	 * parse ahead in another thread while the rows are inserted
+	 */
+	memset(&st, 0, sizeof(st));
+	st.mdb = mdb;
+	st.table = table;
+	st.csv = &csv;
+	st.free_batches = g_async_queue_new();
+	st.full_batches = g_async_queue_new();
+	for (i=0;i<IMPORT_BATCHES;i++) {
+		batches[i].fields = g_malloc0(IMPORT_BATCH_ROWS * table->num_cols * sizeof(MdbField));
+		batches[i].last = batches[i].failed = 0;
+		g_async_queue_push(st.free_batches, &batches[i]);
+	}
+	parser = g_thread_new("mdb-import parser", parse_rows, &st);
+
+	start = last_report = g_get_monotonic_time();
+	while (!last) {
+		batch = g_async_queue_pop(st.full_batches);
+		for (r=0;r<batch->num_rows;r++) {
+			MdbField *fields = &batch->fields[r * table->num_cols];
+
+			/* after a failure, only drain what was parsed already */
+			if (!failed) {
+				if (mdb_bulk_insert_append(bulk, table->num_cols, fields)) {
+					rows++;
+				} else {
+					failed = 1;
+					stop_row = rows + 1;
+					g_atomic_int_set(&st.stop, 1);
+				}
+			}
+			free_values(fields, table->num_cols);
+		}
+		last = batch->last;
+		if (batch->failed)
+			failed = 1;
+		g_async_queue_push(st.free_batches, batch);
+		if (progress && g_get_monotonic_time() - last_report >= 1000000) {
+			print_progress(rows, start, 0);
+			last_report = g_get_monotonic_time();
 		}
-		/*
-	 	* all the prep work is done, let's add the row
-	 	*/
-		mdb_insert_row(table, num_fields, fields);
 	}
+	g_thread_join(parser);
+	if (failed && !stop_row)
+		stop_row = st.row;
 
+	/* the rows appended before a failure are kept, with their indexes */
+	if (progress)
+		fprintf(stderr, "\r%lu rows, rebuilding indexes\n", rows);
+	if (!mdb_bulk_insert_end(bulk) || !mdb_flush(mdb)) {
+		fprintf(stderr, "Import failed\n");
+		exit(1);
+	}
+	if (failed)
+		fprintf(stderr, "Import stopped at row %lu, %lu rows before it were imported\n", stop_row, rows);
+	else if (progress)
+		print_progress(rows, start, 1);
+
+	for (i=0;i<IMPORT_BATCHES;i++)
+		g_free(batches[i].fields);
+	g_async_queue_unref(st.free_batches);
+	g_async_queue_unref(st.full_batches);
+	csv_clear_record(&csv);
+	g_ptr_array_free(csv.record, TRUE);
+	g_string_free(csv.field, TRUE);
 	mdb_free_tabledef(table);
-	fclose(in);
+	if (csv.in != stdin)
+		fclose(csv.in);
 	mdb_close(mdb);
 
 	g_option_context_free(opt_context);
 	g_free(delimiter);
-	return 0;
+	return failed ? 1 : 0;
 }
-
@@ -53,14 +53,35 @@ extern void clear_history ();
 
 void dump_results(FILE *out, MdbSQL *sql, char *delimiter);
 void dump_results_pp(FILE *out, MdbSQL *sql);
+void print_rows_affected(FILE *out, long row_count);
 
 #if SQL
 
+enum {
+	FORMAT_TABLE,	/* pretty printed */
+	FORMAT_PLAIN,	/* values as they are, between delimiters */
+	FORMAT_CSV,
+	FORMAT_TSV,
+	FORMAT_JSON	/* JSON lines */
+};
+
 int headers = 1;
 int footers = 1;
 int pretty_print = 1;
+int format = FORMAT_TABLE;
+int flush_rows = 0;
 int showplan = 0;
 int noexec = 0;
+int writable = 0;
+
+/* rows looked at to size the columns of a table */
+#define PP_LOOKAHEAD 1000
+
+/* stdio buffer of the output when it isn't a terminal */
+#define OUTPUT_BUFFER_SIZE (256 * 1024)
+
+/* each row is put together here and written with a single call */
+static GString *row_buf;
 
 #ifdef HAVE_READLINE_HISTORY
 #define HISTFILE ".mdbhistory"
@@ -190,54 +211,201 @@ read_file(char *s, int line, unsigned int *bufsz, char *mybuf)
 	}
 	return lines;
 }
-void 
+/*
+ * run a query and print its result.  Returns 0, or 1 if the query failed.
+ */
+int
 run_query(FILE *out, MdbSQL *sql, char *mybuf, char *delimiter)
 {
 	MdbTableDef *table;
 
 	mdb_sql_run_query(sql, mybuf);
-	if (!mdb_sql_has_error(sql)) {
-		if (showplan) {
-			table = sql->cur_table;
-			if (table->sarg_tree) mdb_sql_dump_node(table->sarg_tree, 0);
-			if (sql->cur_table->strategy == MDB_TABLE_SCAN)
-				printf("Table scanning %s\n", table->name);
-			else 
-				printf("Index scanning %s using %s\n", table->name, table->scan_idx->name);
+	if (mdb_sql_has_error(sql))
+		return 1;
+
+	/* CREATE INDEX and the like return no rows */
+	if (!sql->cur_table) {
+		if (footers && sql->rows_affected >= 0)
+			print_rows_affected(out, sql->rows_affected);
+		mdb_sql_reset(sql);
+		fflush(out);
+		return 0;
+	}
+	if (showplan) {
+		table = sql->cur_table;
+		if (table->sarg_tree) mdb_sql_dump_node(table->sarg_tree, 0);
+		if (sql->cur_table->strategy == MDB_TABLE_SCAN)
+			printf("Table scanning %s\n", table->name);
+		else if (sql->cur_table->strategy == MDB_BITMAP_SCAN)
+			printf("Bitmap scanning %s (%d rows)\n", table->name, table->bitmap_rows->len);
+		else 
+			printf("Index scanning %s using %s\n", table->name, table->scan_idx->name);
+	}
+	/* If noexec != on, dump results */
+	if (!noexec) {
+		if (format == FORMAT_TABLE)
+			dump_results_pp(out, sql);
+		else
+			dump_results(out, sql, delimiter);
+	}
+	mdb_sql_reset(sql);
+	/* the output is flushed once a query is done, not row by row */
+	fflush(out);
+	return 0;
+}
+
+/*
+ * run every statement of a file, separated by semicolons, stopping at the
+ * first that fails.  Returns 0 if they all ran.
+ */
+int
+run_batch(FILE *out, MdbSQL *sql, char *filename, char *delimiter)
+{
+	GError *error = NULL;
+	gchar *text, *stmt, *p;
+	char quote = 0;
+	int num = 0, ret = 0, end;
+
+	if (!g_file_get_contents(filename, &text, NULL, &error)) {
+		fprintf(stderr, "Unable to open file %s: %s\n", filename, error->message);
+		g_error_free(error);
+		return 1;
+	}
+	for (stmt = p = text; ; p++) {
+		/* a semicolon inside a string or quoted name is not the end */
+		if (quote) {
+			if (!*p) {
+				fprintf(stderr, "Unterminated quote in %s\n", filename);
+				ret = 1;
+				break;
+			}
+			if (*p == quote)
+				quote = 0;
+			continue;
 		}
-		/* If noexec != on, dump results */
-		if (!noexec) {
-			if (pretty_print)
-				dump_results_pp(out, sql);
-			else
-				dump_results(out, sql, delimiter);
+		if (*p == '\'' || *p == '"') {
+			quote = *p;
+			continue;
 		}
-		mdb_sql_reset(sql);
+		if (*p && *p != ';')
+			continue;
+
+		end = !*p;
+		*p = '\0';
+		/* the newlines are left in for the parser's line numbers */
+		if (stmt[strspn(stmt, " \t\r\n")]) {
+			num++;
+			if (run_query(out, sql, stmt, delimiter)) {
+				fprintf(stderr, "Statement %d of %s failed\n", num, filename);
+				ret = 1;
+				break;
+			}
+		}
+		if (end)
+			break;
+		stmt = p + 1;
 	}
+	g_free(text);
+	return ret;
 }
 
-void print_value(FILE *out, char *v, int sz, int first)
+/* write out the row put together in row_buf */
+static void
+write_row(FILE *out)
+{
+	if (fwrite(row_buf->str, 1, row_buf->len, out) != row_buf->len) {
+		fprintf(stderr, "Error writing output\n");
+		exit(1);
+	}
+	g_string_truncate(row_buf, 0);
+	if (flush_rows)
+		fflush(out);
+}
+static void
+print_value(GString *row, char *v, int sz, int first)
 {
-int i;
-int vlen;
+	int vlen;
 
 	if (first)
-		fputc('|', out);
+		g_string_append_c(row, '|');
 	vlen = strlen_utf(v);
-	fputs(v, out);
-	for (i=vlen;i<sz;i++)
-		fputc(' ', out);
-	fputc('|', out);
+	g_string_append(row, v);
+	for (;vlen<sz;vlen++)
+		g_string_append_c(row, ' ');
+	g_string_append_c(row, '|');
 }
-static void print_break(FILE *out, int sz, int first)
+static void
+print_break(GString *row, int sz, int first)
 {
-int i;
 	if (first)
-		fputc('+', out);
-	for (i=0;i<sz;i++)
-		fputc('-', out);
-	fputc('+', out);
+		g_string_append_c(row, '+');
+	for (;sz>0;sz--)
+		g_string_append_c(row, '-');
+	g_string_append_c(row, '+');
 }
+/* CSV, quoted when there is anything to quote, or when forced */
+static void
+print_csv(GString *row, const char *v, int force)
+{
+	const char *p;
+
+	if (!force && !v[strcspn(v, ",\"\r\n")]) {
+		g_string_append(row, v);
+		return;
+	}
+	g_string_append_c(row, '"');
+	while ((p = strchr(v, '"'))) {
+		g_string_append_len(row, v, p - v + 1);
+		g_string_append_c(row, '"');
+		v = p + 1;
+	}
+	g_string_append(row, v);
+	g_string_append_c(row, '"');
+}
+/* TSV, with tabs, line breaks and backslashes escaped */
+static void
+print_tsv(GString *row, const char *v)
+{
+	size_t run;
+
+	while (*v) {
+		run = strcspn(v, "\\\t\n\r");
+		g_string_append_len(row, v, run);
+		v += run;
+		switch (*v) {
+			case '\\': g_string_append(row, "\\\\"); break;
+			case '\t': g_string_append(row, "\\t"); break;
+			case '\n': g_string_append(row, "\\n"); break;
+			case '\r': g_string_append(row, "\\r"); break;
+			default: return;
+		}
+		v++;
+	}
+}
+/* the table columns the result columns are bound to */
+static MdbColumn **
+result_columns(MdbSQL *sql)
+{
+	MdbTableDef *table = sql->cur_table;
+	MdbColumn **cols, *col;
+	MdbSQLColumn *sqlcol;
+	unsigned int i, j;
+
+	cols = g_new0(MdbColumn *, sql->num_columns);
+	for (j=0;j<sql->num_columns;j++) {
+		sqlcol = g_ptr_array_index(sql->columns,j);
+		for (i=0;i<table->num_cols;i++) {
+			col = g_ptr_array_index(table->columns,i);
+			if (!g_ascii_strcasecmp(col->name, sqlcol->name)) {
+				cols[j] = col;
+				break;
+			}
+		}
+	}
+	return cols;
+}
+#define is_null(col) ((col) && (col)->col_type != MDB_BOOL && !(col)->cur_value_len)
+
 void print_rows_retrieved(FILE *out, unsigned long row_count)
 {
 	if (!row_count) 
@@ -246,93 +414,180 @@ void print_rows_retrieved(FILE *out, unsigned long row_count)
 		fprintf(out, "1 Row retrieved\n");
 	else 
 		fprintf(out, "%lu Rows retrieved\n", row_count);
-	fflush(out);
 }
+void print_rows_affected(FILE *out, long row_count)
+{
+	if (!row_count) 
+		fprintf(out, "No Rows affected\n");
+	else if (row_count==1)
+		fprintf(out, "1 Row affected\n");
+	else 
+		fprintf(out, "%ld Rows affected\n", row_count);
+}
+/*
+ * print the result in one of the formats for other programs: plain,
+ * between delimiters, CSV, TSV or JSON lines.  Each row is put together
+ * and written at once.
+ */
 void
 dump_results(FILE *out, MdbSQL *sql, char *delimiter)
 {
 	unsigned int j;
 	MdbSQLColumn *sqlcol;
+	MdbColumn **cols = result_columns(sql);
+	char **keys = NULL;
+	char *sep, *value;
 	unsigned long row_count = 0;
 
-	if (headers) {
-		for (j=0;j<sql->num_columns-1;j++) {
+	if (format == FORMAT_CSV)
+		sep = ",";
+	else if (format == FORMAT_PLAIN && delimiter)
+		sep = delimiter;
+	else
+		sep = "\t";
+
+	if (format == FORMAT_JSON) {
+		/* each column's name, quoted once for all the rows */
+		keys = g_new0(char *, sql->num_columns + 1);
+		for (j=0;j<sql->num_columns;j++) {
 			sqlcol = g_ptr_array_index(sql->columns,j);
-			fprintf(out, "%s%s", sqlcol->name,
-				delimiter ? delimiter : "\t");
+			g_string_assign(row_buf, j ? "," : "{");
+			mdb_json_append_string(row_buf, sqlcol->name, strlen(sqlcol->name));
+			g_string_append_c(row_buf, ':');
+			keys[j] = g_strdup(row_buf->str);
 		}
-		sqlcol = g_ptr_array_index(sql->columns,sql->num_columns-1);
-		fprintf(out, "%s", sqlcol->name);
-		fprintf(out,"\n");
-		fflush(out);
+		g_string_truncate(row_buf, 0);
+	} else if (headers) {
+		for (j=0;j<sql->num_columns;j++) {
+			sqlcol = g_ptr_array_index(sql->columns,j);
+			if (j)
+				g_string_append(row_buf, sep);
+			if (format == FORMAT_CSV)
+				print_csv(row_buf, sqlcol->name, 0);
+			else if (format == FORMAT_TSV)
+				print_tsv(row_buf, sqlcol->name);
+			else
+				g_string_append(row_buf, sqlcol->name);
+		}
+		g_string_append_c(row_buf, '\n');
+		write_row(out);
 	}
 	while(mdb_fetch_row(sql->cur_table)) {
 		row_count++;
-  		for (j=0;j<sql->num_columns-1;j++) {
-			sqlcol = g_ptr_array_index(sql->columns,j);
-			fprintf(out, "%s%s", (char*)(sql->bound_values[j]),
-				delimiter ? delimiter : "\t");
+		for (j=0;j<sql->num_columns;j++) {
+			value = sql->bound_values[j];
+			if (format == FORMAT_JSON) {
+				g_string_append(row_buf, keys[j]);
+				if (cols[j])
+					mdb_json_append_value(sql->mdb, cols[j], row_buf);
+				else
+					mdb_json_append_string(row_buf, value, strlen(value));
+				continue;
+			}
+			if (j)
+				g_string_append(row_buf, sep);
+			if (format == FORMAT_CSV) {
+				/* NULL is left empty, an empty string is "" */
+				if (!is_null(cols[j]))
+					print_csv(row_buf, value, !*value);
+			} else if (format == FORMAT_TSV) {
+				if (is_null(cols[j]))
+					g_string_append(row_buf, "\\N");
+				else
+					print_tsv(row_buf, value);
+			} else {
+				g_string_append(row_buf, value);
+			}
 		}
-		sqlcol = g_ptr_array_index(sql->columns,sql->num_columns-1);
-		fprintf(out, "%s", (char*)(sql->bound_values[sql->num_columns-1]));
-		fprintf(out,"\n");
-		fflush(out);
+		if (format == FORMAT_JSON)
+			g_string_append_c(row_buf, '}');
+		g_string_append_c(row_buf, '\n');
+		write_row(out);
 	}
-	if (footers) {
+	if (footers && format == FORMAT_PLAIN) {
 		print_rows_retrieved(out, row_count);
 	}
+	g_strfreev(keys);
+	g_free(cols);
 }
 
+/*
+ * print the result as a table.  The columns are as wide as their values,
+ * going by the header and the rows up to PP_LOOKAHEAD, which are held until
+ * then; the rows after that are printed as they are fetched.
+ */
 void 
 dump_results_pp(FILE *out, MdbSQL *sql)
 {
-	unsigned int j;
+	unsigned int i, j;
 	MdbSQLColumn *sqlcol;
+	GPtrArray *ahead = g_ptr_array_new();
+	char **values;
+	int *width, len;
 	unsigned long row_count = 0;
 
-	/* print header */
-	if (headers) {
+	width = g_new0(int, sql->num_columns);
+	for (j=0;j<sql->num_columns;j++) {
+		sqlcol = g_ptr_array_index(sql->columns,j);
+		if (headers)
+			width[j] = strlen_utf(sqlcol->name);
+	}
+	while (ahead->len < PP_LOOKAHEAD && mdb_fetch_row(sql->cur_table)) {
+		values = g_new(char *, sql->num_columns);
 		for (j=0;j<sql->num_columns;j++) {
-			sqlcol = g_ptr_array_index(sql->columns,j);
-			if (strlen(sqlcol->name)>sqlcol->disp_size)
-				sqlcol->disp_size = strlen(sqlcol->name);
-			print_break(out, sqlcol->disp_size, !j);
+			values[j] = g_strdup(sql->bound_values[j]);
+			len = strlen_utf(values[j]);
+			if (len > width[j])
+				width[j] = len;
 		}
-		fprintf(out,"\n");
-		fflush(out);
+		g_ptr_array_add(ahead, values);
+	}
+
+	/* print header */
+	if (headers) {
+		for (j=0;j<sql->num_columns;j++)
+			print_break(row_buf, width[j], !j);
+		g_string_append_c(row_buf, '\n');
 		for (j=0;j<sql->num_columns;j++) {
 			sqlcol = g_ptr_array_index(sql->columns,j);
-			print_value(out, sqlcol->name,sqlcol->disp_size,!j);
+			print_value(row_buf, sqlcol->name, width[j], !j);
 		}
-		fprintf(out,"\n");
-		fflush(out);
+		g_string_append_c(row_buf, '\n');
 	}
-
-	for (j=0;j<sql->num_columns;j++) {
-		sqlcol = g_ptr_array_index(sql->columns,j);
-		print_break(out, sqlcol->disp_size, !j);
-	}
-	fprintf(out,"\n");
-	fflush(out);
+	for (j=0;j<sql->num_columns;j++)
+		print_break(row_buf, width[j], !j);
+	g_string_append_c(row_buf, '\n');
+	write_row(out);
 
 	/* print each row */
-	while(mdb_fetch_row(sql->cur_table)) {
+	for (i=0;i<ahead->len;i++) {
+		values = g_ptr_array_index(ahead, i);
 		row_count++;
-  		for (j=0;j<sql->num_columns;j++) {
-			sqlcol = g_ptr_array_index(sql->columns,j);
-			print_value(out, sql->bound_values[j],sqlcol->disp_size,!j);
+		for (j=0;j<sql->num_columns;j++) {
+			print_value(row_buf, values[j], width[j], !j);
+			g_free(values[j]);
+		}
+		g_free(values);
+		g_string_append_c(row_buf, '\n');
+		write_row(out);
+	}
+	if (ahead->len == PP_LOOKAHEAD) {
+		while(mdb_fetch_row(sql->cur_table)) {
+			row_count++;
+			for (j=0;j<sql->num_columns;j++)
+				print_value(row_buf, sql->bound_values[j], width[j], !j);
+			g_string_append_c(row_buf, '\n');
+			write_row(out);
 		}
-		fprintf(out,"\n");
-		fflush(out);
 	}
+	g_ptr_array_free(ahead, TRUE);
 
 	/* footer */
-	for (j=0;j<sql->num_columns;j++) {
-		sqlcol = g_ptr_array_index(sql->columns,j);
-		print_break(out, sqlcol->disp_size, !j);
-	}
-	fprintf(out,"\n");
-	fflush(out);
+	for (j=0;j<sql->num_columns;j++)
+		print_break(row_buf, width[j], !j);
+	g_string_append_c(row_buf, '\n');
+	write_row(out);
+	g_free(width);
 	if (footers) {
 		print_rows_retrieved(out, row_count);
 	}
@@ -352,7 +607,10 @@ main(int argc, char **argv)
 	char *home = getenv("HOME");
 	char *histpath;
 	char *delimiter = NULL;
-
+	char *str_format = NULL;
+	char *str_flush = NULL;
+	char *batch_file = NULL;
+	int ret = 0;
 
 	GOptionEntry entries[] = {
 		{ "delim", 'd', 0, G_OPTION_ARG_STRING, &delimiter, "Use this delimiter.", "char"},
@@ -361,6 +619,10 @@ main(int argc, char **argv)
 		{ "no-footer", 'F', G_OPTION_FLAG_REVERSE, G_OPTION_ARG_NONE, &footers, "Don't print footer", NULL},
 		{ "input", 'i', 0, G_OPTION_ARG_STRING, &filename_in, "Read SQL from specified file", "file"},
 		{ "output", 'o', 0, G_OPTION_ARG_STRING, &filename_out, "Write result to specified file", "file"},
+		{ "writable", 'w', 0, G_OPTION_ARG_NONE, &writable, "Open the database for writing (CREATE INDEX, UPDATE)", NULL},
+		{ "format", 'f', 0, G_OPTION_ARG_STRING, &str_format, "Output format. Default is table, or plain with -P", "table|plain|csv|tsv|json"},
+		{ "flush", 0, 0, G_OPTION_ARG_STRING, &str_flush, "Flush the output after each row or each query. Default is query", "row|query"},
+		{ "batch", 'b', 0, G_OPTION_ARG_STRING, &batch_file, "Run the statements in file, separated by semicolons, stopping at the first that fails", "file"},
 		{ NULL },
 	};
 	GError *error = NULL;
@@ -382,6 +644,32 @@ main(int argc, char **argv)
 		exit(1);
 	}
 
+	if (!str_format)
+		format = pretty_print ? FORMAT_TABLE : FORMAT_PLAIN;
+	else if (!strcmp(str_format, "table"))
+		format = FORMAT_TABLE;
+	else if (!strcmp(str_format, "plain"))
+		format = FORMAT_PLAIN;
+	else if (!strcmp(str_format, "csv"))
+		format = FORMAT_CSV;
+	else if (!strcmp(str_format, "tsv"))
+		format = FORMAT_TSV;
+	else if (!strcmp(str_format, "json"))
+		format = FORMAT_JSON;
+	else {
+		fputs("Invalid format\n", stderr);
+		exit(1);
+	}
+
+	if (str_flush) {
+		if (!strcmp(str_flush, "row"))
+			flush_rows = 1;
+		else if (strcmp(str_flush, "query")) {
+			fputs("Invalid flush policy, expected row or query\n", stderr);
+			exit(1);
+		}
+	}
+
 #ifdef HAVE_READLINE_HISTORY
 	if (home) {
 		histpath = (char *) g_strconcat(home, "/", HISTFILE, NULL);
@@ -407,10 +695,15 @@ main(int argc, char **argv)
 			exit(1);
 		}
 	}
+	/* output to a terminal stays line buffered */
+	if (!isatty(fileno(out ? out : stdout)))
+		setvbuf(out ? out : stdout, NULL, _IOFBF, OUTPUT_BUFFER_SIZE);
+	row_buf = g_string_sized_new(4096);
 
 
 	/* initialize the SQL engine */
 	sql = mdb_sql_init();
+	sql->writable = writable;
 	if (argc == 2) {
 		mdb_sql_open(sql, argv[1]);
 	}
@@ -420,7 +713,11 @@ main(int argc, char **argv)
 	mybuf = (char *) g_malloc(bufsz);
 	mybuf[0]='\0';
 
-	while (1) {
+	/* the statements of a batch file are run and that is all */
+	if (batch_file)
+		ret = run_batch((out) ? out : stdout, sql, batch_file, delimiter);
+
+	while (!batch_file) {
 		line ++;
 		if (s) free(s);
 
@@ -491,8 +788,12 @@ main(int argc, char **argv)
 	g_free(delimiter);
 	g_free(filename_in);
 	g_free(filename_out);
+	g_free(str_format);
+	g_free(str_flush);
+	g_free(batch_file);
+	g_string_free(row_buf, TRUE);
 
-	return 0;
+	return ret;
 }
 #else
 int main(int argc, char **argv)
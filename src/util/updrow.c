@@ -88,7 +88,13 @@ void read_to_row(MdbTableDef *table, char *sargname)
 		sargval = strtok(NULL," ");
 		printf("col %s op %s val %s\n",sargcol,sargop,sargval);
         	sarg.op = MDB_EQUAL; /* only support = for now, sorry */
-		sarg.value.i = atoi(sargval);
+		if (sarg.col && (sarg.col->col_type == MDB_FLOAT
+		 || sarg.col->col_type == MDB_DOUBLE
+		 || sarg.col->col_type == MDB_MONEY
+		 || sarg.col->col_type == MDB_NUMERIC))
+			sarg.value.d = g_ascii_strtod(sargval, NULL);
+		else
+			sarg.value.i = atoi(sargval);
 		table->sarg_tree = &sarg;
 
 		// mdb_add_sarg_by_name(table, sargcol, &sarg);